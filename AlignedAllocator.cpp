@@ -0,0 +1,47 @@
+#pragma once
+
+#include <new>
+#include <stdlib.h>
+#include <vector>
+
+using namespace std;
+
+template <typename T, size_t ALIGNMENT>
+struct AlignedAllocator {
+    /**
+     * Allocator giving memory aligned on ALIGNMENT bytes, so that SIMD loads of vectors using
+     * it never straddle two cache lines
+    */
+    typedef T value_type;
+    template <typename U> struct rebind { typedef AlignedAllocator<U, ALIGNMENT> other; };
+
+    AlignedAllocator() {}
+    template <typename U> AlignedAllocator(const AlignedAllocator<U, ALIGNMENT>&) {}
+
+    T* allocate(size_t n) {
+        size_t size = (n * sizeof(T) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+#ifdef _MSC_VER
+        void* memory = _aligned_malloc(size, ALIGNMENT);
+#else
+        void* memory = aligned_alloc(ALIGNMENT, size);
+#endif
+        if (memory == nullptr) {
+            throw bad_alloc();
+        }
+        return (T*) memory;
+    }
+
+    void deallocate(T* memory, size_t) {
+#ifdef _MSC_VER
+        _aligned_free(memory);
+#else
+        free(memory);
+#endif
+    }
+
+    template <typename U> bool operator == (const AlignedAllocator<U, ALIGNMENT>&) const { return true; }
+    template <typename U> bool operator != (const AlignedAllocator<U, ALIGNMENT>&) const { return false; }
+};
+
+template <typename T, size_t ALIGNMENT=32>
+using AlignedVector = vector<T, AlignedAllocator<T, ALIGNMENT>>;
@@ -0,0 +1,113 @@
+#pragma once
+
+// Replaces the global operator new and delete to count the heap allocations of the program,
+// so that the render loop can be checked not to allocate anything (see --check-allocations).
+// This file must only be included once, by main.cpp.
+
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+static std::atomic<long long> allocationCount(0); // number of calls to operator new since the start (aligned ones included)
+
+long long heapAllocations() {
+    /**
+     * Returns the number of heap allocations made so far by every thread
+    */
+    return allocationCount.load(std::memory_order_relaxed);
+}
+
+static void* countedAllocation(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size == 0 ? 1 : size);
+}
+
+void* operator new(size_t size) {
+    void* p = countedAllocation(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    void* p = countedAllocation(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return countedAllocation(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return countedAllocation(size);
+}
+
+static void* countedAlignedAllocation(size_t size, std::align_val_t alignment) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    size_t align = (size_t) alignment;
+    size = (size + align - 1) / align * align; // aligned_alloc wants a multiple of the alignment
+#ifdef _MSC_VER
+    return _aligned_malloc(size == 0 ? align : size, align);
+#else
+    return aligned_alloc(align, size == 0 ? align : size);
+#endif
+}
+
+static void alignedFree(void* p) {
+#ifdef _MSC_VER
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    void* p = countedAlignedAllocation(size, alignment);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    void* p = countedAlignedAllocation(size, alignment);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return countedAlignedAllocation(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return countedAlignedAllocation(size, alignment);
+}
+
+// GCC sees free() called on memory from operator new once the replacements are inlined in the
+// same translation unit, which is what they do
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas" // compilers not knowing the next warning
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { alignedFree(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { alignedFree(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { alignedFree(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { alignedFree(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { alignedFree(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { alignedFree(p); }
+#ifdef __GNUC__
+#pragma GCC diagnostic pop
+#endif
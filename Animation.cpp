@@ -0,0 +1,325 @@
+#pragma once
+
+// Keyframed animations rendered as image sequences. This file is included by main.cpp after
+// GBuffer.cpp and SceneFile.cpp, since it builds on them.
+//
+// Animation files are text files, one keyframe per line, # starting a comment:
+//     frames <count>
+//     camera <frame> <x> <y> <z>
+//     sphere <frame> <sphere index> <x> <y> <z>   (center of the sphere)
+// Between two keyframes, positions are interpolated linearly. Before the first keyframe and
+// after the last one, they stay at the position of that keyframe. Cameras and spheres without
+// keyframes stay where the scene puts them.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// custom files:
+#include <Framebuffer.cpp>
+#include <ImageWriter.cpp>
+#include <ThreadPool.cpp>
+
+using namespace std;
+
+struct Keyframe {
+    float frame;
+    Vector3 position;
+};
+
+struct AnimationTrack {
+    /**
+     * Keyframes of the position of the camera (sphere -1) or of a sphere, sorted by frame
+    */
+    int sphere;
+    vector<Keyframe> keys;
+
+    Vector3 at(float frame) const {
+        /**
+         * Returns the position at a frame, interpolated between the keyframes around it
+        */
+        if (frame <= this->keys.front().frame) {
+            return this->keys.front().position;
+        }
+        for (size_t k = 1; k < this->keys.size(); k++) {
+            if (frame <= this->keys[k].frame) {
+                const Keyframe& previous = this->keys[k-1];
+                const Keyframe& next = this->keys[k];
+                float blend = (frame - previous.frame) / (next.frame - previous.frame);
+                Vector3 start = previous.position, end = next.position;
+                return start + (end - start) * blend;
+            }
+        }
+        return this->keys.back().position;
+    }
+};
+
+class Animation {
+    public:
+        int frameCount = 1;
+        vector<AnimationTrack> tracks; // one track per animated camera or sphere
+
+        Animation() {} // default constructor, one frame where nothing moves
+
+        Scene frame(const Scene& scene, int frame) const {
+            /**
+             * Returns the scene at a frame of the animation
+            */
+            Scene animated = scene;
+            for (const AnimationTrack& track : this->tracks) {
+                if (track.sphere == -1) {
+                    animated.cameraPos = track.at((float) frame);
+                }
+                else {
+                    animated.spheres[track.sphere].center = track.at((float) frame);
+                }
+            }
+            return animated;
+        }
+
+        AnimationTrack& track(int sphere) {
+            /**
+             * Returns the track of the camera (sphere -1) or of a sphere, creating it if needed
+            */
+            for (AnimationTrack& track : this->tracks) {
+                if (track.sphere == sphere) {
+                    return track;
+                }
+            }
+            this->tracks.push_back({sphere, {}});
+            return this->tracks.back();
+        }
+};
+
+bool loadAnimation(const string& path, int sphereCount, Animation& animation) {
+    /**
+     * Reads an animation file
+     *
+     * @param path The file to read
+     * @param sphereCount The number of spheres of the animated scene
+     * @param animation Set to the animation of the file
+     * @return false if the file could not be read or has an error (reported on cerr)
+    */
+    ifstream file(path);
+    if (!file) {
+        cerr << "Could not open " << path << endl;
+        return false;
+    }
+    animation = Animation();
+    string line;
+    for (int lineNumber = 1; getline(file, line); lineNumber++) {
+        size_t comment = line.find('#');
+        if (comment != string::npos) {
+            line.resize(comment);
+        }
+        const char* cursor = line.c_str();
+        string keyword = readWord(cursor);
+        if (keyword.empty()) {
+            continue; // empty line
+        }
+        float values[5];
+        bool valid;
+        if (keyword == "frames") {
+            valid = readNumbers(cursor, values, 1) && values[0] >= 1;
+            animation.frameCount = (int) values[0];
+        }
+        else if (keyword == "camera") {
+            valid = readNumbers(cursor, values, 4);
+            animation.track(-1).keys.push_back({values[0], Vector3(values[1], values[2], values[3])});
+        }
+        else if (keyword == "sphere") {
+            valid = readNumbers(cursor, values, 5) && values[1] >= 0 && values[1] < sphereCount && values[1] == (int) values[1];
+            if (valid) {
+                animation.track((int) values[1]).keys.push_back({values[0], Vector3(values[2], values[3], values[4])});
+            }
+        }
+        else {
+            cerr << path << ":" << lineNumber << ": unknown element \"" << keyword << "\"" << endl;
+            return false;
+        }
+        if (!valid || !readWord(cursor).empty()) {
+            cerr << path << ":" << lineNumber << ": invalid " << keyword << ": " << line << endl;
+            return false;
+        }
+    }
+    for (AnimationTrack& track : animation.tracks) {
+        stable_sort(track.keys.begin(), track.keys.end(), [](const Keyframe& a, const Keyframe& b) { return a.frame < b.frame; });
+        for (size_t k = 1; k < track.keys.size(); k++) {
+            if (track.keys[k].frame == track.keys[k-1].frame) {
+                cerr << path << ": two keyframes at frame " << track.keys[k].frame << " for the same "
+                     << (track.sphere == -1 ? "camera" : "sphere") << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+class AsyncImageWriter {
+    /**
+     * Writes images on its own thread, so that the next frame can be rendered while the last
+     * one is converted, encoded and written to the disk. Only one image is written at a time:
+     * the framebuffer handed to write() must not be changed until the next call to write() or
+     * wait() returns.
+    */
+    public:
+        AsyncImageWriter() {
+            this->worker = thread(&AsyncImageWriter::workerLoop, this);
+        }
+
+        ~AsyncImageWriter() {
+            {
+                lock_guard<mutex> lock(this->stateLock);
+                this->stopping = true;
+            }
+            this->changed.notify_all();
+            this->worker.join();
+        }
+
+        AsyncImageWriter(const AsyncImageWriter&) = delete;
+        AsyncImageWriter& operator = (const AsyncImageWriter&) = delete;
+
+        void write(const Framebuffer& framebuffer, const string& path) {
+            /**
+             * Waits until the previous image is written, then starts writing framebuffer to path
+            */
+            unique_lock<mutex> lock(this->stateLock);
+            this->changed.wait(lock, [this] { return this->pending == nullptr; });
+            this->pending = &framebuffer;
+            this->path = path;
+            this->changed.notify_all();
+        }
+
+        bool wait() {
+            /**
+             * Waits until the last image is written
+             *
+             * @return false if any image could not be written since the last call to wait()
+            */
+            unique_lock<mutex> lock(this->stateLock);
+            this->changed.wait(lock, [this] { return this->pending == nullptr; });
+            bool succeeded = !this->failed;
+            this->failed = false;
+            return succeeded;
+        }
+
+        double busyTime() const {
+            /**
+             * Returns the time spent writing images so far, in milliseconds
+            */
+            return this->writeTime;
+        }
+
+    private:
+        thread worker;
+        mutex stateLock;
+        condition_variable changed; // signaled when an image is handed over or written, and on destruction
+        const Framebuffer* pending = nullptr; // image being written, null when the writer is idle
+        string path; // where the pending image is written
+        bool failed = false;
+        bool stopping = false;
+        double writeTime = 0;
+
+        void workerLoop() {
+            unique_lock<mutex> lock(this->stateLock);
+            while (true) {
+                this->changed.wait(lock, [this] { return this->stopping || this->pending != nullptr; });
+                if (this->pending == nullptr) { // stopping
+                    return;
+                }
+                const Framebuffer* framebuffer = this->pending;
+                string path = this->path;
+                lock.unlock();
+                auto start = chrono::steady_clock::now();
+                bool written = writeImage(*framebuffer, path);
+                if (!written) {
+                    cerr << "Could not write " << path << endl;
+                }
+                double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+                lock.lock();
+                this->writeTime += elapsed;
+                this->failed = this->failed || !written;
+                this->pending = nullptr;
+                this->changed.notify_all();
+            }
+        }
+};
+
+bool renderAnimation(const Scene& scene, const Animation& animation, ThreadPool& pool, const string& outputPath,
+                     bool useBVH=true, bool useSphereArrays=true, const CompiledScene* compiledScene=nullptr,
+                     float refitThreshold=0) {
+    /**
+     * Renders every frame of an animation to outputPath with the frame number appended
+     * (render.png gives render_0000.png, render_0001.png...). Frames are rendered back to back:
+     * while a frame is traced, the previous one is written by another thread. The thread pool,
+     * the two framebuffers and the G-buffer are shared by all the frames, and the BVH of a frame
+     * is copied from the previous one when the spheres did not move, and refit to them when they
+     * did (with refitThreshold).
+     *
+     * @param scene The scene at the start of the animation
+     * @param animation The keyframes moving the camera and the spheres of scene
+     * @param pool The threads to render with
+     * @param outputPath The path of the images, before the frame number is added
+     * @param useBVH Builds a BVH over the spheres of every frame
+     * @param useSphereArrays Builds the SoA sphere arrays of every frame
+     * @param compiledScene If not null, scene compiled with the same options, whose BVH is
+     *                      reused by the first frame if its spheres did not move
+     * @param refitThreshold If positive, the BVH over the spheres of the previous frame is refit
+     *                       to the spheres which moved, and built again once its SAH cost grows
+     *                       past refitThreshold times its cost when it was built. 0 builds it
+     *                       again every frame the spheres moved.
+     * @return false if an image could not be written
+    */
+    Framebuffer framebuffers[2] = {Framebuffer(xRes, yRes, defaultColor), Framebuffer(xRes, yRes, defaultColor)};
+    GBuffer gbuffer;
+    CompiledScene previous;
+    const CompiledScene* reusable = compiledScene; // scene the BVH can be copied from
+    AsyncImageWriter writer;
+    double renderTime = 0;
+    double bvhTime = 0; // building or refitting the BVHs of the frames, part of renderTime
+    auto start = chrono::steady_clock::now();
+    for (int frame = 0; frame < animation.frameCount; frame++) {
+        auto frameStart = chrono::steady_clock::now();
+        CompiledScene compiled = CompiledScene::compile(animation.frame(scene, frame), useBVH, useSphereArrays, reusable, refitThreshold, &pool);
+        // framebuffers[frame % 2] was handed to the writer two frames ago, and the write of the
+        // last frame only started once that one was finished
+        Framebuffer& framebuffer = framebuffers[frame % 2];
+        bool relit = renderWithGBuffer(compiled, framebuffer, pool, gbuffer);
+        double frameTime = chrono::duration<double, milli>(chrono::steady_clock::now() - frameStart).count();
+        renderTime += frameTime;
+        bvhTime += compiled.bvhBuildTime;
+        ostringstream number;
+        number << setw(4) << setfill('0') << frame;
+        string framePath = suffixedPath(outputPath, "_" + number.str());
+        writer.write(framebuffer, framePath);
+        cout << "Frame " << frame << " rendered in " << frameTime << " ms";
+        if (compiled.bvhNodeCount > 0 && compiled.bvhBuildTime == 0) {
+            cout << ", BVH reused";
+        }
+        else if (compiled.bvhRefits > 0) {
+            cout << ", BVH refit in " << compiled.bvhBuildTime << " ms (" << compiled.bvhRotations << " rotations, SAH cost "
+                 << 100 * compiled.sphereSahCost / compiled.builtSphereSahCost << "% of the built one)";
+        }
+        else if (compiled.bvhNodeCount > 0) {
+            cout << ", BVH built in " << compiled.bvhBuildTime << " ms";
+        }
+        cout << (relit ? ", shaded from the G-buffer" : "") << ", writing " << framePath << endl;
+        previous = move(compiled);
+        reusable = &previous;
+    }
+    bool written = writer.wait();
+    double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    cout << "Animation complete: " << animation.frameCount << " frames in " << elapsed << " ms ("
+         << 1000 * animation.frameCount / elapsed << " frames per second), " << renderTime << " ms rendering (" << bvhTime
+         << " ms of them building or refitting BVHs) and "
+         << writer.busyTime() << " ms writing images in parallel" << endl;
+    return written;
+}
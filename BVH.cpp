@@ -0,0 +1,440 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <vector>
+
+using namespace std;
+
+struct AABB {
+    /**
+     * Axis-aligned bounding box, used to bound primitives and BVH nodes
+    */
+    float min[3], max[3];
+
+    AABB() { // empty box, growing it with anything gives that thing's bounds
+        for (int axis = 0; axis < 3; axis++) {
+            this->min[axis] = numeric_limits<float>::infinity();
+            this->max[axis] = -numeric_limits<float>::infinity();
+        }
+    }
+
+    void grow(const AABB& box) {
+        for (int axis = 0; axis < 3; axis++) {
+            this->min[axis] = std::min(this->min[axis], box.min[axis]);
+            this->max[axis] = std::max(this->max[axis], box.max[axis]);
+        }
+    }
+
+    void grow(const float point[3]) {
+        for (int axis = 0; axis < 3; axis++) {
+            this->min[axis] = std::min(this->min[axis], point[axis]);
+            this->max[axis] = std::max(this->max[axis], point[axis]);
+        }
+    }
+
+    float center(int axis) const {
+        return (this->min[axis] + this->max[axis]) * .5f;
+    }
+
+    float surfaceArea() const {
+        float dx = this->max[0] - this->min[0];
+        float dy = this->max[1] - this->min[1];
+        float dz = this->max[2] - this->min[2];
+        if (dx < 0 || dy < 0 || dz < 0) { // empty box
+            return 0;
+        }
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    }
+
+    bool intersectRay(const float origin[3], const float invDir[3], float tMin, float tMax, float& tEntry) const {
+        /**
+         * Slab test between the box and the ray origin + t*dir, t in [tMin, tMax]
+         *
+         * @param origin The ray origin
+         * @param invDir The inverse of each component of the ray direction
+         * @param tMin The start of the ray
+         * @param tMax The end of the ray
+         * @param tEntry Set to the distance at which the ray enters the box
+         * @return true if the ray crosses the box between tMin and tMax
+        */
+        for (int axis = 0; axis < 3; axis++) {
+            float t1 = (this->min[axis] - origin[axis]) * invDir[axis];
+            float t2 = (this->max[axis] - origin[axis]) * invDir[axis];
+            tMin = std::max(tMin, std::min(t1, t2));
+            tMax = std::min(tMax, std::max(t1, t2));
+        }
+        tEntry = tMin;
+        return tMin <= tMax;
+    }
+};
+
+struct BVHNode {
+    /**
+     * A node of a BVH, 32 bytes so that two nodes fit in a cache line. The two children of
+     * an interior node are stored next to each other in BVH::nodes.
+    */
+    AABB bounds;
+    int first; // leaf: index of the first primitive in BVH::primitives, interior: index of the left child
+    int count; // number of primitives of a leaf, 0 for interior nodes
+};
+
+class BVH {
+    /**
+     * Bounding volume hierarchy over any kind of primitive, built from the primitive bounding
+     * boxes with the surface area heuristic (SAH). Nodes and primitive indices are stored in
+     * two flat arrays, and traversal is done with a small fixed stack, visiting the closest
+     * child first.
+     * The BVH only knows about boxes: the primitive tests are done by the caller, for a whole
+     * leaf at once (leaf primitives are contiguous in the primitives array).
+    */
+    public:
+        vector<BVHNode> nodes; // nodes[0] is the root, empty if nothing was built
+        vector<int> primitives; // primitive indices, grouped by leaf
+        double buildTime = 0; // duration of the last build, in milliseconds
+        float intersectionCost = INTERSECTION_COST; // SAH cost of testing one primitive, as given to the last build
+
+        static constexpr int BIN_COUNT = 16; // number of candidate split planes per axis
+        static constexpr int MAX_LEAF_SIZE = 8; // bigger leaves are always split
+        static constexpr float TRAVERSAL_COST = 1; // SAH cost of visiting a node...
+        static constexpr float INTERSECTION_COST = 1; // ...relative to testing one primitive
+        static constexpr int STACK_SIZE = 64;
+
+        BVH() {} // default constructor
+
+        void build(const vector<AABB>& boxes, float intersectionCost=INTERSECTION_COST) {
+            /**
+             * (Re)builds the hierarchy over a set of primitives
+             *
+             * @param boxes The bounding box of every primitive, primitive i being boxes[i]
+             * @param intersectionCost The SAH cost of testing one primitive, relative to visiting
+             *                         a node: primitives tested several at a time by a SIMD
+             *                         kernel cost less, and get bigger leaves
+            */
+            auto start = chrono::steady_clock::now();
+            this->intersectionCost = intersectionCost;
+            this->nodes.clear();
+            this->primitives.resize(boxes.size());
+            for (size_t i = 0; i < boxes.size(); i++) {
+                this->primitives[i] = (int) i;
+            }
+            if (!boxes.empty()) {
+                this->nodes.reserve(2 * boxes.size() - 1);
+                this->nodes.push_back(BVHNode());
+                this->nodes[0].first = 0;
+                this->nodes[0].count = (int) boxes.size();
+                subdivide(0, boxes, 0);
+            }
+            this->nodes.shrink_to_fit();
+            this->buildTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        }
+
+        float sahCost() const {
+            /**
+             * Returns the SAH cost of the hierarchy: the expected cost of tracing a random ray
+             * crossing the root box, in units of primitive intersection tests
+            */
+            if (this->nodes.empty()) {
+                return 0;
+            }
+            if (this->nodes[0].bounds.surfaceArea() <= 0) {
+                return (float) this->primitives.size() * this->intersectionCost;
+            }
+            return sahCost(this->nodes.data(), (int) this->nodes.size(), this->intersectionCost);
+        }
+
+        static float sahCost(const BVHNode* nodes, int nodeCount, float intersectionCost) {
+            /**
+             * Returns the SAH cost of nodes stored anywhere (e.g. refit in a CompiledScene),
+             * 0 for a flat root box
+            */
+            float rootArea = nodeCount > 0 ? nodes[0].bounds.surfaceArea() : 0;
+            if (rootArea <= 0) {
+                return 0;
+            }
+            float cost = 0;
+            for (int i = 0; i < nodeCount; i++) {
+                float probability = nodes[i].bounds.surfaceArea() / rootArea;
+                cost += probability * (nodes[i].count == 0 ? TRAVERSAL_COST : nodes[i].count * intersectionCost);
+            }
+            return cost;
+        }
+
+        static void levels(const BVHNode* nodes, int nodeCount, vector<int>& order, vector<int>& levelStarts) {
+            /**
+             * Lists the nodes breadth first: the nodes of depth d are order[levelStarts[d]] to
+             * order[levelStarts[d+1]-1] (levelStarts.size() - 1 being the depth of the tree).
+             * The nodes of a level only depend on the levels below, and can be refit in parallel.
+            */
+            order.clear();
+            order.reserve(nodeCount);
+            levelStarts.assign(1, 0);
+            if (nodeCount == 0) {
+                return;
+            }
+            order.push_back(0);
+            for (size_t start = 0; start < order.size(); start = levelStarts.back()) {
+                size_t end = order.size();
+                for (size_t k = start; k < end; k++) {
+                    const BVHNode& node = nodes[order[k]];
+                    if (node.count == 0) {
+                        order.push_back(node.first);
+                        order.push_back(node.first + 1);
+                    }
+                }
+                levelStarts.push_back((int) end);
+            }
+        }
+
+        static int rotate(BVHNode* nodes, const vector<int>& order, const vector<int>& levelStarts) {
+            /**
+             * Improves refit nodes with tree rotations, from the deepest level up: a child of a
+             * node is swapped with a child of its sibling when this shrinks the box of the
+             * sibling. The leaves under a node stay the same, so only the sibling box changes,
+             * and the primitives keep their order. A rotation moves a subtree one level down:
+             * the depth of the tree must be checked against STACK_SIZE afterwards.
+             *
+             * @param order The nodes by level, from levels()
+             * @param levelStarts The start of every level in order
+             * @return The number of rotations done
+            */
+            int rotations = 0;
+            for (int level = (int) levelStarts.size() - 3; level >= 0; level--) {
+                for (int k = levelStarts[level]; k < levelStarts[level + 1]; k++) {
+                    const BVHNode& node = nodes[order[k]];
+                    if (node.count > 0) {
+                        continue;
+                    }
+                    float bestGain = 0;
+                    int bestChild = -1, bestGrandchild = -1;
+                    for (int side = 0; side < 2; side++) {
+                        int child = node.first + side, sibling = node.first + 1 - side;
+                        if (nodes[sibling].count > 0) {
+                            continue;
+                        }
+                        float siblingArea = nodes[sibling].bounds.surfaceArea();
+                        for (int g = 0; g < 2; g++) {
+                            // the grandchild moves up, the child takes its place next to the other grandchild
+                            AABB rotated = nodes[child].bounds;
+                            rotated.grow(nodes[nodes[sibling].first + 1 - g].bounds);
+                            float gain = siblingArea - rotated.surfaceArea();
+                            if (gain > bestGain) {
+                                bestGain = gain;
+                                bestChild = child;
+                                bestGrandchild = nodes[sibling].first + g;
+                            }
+                        }
+                    }
+                    if (bestChild < 0) {
+                        continue;
+                    }
+                    int sibling = bestChild == node.first ? node.first + 1 : node.first;
+                    swap(nodes[bestChild], nodes[bestGrandchild]);
+                    AABB bounds = nodes[nodes[sibling].first].bounds;
+                    bounds.grow(nodes[nodes[sibling].first + 1].bounds);
+                    nodes[sibling].bounds = bounds;
+                    rotations++;
+                }
+            }
+            return rotations;
+        }
+
+        static int depth(const BVHNode* nodes, int nodeCount) {
+            /**
+             * Returns the number of levels of the tree, 0 if it is empty
+            */
+            if (nodeCount == 0) {
+                return 0;
+            }
+            int stack[2 * STACK_SIZE][2]; // node and depth; deeper trees are reported as STACK_SIZE + 1 levels deep
+            int stackSize = 0, deepest = 0;
+            stack[stackSize][0] = 0;
+            stack[stackSize++][1] = 1;
+            while (stackSize > 0) {
+                stackSize--;
+                const BVHNode& node = nodes[stack[stackSize][0]];
+                int level = stack[stackSize][1];
+                deepest = max(deepest, level);
+                if (level > STACK_SIZE) {
+                    return STACK_SIZE + 1;
+                }
+                if (node.count == 0) {
+                    for (int side = 0; side < 2; side++) {
+                        stack[stackSize][0] = node.first + side;
+                        stack[stackSize++][1] = level + 1;
+                    }
+                }
+            }
+            return deepest;
+        }
+
+        template <typename LeafTest>
+        int traverse(const float origin[3], const float dir[3], float tMin, float& tMax, LeafTest leafTest) const {
+            return traverse(this->nodes.data(), (int) this->nodes.size(), origin, dir, tMin, tMax, leafTest);
+        }
+
+        template <typename LeafTest>
+        static int traverse(const BVHNode* nodes, int nodeCount, const float origin[3], const float dir[3],
+                            float tMin, float& tMax, LeafTest leafTest) {
+            /**
+             * Walks the hierarchy along the ray origin + t*dir, t in [tMin, tMax], calling
+             * leafTest(first, count, tMax) for every leaf the ray reaches, closest leaves first.
+             * leafTest tests the primitives primitives[first] to primitives[first+count-1], may
+             * shrink tMax when it finds a hit (nodes beyond tMax are skipped), and returns true
+             * to stop the traversal early.
+             *
+             * The nodes may be stored anywhere (e.g. copied out of the BVH by a CompiledScene).
+             *
+             * @return The number of nodes visited, as a measure of the cost of the ray
+            */
+            if (nodeCount == 0) {
+                return 0;
+            }
+            float invDir[3] = {1 / dir[0], 1 / dir[1], 1 / dir[2]};
+            int stack[STACK_SIZE];
+            int stackSize = 0;
+            int visited = 0;
+            float tEntry;
+            if (!nodes[0].bounds.intersectRay(origin, invDir, tMin, tMax, tEntry)) {
+                return 1;
+            }
+            stack[stackSize++] = 0;
+            while (stackSize > 0) {
+                const BVHNode& node = nodes[stack[--stackSize]];
+                visited++;
+                if (node.count > 0) {
+                    if (leafTest(node.first, node.count, tMax)) {
+                        return visited;
+                    }
+                    continue;
+                }
+                float tLeft, tRight;
+                bool hitLeft = nodes[node.first].bounds.intersectRay(origin, invDir, tMin, tMax, tLeft);
+                bool hitRight = nodes[node.first + 1].bounds.intersectRay(origin, invDir, tMin, tMax, tRight);
+                if (hitLeft && hitRight) { // the closest child is popped (visited) first
+                    if (tLeft <= tRight) {
+                        stack[stackSize++] = node.first + 1;
+                        stack[stackSize++] = node.first;
+                    }
+                    else {
+                        stack[stackSize++] = node.first;
+                        stack[stackSize++] = node.first + 1;
+                    }
+                }
+                else if (hitLeft) {
+                    stack[stackSize++] = node.first;
+                }
+                else if (hitRight) {
+                    stack[stackSize++] = node.first + 1;
+                }
+            }
+            return visited;
+        }
+
+    private:
+        struct Bin {
+            AABB bounds;
+            int count = 0;
+        };
+
+        void subdivide(int nodeIndex, const vector<AABB>& boxes, int depth) {
+            /**
+             * Computes the bounds of a node and splits it in two children if the SAH estimates
+             * it is cheaper than keeping it as a leaf. Nodes deeper than the traversal stack
+             * allows are always kept as leaves.
+            */
+            int first = this->nodes[nodeIndex].first;
+            int count = this->nodes[nodeIndex].count;
+            AABB bounds, centroidBounds;
+            for (int i = first; i < first + count; i++) {
+                const AABB& box = boxes[this->primitives[i]];
+                bounds.grow(box);
+                float centroid[3] = {box.center(0), box.center(1), box.center(2)};
+                centroidBounds.grow(centroid);
+            }
+            this->nodes[nodeIndex].bounds = bounds;
+            if (count <= 1 || depth >= STACK_SIZE - 2) {
+                return;
+            }
+
+            // find the cheapest split among BIN_COUNT-1 planes on each axis
+            float bestCost = numeric_limits<float>::infinity();
+            int bestAxis = -1;
+            int bestPlane = 0;
+            for (int axis = 0; axis < 3; axis++) {
+                float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+                if (extent <= 0) {
+                    continue;
+                }
+                Bin bins[BIN_COUNT];
+                float scale = BIN_COUNT / extent;
+                for (int i = first; i < first + count; i++) {
+                    const AABB& box = boxes[this->primitives[i]];
+                    int b = min(BIN_COUNT - 1, (int) ((box.center(axis) - centroidBounds.min[axis]) * scale));
+                    bins[b].count++;
+                    bins[b].bounds.grow(box);
+                }
+                // sweep from the right to get the right side of every plane, then from the left
+                float rightArea[BIN_COUNT - 1];
+                int rightCount[BIN_COUNT - 1];
+                AABB right;
+                int sum = 0;
+                for (int plane = BIN_COUNT - 2; plane >= 0; plane--) {
+                    right.grow(bins[plane + 1].bounds);
+                    sum += bins[plane + 1].count;
+                    rightArea[plane] = right.surfaceArea();
+                    rightCount[plane] = sum;
+                }
+                AABB left;
+                sum = 0;
+                for (int plane = 0; plane < BIN_COUNT - 1; plane++) {
+                    left.grow(bins[plane].bounds);
+                    sum += bins[plane].count;
+                    if (sum == 0 || rightCount[plane] == 0) {
+                        continue;
+                    }
+                    float cost = left.surfaceArea() * sum + rightArea[plane] * rightCount[plane];
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestPlane = plane;
+                    }
+                }
+            }
+
+            float area = bounds.surfaceArea();
+            float leafCost = count * this->intersectionCost;
+            float splitCost = TRAVERSAL_COST + (area > 0 ? bestCost / area : 0) * this->intersectionCost;
+            int middle;
+            if (bestAxis >= 0 && (splitCost < leafCost || count > MAX_LEAF_SIZE)) {
+                float extent = centroidBounds.max[bestAxis] - centroidBounds.min[bestAxis];
+                float scale = BIN_COUNT / extent;
+                float minCentroid = centroidBounds.min[bestAxis];
+                int* begin = this->primitives.data() + first;
+                int* split = partition(begin, begin + count, [&](int primitive) {
+                    int b = min(BIN_COUNT - 1, (int) ((boxes[primitive].center(bestAxis) - minCentroid) * scale));
+                    return b <= bestPlane;
+                });
+                middle = (int) (split - this->primitives.data());
+            }
+            else if (count > MAX_LEAF_SIZE) { // all centroids are equal: split in two halves
+                middle = first + count / 2;
+            }
+            else {
+                return; // keeping a leaf is cheaper
+            }
+
+            int leftIndex = (int) this->nodes.size();
+            this->nodes.push_back(BVHNode());
+            this->nodes.push_back(BVHNode());
+            this->nodes[leftIndex].first = first;
+            this->nodes[leftIndex].count = middle - first;
+            this->nodes[leftIndex + 1].first = middle;
+            this->nodes[leftIndex + 1].count = first + count - middle;
+            this->nodes[nodeIndex].first = leftIndex;
+            this->nodes[nodeIndex].count = 0;
+            subdivide(leftIndex, boxes, depth + 1);
+            subdivide(leftIndex + 1, boxes, depth + 1);
+        }
+};
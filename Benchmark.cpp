@@ -0,0 +1,665 @@
+#pragma once
+
+// Benchmark suite, run with --benchmark. This file is included by main.cpp after the tracer and
+// render functions it measures.
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// custom files:
+#include <Framebuffer.cpp>
+#include <ThreadPool.cpp>
+
+using namespace std;
+
+struct BenchmarkResult {
+    string benchmark; // what is measured
+    string parameter; // what the benchmark scales with
+    long long value; // value of the parameter
+    long long operations; // number of timed operations (intersections, rays, calls or pixels)
+    double nanoseconds; // total time of the operations
+};
+
+static const double benchmarkMinTime = 2e8; // every measure runs for at least this many nanoseconds
+static volatile double benchmarkSink; // timed results end up here so the compiler cannot drop the timed code
+
+template <typename Run>
+BenchmarkResult measure(const string& benchmark, const string& parameter, long long value, long long operationsPerRun, Run run) {
+    /**
+     * Times run(), which does operationsPerRun operations, calling it again until benchmarkMinTime
+     * has passed. A first call is made beforehand and is not timed, to warm the caches up.
+    */
+    benchmarkSink = run();
+    BenchmarkResult result = {benchmark, parameter, value, 0, 0};
+    auto start = chrono::steady_clock::now();
+    do {
+        benchmarkSink = run();
+        result.operations += operationsPerRun;
+        result.nanoseconds = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    } while (result.nanoseconds < benchmarkMinTime);
+    return result;
+}
+
+void writeBenchmarkResults(ostream& out, const vector<BenchmarkResult>& results, int threads) {
+    /**
+     * Writes benchmark results as CSV, one line per measure, with the sphere kernel and the
+     * number of threads so that results of different machines can be told apart
+    */
+    out << "benchmark,parameter,value,operations,ns_per_operation,operations_per_second,kernel,threads" << endl;
+    for (const BenchmarkResult& result : results) {
+        double nsPerOperation = result.nanoseconds / result.operations;
+        out << result.benchmark << "," << result.parameter << "," << result.value << "," << result.operations << ","
+            << nsPerOperation << "," << 1e9 / nsPerOperation << "," << nearestSphereName << "," << threads << endl;
+    }
+}
+
+vector<Vector3> benchmarkTargets(const CompiledScene& scene, int width, int height) {
+    /**
+     * Returns the point of the projection plane of every pixel of a width by height image
+    */
+    int savedXRes = xRes, savedYRes = yRes;
+    xRes = width;
+    yRes = height;
+    vector<Vector3> targets;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            targets.push_back(screenToProjPlane(scene, x, y));
+        }
+    }
+    xRes = savedXRes;
+    yRes = savedYRes;
+    return targets;
+}
+
+void benchmarkSphereIntersection(vector<BenchmarkResult>& results) {
+    /**
+     * Sphere::intersectDistances alone (the test of every sphere in the scalar loops), for rays
+     * of which about half hit the sphere
+    */
+    Sphere sphere(Vector3(0, 0, 9), 3, RGB(255, 255, 255));
+    CompiledScene scene = CompiledScene::compile(Scene::getDefaultScene());
+    Vector3 origin = scene.cameraPos;
+    vector<Vector3> rayDirs;
+    for (const Vector3& target : benchmarkTargets(scene, 64, 64)) {
+        rayDirs.push_back(Vector3::normalize(target - origin));
+    }
+    results.push_back(measure("sphere_intersect_distances", "rays", (long long) rayDirs.size(), rayDirs.size(), [&]() {
+        int hits = 0;
+        for (const Vector3& rayDir : rayDirs) {
+            float t1, t2;
+            tie(t1, t2) = sphere.intersectDistances(origin, rayDir);
+            hits += t1 != numeric_limits<float>::infinity();
+        }
+        return (double) hits;
+    }));
+}
+
+template <PrimitiveType TYPE>
+BenchmarkResult measurePrimitiveKernel(const string& benchmark, const CompiledScene& scene, const Vector3& origin,
+                                       const vector<Vector3>& rayDirs) {
+    /**
+     * Times the kernel of a type of primitive alone, testing every ray against the first
+     * primitive of that type of scene
+    */
+    vector<PrimitiveRay> rays;
+    for (const Vector3& rayDir : rayDirs) {
+        rays.push_back(PrimitiveRay(origin, rayDir));
+    }
+    return measure(benchmark, "rays", (long long) rays.size(), rays.size(), [&]() {
+        int hits = 0;
+        for (const PrimitiveRay& ray : rays) {
+            float t;
+            hits += nearestPrimitive<TYPE>(scene.groups[TYPE].arrays, 0, 1, ray, 1, numeric_limits<float>::infinity(), t) != -1;
+        }
+        return (double) hits;
+    });
+}
+
+void benchmarkPrimitiveIntersection(vector<BenchmarkResult>& results) {
+    /**
+     * The ground of the default scene as a sphere (what it used to be) and as a plane, then the
+     * box and triangle kernels, for the primary rays of a 64x64 image
+    */
+    Scene source = Scene::getDefaultScene();
+    source.boxes = {Box(Vector3(-1, -1, 8), Vector3(1, 1, 10), RGB(255, 255, 255))};
+    source.triangles = {Triangle(Vector3(-2, -1, 9), Vector3(2, -1, 9), Vector3(0, 2, 9), RGB(255, 255, 255))};
+    CompiledScene scene = CompiledScene::compile(source);
+    Sphere ground(Vector3(0, -10001, 0), 10000, RGB(150, 150, 150));
+    Vector3 origin = scene.cameraPos;
+    vector<Vector3> rayDirs;
+    for (const Vector3& target : benchmarkTargets(scene, 64, 64)) {
+        rayDirs.push_back(Vector3::normalize(target - origin));
+    }
+    results.push_back(measure("ground_sphere_intersect", "rays", (long long) rayDirs.size(), rayDirs.size(), [&]() {
+        int hits = 0;
+        for (const Vector3& rayDir : rayDirs) {
+            float t1, t2;
+            tie(t1, t2) = ground.intersectDistances(origin, rayDir);
+            hits += t1 != numeric_limits<float>::infinity();
+        }
+        return (double) hits;
+    }));
+    results.push_back(measurePrimitiveKernel<PLANE>("ground_plane_intersect", scene, origin, rayDirs));
+    results.push_back(measurePrimitiveKernel<BOX>("box_intersect", scene, origin, rayDirs));
+    results.push_back(measurePrimitiveKernel<TRIANGLE>("triangle_intersect", scene, origin, rayDirs));
+}
+
+vector<Vector3> randomVectors(int count, float scale, unsigned seed) {
+    /**
+     * Returns count vectors of random directions and lengths between scale and 2*scale
+    */
+    mt19937 generator(seed);
+    uniform_real_distribution<float> coordinate(-1, 1), length(1, 2);
+    vector<Vector3> vectors;
+    while ((int) vectors.size() < count) {
+        Vector3 v(coordinate(generator), coordinate(generator), coordinate(generator));
+        float norm2 = Vector3::dot(v, v);
+        if (norm2 > .01f && norm2 <= 1) { // uniform directions
+            vectors.push_back(v * (scale * length(generator) / sqrtf(norm2)));
+        }
+    }
+    return vectors;
+}
+
+void benchmarkVectorMath(vector<BenchmarkResult>& results) {
+    /**
+     * Vector3::dot and the exact and fast normalizations, over vectors of random directions
+    */
+    vector<Vector3> vectors = randomVectors(4096, 1, 1);
+    results.push_back(measure("vector_dot", "vectors", (long long) vectors.size(), vectors.size(), [&]() {
+        float sum = 0;
+        for (size_t i = 1; i < vectors.size(); i++) {
+            sum += Vector3::dot(vectors[i-1], vectors[i]);
+        }
+        return (double) sum;
+    }));
+    results.push_back(measure("vector_normalize_exact", "vectors", (long long) vectors.size(), vectors.size(), [&]() {
+        float sum = 0;
+        for (const Vector3& v : vectors) {
+            Vector3 n = Vector3::normalizeExact(v);
+            sum += n.x + n.y + n.z;
+        }
+        return (double) sum;
+    }));
+    results.push_back(measure("vector_normalize_fast", "vectors", (long long) vectors.size(), vectors.size(), [&]() {
+        float sum = 0;
+        for (const Vector3& v : vectors) {
+            Vector3 n = Vector3::normalizeFast(v);
+            sum += n.x + n.y + n.z;
+        }
+        return (double) sum;
+    }));
+}
+
+bool checkNormalizePrecision(ostream& out, const CompiledScene& scene, ThreadPool& pool) {
+    /**
+     * Compares Vector3::normalizeFast() and Vector3::normalizeExact() to normalizations in
+     * double precision, for vectors of lengths from 1e-24 to 1e24, then renders scene with both
+     * and compares the images. The fast path is accurate enough if, for lengths from 1e-16 to
+     * 1e16 (far beyond the scale of any scene), its results are less than 1e-6 away from unit
+     * vectors (a few float ulps) and less than 0.1% of the color channels of the images differ.
+     * Any change of rounding makes some rays grazing a silhouette or a shadow edge flip between
+     * hit and miss, so the differences cannot all be small.
+     *
+     * @param out Where the comparison is printed
+     * @param scene The scene rendered with both normalizations
+     * @param pool The threads to render with
+     * @return true if the fast path is accurate enough
+    */
+    bool accurate = true;
+    out << "length    exact error  fast error   (largest distance to the unit vector computed in double)" << endl;
+    for (int exponent = -24; exponent <= 24; exponent += 4) {
+        double errors[2] = {0, 0};
+        for (const Vector3& v : randomVectors(10000, powf(10, (float) exponent), exponent + 100)) {
+            double norm = sqrt((double) v.x * v.x + (double) v.y * v.y + (double) v.z * v.z);
+            Vector3 normalized[2] = {Vector3::normalizeExact(v), Vector3::normalizeFast(v)};
+            for (int k = 0; k < 2; k++) {
+                double dx = normalized[k].x - v.x / norm, dy = normalized[k].y - v.y / norm, dz = normalized[k].z - v.z / norm;
+                double error = sqrt(dx * dx + dy * dy + dz * dz);
+                errors[k] = isfinite(error) ? max(errors[k], error) : numeric_limits<double>::infinity();
+            }
+        }
+        bool inRange = exponent >= -16 && exponent <= 16;
+        accurate = accurate && (!inRange || errors[1] < 1e-6);
+        out << "1e" << left << setw(6) << exponent << "  " << setw(11) << errors[0] << "  " << setw(11) << errors[1]
+            << right << (inRange ? "" : "  (out of the checked range)") << endl;
+    }
+
+    Framebuffer exact(xRes, yRes, defaultColor), fast(xRes, yRes, defaultColor);
+    bool fastNormalize = Vector3::fastNormalize;
+    Vector3::fastNormalize = false;
+    renderParallel(scene, exact, pool);
+    Vector3::fastNormalize = true;
+    renderParallel(scene, fast, pool);
+    Vector3::fastNormalize = fastNormalize;
+    long long differences = 0;
+    int largest = 0;
+    for (size_t i = 0; i < exact.pixels.size(); i++) {
+        COLORREF a = exact.pixels[i], b = fast.pixels[i];
+        int channels[3] = {abs(GetRValue(a) - GetRValue(b)), abs(GetGValue(a) - GetGValue(b)), abs(GetBValue(a) - GetBValue(b))};
+        for (int c = 0; c < 3; c++) {
+            differences += channels[c] != 0;
+            largest = max(largest, channels[c]);
+        }
+    }
+    accurate = accurate && differences < (long long) (3 * exact.pixels.size() / 1000);
+    out << "Rendered with the fast path, " << differences << " color channels of " << 3 * exact.pixels.size()
+        << " differ (by " << largest << " at most)" << endl;
+    out << "The fast normalization is " << (accurate ? "" : "not ") << "accurate enough" << endl;
+    return accurate;
+}
+
+void benchmarkSceneScaling(vector<BenchmarkResult>& results, const vector<int>& sphereCounts) {
+    /**
+     * BVH build, closestIntersection and traceRay for primary rays over random scenes of
+     * increasing size
+    */
+    for (int sphereCount : sphereCounts) {
+        Scene source = Scene::getRandomScene(sphereCount);
+        CompiledScene scene = CompiledScene::compile(source);
+        results.push_back({"bvh_build", "spheres", sphereCount, 1, scene.bvhBuildTime * 1e6});
+        vector<Vector3> targets = benchmarkTargets(scene, 128, 128);
+        Vector3 origin = scene.cameraPos;
+        results.push_back(measure("closest_intersection", "spheres", sphereCount, targets.size(), [&]() {
+            double sum = 0;
+            for (const Vector3& target : targets) {
+                sum += closestIntersection(scene, origin, target, 1, numeric_limits<float>::infinity()).index;
+            }
+            return sum;
+        }));
+        results.push_back(measure("trace_ray", "spheres", sphereCount, targets.size(), [&]() {
+            double sum = 0;
+            for (const Vector3& target : targets) {
+                COLORREF color;
+                Vector3 hitPos, normal;
+                tie(color, hitPos, normal) = traceRay(scene, origin, target, 1, numeric_limits<float>::infinity());
+                sum += hitPos.z;
+            }
+            return sum;
+        }));
+    }
+}
+
+void benchmarkLightScaling(vector<BenchmarkResult>& results, const vector<int>& lightCounts, float errorBound) {
+    /**
+     * lightIntensity (shadow rays included) at the primary hitpoints of a random scene lit by
+     * an increasing number of point lights, shading every light and then walking the light
+     * hierarchy with errorBound as lightErrorBound. The lights shaded per hitpoint by the
+     * hierarchy and its largest and mean errors are printed.
+    */
+    float savedErrorBound = lightErrorBound;
+    for (int lightCount : lightCounts) {
+        CompiledScene scene = CompiledScene::compile(Scene::getRandomScene(100, 1, lightCount));
+        vector<Vector3> targets = benchmarkTargets(scene, 64, 64);
+        vector<Vector3> positions, normals;
+        for (const Vector3& target : targets) {
+            COLORREF color;
+            Vector3 hitPos, normal;
+            tie(color, hitPos, normal) = traceRay(scene, scene.cameraPos, target, 1, numeric_limits<float>::infinity());
+            if (Vector3::norm(normal) > 0) {
+                positions.push_back(hitPos);
+                normals.push_back(normal);
+            }
+        }
+        vector<float> exact(positions.size());
+        for (float bound : {0.f, errorBound}) {
+            lightErrorBound = bound;
+            results.push_back(measure(bound > 0 ? "light_intensity_hierarchy" : "light_intensity", "lights", lightCount, positions.size(), [&]() {
+                double sum = 0;
+                for (size_t i = 0; i < positions.size(); i++) {
+                    sum += lightIntensity(scene, positions[i], normals[i]);
+                }
+                return sum;
+            }));
+        }
+        long long shadedLights = 0;
+        double maxError = 0, errorSum = 0;
+        for (size_t i = 0; i < positions.size(); i++) {
+            lightErrorBound = 0;
+            float exactIntensity = lightIntensity(scene, positions[i], normals[i]);
+            lightErrorBound = errorBound;
+            visitPointLights(scene, positions[i], normals[i], [&](const CompiledLight&, int) { shadedLights++; });
+            double error = fabs(lightIntensity(scene, positions[i], normals[i]) - exactIntensity);
+            maxError = max(maxError, error);
+            errorSum += error;
+        }
+        cerr << "  " << lightCount << " lights: " << (double) shadedLights / max(positions.size(), (size_t) 1)
+             << " lights shaded per hitpoint by the hierarchy, error up to " << maxError << " (mean "
+             << errorSum / max(positions.size(), (size_t) 1) << ")" << endl;
+    }
+    lightErrorBound = savedErrorBound;
+}
+
+void benchmarkSceneLoading(vector<BenchmarkResult>& results, const vector<int>& sphereCounts) {
+    /**
+     * Loading random scenes of increasing size from text files (parsed and compiled) and from
+     * binary files (memory mapped), written to the temporary directory beforehand
+    */
+    for (int sphereCount : sphereCounts) {
+        CompiledScene source = CompiledScene::compile(Scene::getRandomScene(sphereCount));
+        filesystem::path directory = filesystem::temp_directory_path();
+        string textPath = (directory / ("benchmark_" + to_string(sphereCount) + ".scene")).string();
+        string binaryPath = (directory / ("benchmark_" + to_string(sphereCount) + ".rtscene")).string();
+        if (!saveScene(source, textPath) || !saveScene(source, binaryPath)) {
+            cerr << "Could not write the scenes to " << directory << ", scene loading is not benchmarked" << endl;
+            return;
+        }
+        results.push_back(measure("load_text_scene", "spheres", sphereCount, 1, [&]() {
+            CompiledScene scene;
+            loadScene(textPath, scene);
+            return (double) scene.sphereCount;
+        }));
+        results.push_back(measure("load_binary_scene", "spheres", sphereCount, 1, [&]() {
+            CompiledScene scene;
+            loadScene(binaryPath, scene);
+            return (double) scene.sphereCount;
+        }));
+        filesystem::remove(textPath);
+        filesystem::remove(binaryPath);
+    }
+}
+
+void benchmarkMeshes(vector<BenchmarkResult>& results, const vector<int>& triangleCounts) {
+    /**
+     * Meshes of increasing size: loading them from OBJ files (written to the temporary
+     * directory beforehand), building their BVH, and closestIntersection and traceRay for
+     * primary rays in the default scene with the mesh instead of the spheres. The memory taken
+     * by the compiled meshes is printed on cerr.
+    */
+    for (int triangleCount : triangleCounts) {
+        Scene source = Scene::getDefaultScene();
+        source.spheres.clear();
+        source.meshes.push_back(Mesh::getSphereMesh(triangleCount, Vector3(0, 0, 5), 1.5f, RGB(255, 0, 0)));
+        int triangles = source.meshes[0].triangleCount();
+        string objPath = (filesystem::temp_directory_path() / ("benchmark_" + to_string(triangleCount) + ".obj")).string();
+        if (!writeObj(source.meshes[0], objPath)) {
+            cerr << "Could not write " << objPath << ", meshes are not benchmarked" << endl;
+            return;
+        }
+        results.push_back(measure("load_obj", "triangles", triangles, 1, [&]() {
+            Mesh mesh;
+            loadObj(objPath, mesh);
+            return (double) mesh.triangleCount();
+        }));
+        filesystem::remove(objPath);
+        CompiledScene scene = CompiledScene::compile(source);
+        results.push_back({"mesh_bvh_build", "triangles", triangles, 1, scene.bvhBuildTime * 1e6});
+        cerr << "  " << triangles << " triangles: " << (double) scene.meshMemorySize() / triangles
+             << " bytes per triangle (vertices, indices and BVH)" << endl;
+        vector<Vector3> targets = benchmarkTargets(scene, 128, 128);
+        Vector3 origin = scene.cameraPos;
+        results.push_back(measure("mesh_closest_intersection", "triangles", triangles, targets.size(), [&]() {
+            double sum = 0;
+            for (const Vector3& target : targets) {
+                sum += closestIntersection(scene, origin, target, 1, numeric_limits<float>::infinity()).index;
+            }
+            return sum;
+        }));
+        results.push_back(measure("mesh_trace_ray", "triangles", triangles, targets.size(), [&]() {
+            double sum = 0;
+            for (const Vector3& target : targets) {
+                COLORREF color;
+                Vector3 hitPos, normal;
+                tie(color, hitPos, normal) = traceRay(scene, origin, target, 1, numeric_limits<float>::infinity());
+                sum += hitPos.z;
+            }
+            return sum;
+        }));
+    }
+}
+
+void benchmarkInstances(vector<BenchmarkResult>& results, const vector<int>& instanceCounts) {
+    /**
+     * Scenes of Scene::getInstancedScene() with more and more instances: building the top level
+     * BVH, and closestIntersection and traceRay for primary rays. The memory taken by the
+     * instances and by their prototypes is printed on cerr, with the memory the same geometry
+     * would take copied into the scene.
+    */
+    for (int instanceCount : instanceCounts) {
+        Scene source = Scene::getInstancedScene(instanceCount);
+        CompiledScene scene = CompiledScene::compile(source);
+        double prototypeTime = 0; // the prototypes are built once, whatever the number of instances
+        for (const CompiledScene& prototype : scene.prototypes) {
+            prototypeTime += prototype.bvhBuildTime;
+        }
+        results.push_back({"instance_bvh_build", "instances", instanceCount, 1, (scene.bvhBuildTime - prototypeTime) * 1e6});
+        double copiedSize = 0; // size of the prototypes, once per instance
+        for (int i = 0; i < scene.groups[INSTANCE].count; i++) {
+            copiedSize += scene.prototypes[scene.instances[i].prototype].memorySize();
+        }
+        cerr << "  " << instanceCount << " instances: " << (double) scene.instanceMemorySize() / instanceCount
+             << " bytes per instance (transforms and BVH), " << scene.prototypeMemorySize() << " bytes of prototypes ("
+             << copiedSize / 1e6 << " MB if copied into the scene)" << endl;
+        vector<Vector3> targets = benchmarkTargets(scene, 128, 128);
+        Vector3 origin = scene.cameraPos;
+        results.push_back(measure("instance_closest_intersection", "instances", instanceCount, targets.size(), [&]() {
+            double sum = 0;
+            for (const Vector3& target : targets) {
+                sum += closestIntersection(scene, origin, target, 1, numeric_limits<float>::infinity()).index;
+            }
+            return sum;
+        }));
+        results.push_back(measure("instance_trace_ray", "instances", instanceCount, targets.size(), [&]() {
+            double sum = 0;
+            for (const Vector3& target : targets) {
+                COLORREF color;
+                Vector3 hitPos, normal;
+                tie(color, hitPos, normal) = traceRay(scene, origin, target, 1, numeric_limits<float>::infinity());
+                sum += hitPos.z;
+            }
+            return sum;
+        }));
+    }
+}
+
+void benchmarkRelight(vector<BenchmarkResult>& results, const vector<int>& sphereCounts, ThreadPool& pool) {
+    /**
+     * 256x256 frames of random scenes rendered with renderWithGBuffer(), tracing the primary
+     * rays into the G-buffer or (when only the lights changed) shading from it
+    */
+    int savedXRes = xRes, savedYRes = yRes;
+    xRes = yRes = 256;
+    long long pixels = (long long) xRes * yRes;
+    for (int sphereCount : sphereCounts) {
+        CompiledScene scene = CompiledScene::compile(Scene::getRandomScene(sphereCount));
+        Framebuffer framebuffer(xRes, yRes, defaultColor);
+        GBuffer gbuffer;
+        results.push_back(measure("gbuffer_trace", "spheres", sphereCount, pixels, [&]() {
+            gbuffer.invalidate();
+            renderWithGBuffer(scene, framebuffer, pool, gbuffer);
+            return (double) framebuffer.getPixel(xRes / 2, yRes / 2);
+        }));
+        results.push_back(measure("gbuffer_relight", "spheres", sphereCount, pixels, [&]() {
+            renderWithGBuffer(scene, framebuffer, pool, gbuffer);
+            return (double) framebuffer.getPixel(xRes / 2, yRes / 2);
+        }));
+    }
+    xRes = savedXRes;
+    yRes = savedYRes;
+}
+
+void benchmarkWavefront(vector<BenchmarkResult>& results, const vector<int>& depths, ThreadPool& pool) {
+    /**
+     * 256x256 frames of Scene::getReflectiveScene() rendered by the WavefrontRenderer up to
+     * increasing depths, and the cost per ray of every bounce of the deepest render (all its
+     * stages, from the statistics of its last frame)
+    */
+    CompiledScene scene = CompiledScene::compile(Scene::getReflectiveScene());
+    int savedXRes = xRes, savedYRes = yRes;
+    xRes = yRes = 256;
+    long long pixels = (long long) xRes * yRes;
+    Framebuffer framebuffer(xRes, yRes, defaultColor);
+    vector<WavefrontBounce> bounces;
+    for (int depth : depths) {
+        WavefrontRenderer renderer(depth, scene.pointLightCount + scene.directionalLightCount);
+        results.push_back(measure("wavefront_render", "depth", depth, pixels, [&]() {
+            renderer.render(scene, framebuffer, pool);
+            return (double) framebuffer.getPixel(xRes / 2, yRes / 2);
+        }));
+        bounces = renderer.bounces;
+    }
+    for (const WavefrontBounce& bounce : bounces) {
+        double milliseconds = bounce.intersectTime + bounce.shadeTime + bounce.shadowTime + bounce.spawnTime;
+        results.push_back({"wavefront_bounce", "depth", bounce.depth, bounce.rays, milliseconds * 1e6});
+    }
+    xRes = savedXRes;
+    yRes = savedYRes;
+}
+
+void benchmarkRaySorting(vector<BenchmarkResult>& results, const vector<int>& sphereCounts, ThreadPool& pool) {
+    /**
+     * 256x256 frames of random reflective scenes (Scene::getReflectiveScene()) rendered by the
+     * WavefrontRenderer up to 4 bounces, with and without sorting the secondary rays. How often
+     * a ray hits the primitive of the ray traced before it, and a shadow ray is blocked by the
+     * occluder of the previous one, is printed for the bounces after the camera rays.
+    */
+    int savedXRes = xRes, savedYRes = yRes;
+    xRes = yRes = 256;
+    long long pixels = (long long) xRes * yRes;
+    Framebuffer framebuffer(xRes, yRes, defaultColor);
+    for (int sphereCount : sphereCounts) {
+        CompiledScene scene = CompiledScene::compile(Scene::getReflectiveScene(sphereCount));
+        WavefrontRenderer renderer(4, scene.pointLightCount + scene.directionalLightCount);
+        for (bool sorted : {false, true}) {
+            renderer.sortRays = sorted;
+            results.push_back(measure(sorted ? "wavefront_sorted" : "wavefront_unsorted", "spheres", sphereCount, pixels, [&]() {
+                renderer.render(scene, framebuffer, pool);
+                return (double) framebuffer.getPixel(xRes / 2, yRes / 2);
+            }));
+            long long hits = 0, repeatedHits = 0, obstructedRays = 0, cachedOccluders = 0;
+            for (size_t depth = 1; depth < renderer.bounces.size(); depth++) {
+                const WavefrontBounce& bounce = renderer.bounces[depth];
+                hits += bounce.hits;
+                repeatedHits += bounce.repeatedHits;
+                obstructedRays += bounce.obstructedRays;
+                cachedOccluders += bounce.cachedOccluders;
+            }
+            cerr << "  " << sphereCount << " spheres, " << (sorted ? "sorted" : "unsorted") << " secondary rays: "
+                 << 100. * repeatedHits / max(hits, 1LL) << "% of the hits on the primitive of the previous ray, "
+                 << 100. * cachedOccluders / max(obstructedRays, 1LL) << "% of the blocked shadow rays blocked by the cached occluder"
+                 << endl;
+        }
+    }
+    xRes = savedXRes;
+    yRes = savedYRes;
+}
+
+void benchmarkRefit(vector<BenchmarkResult>& results, const vector<int>& sphereCounts, ThreadPool& pool) {
+    /**
+     * Frames of random scenes whose spheres all wander around their place, compiled from the
+     * previous frame with the BVH over the spheres built again or refit (threshold 1.5), and
+     * 256x256 renders of the last frame. The share of the render time spent on the BVH and the
+     * SAH cost of the refit BVH are printed.
+    */
+    int savedXRes = xRes, savedYRes = yRes;
+    xRes = yRes = 256;
+    Framebuffer framebuffer(xRes, yRes, defaultColor);
+    for (int sphereCount : sphereCounts) {
+        Scene scene = Scene::getRandomScene(sphereCount);
+        vector<Vector3> centers(sphereCount);
+        for (int i = 0; i < sphereCount; i++) {
+            centers[i] = scene.spheres[i].center;
+        }
+        int frame = 0;
+        auto nextFrame = [&]() {
+            frame++;
+            for (int i = 0; i < sphereCount; i++) {
+                Vector3 offset(sinf(.3f * frame + i), sinf(.2f * frame + 2 * i), sinf(.25f * frame + 3 * i));
+                scene.spheres[i].center = centers[i] + offset * .2f;
+            }
+        };
+        double milliseconds[2];
+        int builds = 0;
+        CompiledScene previous = CompiledScene::compile(scene);
+        for (float threshold : {0.f, 1.5f}) {
+            BenchmarkResult result = measure(threshold > 0 ? "animation_bvh_refit" : "animation_bvh_build", "spheres", sphereCount, 1, [&]() {
+                nextFrame();
+                CompiledScene compiled = CompiledScene::compile(scene, true, true, &previous, threshold, &pool);
+                builds += threshold > 0 && compiled.bvhRefits == 0;
+                previous = move(compiled);
+                return (double) previous.sphereSahCost;
+            });
+            milliseconds[threshold > 0] = result.nanoseconds / result.operations / 1e6;
+            results.push_back(result);
+        }
+        long long pixels = (long long) xRes * yRes;
+        BenchmarkResult render = measure("animation_render", "spheres", sphereCount, pixels, [&]() {
+            renderParallel(previous, framebuffer, pool);
+            return (double) framebuffer.getPixel(xRes / 2, yRes / 2);
+        });
+        results.push_back(render);
+        double renderTime = render.nanoseconds / render.operations * pixels / 1e6;
+        cerr << "  " << sphereCount << " spheres: BVH built in " << 100 * milliseconds[0] / renderTime << "% of the render time, refit in "
+             << 100 * milliseconds[1] / renderTime << "% (SAH cost " << 100 * previous.sphereSahCost / previous.builtSphereSahCost
+             << "% of the built one, built again " << builds << " times)" << endl;
+    }
+    xRes = savedXRes;
+    yRes = savedYRes;
+}
+
+void benchmarkRender(vector<BenchmarkResult>& results, const vector<int>& resolutions, ThreadPool& pool) {
+    /**
+     * Full renders of the default scene, with render() and renderParallel(), at increasing
+     * resolutions
+    */
+    CompiledScene scene = CompiledScene::compile(Scene::getDefaultScene());
+    int savedXRes = xRes, savedYRes = yRes;
+    for (int resolution : resolutions) {
+        xRes = yRes = resolution;
+        Framebuffer framebuffer(resolution, resolution, defaultColor);
+        long long pixels = (long long) resolution * resolution;
+        results.push_back(measure("render", "resolution", resolution, pixels, [&]() {
+            render(scene, framebuffer);
+            return (double) framebuffer.getPixel(resolution / 2, resolution / 2);
+        }));
+        results.push_back(measure("render_parallel", "resolution", resolution, pixels, [&]() {
+            renderParallel(scene, framebuffer, pool);
+            return (double) framebuffer.getPixel(resolution / 2, resolution / 2);
+        }));
+    }
+    xRes = savedXRes;
+    yRes = savedYRes;
+}
+
+vector<BenchmarkResult> runBenchmarks(ThreadPool& pool) {
+    /**
+     * Runs the whole benchmark suite. Every scene comes from Scene::getRandomScene(),
+     * Scene::getInstancedScene(), Scene::getReflectiveScene() or Scene::getDefaultScene() with fixed seeds, so the
+     * measures can be compared between commits and machines.
+     *
+     * @param pool The threads used by the parallel renders
+    */
+    vector<BenchmarkResult> results;
+    cerr << "Benchmarking Sphere::intersectDistances..." << endl;
+    benchmarkSphereIntersection(results);
+    benchmarkPrimitiveIntersection(results);
+    cerr << "Benchmarking vector math..." << endl;
+    benchmarkVectorMath(results);
+    cerr << "Benchmarking scenes of 10 to 1M spheres..." << endl;
+    benchmarkSceneScaling(results, {10, 1000, 100000, 1000000});
+    cerr << "Benchmarking 1 to 10000 lights, with and without the light hierarchy..." << endl;
+    benchmarkLightScaling(results, {1, 10, 100, 1000, 10000}, .01f);
+    cerr << "Benchmarking scene files of 1k to 1M spheres..." << endl;
+    benchmarkSceneLoading(results, {1000, 100000, 1000000});
+    cerr << "Benchmarking meshes of 10k to 1M triangles..." << endl;
+    benchmarkMeshes(results, {10000, 100000, 1000000});
+    cerr << "Benchmarking 1k to 1M instances..." << endl;
+    benchmarkInstances(results, {1000, 100000, 1000000});
+    cerr << "Benchmarking G-buffer relighting..." << endl;
+    benchmarkRelight(results, {10, 1000, 100000}, pool);
+    cerr << "Benchmarking wavefront renders of 0 to 8 bounces..." << endl;
+    benchmarkWavefront(results, {0, 1, 2, 4, 8}, pool);
+    cerr << "Benchmarking sorted and unsorted secondary rays in scenes of 1k to 100k spheres..." << endl;
+    benchmarkRaySorting(results, {1000, 100000}, pool);
+    cerr << "Benchmarking BVH refits of animated scenes of 10k to 1M spheres..." << endl;
+    benchmarkRefit(results, {10000, 100000, 1000000}, pool);
+    cerr << "Benchmarking renders..." << endl;
+    benchmarkRender(results, {128, 256, 512, 1024}, pool);
+    return results;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Colors are stored as Win32 COLORREF values (0x00BBGGRR) all over the renderer.
+// Outside of Windows, the same type and macros are defined here so that the renderer
+// can run headless (no window, no GDI), e.g. on Linux render nodes.
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdint.h>
+
+typedef uint32_t COLORREF;
+
+#define RGB(r, g, b) ((COLORREF)(((uint8_t)(r)) | (((COLORREF)(uint8_t)(g)) << 8) | (((COLORREF)(uint8_t)(b)) << 16)))
+#define GetRValue(rgb) ((uint8_t)(rgb))
+#define GetGValue(rgb) ((uint8_t)((rgb) >> 8))
+#define GetBValue(rgb) ((uint8_t)((rgb) >> 16))
+#endif
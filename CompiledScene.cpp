@@ -0,0 +1,1078 @@
+#pragma once
+
+// Compiled (frozen) scenes. This file is included by main.cpp after the Scene class it compiles.
+
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// custom files:
+#include <AlignedAllocator.cpp> // for the cache line aligned memory block
+#include <BVH.cpp> // acceleration structure for ray queries
+#include <Instances.cpp> // prototypes and their instances
+#include <Primitives.cpp> // planes, boxes, triangles and meshes, and what depends on the type of a primitive
+#include <SphereArrays.cpp> // SoA sphere storage and SIMD intersection kernels
+#include <ThreadPool.cpp> // to refit the BVH over the spheres in parallel
+
+using namespace std;
+
+enum LightType {
+    AMBIENT_LIGHT,
+    POINT_LIGHT,
+    DIRECTIONAL_LIGHT
+};
+
+struct CompiledLight {
+    /**
+     * A point or directional light of a compiled scene. Its type is not stored: lights are
+     * grouped by type and each group is shaded by its own LightKernel.
+    */
+    float intensity; // between 0 and 1, represents how bright the light is
+    Vector3 position; // position of the light (ignored for directional lights)
+    Vector3 direction; // direction from the scene towards the light (ignored for point lights)
+};
+
+struct LightNode {
+    /**
+     * A node of the light hierarchy of a compiled scene, a BVH over the positions of its point
+     * lights. Seen from far enough, the lights of a node light a hitpoint like a single light of
+     * their summed intensity at their center (see mergedLight()). 48 bytes.
+    */
+    AABB bounds; // of the positions of the lights
+    float center[3]; // mean position of the lights, weighted by their intensities
+    float intensity; // sum of the intensities of the lights
+    int first; // leaf: index of the first light in CompiledScene::lightOrder, interior: index of the left child
+    int count; // number of lights of a leaf, 0 for interior nodes
+
+    CompiledLight mergedLight() const {
+        CompiledLight light;
+        light.intensity = this->intensity;
+        light.position = Vector3(this->center[0], this->center[1], this->center[2]);
+        light.direction = Vector3(0, 0, 0);
+        return light;
+    }
+};
+
+template <LightType TYPE>
+struct LightKernel; // what depends on the type of a light, resolved at compile time
+
+template <>
+struct LightKernel<POINT_LIGHT> {
+    static Vector3 toLight(const CompiledLight& light, const Vector3& position) { // direction from position to the light, not normalized
+        return light.position - position;
+    }
+
+    static float distance(const CompiledLight& light, const Vector3& position) { // length of the shadow rays
+        return Vector3::distance(position, light.position);
+    }
+};
+
+template <>
+struct LightKernel<DIRECTIONAL_LIGHT> {
+    static Vector3 toLight(const CompiledLight& light, const Vector3& position) {
+        return light.direction;
+    }
+
+    static float distance(const CompiledLight& light, const Vector3& position) { // the light is infinitely far away
+        return numeric_limits<float>::infinity();
+    }
+};
+
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash=14695981039346656037ull) {
+    /**
+     * FNV-1a hash of size bytes, continuing hash (the hash of the previous bytes, if any)
+    */
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Hashes of the fields of the primitives and lights, one by one: their padding (and the 4th lane
+// of SSE vectors, see VECTOR3_SSE) is never initialized, so hashing them as raw bytes would give
+// processes compiling the same scene different hashes.
+
+uint64_t hashFields(const Vector3& v, uint64_t hash) {
+    float xyz[3] = {v.x, v.y, v.z};
+    return hashBytes(xyz, sizeof(xyz), hash);
+}
+
+uint64_t hashFields(const Sphere& sphere, uint64_t hash) {
+    hash = hashFields(sphere.center, hash);
+    hash = hashBytes(&sphere.radius, sizeof(float), hash);
+    hash = hashBytes(&sphere.color, sizeof(COLORREF), hash);
+    return hashBytes(&sphere.material, sizeof(int), hash);
+}
+
+uint64_t hashFields(const Plane& plane, uint64_t hash) {
+    hash = hashFields(plane.point, hash);
+    hash = hashFields(plane.normal, hash);
+    hash = hashBytes(&plane.color, sizeof(COLORREF), hash);
+    return hashBytes(&plane.material, sizeof(int), hash);
+}
+
+uint64_t hashFields(const Box& box, uint64_t hash) {
+    hash = hashFields(box.min, hash);
+    hash = hashFields(box.max, hash);
+    hash = hashBytes(&box.color, sizeof(COLORREF), hash);
+    return hashBytes(&box.material, sizeof(int), hash);
+}
+
+uint64_t hashFields(const Triangle& triangle, uint64_t hash) {
+    hash = hashFields(triangle.a, hash);
+    hash = hashFields(triangle.b, hash);
+    hash = hashFields(triangle.c, hash);
+    hash = hashBytes(&triangle.color, sizeof(COLORREF), hash);
+    return hashBytes(&triangle.material, sizeof(int), hash);
+}
+
+uint64_t hashFields(const CompiledLight& light, uint64_t hash) {
+    hash = hashBytes(&light.intensity, sizeof(float), hash);
+    hash = hashFields(light.position, hash);
+    return hashFields(light.direction, hash);
+}
+
+static_assert(sizeof(CompiledInstance) == 2 * sizeof(Transform) + 3 * 4, "compiled instances are hashed as raw bytes, they must have no padding");
+
+template <typename T>
+uint64_t hashFields(const vector<T>& elements, uint64_t hash=14695981039346656037ull) {
+    for (const T& element : elements) {
+        hash = hashFields(element, hash);
+    }
+    return hash;
+}
+
+bool parseLightType(const string& name, LightType& type) {
+    /**
+     * Converts the type of a Light to a LightType. "sun" is accepted as another name for
+     * directional lights.
+     *
+     * @return false if the type is unknown
+    */
+    if (name == "ambient") {
+        type = AMBIENT_LIGHT;
+    }
+    else if (name == "point") {
+        type = POINT_LIGHT;
+    }
+    else if (name == "directional" || name == "sun") {
+        type = DIRECTIONAL_LIGHT;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+struct CompiledSceneLayout {
+    /**
+     * Where every array of a compiled scene starts in its memory block, in bytes (each offset
+     * is a multiple of CompiledScene::CACHE_LINE)
+    */
+    uint64_t shapes[PRIMITIVE_TYPE_COUNT]; // primitives of each type, in scene order
+    uint64_t pointLights, directionalLights, lightNodes, lightOrder, materials, bvhNodes, bvhPrimitives;
+    uint64_t centerX, centerY, centerZ, radius2, index; // SoA sphere arrays
+    uint64_t primitiveNodes[PRIMITIVE_TYPE_COUNT]; // BVH of each type other than spheres (and planes), over the instances for INSTANCE
+    uint64_t primitiveFields[PRIMITIVE_TYPE_COUNT]; // SoA arrays of each type other than spheres
+    uint64_t primitiveIndex[PRIMITIVE_TYPE_COUNT];
+    uint64_t meshVertices, meshTriangles, meshOrder; // MeshArrays (primitiveNodes[MESH] holding the BVHs of all the meshes)
+    uint64_t size; // size of the whole block
+};
+
+struct CompiledMesh {
+    /**
+     * A mesh of a compiled scene: its triangles are a range of the MeshArrays of the scene, and
+     * its BVH a range of the nodes of the mesh group, whose leaves number the triangles from 0
+    */
+    int firstTriangle, triangleCount; // positions of its triangles in the mesh arrays
+    int firstVertex, vertexCount; // its vertices in the vertex buffer
+    int firstNode, nodeCount; // its BVH in the nodes of the mesh group, none if nodeCount is 0
+    COLORREF color;
+    int material; // index in the materials of the scene, -1 for a matte surface
+};
+
+struct PrimitiveGroup {
+    /**
+     * The primitives of one type in a compiled scene. Primitives are identified by a single
+     * number across all types: the spheres come first, then the planes, the boxes, the
+     * triangles, the mesh triangles and the instances, and the primitives of a type are numbered
+     * from first in scene order (mesh after mesh for the mesh triangles).
+    */
+    int first = 0; // identifier of the first primitive of the type
+    int count = 0;
+    const BVHNode* bvhNodes = nullptr; // BVH over the primitives of the type, none if bvhNodeCount is 0 (planes never have one, meshes one each)
+                                       // (for instances, the top level BVH, whose leaves number them in arrays.index order)
+    int bvhNodeCount = 0;
+    PrimitiveArrays arrays; // SoA geometry, in BVH order if there is a BVH (spheres and meshes use CompiledScene::sphereArrays and meshArrays instead)
+};
+
+class CompiledScene {
+    /**
+     * Read-only version of a Scene used by the render loop. Everything rays need (primitives,
+     * lights, BVH nodes and the SoA primitive arrays) is stored in a single memory block aligned
+     * on cache lines, every array starting on its own cache line. Lights are grouped by type,
+     * ambient lights being summed into a single intensity. A compiled scene cannot be changed:
+     * edit the Scene and compile it again instead.
+     * Tracing rays in a compiled scene does not allocate any memory.
+     * The block only holds plain data and indices (no pointers), so it can also be written to
+     * a file and used straight from a memory mapping of it (see SceneFile.cpp).
+     * The prototypes of the instances are compiled scenes of their own, with their own blocks,
+     * which only hold geometry.
+    */
+    public:
+        static constexpr size_t CACHE_LINE = 64;
+        static constexpr float MESH_INTERSECTION_COST = .25f; // SAH cost of a mesh triangle, tested 4 at a time (see nearestMeshTriangle)
+        static constexpr float INSTANCE_INTERSECTION_COST = 4; // SAH cost of an instance, whose rays are transformed and traced in a prototype
+
+        Vector3 cameraPos;
+        float projPlaneWidth = 0;
+        float projPlaneHeight = 0;
+        float projPlaneDistance = 0;
+        const Sphere* spheres = nullptr;
+        int sphereCount = 0;
+        const Plane* planes = nullptr; // the other primitives, counted by groups
+        const Box* boxes = nullptr;
+        const Triangle* triangles = nullptr;
+        const CompiledMesh* meshes = nullptr;
+        int meshCount = 0;
+        int meshVertexCount = 0; // size of the vertex buffer of the meshes, in vertices
+        MeshArrays meshArrays; // triangles and vertices of all the meshes
+        const CompiledInstance* instances = nullptr; // counted by groups[INSTANCE]
+        vector<CompiledScene> prototypes; // geometry of the instances, compiled with the same options as the scene
+        PrimitiveGroup groups[PRIMITIVE_TYPE_COUNT]; // the primitives of each type (spheres included)
+        float ambientIntensity = 0; // sum of the intensities of all the ambient lights
+        const CompiledLight* pointLights = nullptr;
+        int pointLightCount = 0;
+        const CompiledLight* directionalLights = nullptr;
+        int directionalLightCount = 0;
+        const LightNode* lightNodes = nullptr; // light hierarchy over the point lights, none if lightNodeCount is 0
+        int lightNodeCount = 0;
+        const int* lightOrder = nullptr; // point light indices in the order of the leaves of the light hierarchy
+        const Material* materials = nullptr; // the materials of the primitives, prototypes included (these have none of their own)
+        int materialCount = 0;
+        const BVHNode* bvhNodes = nullptr; // BVH over the spheres, there is no BVH if bvhNodeCount is 0
+        int bvhNodeCount = 0;
+        const int* bvhPrimitives = nullptr; // sphere indices in the order of the BVH leaves
+        SphereArrays sphereArrays; // SoA copy of the spheres (in BVH order if there is a BVH), count is 0 if not built
+        double bvhBuildTime = 0; // milliseconds, for all the BVHs
+        float bvhSahCost = 0; // sum of the SAH costs of all the BVHs
+        float sphereSahCost = 0; // SAH cost of the BVH over the spheres
+        float builtSphereSahCost = 0; // SAH cost of the BVH over the spheres when it was last built, before it was refit
+        int bvhRefits = 0; // times the BVH over the spheres was refit since it was built, 0 if it was built by this compilation
+        int bvhRotations = 0; // tree rotations done by the last refit
+        CompiledSceneLayout layout = {}; // position of the arrays in the block
+        uint64_t geometryHash = 0; // hash of the primitives
+        uint64_t otherGeometryHash = 0; // hash of the primitives other than the spheres (not stored in scene files)
+        uint64_t cameraHash = 0; // hash of the camera position and of the projection plane
+        uint64_t lightsHash = 0; // hash of the lights
+
+        CompiledScene() {} // default constructor, empty scene
+        CompiledScene(const CompiledScene&) = delete; // the arrays point into the block
+        CompiledScene& operator = (const CompiledScene&) = delete;
+        CompiledScene(CompiledScene&&) = default; // moving the block keeps its address
+        CompiledScene& operator = (CompiledScene&&) = default;
+
+        static CompiledScene compile(const Scene& scene, bool useBVH=true, bool useSphereArrays=true,
+                                     const CompiledScene* previous=nullptr, float refitThreshold=0, ThreadPool* pool=nullptr) {
+            /**
+             * Freezes a scene into a compiled scene
+             *
+             * @param scene The scene to compile
+             * @param useBVH Builds a BVH over the spheres, one over the boxes, one over the
+             *               triangles, one per mesh and one over the instances (and the same
+             *               ones in every prototype), otherwise rays test every primitive
+             * @param useSphereArrays Builds the SoA sphere arrays for the SIMD kernels, otherwise
+             *                        spheres are tested one by one with Sphere::intersectDistances
+             *                        (the other types are always tested from their SoA arrays)
+             * @param previous If not null, a scene compiled before with the same options: when
+             *                 its primitives are the same (same geometryHash), its BVHs and
+             *                 primitive arrays are copied instead of being built again (and so
+             *                 are the ones of its prototypes, prototype by prototype)
+             * @param refitThreshold If positive, and only the spheres changed since previous (e.g.
+             *                       they moved), the BVH over the spheres of previous is refit to
+             *                       them and improved by tree rotations instead of being built
+             *                       again, as long as its SAH cost stays below refitThreshold times
+             *                       its cost when it was built. The other BVHs are copied.
+             * @param pool The threads refitting the BVH, the calling thread alone if null
+             * @return The compiled scene
+            */
+            CompiledScene compiled;
+            compiled.cameraPos = scene.cameraPos;
+            compiled.projPlaneWidth = scene.projPlaneWidth;
+            compiled.projPlaneHeight = scene.projPlaneHeight;
+            compiled.projPlaneDistance = scene.projPlaneDistance;
+            float camera[6] = {scene.cameraPos.x, scene.cameraPos.y, scene.cameraPos.z,
+                               scene.projPlaneWidth, scene.projPlaneHeight, scene.projPlaneDistance};
+            compiled.cameraHash = hashBytes(camera, sizeof(camera));
+
+            vector<CompiledLight> lights[3]; // lights of each type, in scene order
+            for (const Light& light : scene.lights) {
+                LightType type;
+                if (!parseLightType(light.type, type)) {
+                    cerr << "Unknown light type \"" << light.type << "\", the light is ignored" << endl;
+                    continue;
+                }
+                if (type == AMBIENT_LIGHT) {
+                    compiled.ambientIntensity += light.intensity;
+                    continue;
+                }
+                CompiledLight compiledLight;
+                compiledLight.intensity = light.intensity;
+                compiledLight.position = light.position;
+                compiledLight.direction = light.direction;
+                lights[type].push_back(compiledLight);
+            }
+
+            int count = (int) scene.spheres.size();
+            int meshTriangleCount = 0, meshVertexCount = 0;
+            for (const Mesh& mesh : scene.meshes) {
+                meshTriangleCount += mesh.triangleCount();
+                meshVertexCount += (int) mesh.vertices.size();
+            }
+            vector<CompiledInstance> instances;
+            compiled.prototypes.reserve(scene.prototypes.size());
+            for (size_t p = 0; p < scene.prototypes.size(); p++) {
+                bool samePrototype = previous != nullptr && p < previous->prototypes.size();
+                compiled.prototypes.push_back(compilePrototype(scene.prototypes[p], useBVH, useSphereArrays,
+                                                               samePrototype ? &previous->prototypes[p] : nullptr));
+            }
+            for (const Instance& instance : scene.instances) {
+                CompiledInstance compiledInstance;
+                compiledInstance.toScene = instance.transform;
+                compiledInstance.prototype = instance.prototype;
+                compiledInstance.hasColor = instance.hasColor ? 1 : 0;
+                compiledInstance.color = instance.hasColor ? instance.color : 0;
+                if (instance.prototype < 0 || instance.prototype >= (int) scene.prototypes.size()) {
+                    cerr << "Instance of unknown prototype " << instance.prototype << ", the instance is ignored" << endl;
+                    continue;
+                }
+                if (!instance.transform.inverse(compiledInstance.toPrototype)) {
+                    cerr << "Instance of prototype " << instance.prototype << " with a flat transform, the instance is ignored" << endl;
+                    continue;
+                }
+                instances.push_back(compiledInstance);
+            }
+            int counts[PRIMITIVE_TYPE_COUNT] = {count, (int) scene.planes.size(), (int) scene.boxes.size(), (int) scene.triangles.size(),
+                                                meshTriangleCount, (int) instances.size()};
+            uint64_t& otherHash = compiled.otherGeometryHash;
+            otherHash = hashFields(scene.planes);
+            otherHash = hashFields(scene.boxes, otherHash);
+            otherHash = hashFields(scene.triangles, otherHash);
+            for (const Mesh& mesh : scene.meshes) {
+                otherHash = hashFields(mesh.vertices, otherHash);
+                otherHash = hashBytes(mesh.indices.data(), mesh.indices.size() * sizeof(int), otherHash);
+                otherHash = hashBytes(&mesh.color, sizeof(COLORREF), otherHash);
+                otherHash = hashBytes(&mesh.material, sizeof(int), otherHash);
+            }
+            for (const CompiledScene& prototype : compiled.prototypes) {
+                otherHash = hashBytes(&prototype.geometryHash, sizeof(uint64_t), otherHash);
+            }
+            otherHash = hashBytes(instances.data(), instances.size() * sizeof(CompiledInstance), otherHash); // no padding (see the static_assert)
+            compiled.geometryHash = hashFields(scene.spheres, otherHash);
+            compiled.lightsHash = hashBytes(&compiled.ambientIntensity, sizeof(float));
+            compiled.lightsHash = hashFields(lights[POINT_LIGHT], compiled.lightsHash);
+            compiled.lightsHash = hashFields(lights[DIRECTIONAL_LIGHT], compiled.lightsHash);
+            BVH lightBVH; // over the positions of the point lights, whatever useBVH: shading walks it
+            if (!lights[POINT_LIGHT].empty()) {
+                vector<AABB> lightBoxes(lights[POINT_LIGHT].size());
+                for (size_t i = 0; i < lightBoxes.size(); i++) {
+                    const Vector3& position = lights[POINT_LIGHT][i].position;
+                    float point[3] = {position.x, position.y, position.z};
+                    lightBoxes[i].grow(point);
+                }
+                lightBVH.build(lightBoxes);
+            }
+            bool sameCounts = previous != nullptr && previous->sphereArrays.count == (useSphereArrays ? count : 0)
+                              && previous->meshCount == (int) scene.meshes.size() && previous->meshVertexCount == meshVertexCount;
+            for (int type = 0; type < PRIMITIVE_TYPE_COUNT; type++) {
+                sameCounts = sameCounts && previous->groups[type].count == counts[type]
+                             && (previous->groups[type].bvhNodeCount > 0) == (useBVH && type != PLANE && counts[type] > 0);
+            }
+            bool reuse = sameCounts && previous->geometryHash == compiled.geometryHash;
+            bool refit = !reuse && sameCounts && refitThreshold > 0 && previous->otherGeometryHash == otherHash
+                         && previous->bvhNodeCount > 0 && previous->builtSphereSahCost > 0;
+            vector<BVHNode> refitNodes; // the nodes of previous, refit to the spheres
+            if (refit) {
+                auto start = chrono::steady_clock::now();
+                refitNodes.assign(previous->bvhNodes, previous->bvhNodes + previous->bvhNodeCount);
+                compiled.bvhRotations = refitSphereBVH(scene.spheres, previous->bvhPrimitives, refitNodes, pool);
+                compiled.sphereSahCost = BVH::sahCost(refitNodes.data(), (int) refitNodes.size(), BVH::INTERSECTION_COST);
+                compiled.bvhBuildTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+                // past the threshold, or too deep for the traversal stack after the rotations, the BVH is built again
+                refit = compiled.sphereSahCost <= refitThreshold * previous->builtSphereSahCost
+                        && BVH::depth(refitNodes.data(), (int) refitNodes.size()) <= BVH::STACK_SIZE - 2;
+            }
+            BVH bvhs[PRIMITIVE_TYPE_COUNT]; // planes are unbounded and have no BVH (and meshes have their own)
+            vector<BVH> meshBVHs(scene.meshes.size());
+            int meshNodeCount = 0;
+            if (reuse) {
+                compiled.bvhSahCost = previous->bvhSahCost;
+                compiled.sphereSahCost = previous->sphereSahCost;
+                compiled.builtSphereSahCost = previous->builtSphereSahCost;
+                compiled.bvhRefits = previous->bvhRefits;
+            }
+            else if (refit) {
+                compiled.bvhSahCost = previous->bvhSahCost - previous->sphereSahCost + compiled.sphereSahCost;
+                compiled.builtSphereSahCost = previous->builtSphereSahCost;
+                compiled.bvhRefits = previous->bvhRefits + 1;
+            }
+            else if (useBVH) {
+                compiled.bvhBuildTime = 0; // of the BVHs built, not of a refit given up
+                buildBVH<SPHERE>(scene.spheres, bvhs[SPHERE]);
+                compiled.sphereSahCost = bvhs[SPHERE].sahCost();
+                compiled.builtSphereSahCost = compiled.sphereSahCost;
+                compiled.bvhRotations = 0;
+                buildBVH<BOX>(scene.boxes, bvhs[BOX]);
+                buildBVH<TRIANGLE>(scene.triangles, bvhs[TRIANGLE]);
+                for (size_t m = 0; m < scene.meshes.size(); m++) {
+                    buildMeshBVH(scene.meshes[m], meshBVHs[m]);
+                    meshNodeCount += (int) meshBVHs[m].nodes.size();
+                }
+                for (const BVH& bvh : bvhs) {
+                    compiled.bvhBuildTime += bvh.buildTime;
+                    compiled.bvhSahCost += bvh.sahCost();
+                }
+                for (const BVH& bvh : meshBVHs) {
+                    compiled.bvhBuildTime += bvh.buildTime;
+                    compiled.bvhSahCost += bvh.sahCost();
+                }
+                buildInstanceBVH(instances, compiled.prototypes, bvhs[INSTANCE]);
+                compiled.bvhBuildTime += bvhs[INSTANCE].buildTime;
+                compiled.bvhSahCost += bvhs[INSTANCE].sahCost();
+                for (const CompiledScene& prototype : compiled.prototypes) {
+                    compiled.bvhBuildTime += prototype.bvhBuildTime;
+                    compiled.bvhSahCost += prototype.bvhSahCost;
+                }
+            }
+
+            compiled.sphereCount = count;
+            compiled.pointLightCount = (int) lights[POINT_LIGHT].size();
+            compiled.directionalLightCount = (int) lights[DIRECTIONAL_LIGHT].size();
+            compiled.lightNodeCount = (int) lightBVH.nodes.size();
+            compiled.materialCount = (int) scene.materials.size();
+            bool copy = reuse || refit; // the arrays of the BVHs have the same sizes as in previous
+            compiled.bvhNodeCount = copy ? previous->bvhNodeCount : (int) bvhs[SPHERE].nodes.size();
+            compiled.sphereArrays.count = useSphereArrays ? count : 0;
+            compiled.meshCount = (int) scene.meshes.size();
+            compiled.meshVertexCount = meshVertexCount;
+            for (int type = 0; type < PRIMITIVE_TYPE_COUNT; type++) {
+                compiled.groups[type].count = counts[type];
+                compiled.groups[type].bvhNodeCount = copy ? previous->groups[type].bvhNodeCount : (int) bvhs[type].nodes.size();
+            }
+            if (!copy) {
+                compiled.groups[MESH].bvhNodeCount = meshNodeCount;
+            }
+            compiled.layout = compiled.layoutOfCounts();
+            compiled.block.assign(compiled.layout.size, 0);
+            uint8_t* base = compiled.block.data();
+            const CompiledSceneLayout& layout = compiled.layout;
+
+            Sphere* spheres = (Sphere*) (base + layout.shapes[SPHERE]);
+            for (int i = 0; i < count; i++) {
+                new (spheres + i) Sphere(scene.spheres[i]);
+            }
+            compiled.storeShapes<PLANE>(base, scene.planes);
+            compiled.storeShapes<BOX>(base, scene.boxes);
+            compiled.storeShapes<TRIANGLE>(base, scene.triangles);
+            CompiledMesh* meshes = (CompiledMesh*) (base + layout.shapes[MESH]);
+            CompiledMesh next = {}; // where the arrays of the next mesh start
+            for (size_t m = 0; m < scene.meshes.size(); m++) {
+                const Mesh& mesh = scene.meshes[m];
+                CompiledMesh compiledMesh = next;
+                compiledMesh.triangleCount = mesh.triangleCount();
+                compiledMesh.vertexCount = (int) mesh.vertices.size();
+                compiledMesh.nodeCount = copy ? previous->meshes[m].nodeCount : (int) meshBVHs[m].nodes.size();
+                compiledMesh.color = mesh.color;
+                compiledMesh.material = mesh.material;
+                new (meshes + m) CompiledMesh(compiledMesh);
+                next.firstTriangle += compiledMesh.triangleCount;
+                next.firstVertex += compiledMesh.vertexCount;
+                next.firstNode += compiledMesh.nodeCount;
+            }
+            CompiledInstance* compiledInstances = (CompiledInstance*) (base + layout.shapes[INSTANCE]);
+            for (size_t i = 0; i < instances.size(); i++) {
+                new (compiledInstances + i) CompiledInstance(instances[i]);
+            }
+
+            CompiledLight* pointLights = (CompiledLight*) (base + layout.pointLights);
+            for (size_t i = 0; i < lights[POINT_LIGHT].size(); i++) {
+                new (pointLights + i) CompiledLight(lights[POINT_LIGHT][i]);
+            }
+            CompiledLight* directionalLights = (CompiledLight*) (base + layout.directionalLights);
+            for (size_t i = 0; i < lights[DIRECTIONAL_LIGHT].size(); i++) {
+                new (directionalLights + i) CompiledLight(lights[DIRECTIONAL_LIGHT][i]);
+            }
+            compiled.storeLightHierarchy(base, lights[POINT_LIGHT], lightBVH);
+            Material* materials = (Material*) (base + layout.materials);
+            for (int i = 0; i < compiled.materialCount; i++) {
+                new (materials + i) Material(scene.materials[i]);
+            }
+
+            if (copy) {
+                // the BVHs and the primitive arrays are the last arrays of the block, and have
+                // the same size in both scenes
+                memcpy(base + layout.bvhNodes, previous->blockData() + previous->layout.bvhNodes, layout.size - layout.bvhNodes);
+                if (refit) {
+                    // the refit nodes keep the primitives in the same order: only the positions
+                    // and radii of the sphere arrays change
+                    memcpy(base + layout.bvhNodes, refitNodes.data(), refitNodes.size() * sizeof(BVHNode));
+                    float* centerX = (float*) (base + layout.centerX);
+                    float* centerY = (float*) (base + layout.centerY);
+                    float* centerZ = (float*) (base + layout.centerZ);
+                    float* radius2 = (float*) (base + layout.radius2);
+                    const int* index = (const int*) (base + layout.index);
+                    runBlocks(pool, useSphereArrays ? count : 0, [&](int begin, int end) {
+                        for (int k = begin; k < end; k++) {
+                            const Sphere& sphere = scene.spheres[index[k]];
+                            centerX[k] = sphere.center.x;
+                            centerY[k] = sphere.center.y;
+                            centerZ[k] = sphere.center.z;
+                            radius2[k] = sphere.radius * sphere.radius;
+                        }
+                    });
+                }
+                compiled.attach(base);
+                return compiled;
+            }
+
+            const BVH& bvh = bvhs[SPHERE];
+            BVHNode* nodes = (BVHNode*) (base + layout.bvhNodes);
+            for (size_t i = 0; i < bvh.nodes.size(); i++) {
+                new (nodes + i) BVHNode(bvh.nodes[i]);
+            }
+            int* primitives = (int*) (base + layout.bvhPrimitives);
+            for (size_t i = 0; i < bvh.primitives.size(); i++) {
+                primitives[i] = bvh.primitives[i];
+            }
+
+            if (useSphereArrays) {
+                // the spheres are stored in the order of the BVH leaves, so that every leaf is a
+                // contiguous range of the arrays
+                int paddedCount = count + SphereArrays::PADDING;
+                float* centerX = (float*) (base + layout.centerX);
+                float* centerY = (float*) (base + layout.centerY);
+                float* centerZ = (float*) (base + layout.centerZ);
+                float* radius2 = (float*) (base + layout.radius2);
+                int* index = (int*) (base + layout.index);
+                for (int k = 0; k < paddedCount; k++) {
+                    if (k >= count) { // padding spheres can never be hit
+                        radius2[k] = -1;
+                        continue;
+                    }
+                    int i = bvh.nodes.empty() ? k : bvh.primitives[k];
+                    const Sphere& sphere = scene.spheres[i];
+                    centerX[k] = sphere.center.x;
+                    centerY[k] = sphere.center.y;
+                    centerZ[k] = sphere.center.z;
+                    radius2[k] = sphere.radius * sphere.radius;
+                    index[k] = i;
+                }
+            }
+            compiled.storeArrays<PLANE>(base, scene.planes, bvhs[PLANE]);
+            compiled.storeArrays<BOX>(base, scene.boxes, bvhs[BOX]);
+            compiled.storeArrays<TRIANGLE>(base, scene.triangles, bvhs[TRIANGLE]);
+            for (size_t m = 0; m < scene.meshes.size(); m++) {
+                compiled.storeMesh(base, meshes[m], scene.meshes[m], meshBVHs[m]);
+            }
+            compiled.storeInstanceBVH(base, bvhs[INSTANCE], (int) instances.size());
+            compiled.attach(base);
+            return compiled;
+        }
+
+        CompiledSceneLayout layoutOfCounts() const {
+            /**
+             * Computes the layout of the block of the scene from the counts of its arrays
+             * (sphereCount, the light counts, lightNodeCount, materialCount, bvhNodeCount, sphereArrays.count, meshCount,
+             * meshVertexCount and the count and bvhNodeCount of every group), every array starting
+             * on a new cache line. The BVH of a type covers all its primitives when its node count
+             * is not 0.
+            */
+            CompiledSceneLayout layout = {};
+            uint64_t size = 0;
+            auto reserve = [&size](uint64_t bytes) {
+                uint64_t offset = size;
+                size += (bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+                return offset;
+            };
+            int sphereArrayCount = this->sphereArrays.count;
+            uint64_t paddedCount = sphereArrayCount > 0 ? sphereArrayCount + SphereArrays::PADDING : 0;
+            layout.shapes[SPHERE] = reserve((uint64_t) this->sphereCount * sizeof(Sphere));
+            layout.shapes[PLANE] = reserve((uint64_t) this->groups[PLANE].count * sizeof(Plane));
+            layout.shapes[BOX] = reserve((uint64_t) this->groups[BOX].count * sizeof(Box));
+            layout.shapes[TRIANGLE] = reserve((uint64_t) this->groups[TRIANGLE].count * sizeof(Triangle));
+            layout.shapes[MESH] = reserve((uint64_t) this->meshCount * sizeof(CompiledMesh));
+            layout.shapes[INSTANCE] = reserve((uint64_t) this->groups[INSTANCE].count * sizeof(CompiledInstance));
+            layout.pointLights = reserve((uint64_t) this->pointLightCount * sizeof(CompiledLight));
+            layout.directionalLights = reserve((uint64_t) this->directionalLightCount * sizeof(CompiledLight));
+            layout.lightNodes = reserve((uint64_t) this->lightNodeCount * sizeof(LightNode));
+            layout.lightOrder = reserve((uint64_t) (this->lightNodeCount > 0 ? this->pointLightCount : 0) * sizeof(int));
+            layout.materials = reserve((uint64_t) this->materialCount * sizeof(Material));
+            // everything from here on only depends on the geometry (see compile())
+            layout.bvhNodes = reserve((uint64_t) this->bvhNodeCount * sizeof(BVHNode));
+            layout.bvhPrimitives = reserve((uint64_t) (this->bvhNodeCount > 0 ? this->sphereCount : 0) * sizeof(int));
+            layout.centerX = reserve(paddedCount * sizeof(float));
+            layout.centerY = reserve(paddedCount * sizeof(float));
+            layout.centerZ = reserve(paddedCount * sizeof(float));
+            layout.radius2 = reserve(paddedCount * sizeof(float));
+            layout.index = reserve((uint64_t) sphereArrayCount * sizeof(int));
+            const int fields[PRIMITIVE_TYPE_COUNT] = {0, PrimitiveKernel<PLANE>::FIELDS, PrimitiveKernel<BOX>::FIELDS,
+                                                      PrimitiveKernel<TRIANGLE>::FIELDS, 0, 0};
+            for (int type = PLANE; type < PRIMITIVE_TYPE_COUNT; type++) {
+                const PrimitiveGroup& group = this->groups[type];
+                layout.primitiveNodes[type] = reserve((uint64_t) group.bvhNodeCount * sizeof(BVHNode));
+                if (type != MESH) {
+                    layout.primitiveFields[type] = reserve((uint64_t) group.count * fields[type] * sizeof(float));
+                    layout.primitiveIndex[type] = reserve((uint64_t) group.count * sizeof(int));
+                }
+            }
+            layout.meshVertices = reserve((uint64_t) this->meshVertexCount * 3 * sizeof(float));
+            layout.meshTriangles = reserve((uint64_t) this->groups[MESH].count * 3 * sizeof(int));
+            layout.meshOrder = reserve((uint64_t) this->groups[MESH].count * sizeof(int));
+            layout.size = size;
+            return layout;
+        }
+
+        void attach(const uint8_t* base, shared_ptr<const void> owner=nullptr) {
+            /**
+             * Points the arrays of the scene into a block holding them at the positions given
+             * by layout, the counts being already set. The block is either the one of the scene
+             * or memory kept alive by owner (e.g. a memory mapped file).
+            */
+            this->spheres = (const Sphere*) (base + this->layout.shapes[SPHERE]);
+            this->planes = (const Plane*) (base + this->layout.shapes[PLANE]);
+            this->boxes = (const Box*) (base + this->layout.shapes[BOX]);
+            this->triangles = (const Triangle*) (base + this->layout.shapes[TRIANGLE]);
+            this->meshes = (const CompiledMesh*) (base + this->layout.shapes[MESH]);
+            this->instances = (const CompiledInstance*) (base + this->layout.shapes[INSTANCE]);
+            this->pointLights = (const CompiledLight*) (base + this->layout.pointLights);
+            this->directionalLights = (const CompiledLight*) (base + this->layout.directionalLights);
+            this->lightNodes = (const LightNode*) (base + this->layout.lightNodes);
+            this->lightOrder = (const int*) (base + this->layout.lightOrder);
+            this->materials = (const Material*) (base + this->layout.materials);
+            this->bvhNodes = (const BVHNode*) (base + this->layout.bvhNodes);
+            this->bvhPrimitives = (const int*) (base + this->layout.bvhPrimitives);
+            this->sphereArrays.centerX = (const float*) (base + this->layout.centerX);
+            this->sphereArrays.centerY = (const float*) (base + this->layout.centerY);
+            this->sphereArrays.centerZ = (const float*) (base + this->layout.centerZ);
+            this->sphereArrays.radius2 = (const float*) (base + this->layout.radius2);
+            this->sphereArrays.index = (const int*) (base + this->layout.index);
+            this->groups[SPHERE].count = this->sphereCount;
+            this->groups[SPHERE].bvhNodes = this->bvhNodes;
+            this->groups[SPHERE].bvhNodeCount = this->bvhNodeCount;
+            int first = 0;
+            for (int type = 0; type < PRIMITIVE_TYPE_COUNT; type++) {
+                PrimitiveGroup& group = this->groups[type];
+                group.first = first;
+                first += group.count;
+                if (type != SPHERE) {
+                    group.bvhNodes = (const BVHNode*) (base + this->layout.primitiveNodes[type]);
+                }
+                if (type != SPHERE && type != MESH) {
+                    group.arrays.fields = (const float*) (base + this->layout.primitiveFields[type]);
+                    group.arrays.index = (const int*) (base + this->layout.primitiveIndex[type]);
+                    group.arrays.count = group.count;
+                }
+            }
+            this->meshArrays.vertices = (const float*) (base + this->layout.meshVertices);
+            this->meshArrays.triangles = (const int*) (base + this->layout.meshTriangles);
+            this->meshArrays.order = (const int*) (base + this->layout.meshOrder);
+            this->meshArrays.count = this->groups[MESH].count;
+            this->data = base;
+            this->owner = owner;
+        }
+
+        int primitiveCount() const {
+            /**
+             * Returns the number of primitives of the scene, of any type
+            */
+            const PrimitiveGroup& last = this->groups[PRIMITIVE_TYPE_COUNT - 1];
+            return last.first + last.count;
+        }
+
+        PrimitiveType primitiveType(int primitive) const {
+            /**
+             * Returns the type of a primitive, given by its identifier (see PrimitiveGroup)
+            */
+            int type = SPHERE;
+            while (type < PRIMITIVE_TYPE_COUNT - 1 && primitive >= this->groups[type + 1].first) {
+                type++;
+            }
+            return (PrimitiveType) type;
+        }
+
+        AABB bounds() const {
+            /**
+             * Returns the bounds of the bounded primitives of the scene (all of them but the
+             * planes), the origin if there is none
+            */
+            AABB bounds;
+            for (int i = 0; i < this->sphereCount; i++) {
+                bounds.grow(PrimitiveKernel<SPHERE>::bounds(this->spheres[i]));
+            }
+            for (int i = 0; i < this->groups[BOX].count; i++) {
+                bounds.grow(PrimitiveKernel<BOX>::bounds(this->boxes[i]));
+            }
+            for (int i = 0; i < this->groups[TRIANGLE].count; i++) {
+                bounds.grow(PrimitiveKernel<TRIANGLE>::bounds(this->triangles[i]));
+            }
+            for (int k = 0; k < this->groups[MESH].count; k++) {
+                bounds.grow(PrimitiveKernel<TRIANGLE>::bounds(this->meshArrays.vertex(k, 0), this->meshArrays.vertex(k, 1),
+                                                              this->meshArrays.vertex(k, 2)));
+            }
+            if (bounds.min[0] > bounds.max[0]) { // empty
+                float origin[3] = {0, 0, 0};
+                bounds.grow(origin);
+            }
+            return bounds;
+        }
+
+        int meshAt(int triangle) const {
+            /**
+             * Returns the index of the mesh holding a triangle of the mesh arrays
+            */
+            int low = 0, high = this->meshCount - 1; // binary search of the last mesh starting at or before triangle
+            while (low < high) {
+                int middle = (low + high + 1) / 2;
+                if (this->meshes[middle].firstTriangle <= triangle) {
+                    low = middle;
+                }
+                else {
+                    high = middle - 1;
+                }
+            }
+            return low;
+        }
+
+        template <PrimitiveType TYPE>
+        const typename PrimitiveKernel<TYPE>::Shape& shape(int i) const {
+            /**
+             * Returns the primitive of index i (in scene order) among the primitives of type TYPE
+            */
+            return ((const typename PrimitiveKernel<TYPE>::Shape*) (this->data + this->layout.shapes[TYPE]))[i];
+        }
+
+        string describePrimitive(int primitive) const {
+            /**
+             * Returns a ready-to-display description of a primitive, given by its identifier
+            */
+            PrimitiveType type = this->primitiveType(primitive);
+            int i = primitive - this->groups[type].first;
+            switch (type) {
+                case SPHERE: return "sphere " + to_string(i) + " (" + this->shape<SPHERE>(i).toString() + ")";
+                case PLANE: return "plane " + to_string(i) + " (" + this->shape<PLANE>(i).toString() + ")";
+                case BOX: return "box " + to_string(i) + " (" + this->shape<BOX>(i).toString() + ")";
+                default: return "triangle " + to_string(i) + " (" + this->shape<TRIANGLE>(i).toString() + ")";
+                case MESH: {
+                    int m = this->meshAt(i);
+                    string vertices;
+                    for (int corner = 0; corner < 3; corner++) {
+                        const float* vertex = this->meshArrays.vertex(i, corner);
+                        vertices += (corner > 0 ? ", " : "") + Vector3(vertex[0], vertex[1], vertex[2]).toString();
+                    }
+                    return "mesh " + to_string(m) + " triangle " + to_string(i - this->meshes[m].firstTriangle) + " (Vertices: " + vertices + ")";
+                }
+                case INSTANCE: return "instance " + to_string(i) + " (" + this->instances[i].toString() + ")";
+            }
+        }
+
+        const uint8_t* blockData() const {
+            /**
+             * Returns the memory block of the scene, layout.size bytes long
+            */
+            return this->data;
+        }
+
+        size_t memorySize() const {
+            /**
+             * Returns the size in bytes of the memory block of the compiled scene
+            */
+            return this->layout.size;
+        }
+
+        size_t meshMemorySize() const {
+            /**
+             * Returns the size in bytes of the arrays of the meshes (BVHs, vertices and triangles)
+             * in the memory block
+            */
+            return (this->layout.primitiveNodes[INSTANCE] - this->layout.primitiveNodes[MESH]) + (this->layout.size - this->layout.meshVertices)
+                   + this->meshCount * sizeof(CompiledMesh);
+        }
+
+        size_t instanceMemorySize() const {
+            /**
+             * Returns the size in bytes of the instances in the memory block (their transforms and
+             * the top level BVH), which does not depend on the size of their prototypes
+            */
+            return (this->layout.meshVertices - this->layout.primitiveNodes[INSTANCE])
+                   + this->groups[INSTANCE].count * sizeof(CompiledInstance);
+        }
+
+        size_t prototypeMemorySize() const {
+            /**
+             * Returns the size in bytes of the blocks of the prototypes, each stored once
+             * whatever the number of its instances
+            */
+            size_t size = 0;
+            for (const CompiledScene& prototype : this->prototypes) {
+                size += prototype.memorySize();
+            }
+            return size;
+        }
+
+    private:
+        template <PrimitiveType TYPE>
+        static void buildBVH(const vector<typename PrimitiveKernel<TYPE>::Shape>& shapes, BVH& bvh) {
+            /**
+             * Builds a BVH over the primitives of a type, nothing if there is none
+            */
+            if (shapes.empty()) {
+                return;
+            }
+            vector<AABB> boxes(shapes.size());
+            for (size_t i = 0; i < shapes.size(); i++) {
+                boxes[i] = PrimitiveKernel<TYPE>::bounds(shapes[i]);
+            }
+            bvh.build(boxes);
+        }
+
+        static void buildMeshBVH(const Mesh& mesh, BVH& bvh) {
+            /**
+             * Builds the BVH over the triangles of a mesh, nothing if it has none
+            */
+            if (mesh.indices.size() < 3) {
+                return;
+            }
+            vector<AABB> boxes(mesh.triangleCount());
+            for (size_t k = 0; k < boxes.size(); k++) {
+                const int* triangle = mesh.indices.data() + 3 * k;
+                boxes[k] = PrimitiveKernel<TRIANGLE>::bounds(&mesh.vertices[triangle[0]].x, &mesh.vertices[triangle[1]].x,
+                                                             &mesh.vertices[triangle[2]].x);
+            }
+            bvh.build(boxes, MESH_INTERSECTION_COST);
+        }
+
+        static constexpr int REFIT_BLOCK_SIZE = 4096; // nodes or spheres per refit task
+
+        template <typename Task>
+        static void runBlocks(ThreadPool* pool, int count, const Task& task) {
+            /**
+             * Runs task(begin, end) over blocks of REFIT_BLOCK_SIZE indices covering 0 to
+             * count-1, on the pool if there is one
+            */
+            int blockCount = (count + REFIT_BLOCK_SIZE - 1) / REFIT_BLOCK_SIZE;
+            auto block = [&](int b) {
+                task(b * REFIT_BLOCK_SIZE, min(count, (b + 1) * REFIT_BLOCK_SIZE));
+            };
+            if (pool == nullptr) {
+                for (int b = 0; b < blockCount; b++) {
+                    block(b);
+                }
+                return;
+            }
+            pool->run(blockCount, block);
+        }
+
+        static int refitSphereBVH(const vector<Sphere>& spheres, const int* primitives, vector<BVHNode>& nodes, ThreadPool* pool) {
+            /**
+             * Refits a BVH over the spheres to their current bounds, keeping its tree: the
+             * leaves are refit from their spheres and every node from its children, level by
+             * level from the deepest, the nodes of a level in parallel. Tree rotations then
+             * win back some of the quality lost by the spheres which moved away from their
+             * neighbours.
+             *
+             * @param primitives The sphere indices in the order of the leaves
+             * @return The number of rotations done
+            */
+            vector<int> order, levelStarts;
+            BVH::levels(nodes.data(), (int) nodes.size(), order, levelStarts);
+            BVHNode* refit = nodes.data();
+            for (int level = (int) levelStarts.size() - 2; level >= 0; level--) {
+                const int* levelNodes = order.data() + levelStarts[level];
+                runBlocks(pool, levelStarts[level + 1] - levelStarts[level], [&](int begin, int end) {
+                    for (int k = begin; k < end; k++) {
+                        BVHNode& node = refit[levelNodes[k]];
+                        AABB bounds;
+                        if (node.count > 0) {
+                            for (int p = node.first; p < node.first + node.count; p++) {
+                                bounds.grow(PrimitiveKernel<SPHERE>::bounds(spheres[primitives[p]]));
+                            }
+                        }
+                        else {
+                            bounds = refit[node.first].bounds;
+                            bounds.grow(refit[node.first + 1].bounds);
+                        }
+                        node.bounds = bounds;
+                    }
+                });
+            }
+            return BVH::rotate(refit, order, levelStarts);
+        }
+
+        static CompiledScene compilePrototype(const Prototype& prototype, bool useBVH, bool useSphereArrays, const CompiledScene* previous) {
+            /**
+             * Compiles the geometry of a prototype as a scene without camera nor lights
+            */
+            Scene geometry(Vector3(0, 0, 0), 1, 1, 1, prototype.spheres, {});
+            geometry.boxes = prototype.boxes;
+            geometry.triangles = prototype.triangles;
+            geometry.meshes = prototype.meshes;
+            return compile(geometry, useBVH, useSphereArrays, previous);
+        }
+
+        static void buildInstanceBVH(const vector<CompiledInstance>& instances, const vector<CompiledScene>& prototypes, BVH& bvh) {
+            /**
+             * Builds the top level BVH, over the bounds of the instances in the scene, nothing if
+             * there is none. The bounds are grown a little: rays are transformed into the space of
+             * the prototypes, and a hit found there may be rounded slightly out of them.
+            */
+            if (instances.empty()) {
+                return;
+            }
+            vector<AABB> prototypeBounds(prototypes.size());
+            for (size_t p = 0; p < prototypes.size(); p++) {
+                prototypeBounds[p] = prototypes[p].bounds();
+            }
+            vector<AABB> boxes(instances.size());
+            for (size_t i = 0; i < instances.size(); i++) {
+                AABB box = instances[i].toScene.applyBounds(prototypeBounds[instances[i].prototype]);
+                float extent = 0;
+                for (int axis = 0; axis < 3; axis++) {
+                    extent = max(extent, max(fabsf(box.min[axis]), fabsf(box.max[axis])));
+                }
+                for (int axis = 0; axis < 3; axis++) {
+                    box.min[axis] -= 1e-5f * extent;
+                    box.max[axis] += 1e-5f * extent;
+                }
+                boxes[i] = box;
+            }
+            bvh.build(boxes, INSTANCE_INTERSECTION_COST);
+        }
+
+
+        template <PrimitiveType TYPE>
+        void storeShapes(uint8_t* base, const vector<typename PrimitiveKernel<TYPE>::Shape>& shapes) {
+            typedef typename PrimitiveKernel<TYPE>::Shape Shape;
+            Shape* stored = (Shape*) (base + this->layout.shapes[TYPE]);
+            for (size_t i = 0; i < shapes.size(); i++) {
+                new (stored + i) Shape(shapes[i]);
+            }
+        }
+
+        template <PrimitiveType TYPE>
+        void storeArrays(uint8_t* base, const vector<typename PrimitiveKernel<TYPE>::Shape>& shapes, const BVH& bvh) {
+            /**
+             * Writes the BVH and the SoA arrays of the primitives of a type other than spheres, the
+             * arrays being in the order of the BVH leaves like the sphere arrays
+            */
+            BVHNode* nodes = (BVHNode*) (base + this->layout.primitiveNodes[TYPE]);
+            for (size_t i = 0; i < bvh.nodes.size(); i++) {
+                new (nodes + i) BVHNode(bvh.nodes[i]);
+            }
+            float* fields = (float*) (base + this->layout.primitiveFields[TYPE]);
+            int* index = (int*) (base + this->layout.primitiveIndex[TYPE]);
+            int count = (int) shapes.size();
+            for (int k = 0; k < count; k++) {
+                int i = bvh.nodes.empty() ? k : bvh.primitives[k];
+                PrimitiveKernel<TYPE>::store(shapes[i], fields, count, k);
+                index[k] = i;
+            }
+        }
+
+        void storeMesh(uint8_t* base, const CompiledMesh& compiledMesh, const Mesh& mesh, const BVH& bvh) {
+            /**
+             * Writes the BVH, the vertices and the triangles of a mesh at its place in the mesh
+             * arrays, and the order of its triangles in the BVH leaves
+            */
+            BVHNode* nodes = (BVHNode*) (base + this->layout.primitiveNodes[MESH]) + compiledMesh.firstNode;
+            for (size_t i = 0; i < bvh.nodes.size(); i++) {
+                new (nodes + i) BVHNode(bvh.nodes[i]);
+            }
+            float* vertices = (float*) (base + this->layout.meshVertices) + 3 * (size_t) compiledMesh.firstVertex;
+            for (size_t i = 0; i < mesh.vertices.size(); i++) {
+                vertices[3*i] = mesh.vertices[i].x;
+                vertices[3*i + 1] = mesh.vertices[i].y;
+                vertices[3*i + 2] = mesh.vertices[i].z;
+            }
+            int* triangles = (int*) (base + this->layout.meshTriangles) + 3 * (size_t) compiledMesh.firstTriangle;
+            for (int i = 0; i < 3 * compiledMesh.triangleCount; i++) {
+                triangles[i] = compiledMesh.firstVertex + mesh.indices[i];
+            }
+            int* order = (int*) (base + this->layout.meshOrder) + compiledMesh.firstTriangle;
+            for (int k = 0; k < compiledMesh.triangleCount; k++) {
+                order[k] = compiledMesh.firstTriangle + (bvh.nodes.empty() ? k : bvh.primitives[k]);
+            }
+        }
+
+        void storeLightHierarchy(uint8_t* base, const vector<CompiledLight>& lights, const BVH& bvh) {
+            /**
+             * Writes the light hierarchy and the order of the point lights in its leaves, summing
+             * the lights of every node from the leaves up (children come after their parent)
+            */
+            int* order = (int*) (base + this->layout.lightOrder);
+            for (size_t k = 0; k < bvh.primitives.size() && !bvh.nodes.empty(); k++) {
+                order[k] = bvh.primitives[k];
+            }
+            LightNode* nodes = (LightNode*) (base + this->layout.lightNodes);
+            for (int n = (int) bvh.nodes.size() - 1; n >= 0; n--) {
+                const BVHNode& node = bvh.nodes[n];
+                LightNode lightNode;
+                lightNode.bounds = node.bounds;
+                lightNode.first = node.first;
+                lightNode.count = node.count;
+                float intensity = 0, weighted[3] = {0, 0, 0};
+                auto add = [&](float lightIntensity, float x, float y, float z) {
+                    intensity += lightIntensity;
+                    weighted[0] += lightIntensity * x;
+                    weighted[1] += lightIntensity * y;
+                    weighted[2] += lightIntensity * z;
+                };
+                if (node.count > 0) {
+                    for (int k = node.first; k < node.first + node.count; k++) {
+                        const CompiledLight& light = lights[order[k]];
+                        add(light.intensity, light.position.x, light.position.y, light.position.z);
+                    }
+                }
+                else {
+                    for (int child = node.first; child <= node.first + 1; child++) {
+                        add(nodes[child].intensity, nodes[child].center[0], nodes[child].center[1], nodes[child].center[2]);
+                    }
+                }
+                lightNode.intensity = intensity;
+                for (int axis = 0; axis < 3; axis++) {
+                    lightNode.center[axis] = intensity > 0 ? weighted[axis] / intensity : node.bounds.center(axis);
+                }
+                if (node.count == 1) { // exactly the light
+                    const Vector3& position = lights[order[node.first]].position;
+                    lightNode.center[0] = position.x;
+                    lightNode.center[1] = position.y;
+                    lightNode.center[2] = position.z;
+                }
+                new (nodes + n) LightNode(lightNode);
+            }
+        }
+
+        void storeInstanceBVH(uint8_t* base, const BVH& bvh, int count) {
+            /**
+             * Writes the top level BVH and the order of the instances in its leaves
+            */
+            BVHNode* nodes = (BVHNode*) (base + this->layout.primitiveNodes[INSTANCE]);
+            for (size_t i = 0; i < bvh.nodes.size(); i++) {
+                new (nodes + i) BVHNode(bvh.nodes[i]);
+            }
+            int* index = (int*) (base + this->layout.primitiveIndex[INSTANCE]);
+            for (int k = 0; k < count; k++) {
+                index[k] = bvh.nodes.empty() ? k : bvh.primitives[k];
+            }
+        }
+
+        AlignedVector<uint8_t, CACHE_LINE> block; // storage of every array of the scene, unless it is owned by owner
+        shared_ptr<const void> owner; // keeps the block alive when it is not stored in block
+        const uint8_t* data = nullptr; // start of the block
+};
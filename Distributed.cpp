@@ -0,0 +1,367 @@
+#pragma once
+
+// Distributed rendering: a coordinator process hands the tiles of the image to worker processes
+// over a local (Unix domain) socket, and assembles the pixel blocks they send back. This file is
+// included by main.cpp after pixelColor() since workers render with it. Only available on POSIX
+// systems, and workers are only started by the coordinator on Linux (they are started from
+// /proc/self/exe): elsewhere they are started by hand.
+//
+// Every message is sent in the byte order of the machine, the processes running on the same one:
+// - a worker connects and sends a WorkerHello (resolution and hashes of the scene it loaded),
+// - the coordinator sends TileMessages, a tile index of -1 asking the worker to stop,
+// - the worker answers every tile with the same TileMessage followed by its pixels (row by row).
+// Each worker has up to TILES_IN_FLIGHT tiles at a time and gets a new one for every tile it
+// sends back, so faster workers render more tiles. When a worker dies, its unfinished tiles are
+// handed to the other workers again.
+
+#ifndef _WIN32
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// custom files:
+#include <Framebuffer.cpp>
+#include <ThreadPool.cpp>
+
+using namespace std;
+
+struct WorkerHello {
+    char magic[8]; // "RTWORKER"
+    int32_t width, height; // resolution the worker renders at
+    uint64_t geometryHash, cameraHash, lightsHash; // scene the worker loaded
+};
+
+struct TileMessage {
+    int32_t tile; // index of the tile, -1 to stop the worker
+    int32_t x0, y0, x1, y1; // pixels [x0, x1) x [y0, y1) of the image
+};
+
+static const int TILES_IN_FLIGHT = 2; // tiles sent to a worker before it answers, so it never waits for the next one
+static const double WORKER_TIMEOUT = 10000; // milliseconds without any worker started by hand before the coordinator renders on its own
+
+static bool sendAll(int socket, const void* data, size_t size) {
+    /**
+     * Sends size bytes, returning false if the other process is gone
+    */
+    const char* bytes = (const char*) data;
+    while (size > 0) {
+        ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL); // no SIGPIPE if the other process is dead
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= (size_t) sent;
+    }
+    return true;
+}
+
+static bool receiveAll(int socket, void* data, size_t size) {
+    /**
+     * Receives exactly size bytes, returning false if the other process is gone
+    */
+    char* bytes = (char*) data;
+    while (size > 0) {
+        ssize_t received = recv(socket, bytes, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        bytes += received;
+        size -= (size_t) received;
+    }
+    return true;
+}
+
+static bool socketAddress(const string& path, sockaddr_un& address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << "Socket path too long: " << path << endl;
+        return false;
+    }
+    strcpy(address.sun_path, path.c_str());
+    return true;
+}
+
+int runWorker(const CompiledScene& scene, const string& socketPath, int exitAfter=-1) {
+    /**
+     * Worker side: connects to the coordinator and renders the tiles it asks for with
+     * pixelColor(), on the threads of a pool, until it is asked to stop
+     *
+     * @param scene The scene to render, the same as the one of the coordinator
+     * @param socketPath The socket of the coordinator
+     * @param exitAfter If not negative, the worker exits without a word after this many tiles,
+     *                  to test how the coordinator copes with workers dying
+     * @return The exit code of the worker process
+    */
+    sockaddr_un address;
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || !socketAddress(socketPath, address) || connect(connection, (sockaddr*) &address, sizeof(address)) != 0) {
+        cerr << "Worker " << getpid() << ": could not connect to " << socketPath << endl;
+        return 1;
+    }
+    WorkerHello hello;
+    memcpy(hello.magic, "RTWORKER", 8);
+    hello.width = xRes;
+    hello.height = yRes;
+    hello.geometryHash = scene.geometryHash;
+    hello.cameraHash = scene.cameraHash;
+    hello.lightsHash = scene.lightsHash;
+    if (!sendAll(connection, &hello, sizeof(hello))) {
+        return 1;
+    }
+    ThreadPool pool(threadCount);
+    vector<COLORREF> pixels;
+    int rendered = 0;
+    TileMessage tile;
+    while (receiveAll(connection, &tile, sizeof(tile)) && tile.tile >= 0) {
+        if (rendered == exitAfter) {
+            _exit(1);
+        }
+        int width = tile.x1 - tile.x0;
+        pixels.resize((size_t) width * (tile.y1 - tile.y0));
+        pool.run(tile.y1 - tile.y0, [&](int row) {
+            for (int x = tile.x0; x < tile.x1; x++) {
+                pixels[(size_t) row * width + (x - tile.x0)] = pixelColor(scene, x, tile.y0 + row);
+            }
+        });
+        if (!sendAll(connection, &tile, sizeof(tile)) || !sendAll(connection, pixels.data(), pixels.size() * sizeof(COLORREF))) {
+            break; // the coordinator is gone
+        }
+        rendered++;
+    }
+    close(connection);
+    return 0;
+}
+
+struct WorkerConnection {
+    int socket;
+    vector<int> tiles; // tiles sent to the worker and not received yet
+    int rendered = 0; // tiles received from the worker
+};
+
+bool renderDistributed(const CompiledScene& scene, Framebuffer& framebuffer, ThreadPool& pool, const string& socketPath,
+                       const vector<string>& workerCommand, int spawnCount) {
+    /**
+     * Coordinator side: renders a scene into a framebuffer with worker processes. The image is
+     * split into tiles of tileSize by tileSize pixels, handed to the workers as they ask for
+     * more. Every pixel is computed by pixelColor() like in renderParallel(), so both produce
+     * the exact same image. As soon as no worker is connected and every worker it started is
+     * dead (or, when it started none, after WORKER_TIMEOUT milliseconds without any worker),
+     * the coordinator renders the remaining tiles itself.
+     *
+     * @param scene The scene to render, workers must have loaded the same one
+     * @param framebuffer The image to render into, its size must be xRes by yRes
+     * @param pool The threads rendering the tiles left when there is no worker
+     * @param socketPath The socket workers connect to, created (and removed) by the coordinator
+     * @param workerCommand The command line of the workers to start, the socket path is appended
+     * @param spawnCount The number of workers to start (on Linux only), other workers may
+     *                   connect to the socket
+     * @return false if the socket could not be created
+    */
+    sockaddr_un address;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (listener < 0 || !socketAddress(socketPath, address) || ::bind(listener, (sockaddr*) &address, sizeof(address)) != 0
+        || listen(listener, 64) != 0) {
+        cerr << "Could not listen on " << socketPath << endl;
+        return false;
+    }
+
+    vector<pid_t> children;
+    for (int i = 0; i < spawnCount; i++) {
+        pid_t child = fork();
+        if (child == 0) {
+            vector<char*> args;
+            for (const string& arg : workerCommand) {
+                args.push_back((char*) arg.c_str());
+            }
+            args.push_back((char*) socketPath.c_str());
+            args.push_back(nullptr);
+            execv("/proc/self/exe", args.data());
+            _exit(127);
+        }
+        if (child > 0) {
+            children.push_back(child);
+        }
+    }
+
+    int tilesX = (xRes + tileSize - 1) / tileSize;
+    int tilesY = (yRes + tileSize - 1) / tileSize;
+    int tileCount = tilesX * tilesY;
+    deque<int> pending; // tiles to hand out, the ones of dead workers first
+    for (int tile = 0; tile < tileCount; tile++) {
+        pending.push_back(tile);
+    }
+    auto tileMessage = [&](int tile) {
+        TileMessage message;
+        message.tile = tile;
+        message.x0 = (tile % tilesX) * tileSize;
+        message.y0 = (tile / tilesX) * tileSize;
+        message.x1 = min(message.x0 + tileSize, xRes);
+        message.y1 = min(message.y0 + tileSize, yRes);
+        return message;
+    };
+
+    vector<WorkerConnection> workers;
+    vector<COLORREF> pixels;
+    int finished = 0, reissued = 0, deadWorkers = 0, totalWorkers = 0;
+    auto lastWorkerSeen = chrono::steady_clock::now();
+    auto dropWorker = [&](size_t w) { // the worker is dead: its tiles go back to the front of the queue
+        for (auto tile = workers[w].tiles.rbegin(); tile != workers[w].tiles.rend(); ++tile) {
+            pending.push_front(*tile);
+            reissued++;
+        }
+        cerr << "Worker " << w << " lost after " << workers[w].rendered << " tiles, " << workers[w].tiles.size()
+             << " tiles handed to the other workers" << endl;
+        close(workers[w].socket);
+        workers[w].socket = -1;
+        workers[w].tiles.clear();
+        deadWorkers++;
+    };
+    auto feedWorker = [&](size_t w) { // tops the tiles of a worker up to TILES_IN_FLIGHT
+        while (workers[w].socket >= 0 && (int) workers[w].tiles.size() < TILES_IN_FLIGHT && !pending.empty()) {
+            TileMessage message = tileMessage(pending.front());
+            if (!sendAll(workers[w].socket, &message, sizeof(message))) {
+                dropWorker(w);
+                return;
+            }
+            workers[w].tiles.push_back(pending.front());
+            pending.pop_front();
+        }
+    };
+
+    auto childrenAlive = [&]() { // reaps the workers started which died
+        int alive = 0;
+        for (pid_t& child : children) {
+            if (child > 0 && waitpid(child, nullptr, WNOHANG) == child) {
+                child = -1;
+            }
+            alive += child > 0;
+        }
+        return alive;
+    };
+
+    while (finished < tileCount) {
+        vector<pollfd> polled = {{listener, POLLIN, 0}};
+        vector<size_t> polledWorkers;
+        for (size_t w = 0; w < workers.size(); w++) {
+            if (workers[w].socket >= 0) {
+                polled.push_back({workers[w].socket, POLLIN, 0});
+                polledWorkers.push_back(w);
+            }
+        }
+        if (!polledWorkers.empty() || childrenAlive() > 0) {
+            lastWorkerSeen = chrono::steady_clock::now();
+        }
+        else if (!children.empty()
+                 || chrono::duration<double, milli>(chrono::steady_clock::now() - lastWorkerSeen).count() > WORKER_TIMEOUT) {
+            cerr << "No worker left, the coordinator renders the " << pending.size() << " remaining tiles" << endl;
+            vector<int> tiles(pending.begin(), pending.end());
+            pool.run((int) tiles.size(), [&](int t) {
+                TileMessage message = tileMessage(tiles[t]);
+                for (int y = message.y0; y < message.y1; y++) {
+                    for (int x = message.x0; x < message.x1; x++) {
+                        framebuffer.setPixel(x, y, pixelColor(scene, x, y));
+                    }
+                }
+            });
+            finished += (int) tiles.size();
+            pending.clear();
+            break;
+        }
+        if (poll(polled.data(), polled.size(), 100) <= 0) {
+            continue;
+        }
+
+        if (polled[0].revents & POLLIN) { // a new worker
+            int connection = accept(listener, nullptr, nullptr);
+            WorkerHello hello;
+            if (connection >= 0 && receiveAll(connection, &hello, sizeof(hello))) {
+                if (memcmp(hello.magic, "RTWORKER", 8) != 0 || hello.width != xRes || hello.height != yRes
+                    || hello.geometryHash != scene.geometryHash || hello.cameraHash != scene.cameraHash
+                    || hello.lightsHash != scene.lightsHash) {
+                    cerr << "A worker with another scene or resolution was refused" << endl;
+                    close(connection);
+                }
+                else {
+                    workers.push_back({connection, {}, 0});
+                    totalWorkers++;
+                    feedWorker(workers.size() - 1);
+                }
+            }
+            else if (connection >= 0) {
+                close(connection);
+            }
+        }
+
+        for (size_t p = 1; p < polled.size(); p++) {
+            size_t w = polledWorkers[p - 1];
+            if (polled[p].revents == 0 || workers[w].socket < 0) {
+                continue;
+            }
+            TileMessage answer;
+            bool received = receiveAll(workers[w].socket, &answer, sizeof(answer));
+            auto sent = find(workers[w].tiles.begin(), workers[w].tiles.end(), answer.tile);
+            // the rectangle of the tile is the one handed out, whatever the worker sent back
+            TileMessage message = tileMessage(sent != workers[w].tiles.end() ? answer.tile : 0);
+            int width = message.x1 - message.x0;
+            if (received && sent != workers[w].tiles.end()) {
+                pixels.resize((size_t) width * (message.y1 - message.y0));
+                received = receiveAll(workers[w].socket, pixels.data(), pixels.size() * sizeof(COLORREF));
+            }
+            if (!received || sent == workers[w].tiles.end()) {
+                dropWorker(w);
+                continue;
+            }
+            for (int y = message.y0; y < message.y1; y++) {
+                copy(pixels.begin() + (size_t) (y - message.y0) * width, pixels.begin() + (size_t) (y - message.y0 + 1) * width,
+                     framebuffer.pixels.begin() + (size_t) y * xRes + message.x0);
+            }
+            workers[w].tiles.erase(sent);
+            workers[w].rendered++;
+            finished++;
+            feedWorker(w);
+        }
+        for (size_t w = 0; w < workers.size(); w++) { // tiles given back by dead workers
+            feedWorker(w);
+        }
+    }
+
+    TileMessage stop = {-1, 0, 0, 0, 0};
+    for (WorkerConnection& worker : workers) {
+        if (worker.socket >= 0) {
+            sendAll(worker.socket, &stop, sizeof(stop));
+            close(worker.socket);
+        }
+    }
+    close(listener);
+    unlink(socketPath.c_str());
+    for (pid_t child : children) {
+        if (child > 0) {
+            waitpid(child, nullptr, 0);
+        }
+    }
+    cout << "Distributed render: " << tileCount << " tiles over " << totalWorkers << " workers (";
+    for (size_t w = 0; w < workers.size(); w++) {
+        cout << (w > 0 ? ", " : "") << workers[w].rendered;
+    }
+    cout << " tiles each), " << deadWorkers << " workers lost, " << reissued << " tiles handed out again" << endl;
+    return true;
+}
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FLOAT4_SSE
+#include <emmintrin.h>
+#endif
+
+struct Mask4 {
+    /**
+     * Result of a comparison between two Float4, one boolean per lane
+    */
+#ifdef FLOAT4_SSE
+    __m128 v; // all bits set in the lanes that are true
+
+    Mask4() {}
+    Mask4(__m128 _v) : v(_v) {}
+    int bits() const { return _mm_movemask_ps(this->v); } // bit k is set if lane k is true
+    Mask4 operator & (Mask4 B) const { return _mm_and_ps(this->v, B.v); }
+    Mask4 operator | (Mask4 B) const { return _mm_or_ps(this->v, B.v); }
+    static Mask4 fromBits(int bits) {
+        return _mm_castsi128_ps(_mm_setr_epi32(bits & 1 ? -1 : 0, bits & 2 ? -1 : 0, bits & 4 ? -1 : 0, bits & 8 ? -1 : 0));
+    }
+#else
+    bool v[4];
+
+    Mask4() {}
+    int bits() const { return this->v[0] | (this->v[1] << 1) | (this->v[2] << 2) | (this->v[3] << 3); }
+    Mask4 operator & (Mask4 B) const { Mask4 R; for (int k = 0; k < 4; k++) R.v[k] = this->v[k] && B.v[k]; return R; }
+    Mask4 operator | (Mask4 B) const { Mask4 R; for (int k = 0; k < 4; k++) R.v[k] = this->v[k] || B.v[k]; return R; }
+    static Mask4 fromBits(int bits) { Mask4 R; for (int k = 0; k < 4; k++) R.v[k] = (bits >> k) & 1; return R; }
+#endif
+    bool any() const { return this->bits() != 0; }
+};
+
+struct Float4 {
+    /**
+     * Four floats processed together, with SSE when it is available and with plain scalar code
+     * otherwise. Every operation is done in single precision and rounded like its scalar
+     * counterpart, so both versions give the exact same results.
+    */
+#ifdef FLOAT4_SSE
+    __m128 v;
+
+    Float4() {}
+    Float4(__m128 _v) : v(_v) {}
+    explicit Float4(float a) : v(_mm_set1_ps(a)) {}
+    static Float4 load(const float* p) { return _mm_load_ps(p); } // p must be 16 bytes aligned
+    void store(float* p) const { _mm_store_ps(p, this->v); }
+
+    Float4 operator + (Float4 B) const { return _mm_add_ps(this->v, B.v); }
+    Float4 operator - (Float4 B) const { return _mm_sub_ps(this->v, B.v); }
+    Float4 operator * (Float4 B) const { return _mm_mul_ps(this->v, B.v); }
+    Float4 operator / (Float4 B) const { return _mm_div_ps(this->v, B.v); }
+    Mask4 operator < (Float4 B) const { return _mm_cmplt_ps(this->v, B.v); }
+    Mask4 operator <= (Float4 B) const { return _mm_cmple_ps(this->v, B.v); }
+    Mask4 operator >= (Float4 B) const { return _mm_cmpge_ps(this->v, B.v); }
+    static Float4 sqrt(Float4 A) { return _mm_sqrt_ps(A.v); }
+    static Float4 min(Float4 A, Float4 B) { return _mm_min_ps(A.v, B.v); }
+    static Float4 max(Float4 A, Float4 B) { return _mm_max_ps(A.v, B.v); }
+    static Float4 select(Mask4 mask, Float4 A, Float4 B) { // A in the lanes where mask is true, B elsewhere
+        return _mm_or_ps(_mm_and_ps(mask.v, A.v), _mm_andnot_ps(mask.v, B.v));
+    }
+#else
+    float v[4];
+
+    Float4() {}
+    explicit Float4(float a) { for (int k = 0; k < 4; k++) this->v[k] = a; }
+    static Float4 load(const float* p) { Float4 R; for (int k = 0; k < 4; k++) R.v[k] = p[k]; return R; }
+    void store(float* p) const { for (int k = 0; k < 4; k++) p[k] = this->v[k]; }
+
+    Float4 operator + (Float4 B) const { Float4 R; for (int k = 0; k < 4; k++) R.v[k] = this->v[k] + B.v[k]; return R; }
+    Float4 operator - (Float4 B) const { Float4 R; for (int k = 0; k < 4; k++) R.v[k] = this->v[k] - B.v[k]; return R; }
+    Float4 operator * (Float4 B) const { Float4 R; for (int k = 0; k < 4; k++) R.v[k] = this->v[k] * B.v[k]; return R; }
+    Float4 operator / (Float4 B) const { Float4 R; for (int k = 0; k < 4; k++) R.v[k] = this->v[k] / B.v[k]; return R; }
+    Mask4 operator < (Float4 B) const { Mask4 R; for (int k = 0; k < 4; k++) R.v[k] = this->v[k] < B.v[k]; return R; }
+    Mask4 operator <= (Float4 B) const { Mask4 R; for (int k = 0; k < 4; k++) R.v[k] = this->v[k] <= B.v[k]; return R; }
+    Mask4 operator >= (Float4 B) const { Mask4 R; for (int k = 0; k < 4; k++) R.v[k] = this->v[k] >= B.v[k]; return R; }
+    static Float4 sqrt(Float4 A) { Float4 R; for (int k = 0; k < 4; k++) R.v[k] = sqrtf(A.v[k]); return R; }
+    // same operand order as the SSE instructions: B is returned when a lane compares false (NaN)
+    static Float4 min(Float4 A, Float4 B) { Float4 R; for (int k = 0; k < 4; k++) R.v[k] = A.v[k] < B.v[k] ? A.v[k] : B.v[k]; return R; }
+    static Float4 max(Float4 A, Float4 B) { Float4 R; for (int k = 0; k < 4; k++) R.v[k] = A.v[k] > B.v[k] ? A.v[k] : B.v[k]; return R; }
+    static Float4 select(Mask4 mask, Float4 A, Float4 B) { Float4 R; for (int k = 0; k < 4; k++) R.v[k] = mask.v[k] ? A.v[k] : B.v[k]; return R; }
+#endif
+};
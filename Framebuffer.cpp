@@ -0,0 +1,49 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+// custom file:
+#include <Color.cpp> // for COLORREF
+
+using namespace std;
+
+class Framebuffer {
+    /**
+     * A contiguous in-memory image (row-major, one COLORREF per pixel) the renderer writes
+     * into. Nothing is presented while rendering: the whole frame is shown in a window or
+     * written to an image file once it is complete.
+    */
+    public:
+        int width, height; // resolution in pixels
+        vector<COLORREF> pixels; // pixel (x, y) is stored at index y*width + x
+
+        Framebuffer() : width(0), height(0) {} // default constructor
+        Framebuffer(int _width, int _height, COLORREF _color=RGB(0, 0, 0)) {
+            this->width = _width;
+            this->height = _height;
+            this->pixels.assign((size_t) _width * _height, _color);
+        }
+
+        void setPixel(int x, int y, COLORREF color) {
+            this->pixels[(size_t) y * this->width + x] = color;
+        }
+
+        COLORREF getPixel(int x, int y) const {
+            return this->pixels[(size_t) y * this->width + x];
+        }
+
+        const COLORREF* row(int y) const {
+            /**
+             * Returns a pointer to the first pixel of the row y
+            */
+            return this->pixels.data() + (size_t) y * this->width;
+        }
+
+        void clear(COLORREF color) {
+            /**
+             * Fills the whole framebuffer with a single color
+            */
+            fill(this->pixels.begin(), this->pixels.end(), color);
+        }
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+// G-buffer of the primary rays, for re-renders where only the lights change. This file is
+// included by main.cpp after the tracer functions (screenToProjPlane, closestHit,
+// hitAttributes, shadeHitpoint...) since it builds on them.
+
+#include <limits>
+#include <stdint.h>
+#include <vector>
+
+// custom files:
+#include <Color.cpp>
+#include <Framebuffer.cpp>
+#include <ThreadPool.cpp>
+
+using namespace std;
+
+class GBuffer {
+    /**
+     * What the primary ray of every pixel found during the last frame: hitpoint position,
+     * normal, surface color and primitive. It only depends on the primitives, the camera and the
+     * resolution, so as long as they do not change (same scene hashes), frames can be shaded
+     * from it without tracing any primary ray: only the lighting (shadow rays included) is
+     * computed again.
+    */
+    public:
+        int width = 0, height = 0; // resolution of the frame the buffer holds
+        uint64_t geometryHash = 0, cameraHash = 0; // hashes of the scene of that frame
+        bool valid = false; // false until a frame is traced into the buffer
+        vector<Vector3> positions; // hitpoint of every pixel, pixel (x, y) being at index y*width + x
+        vector<Vector3> normals; // normal at the hitpoint, 0 for the background
+        vector<COLORREF> colors; // surface color at the hitpoint, backgroundColor for the background
+        vector<int> primitives; // primitive hit, -1 for the background
+
+        GBuffer() {} // default constructor, empty buffer
+
+        bool matches(const CompiledScene& scene, int width, int height) const {
+            /**
+             * Returns true if the buffer holds the primary hits of a width by height frame of scene
+            */
+            return this->valid && this->width == width && this->height == height
+                   && this->geometryHash == scene.geometryHash && this->cameraHash == scene.cameraHash;
+        }
+
+        void invalidate() {
+            this->valid = false;
+        }
+};
+
+bool renderWithGBuffer(const CompiledScene& scene, Framebuffer& framebuffer, ThreadPool& pool, GBuffer& gbuffer) {
+    /**
+     * Renders a scene like renderParallel() (the image is the same), keeping the primary hits in
+     * a G-buffer. If the G-buffer already holds the primary hits of this scene (only the lights
+     * changed since the frame it was filled by), no primary ray is traced: every pixel is only
+     * shaded again from the buffer.
+     *
+     * @param scene The scene to render
+     * @param framebuffer The image to render into, its size must be xRes by yRes
+     * @param pool The threads to render with
+     * @param gbuffer The primary hits of the last frame, updated if they cannot be reused
+     * @return true if the frame was shaded from the G-buffer, false if primary rays were traced
+    */
+    bool relight = gbuffer.matches(scene, xRes, yRes);
+    if (!relight) {
+        size_t pixels = (size_t) xRes * yRes;
+        gbuffer.width = xRes;
+        gbuffer.height = yRes;
+        gbuffer.geometryHash = scene.geometryHash;
+        gbuffer.cameraHash = scene.cameraHash;
+        gbuffer.positions.resize(pixels);
+        gbuffer.normals.resize(pixels);
+        gbuffer.colors.resize(pixels);
+        gbuffer.primitives.resize(pixels);
+    }
+    int tilesX = (xRes + tileSize - 1) / tileSize;
+    int tilesY = (yRes + tileSize - 1) / tileSize;
+    pool.run(tilesX * tilesY, [&](int tile) {
+        int x0 = (tile % tilesX) * tileSize;
+        int y0 = (tile / tilesX) * tileSize;
+        int x1 = min(x0 + tileSize, xRes);
+        int y1 = min(y0 + tileSize, yRes);
+        Vector3 cameraPos = scene.cameraPos;
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                size_t i = (size_t) y * xRes + x;
+                if (!relight) { // same primary ray as viewportColor()
+                    Vector3 rayDir = Vector3::normalize(screenToProjPlane(scene, x, y) - cameraPos);
+                    HitRecord hit = closestHit(scene, cameraPos, rayDir, 1, numeric_limits<float>::infinity());
+                    tie(gbuffer.colors[i], gbuffer.positions[i], gbuffer.normals[i]) = hitAttributes(scene, cameraPos, rayDir, hit);
+                    gbuffer.primitives[i] = hit.index;
+                }
+                framebuffer.setPixel(x, y, shadeHitpoint(scene, gbuffer.colors[i], gbuffer.positions[i], gbuffer.normals[i]));
+            }
+        }
+    });
+    gbuffer.valid = true;
+    return relight;
+}
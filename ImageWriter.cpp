@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// custom files:
+#include <Color.cpp> // for COLORREF
+#include <Framebuffer.cpp> // for the in-memory image
+
+using namespace std;
+
+class PPMWriter {
+    /**
+     * Writes binary PPM (P6) images row by row. PPM has no compression at all, which
+     * makes it the cheapest format to produce.
+    */
+    public:
+        PPMWriter() {} // default constructor
+
+        bool open(const string& path, int _width, int _height) {
+            /**
+             * Creates the file at path and writes the PPM header
+             *
+             * @param path Where to write the image
+             * @param _width The image width in pixels
+             * @param _height The image height in pixels
+             * @return false if the file could not be created
+            */
+            this->width = _width;
+            this->file.open(path, ios::binary);
+            this->file << "P6\n" << _width << " " << _height << "\n255\n";
+            return this->file.good();
+        }
+
+        void writeRows(const COLORREF* pixels, int rows) {
+            /**
+             * Appends rows of pixels (row-major, width pixels per row) to the image
+            */
+            this->buffer.resize((size_t) this->width * 3);
+            for (int y = 0; y < rows; y++) {
+                const COLORREF* row = pixels + (size_t) y * this->width;
+                for (int x = 0; x < this->width; x++) {
+                    this->buffer[3*x] = GetRValue(row[x]);
+                    this->buffer[3*x + 1] = GetGValue(row[x]);
+                    this->buffer[3*x + 2] = GetBValue(row[x]);
+                }
+                this->file.write((const char*) this->buffer.data(), this->buffer.size());
+            }
+        }
+
+        bool close() {
+            this->file.close();
+            return !this->file.fail();
+        }
+
+    private:
+        ofstream file;
+        int width = 0;
+        vector<uint8_t> buffer; // one row of RGB bytes
+};
+
+class PNGWriter {
+    /**
+     * Writes 8 bits RGB PNG images row by row. The pixel data is stored in uncompressed
+     * deflate blocks: the files are bigger than with a real compressor but encoding is
+     * about as fast as copying the pixels, and no zlib dependency is needed.
+     * Each call to writeRows() produces its own IDAT chunk, so the whole image never has
+     * to be held in memory.
+    */
+    public:
+        PNGWriter() {} // default constructor
+
+        bool open(const string& path, int _width, int _height) {
+            /**
+             * Creates the file at path and writes the PNG signature and header
+             *
+             * @param path Where to write the image
+             * @param _width The image width in pixels
+             * @param _height The image height in pixels
+             * @return false if the file could not be created
+            */
+            this->width = _width;
+            this->height = _height;
+            this->rowsWritten = 0;
+            this->adlerA = 1;
+            this->adlerB = 0;
+            this->file.open(path, ios::binary);
+            const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+            this->file.write((const char*) signature, 8);
+            vector<uint8_t> header;
+            putUint32(header, _width);
+            putUint32(header, _height);
+            header.push_back(8); // bit depth
+            header.push_back(2); // color type: RGB
+            header.push_back(0); // compression method: deflate
+            header.push_back(0); // filter method
+            header.push_back(0); // no interlace
+            writeChunk("IHDR", header);
+            return this->file.good();
+        }
+
+        void writeRows(const COLORREF* pixels, int rows) {
+            /**
+             * Appends rows of pixels (row-major, width pixels per row) to the image. The
+             * deflate stream is terminated when the last row of the image is written.
+            */
+            // filtered scanlines: a filter type byte (0: none) followed by the RGB bytes
+            size_t rowSize = (size_t) this->width * 3 + 1;
+            this->raw.resize(rowSize * rows);
+            for (int y = 0; y < rows; y++) {
+                const COLORREF* row = pixels + (size_t) y * this->width;
+                uint8_t* out = this->raw.data() + y * rowSize;
+                out[0] = 0;
+                for (int x = 0; x < this->width; x++) {
+                    out[1 + 3*x] = GetRValue(row[x]);
+                    out[2 + 3*x] = GetGValue(row[x]);
+                    out[3 + 3*x] = GetBValue(row[x]);
+                }
+            }
+            updateAdler(this->raw.data(), this->raw.size());
+            bool first = this->rowsWritten == 0;
+            this->rowsWritten += rows;
+            bool last = this->rowsWritten >= this->height;
+
+            this->chunk.clear();
+            if (first) { // zlib header: deflate, 32K window, no preset dictionary
+                this->chunk.push_back(0x78);
+                this->chunk.push_back(0x01);
+            }
+            size_t offset = 0;
+            do { // stored deflate blocks hold at most 65535 bytes
+                size_t length = min(this->raw.size() - offset, (size_t) 65535);
+                bool finalBlock = last && offset + length == this->raw.size();
+                this->chunk.push_back(finalBlock ? 1 : 0);
+                this->chunk.push_back(length & 0xFF);
+                this->chunk.push_back((length >> 8) & 0xFF);
+                this->chunk.push_back(~length & 0xFF);
+                this->chunk.push_back((~length >> 8) & 0xFF);
+                this->chunk.insert(this->chunk.end(), this->raw.begin() + offset, this->raw.begin() + offset + length);
+                offset += length;
+            } while (offset < this->raw.size());
+            if (last) {
+                putUint32(this->chunk, (this->adlerB << 16) | this->adlerA);
+            }
+            writeChunk("IDAT", this->chunk);
+        }
+
+        bool close() {
+            writeChunk("IEND", vector<uint8_t>());
+            this->file.close();
+            return !this->file.fail() && this->rowsWritten == this->height;
+        }
+
+    private:
+        ofstream file;
+        int width = 0, height = 0;
+        int rowsWritten = 0;
+        uint32_t adlerA = 1, adlerB = 0; // running Adler-32 checksum of the raw scanlines
+        vector<uint8_t> raw; // filtered scanlines of the current call to writeRows()
+        vector<uint8_t> chunk; // content of the current IDAT chunk
+
+        static void putUint32(vector<uint8_t>& out, uint32_t value) { // big endian
+            out.push_back(value >> 24);
+            out.push_back((value >> 16) & 0xFF);
+            out.push_back((value >> 8) & 0xFF);
+            out.push_back(value & 0xFF);
+        }
+
+        static uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size) {
+            static const struct CRCTable { // filled once, on the first call
+                uint32_t values[256];
+                CRCTable() {
+                    for (uint32_t n = 0; n < 256; n++) {
+                        uint32_t c = n;
+                        for (int k = 0; k < 8; k++) {
+                            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                        }
+                        this->values[n] = c;
+                    }
+                }
+            } table;
+            for (size_t i = 0; i < size; i++) {
+                crc = table.values[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+            }
+            return crc;
+        }
+
+        void updateAdler(const uint8_t* data, size_t size) {
+            while (size > 0) {
+                size_t n = min(size, (size_t) 5552); // largest n for which the sums cannot overflow
+                for (size_t i = 0; i < n; i++) {
+                    this->adlerA += data[i];
+                    this->adlerB += this->adlerA;
+                }
+                this->adlerA %= 65521;
+                this->adlerB %= 65521;
+                data += n;
+                size -= n;
+            }
+        }
+
+        void writeChunk(const char* type, const vector<uint8_t>& data) {
+            vector<uint8_t> header;
+            putUint32(header, data.size());
+            this->file.write((const char*) header.data(), 4);
+            this->file.write(type, 4);
+            this->file.write((const char*) data.data(), data.size());
+            uint32_t crc = crc32(0xFFFFFFFF, (const uint8_t*) type, 4);
+            crc = crc32(crc, data.data(), data.size()) ^ 0xFFFFFFFF;
+            header.clear();
+            putUint32(header, crc);
+            this->file.write((const char*) header.data(), 4);
+        }
+};
+
+string suffixedPath(const string& path, const string& suffix) {
+    /**
+     * Returns path with suffix inserted before its extension (render.png and _heatmap give
+     * render_heatmap.png), or followed by suffix and a .png extension if it has none
+    */
+    size_t extension = path.find_last_of('.');
+    if (extension == string::npos || path.find_first_of("/\\", extension) != string::npos) {
+        return path + suffix + ".png";
+    }
+    return path.substr(0, extension) + suffix + path.substr(extension);
+}
+
+class ImageStreamWriter {
+    /**
+     * Writes an image row by row as PNG or binary PPM, the format being picked from the file
+     * extension: ".png" for PNG, anything else for PPM. Neither format needs the whole image in
+     * memory, so images bigger than the memory can be written a band of rows at a time.
+    */
+    public:
+        ImageStreamWriter() {} // default constructor
+
+        bool open(const string& path, int _width, int _height) {
+            this->png = path.size() >= 4 && path.compare(path.size() - 4, 4, ".png") == 0;
+            return this->png ? this->pngWriter.open(path, _width, _height) : this->ppmWriter.open(path, _width, _height);
+        }
+
+        void writeRows(const COLORREF* pixels, int rows) {
+            /**
+             * Appends rows of pixels (row-major, width pixels per row) to the image
+            */
+            if (this->png) {
+                this->pngWriter.writeRows(pixels, rows);
+            }
+            else {
+                this->ppmWriter.writeRows(pixels, rows);
+            }
+        }
+
+        bool close() {
+            return this->png ? this->pngWriter.close() : this->ppmWriter.close();
+        }
+
+    private:
+        bool png = false;
+        PNGWriter pngWriter;
+        PPMWriter ppmWriter;
+};
+
+bool writeImage(const Framebuffer& framebuffer, const string& path) {
+    /**
+     * Writes a framebuffer to an image file. The format is picked from the file extension:
+     * ".png" for PNG, anything else for binary PPM.
+     *
+     * @param framebuffer The image to write
+     * @param path Where to write the image
+     * @return false if the file could not be written
+    */
+    ImageStreamWriter writer;
+    if (!writer.open(path, framebuffer.width, framebuffer.height)) {
+        return false;
+    }
+    for (int y = 0; y < framebuffer.height; y += 64) { // bounded encoding buffers
+        writer.writeRows(framebuffer.row(y), min(64, framebuffer.height - y));
+    }
+    return writer.close();
+}
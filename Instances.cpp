@@ -0,0 +1,201 @@
+#pragma once
+
+// Instancing: prototypes, geometry shared by many objects of a scene, and instances, copies of a
+// prototype placed in the scene by a transform and possibly painted with their own color. This
+// file is included by main.cpp after Primitives.cpp, the Scene class holding both.
+//
+// An instance costs the same memory whatever the size of its prototype: a compiled scene keeps
+// every prototype compiled once, with its own BVHs (bottom level), and a BVH over the bounds of
+// the instances (top level). Rays reaching an instance are moved into the space of its prototype
+// and traced there.
+
+#include <math.h>
+#include <string>
+#include <vector>
+
+// custom files:
+#include <BVH.cpp> // for AABB
+#include <Color.cpp> // for COLORREF
+#include <Primitives.cpp> // the primitives prototypes are made of
+#include <Vector3.cpp> // for 3D vectors
+
+using namespace std;
+
+struct Transform {
+    /**
+     * Affine transform of 3D space, p -> matrix*p + translation, stored as the 3 rows of a 3x4
+     * matrix (the translation being the last column)
+    */
+    float m[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}; // identity by default
+
+    static Transform translation(const Vector3& offset) {
+        Transform transform;
+        transform.m[0][3] = offset.x;
+        transform.m[1][3] = offset.y;
+        transform.m[2][3] = offset.z;
+        return transform;
+    }
+
+    static Transform rotation(const Vector3& axis, float degrees) {
+        /**
+         * Returns the rotation of degrees around an axis going through the origin, counterclockwise
+         * when the axis points towards the viewer
+        */
+        Vector3 u = Vector3::normalizeExact(axis);
+        float angle = degrees * (float) M_PI / 180;
+        float c = cosf(angle), s = sinf(angle), t = 1 - c;
+        Transform transform;
+        float rows[3][3] = {{t*u.x*u.x + c, t*u.x*u.y - s*u.z, t*u.x*u.z + s*u.y},
+                            {t*u.x*u.y + s*u.z, t*u.y*u.y + c, t*u.y*u.z - s*u.x},
+                            {t*u.x*u.z - s*u.y, t*u.y*u.z + s*u.x, t*u.z*u.z + c}};
+        for (int row = 0; row < 3; row++) {
+            for (int column = 0; column < 3; column++) {
+                transform.m[row][column] = rows[row][column];
+            }
+        }
+        return transform;
+    }
+
+    static Transform scaling(float factor) {
+        Transform transform;
+        for (int axis = 0; axis < 3; axis++) {
+            transform.m[axis][axis] = factor;
+        }
+        return transform;
+    }
+
+    Transform operator * (const Transform& B) const {
+        /**
+         * Returns the transform applying B first, then this
+        */
+        Transform product;
+        for (int row = 0; row < 3; row++) {
+            for (int column = 0; column < 4; column++) {
+                product.m[row][column] = this->m[row][0] * B.m[0][column] + this->m[row][1] * B.m[1][column]
+                                         + this->m[row][2] * B.m[2][column] + (column == 3 ? this->m[row][3] : 0);
+            }
+        }
+        return product;
+    }
+
+    Vector3 apply(const Vector3& point) const {
+        return Vector3(this->m[0][0]*point.x + this->m[0][1]*point.y + this->m[0][2]*point.z + this->m[0][3],
+                       this->m[1][0]*point.x + this->m[1][1]*point.y + this->m[1][2]*point.z + this->m[1][3],
+                       this->m[2][0]*point.x + this->m[2][1]*point.y + this->m[2][2]*point.z + this->m[2][3]);
+    }
+
+    Vector3 applyLinear(const Vector3& vector) const { // for directions, which are not translated
+        return Vector3(this->m[0][0]*vector.x + this->m[0][1]*vector.y + this->m[0][2]*vector.z,
+                       this->m[1][0]*vector.x + this->m[1][1]*vector.y + this->m[1][2]*vector.z,
+                       this->m[2][0]*vector.x + this->m[2][1]*vector.y + this->m[2][2]*vector.z);
+    }
+
+    Vector3 applyTransposed(const Vector3& vector) const {
+        /**
+         * Applies the transpose of the matrix: the transposed inverse of a transform moves the
+         * normals the transform itself moves points
+        */
+        return Vector3(this->m[0][0]*vector.x + this->m[1][0]*vector.y + this->m[2][0]*vector.z,
+                       this->m[0][1]*vector.x + this->m[1][1]*vector.y + this->m[2][1]*vector.z,
+                       this->m[0][2]*vector.x + this->m[1][2]*vector.y + this->m[2][2]*vector.z);
+    }
+
+    bool inverse(Transform& inverse) const {
+        /**
+         * Computes the inverse transform, in double precision
+         *
+         * @return false if the transform cannot be inverted (flattens space)
+        */
+        const float (*a)[4] = this->m;
+        double cofactors[3][3];
+        for (int row = 0; row < 3; row++) {
+            for (int column = 0; column < 3; column++) {
+                int r1 = (row + 1) % 3, r2 = (row + 2) % 3, c1 = (column + 1) % 3, c2 = (column + 2) % 3;
+                cofactors[row][column] = (double) a[r1][c1] * a[r2][c2] - (double) a[r1][c2] * a[r2][c1];
+            }
+        }
+        double determinant = a[0][0] * cofactors[0][0] + a[0][1] * cofactors[0][1] + a[0][2] * cofactors[0][2];
+        if (determinant == 0 || !isfinite(determinant)) {
+            return false;
+        }
+        for (int row = 0; row < 3; row++) {
+            for (int column = 0; column < 3; column++) {
+                inverse.m[row][column] = (float) (cofactors[column][row] / determinant);
+            }
+        }
+        for (int row = 0; row < 3; row++) {
+            double translation = 0;
+            for (int k = 0; k < 3; k++) {
+                translation -= cofactors[k][row] / determinant * a[k][3];
+            }
+            inverse.m[row][3] = (float) translation;
+        }
+        return true;
+    }
+
+    AABB applyBounds(const AABB& box) const {
+        /**
+         * Returns the bounds of a box once transformed (the bounds of its 8 transformed corners)
+        */
+        AABB bounds;
+        for (int corner = 0; corner < 8; corner++) {
+            Vector3 point(corner & 1 ? box.max[0] : box.min[0], corner & 2 ? box.max[1] : box.min[1], corner & 4 ? box.max[2] : box.min[2]);
+            Vector3 moved = this->apply(point);
+            float coordinates[3] = {moved.x, moved.y, moved.z};
+            bounds.grow(coordinates);
+        }
+        return bounds;
+    }
+};
+
+class Prototype { // geometry shared by instances, in a space of its own (planes cannot be instanced, they are unbounded)
+    public:
+        vector<Sphere> spheres;
+        vector<Box> boxes;
+        vector<Triangle> triangles;
+        vector<Mesh> meshes;
+
+        Prototype() {} // default Prototype constructor
+};
+
+class Instance { // a copy of a prototype placed in the scene
+    public:
+        int prototype; // index of the prototype in the scene
+        Transform transform; // from the space of the prototype to the scene
+        bool hasColor = false; // paints the whole instance with color instead of the colors of the prototype
+        COLORREF color = 0;
+
+        Instance() {} // default Instance constructor
+
+        Instance(int prototype, Transform transform) {
+            this->prototype = prototype;
+            this->transform = transform;
+        }
+
+        Instance(int prototype, Transform transform, COLORREF color) : Instance(prototype, transform) {
+            this->hasColor = true;
+            this->color = color;
+        }
+
+        string toString() const {
+            return "Prototype: " + to_string(this->prototype) + ",   position: "
+                   + Vector3(this->transform.m[0][3], this->transform.m[1][3], this->transform.m[2][3]).toString();
+        }
+};
+
+struct CompiledInstance {
+    /**
+     * An instance of a compiled scene, with both of its transforms: rays are moved into the space
+     * of the prototype with toPrototype, and hitpoints back into the scene with toScene
+    */
+    Transform toScene;
+    Transform toPrototype;
+    int prototype;
+    int hasColor; // 0 or 1
+    COLORREF color;
+
+    string toString() const {
+        Instance instance(this->prototype, this->toScene);
+        return instance.toString();
+    }
+};
@@ -12,13 +12,14 @@ class Light {
      * There are three type of lights supported:
      *      - ambient: a world light that illuminates any point in the scene.
      *      - point: all rays of this kind of lights come from a single point.
-     *      - sun: all rays of this kind of lights are parallel.
+     *      - directional: all rays of this kind of lights are parallel ("sun" is accepted
+     *        as another name for it).
     */
     public:
-        string type; // a light can either be "ambient", "point" or "sun"
+        string type; // a light can either be "ambient", "point" or "directional"
         float intensity; // between 0 and 1, represents how bright the light is
-        Vector3 position; // position of the light (ignored for ambient and sun)
-        Vector3 direction; // direction of the light (ignored for point and sun)
+        Vector3 position; // position of the light (ignored for ambient and directional)
+        Vector3 direction; // direction of the light (ignored for ambient and point)
 
     Light() {} // default constructor
     Light(string _type, float _intensity, Vector3 _position=Vector3(0, 0, 0), Vector3 _direction=Vector3(0, 0, 0)) {
@@ -0,0 +1,189 @@
+#pragma once
+
+// Wavefront OBJ meshes. This file is included by SceneFile.cpp: text scenes reference their
+// meshes as OBJ files.
+//
+// Only the geometry is read: vertices ("v <x> <y> <z>") and faces ("f <a> <b> <c>...", each
+// corner being a vertex index starting at 1, negative indices counting back from the last
+// vertex, possibly followed by "/texture/normal" indices, which are ignored). Faces of more than
+// three vertices are split into a fan of triangles, and every other element (normals, texture
+// coordinates, groups, materials...) is ignored. Vertices must be defined before the faces that
+// use them.
+// Files are read by chunks into a fixed buffer and every line is parsed in place, so loading a
+// mesh of millions of triangles allocates nothing per line: only the vertex and index arrays
+// grow, from a size guessed from the size of the file.
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// custom files:
+#include <Primitives.cpp> // for Mesh
+
+using namespace std;
+
+static bool isObjSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool parseObjLine(char* line, Mesh& mesh, const char*& error) {
+    /**
+     * Reads one line of an OBJ file (without its end of line), adding its vertex or its
+     * triangles to mesh
+     *
+     * @return false if the line is invalid, error being set to the reason
+    */
+    char* cursor = line;
+    while (isObjSpace(*cursor)) {
+        cursor++;
+    }
+    if (cursor[0] == 'v' && isObjSpace(cursor[1])) {
+        cursor++;
+        float xyz[3];
+        for (int axis = 0; axis < 3; axis++) {
+            char* end;
+            xyz[axis] = strtof(cursor, &end);
+            if (end == cursor) {
+                error = "invalid vertex";
+                return false;
+            }
+            cursor = end;
+        }
+        mesh.vertices.push_back(Vector3(xyz[0], xyz[1], xyz[2]));
+    }
+    else if (cursor[0] == 'f' && isObjSpace(cursor[1])) {
+        cursor++;
+        int vertexCount = (int) mesh.vertices.size();
+        int corners = 0, first = 0, previous = 0;
+        while (true) {
+            char* end;
+            long index = strtol(cursor, &end, 10);
+            if (end == cursor) {
+                break;
+            }
+            cursor = end;
+            while (*cursor != '\0' && !isObjSpace(*cursor)) { // texture and normal indices
+                cursor++;
+            }
+            long vertex = index > 0 ? index - 1 : vertexCount + index;
+            if (index == 0 || vertex < 0 || vertex >= vertexCount) {
+                error = "vertex index out of range";
+                return false;
+            }
+            if (corners == 0) {
+                first = (int) vertex;
+            }
+            else if (corners >= 2) { // fan around the first corner
+                mesh.indices.push_back(first);
+                mesh.indices.push_back(previous);
+                mesh.indices.push_back((int) vertex);
+            }
+            previous = (int) vertex;
+            corners++;
+        }
+        if (corners < 3) {
+            error = "face of less than 3 vertices";
+            return false;
+        }
+    }
+    return true; // other elements are ignored
+}
+
+bool loadObj(const string& path, Mesh& mesh) {
+    /**
+     * Reads the vertices and the faces of an OBJ file into a mesh, whose color is left as it is
+     *
+     * @param path The file to read
+     * @param mesh Set to the triangles of the file
+     * @return false if the file could not be read or has an error (reported on cerr)
+    */
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        cerr << "Could not open " << path << endl;
+        return false;
+    }
+    mesh.vertices.clear();
+    mesh.indices.clear();
+    if (fseek(file, 0, SEEK_END) == 0) { // about 40 bytes per triangle, with half as many vertices as triangles
+        long size = ftell(file);
+        if (size > 0) {
+            mesh.vertices.reserve(size / 80);
+            mesh.indices.reserve(size / 40 * 3);
+        }
+        fseek(file, 0, SEEK_SET);
+    }
+    static constexpr size_t CHUNK_SIZE = 1 << 20; // also the maximum length of a line
+    vector<char> buffer(CHUNK_SIZE + 1); // one more byte to end the last line of the file
+    size_t kept = 0; // bytes of the line cut at the end of the previous chunk, moved at the start of buffer
+    int lineNumber = 0;
+    const char* error = nullptr;
+    while (error == nullptr) {
+        size_t read = fread(buffer.data() + kept, 1, CHUNK_SIZE - kept, file);
+        size_t end = kept + read;
+        bool lastChunk = read < CHUNK_SIZE - kept;
+        size_t start = 0;
+        for (size_t i = 0; i < end && error == nullptr; i++) {
+            if (buffer[i] == '\n') {
+                buffer[i] = '\0';
+                lineNumber++;
+                parseObjLine(buffer.data() + start, mesh, error);
+                start = i + 1;
+            }
+        }
+        if (error != nullptr) {
+            break;
+        }
+        if (lastChunk) {
+            if (start < end) { // last line, without end of line
+                buffer[end] = '\0';
+                lineNumber++;
+                parseObjLine(buffer.data() + start, mesh, error);
+            }
+            break;
+        }
+        kept = end - start;
+        if (kept == CHUNK_SIZE) {
+            lineNumber++;
+            error = "line too long";
+            break;
+        }
+        memmove(buffer.data(), buffer.data() + start, kept);
+    }
+    bool failed = ferror(file) != 0;
+    fclose(file);
+    if (error != nullptr) {
+        cerr << path << ":" << lineNumber << ": " << error << endl;
+        return false;
+    }
+    if (failed) {
+        cerr << "Could not read " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+bool writeObj(const Mesh& mesh, const string& path) {
+    /**
+     * Writes the vertices and the triangles of a mesh as an OBJ file, with enough digits for
+     * every float to be read back exactly
+     *
+     * @return false if the file could not be written
+    */
+    ofstream file(path);
+    file << setprecision(numeric_limits<float>::max_digits10);
+    file << "# mesh written by the raytracer" << endl;
+    for (const Vector3& vertex : mesh.vertices) {
+        file << "v " << vertex.x << " " << vertex.y << " " << vertex.z << "\n";
+    }
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        file << "f " << mesh.indices[i] + 1 << " " << mesh.indices[i + 1] + 1 << " " << mesh.indices[i + 2] + 1 << "\n";
+    }
+    file.close();
+    return !file.fail();
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+// Packet tracing of primary rays. This file is included by main.cpp after the tracer functions
+// (screenToProjPlane, hitAttributes, shadeHitpoint...) since it builds on them.
+
+#include <limits>
+
+// custom files:
+#include <Float4.cpp> // 4 lanes SIMD
+#include <Framebuffer.cpp>
+#include <ThreadPool.cpp>
+
+template <int SIZE>
+struct PrimaryRayPacket {
+    /**
+     * The primary rays of a block of SIZE by SIZE pixels, stored lane by lane so that groups
+     * of 4 rays are processed together. All the rays start from the camera. Lanes of pixels
+     * outside the image (or the tile) are disabled by giving them a negative tMax, so they
+     * can never hit anything.
+    */
+    static constexpr int RAYS = SIZE * SIZE;
+    static constexpr int GROUPS = RAYS / 4;
+
+    alignas(16) float dirX[RAYS], dirY[RAYS], dirZ[RAYS]; // rayDir of every ray, normalize(target - origin)
+    alignas(16) float invX[RAYS], invY[RAYS], invZ[RAYS]; // inverse of each component of rayDir, for the box tests
+    alignas(16) float a[RAYS]; // dot(rayDir, rayDir), first coefficient of the intersection equation
+    alignas(16) float tMax[RAYS]; // distance of the closest hit found so far (ray end)
+    int hit[RAYS]; // identifier of the closest primitive hit so far, -1 if none
+    int instancePrimitive[RAYS]; // primitive hit in the prototype when hit is an instance (see HitRecord)
+};
+
+template <int SIZE>
+bool anyRayHitsBox(const PrimaryRayPacket<SIZE>& packet, const float origin[3], float tMin, const AABB& box, float& tEntry) {
+    /**
+     * Slab test between a box and every ray of a packet
+     *
+     * @param tEntry Set to the smallest distance at which a ray enters the box
+     * @return true if at least one ray of the packet crosses the box before its tMax
+    */
+    Float4 minX(box.min[0] - origin[0]), minY(box.min[1] - origin[1]), minZ(box.min[2] - origin[2]);
+    Float4 maxX(box.max[0] - origin[0]), maxY(box.max[1] - origin[1]), maxZ(box.max[2] - origin[2]);
+    Float4 closestEntry(numeric_limits<float>::infinity());
+    bool any = false;
+    for (int g = 0; g < PrimaryRayPacket<SIZE>::GROUPS; g++) {
+        Float4 invX = Float4::load(packet.invX + 4*g), invY = Float4::load(packet.invY + 4*g), invZ = Float4::load(packet.invZ + 4*g);
+        Float4 x1 = minX * invX, x2 = maxX * invX;
+        Float4 y1 = minY * invY, y2 = maxY * invY;
+        Float4 z1 = minZ * invZ, z2 = maxZ * invZ;
+        Float4 entry = Float4::max(Float4::max(Float4(tMin), Float4::min(x1, x2)), Float4::max(Float4::min(y1, y2), Float4::min(z1, z2)));
+        Float4 exit = Float4::min(Float4::min(Float4::load(packet.tMax + 4*g), Float4::max(x1, x2)), Float4::min(Float4::max(y1, y2), Float4::max(z1, z2)));
+        Mask4 hits = entry <= exit;
+        if (hits.any()) {
+            any = true;
+            closestEntry = Float4::select(hits, Float4::min(entry, closestEntry), closestEntry);
+        }
+    }
+    alignas(16) float entries[4];
+    closestEntry.store(entries);
+    tEntry = min(min(entries[0], entries[1]), min(entries[2], entries[3]));
+    return any;
+}
+
+template <int SIZE>
+void intersectPacketSpheres(const SphereArrays& arrays, PrimaryRayPacket<SIZE>& packet, const float origin[3], float tMin, int begin, int end) {
+    /**
+     * Tests the spheres [begin, end) of the sphere arrays against every ray of a packet, with
+     * the same equation and rounding as the nearestSphere kernels
+    */
+    STATS(pixelStats.intersectionTests += (long long) (end - begin) * PrimaryRayPacket<SIZE>::RAYS;)
+    for (int k = begin; k < end; k++) {
+        // the origin is shared by the whole packet, so only b depends on the ray
+        float wx = origin[0] - arrays.centerX[k];
+        float wy = origin[1] - arrays.centerY[k];
+        float wz = origin[2] - arrays.centerZ[k];
+        Float4 c((wx*wx + wy*wy + wz*wz) - arrays.radius2[k]);
+        Float4 WX(wx), WY(wy), WZ(wz);
+        for (int g = 0; g < PrimaryRayPacket<SIZE>::GROUPS; g++) {
+            Float4 a = Float4::load(packet.a + 4*g);
+            Float4 b = Float4(2) * ((WX * Float4::load(packet.dirX + 4*g) + WY * Float4::load(packet.dirY + 4*g)) + WZ * Float4::load(packet.dirZ + 4*g));
+            Float4 discriminant = b*b - (Float4(4) * a) * c;
+            Float4 tMax = Float4::load(packet.tMax + 4*g);
+            Mask4 hits = (discriminant >= Float4(0)) & (Float4(tMin) <= tMax); // disabled lanes have tMax < tMin
+            if (!hits.any()) {
+                continue;
+            }
+            Float4 root = Float4::sqrt(discriminant);
+            Float4 twoA = Float4(2) * a;
+            Float4 t1 = (Float4(0) - b + root) / twoA;
+            Float4 t2 = (Float4(0) - b - root) / twoA;
+            Float4 infinity(numeric_limits<float>::infinity());
+            t1 = Float4::select((Float4(tMin) <= t1) & (t1 <= tMax), t1, infinity);
+            t2 = Float4::select((Float4(tMin) <= t2) & (t2 <= tMax), t2, infinity);
+            Float4 t = Float4::min(t1, t2);
+            int closer = (hits & (t < infinity)).bits();
+            if (closer == 0) {
+                continue;
+            }
+            alignas(16) float lanes[4];
+            t.store(lanes);
+            int sphere = arrays.index[k];
+            for (int lane = 0; lane < 4; lane++) { // ties go to the lowest sphere index, like in closestHit
+                int r = 4*g + lane;
+                if ((closer >> lane & 1) && (lanes[lane] < packet.tMax[r] || sphere < packet.hit[r])) {
+                    packet.tMax[r] = lanes[lane];
+                    packet.hit[r] = sphere;
+                }
+            }
+        }
+    }
+}
+
+template <int SIZE>
+void intersectPacket(const CompiledScene& scene, PrimaryRayPacket<SIZE>& packet, const float origin[3], float tMin) {
+    /**
+     * Finds the closest sphere hit by every ray of a packet. The whole packet walks the BVH
+     * together: a node is visited if at least one ray crosses it, and each leaf sphere is
+     * tested against all the rays at once.
+    */
+    const SphereArrays& arrays = scene.sphereArrays;
+    if (scene.bvhNodeCount == 0) {
+        intersectPacketSpheres(arrays, packet, origin, tMin, 0, arrays.count);
+        return;
+    }
+    int stack[BVH::STACK_SIZE];
+    int stackSize = 0;
+    float tEntry;
+    if (anyRayHitsBox(packet, origin, tMin, scene.bvhNodes[0].bounds, tEntry)) {
+        stack[stackSize++] = 0;
+    }
+    while (stackSize > 0) {
+        const BVHNode& node = scene.bvhNodes[stack[--stackSize]];
+        if (node.count > 0) {
+            intersectPacketSpheres(arrays, packet, origin, tMin, node.first, node.first + node.count);
+            continue;
+        }
+        float tLeft, tRight;
+        bool hitLeft = anyRayHitsBox(packet, origin, tMin, scene.bvhNodes[node.first].bounds, tLeft);
+        bool hitRight = anyRayHitsBox(packet, origin, tMin, scene.bvhNodes[node.first + 1].bounds, tRight);
+        if (hitLeft && hitRight) { // the child closest to the packet is visited first
+            stack[stackSize++] = tLeft <= tRight ? node.first + 1 : node.first;
+            stack[stackSize++] = tLeft <= tRight ? node.first : node.first + 1;
+        }
+        else if (hitLeft || hitRight) {
+            stack[stackSize++] = hitLeft ? node.first : node.first + 1;
+        }
+    }
+}
+
+template <int SIZE>
+void renderPacket(const CompiledScene& scene, Framebuffer& framebuffer, int x0, int y0, int x1, int y1) {
+    /**
+     * Renders the block of SIZE by SIZE pixels starting at (x0, y0) with a ray packet, pixels
+     * outside of [x0, x1) x [y0, y1) being skipped. The colors are the same as the ones given
+     * by pixelColor() with the sphere arrays.
+    */
+    STATS(beginPixelStats();) // the tracing statistics of the packet are shared by its pixels
+    PrimaryRayPacket<SIZE> packet;
+    Vector3 cameraPos = scene.cameraPos;
+    float origin[3] = {cameraPos.x, cameraPos.y, cameraPos.z};
+    float tMin = 1; // same ray range as in viewportColor
+    for (int r = 0; r < PrimaryRayPacket<SIZE>::RAYS; r++) {
+        int x = x0 + r % SIZE;
+        int y = y0 + r / SIZE;
+        bool inside = x < x1 && y < y1;
+        Vector3 target = inside ? screenToProjPlane(scene, x, y) : cameraPos + Vector3(0, 0, 1);
+        Vector3 rayDir = Vector3::normalize(target - cameraPos);
+        packet.dirX[r] = rayDir.x;
+        packet.dirY[r] = rayDir.y;
+        packet.dirZ[r] = rayDir.z;
+        packet.invX[r] = 1 / rayDir.x;
+        packet.invY[r] = 1 / rayDir.y;
+        packet.invZ[r] = 1 / rayDir.z;
+        packet.a[r] = rayDir.x*rayDir.x + rayDir.y*rayDir.y + rayDir.z*rayDir.z;
+        packet.tMax[r] = inside ? numeric_limits<float>::infinity() : -1; // disabled lane
+        packet.hit[r] = -1;
+        packet.instancePrimitive[r] = -1;
+    }
+    intersectPacket(scene, packet, origin, tMin);
+    for (int r = 0; r < PrimaryRayPacket<SIZE>::RAYS; r++) { // the other primitives are tested ray by ray
+        if (packet.tMax[r] < tMin) { // disabled lane
+            continue;
+        }
+        PrimitiveRay ray(cameraPos, Vector3(packet.dirX[r], packet.dirY[r], packet.dirZ[r]));
+        HitRecord hit{packet.tMax[r], packet.hit[r]};
+        int visited = 0;
+        closestOfType<PLANE>(scene, ray, tMin, numeric_limits<float>::infinity(), hit, visited);
+        closestOfType<BOX>(scene, ray, tMin, numeric_limits<float>::infinity(), hit, visited);
+        closestOfType<TRIANGLE>(scene, ray, tMin, numeric_limits<float>::infinity(), hit, visited);
+        closestOfType<MESH>(scene, ray, tMin, numeric_limits<float>::infinity(), hit, visited);
+        closestOfType<INSTANCE>(scene, ray, tMin, numeric_limits<float>::infinity(), hit, visited);
+        packet.tMax[r] = hit.t;
+        packet.hit[r] = hit.index;
+        packet.instancePrimitive[r] = hit.instancePrimitive;
+    }
+    STATS(PixelStats packetStats = pixelStats; packetStats.traceTime = nanosecondsSince(packetStats.start);)
+    STATS(int pixels = (min(x0 + SIZE, x1) - x0) * (min(y0 + SIZE, y1) - y0);)
+    for (int r = 0; r < PrimaryRayPacket<SIZE>::RAYS; r++) {
+        int x = x0 + r % SIZE;
+        int y = y0 + r / SIZE;
+        if (x >= x1 || y >= y1) {
+            continue;
+        }
+        STATS(beginPixelStats();)
+        COLORREF color;
+        Vector3 hitPos, normal;
+        Vector3 rayDir(packet.dirX[r], packet.dirY[r], packet.dirZ[r]);
+        tie(color, hitPos, normal) = hitAttributes(scene, cameraPos, rayDir, HitRecord{packet.tMax[r], packet.hit[r], packet.instancePrimitive[r]});
+        color = shadeHitpoint(scene, color, hitPos, normal);
+        STATS(pixelStats.shadeTime = nanosecondsSince(pixelStats.start);)
+        STATS(pixelStats.primaryRays = 1; pixelStats.primitive = packet.hit[r];)
+        STATS(packet.hit[r] == -1 ? pixelStats.misses++ : pixelStats.hits++;)
+        STATS(pixelStats.intersectionTests += packetStats.intersectionTests / pixels;)
+        STATS(pixelStats.traceTime = packetStats.traceTime / pixels; pixelStats.totalTime = pixelStats.traceTime;)
+        STATS(endPixelStats(x, y);)
+        framebuffer.setPixel(x, y, color);
+    }
+}
+
+void renderPackets(const CompiledScene& scene, Framebuffer& framebuffer, ThreadPool& pool, int packetSize) {
+    /**
+     * Renders a scene like renderParallel(), tracing the primary rays of each tile by blocks of
+     * packetSize by packetSize pixels. scene.sphereArrays must be built.
+     *
+     * @param scene The scene to render
+     * @param framebuffer The image to render into, its size must be xRes by yRes
+     * @param pool The threads to render with
+     * @param packetSize The width of the pixel blocks traced together, 4 or 8
+    */
+    int tilesX = (xRes + tileSize - 1) / tileSize;
+    int tilesY = (yRes + tileSize - 1) / tileSize;
+    pool.run(tilesX * tilesY, [&](int tile) {
+        int x0 = (tile % tilesX) * tileSize;
+        int y0 = (tile / tilesX) * tileSize;
+        int x1 = min(x0 + tileSize, xRes);
+        int y1 = min(y0 + tileSize, yRes);
+        for (int y = y0; y < y1; y += packetSize) {
+            for (int x = x0; x < x1; x += packetSize) {
+                if (packetSize == 8) {
+                    renderPacket<8>(scene, framebuffer, x, y, x1, y1);
+                }
+                else {
+                    renderPacket<4>(scene, framebuffer, x, y, x1, y1);
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,495 @@
+#pragma once
+
+// Primitives other than spheres: infinite planes, axis-aligned boxes, triangles and triangle
+// meshes. This file is included by main.cpp after the Sphere class, which is the fifth type of
+// primitive.
+//
+// Like lights, primitives are grouped by type: a compiled scene keeps one homogeneous array per
+// type (the objects, plus a structure-of-arrays copy of their geometry that rays are tested
+// against), and the code that depends on the type of a primitive is picked at compile time
+// through PrimitiveKernel, so no call is virtual and no primitive is tested through a switch.
+
+#include <limits>
+#include <math.h>
+#include <string>
+#include <vector>
+
+// custom files:
+#include <BVH.cpp> // for AABB
+#include <Color.cpp> // for COLORREF
+#include <Vector3.cpp> // for 3D vectors
+
+using namespace std;
+
+enum PrimitiveType {
+    SPHERE,
+    PLANE,
+    BOX,
+    TRIANGLE,
+    MESH, // the triangles of all the meshes, each mesh having its own BVH
+    INSTANCE, // instances of prototypes (see Instances.cpp), each hit being the hit of a primitive of the prototype
+    PRIMITIVE_TYPE_COUNT
+};
+
+struct Material {
+    /**
+     * How a surface reflects light and lets it through, followed by the secondary rays of the
+     * wavefront renderer (see Wavefront.cpp). The rest of the light, 1 - reflective - transparency,
+     * is the color of the surface lit by the lights of the scene. Primitives refer to their
+     * material by its index in the materials of their scene, -1 being a matte surface (which is
+     * how the other renderers shade every surface).
+    */
+    float reflective = 0; // share of the light coming from the mirror direction, between 0 and 1
+    float transparency = 0; // share of the light coming through the surface, between 0 and 1
+    float refractiveIndex = 1; // of the inside of spheres and boxes relative to the outside (other primitives are thin)
+
+    Material() {} // default Material constructor, matte
+
+    Material(float reflective, float transparency, float refractiveIndex) {
+        this->reflective = reflective;
+        this->transparency = transparency;
+        this->refractiveIndex = refractiveIndex;
+    }
+};
+
+class Plane { // an infinite plane, seen from both sides
+    public:
+        Vector3 point; // any point of the plane
+        Vector3 normal; // normal of the plane, of any length
+        COLORREF color;
+        int material = -1; // index in the materials of the scene, -1 for a matte surface
+
+        Plane() {} // default Plane constructor
+
+        Plane(Vector3 point, Vector3 normal, COLORREF color) {
+            this->point = point;
+            this->normal = normal;
+            this->color = color;
+        }
+
+        string toString() const {
+            return "Point: " + this->point.toString() + ",   normal: " + this->normal.toString();
+        }
+};
+
+class Box { // an axis-aligned box
+    public:
+        Vector3 min; // corner of the box with the lowest coordinates
+        Vector3 max; // opposite corner
+        COLORREF color;
+        int material = -1; // index in the materials of the scene, -1 for a matte surface
+
+        Box() {} // default Box constructor
+
+        Box(Vector3 min, Vector3 max, COLORREF color) {
+            this->min = min;
+            this->max = max;
+            this->color = color;
+        }
+
+        string toString() const {
+            return "Min: " + this->min.toString() + ",   max: " + this->max.toString();
+        }
+};
+
+class Triangle { // a triangle, seen from both sides
+    public:
+        Vector3 a, b, c; // vertices
+        COLORREF color;
+        int material = -1; // index in the materials of the scene, -1 for a matte surface
+
+        Triangle() {} // default Triangle constructor
+
+        Triangle(Vector3 a, Vector3 b, Vector3 c, COLORREF color) {
+            this->a = a;
+            this->b = b;
+            this->c = c;
+            this->color = color;
+        }
+
+        string toString() const {
+            return "Vertices: " + this->a.toString() + ", " + this->b.toString() + ", " + this->c.toString();
+        }
+};
+
+class Mesh { // a triangle mesh, whose triangles share their vertices (seen from both sides)
+    public:
+        vector<Vector3> vertices;
+        vector<int> indices; // three indices in vertices per triangle
+        COLORREF color;
+        int material = -1; // index in the materials of the scene, -1 for a matte surface
+
+        Mesh() {} // default Mesh constructor
+
+        int triangleCount() const {
+            return (int) (this->indices.size() / 3);
+        }
+
+        static Mesh getSphereMesh(int triangleCount, const Vector3& center, float radius, COLORREF color) {
+            /**
+             * Returns a sphere made of about triangleCount triangles (rings of quads split in two,
+             * between two fans around the poles), sharing their vertices
+            */
+            int rings = std::max(2, (int) round(sqrt(triangleCount / 4.)));
+            int segments = 2 * rings;
+            Mesh mesh;
+            mesh.color = color;
+            mesh.vertices.push_back(center + Vector3(0, radius, 0));
+            for (int ring = 1; ring < rings; ring++) {
+                float theta = (float) M_PI * ring / rings;
+                for (int segment = 0; segment < segments; segment++) {
+                    float phi = 2 * (float) M_PI * segment / segments;
+                    mesh.vertices.push_back(center + Vector3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi)) * radius);
+                }
+            }
+            mesh.vertices.push_back(center + Vector3(0, -radius, 0));
+            int south = (int) mesh.vertices.size() - 1;
+            auto vertex = [segments](int ring, int segment) { // index of a vertex of the rings 1 to rings-1
+                return 1 + (ring - 1) * segments + segment % segments;
+            };
+            for (int segment = 0; segment < segments; segment++) {
+                mesh.indices.insert(mesh.indices.end(), {0, vertex(1, segment + 1), vertex(1, segment)});
+                for (int ring = 1; ring < rings - 1; ring++) {
+                    int a = vertex(ring, segment), b = vertex(ring, segment + 1);
+                    int c = vertex(ring + 1, segment + 1), d = vertex(ring + 1, segment);
+                    mesh.indices.insert(mesh.indices.end(), {a, b, c, a, c, d});
+                }
+                mesh.indices.insert(mesh.indices.end(), {vertex(rings - 1, segment), vertex(rings - 1, segment + 1), south});
+            }
+            return mesh;
+        }
+
+        string toString() const {
+            return to_string(this->vertices.size()) + " vertices,   " + to_string(this->triangleCount()) + " triangles";
+        }
+};
+
+struct PrimitiveRay {
+    /**
+     * A ray as the primitive kernels read it: origin, normalized direction and the inverse of
+     * each component of the direction
+    */
+    float origin[3], dir[3], invDir[3];
+
+    PrimitiveRay(const Vector3& origin, const Vector3& rayDir) {
+        float o[3] = {origin.x, origin.y, origin.z};
+        float d[3] = {rayDir.x, rayDir.y, rayDir.z};
+        for (int axis = 0; axis < 3; axis++) {
+            this->origin[axis] = o[axis];
+            this->dir[axis] = d[axis];
+            this->invDir[axis] = 1 / d[axis];
+        }
+    }
+};
+
+struct PrimitiveArrays {
+    /**
+     * Structure-of-arrays view of the primitives of one type: PrimitiveKernel<TYPE>::FIELDS
+     * arrays of count floats, stored one after the other in the memory block of a
+     * CompiledScene (in the order of the BVH leaves if the type has a BVH)
+    */
+    const float* fields = nullptr; // field f of the primitive at position k is fields[f*count + k]
+    const int* index = nullptr; // index in the scene array of its type of each primitive of the arrays
+    int count = 0;
+
+    const float* field(int f) const {
+        return this->fields + (size_t) f * this->count;
+    }
+};
+
+template <PrimitiveType TYPE>
+struct PrimitiveKernel; // what depends on the type of a primitive, resolved at compile time
+// Every kernel has:
+// - Shape, the class of the primitives of the type
+// - normalAt(shape, position, rayDir), the normalized normal at a hitpoint of a ray
+// - bounds(shape), its bounding box, for the types that have a BVH (all but planes)
+// and, except for spheres, which have their own arrays and SIMD kernels (see SphereArrays.cpp):
+// - FIELDS, the number of floats describing the geometry of one primitive in PrimitiveArrays
+// - store(shape, fields, count, k), which writes the fields of shape at position k of arrays
+//   of count primitives
+// - intersect(arrays, k, ray, tMin), the distance of the closest intersection of the ray with
+//   the primitive at position k that is not before tMin, infinity if there is none
+
+template <>
+struct PrimitiveKernel<SPHERE> {
+    typedef Sphere Shape;
+
+    static Vector3 normalAt(const Sphere& sphere, const Vector3& position, const Vector3& rayDir) {
+        return sphere.normalAt(position);
+    }
+
+    static AABB bounds(const Sphere& sphere) {
+        AABB bounds;
+        float extent = sphere.radius * 1.001f; // margin for the rounding errors of the intersection test
+        float center[3] = {sphere.center.x, sphere.center.y, sphere.center.z};
+        for (int axis = 0; axis < 3; axis++) {
+            bounds.min[axis] = center[axis] - extent;
+            bounds.max[axis] = center[axis] + extent;
+        }
+        return bounds;
+    }
+};
+
+template <>
+struct PrimitiveKernel<PLANE> {
+    typedef Plane Shape;
+    static constexpr int FIELDS = 4; // unit normal, and offset (dot(normal, point))
+
+    static void store(const Plane& plane, float* fields, int count, int k) {
+        Vector3 normal = Vector3::normalizeExact(plane.normal);
+        fields[0*count + k] = normal.x;
+        fields[1*count + k] = normal.y;
+        fields[2*count + k] = normal.z;
+        fields[3*count + k] = Vector3::dot(normal, plane.point);
+    }
+
+    static float intersect(const PrimitiveArrays& arrays, int k, const PrimitiveRay& ray, float tMin) {
+        float nx = arrays.field(0)[k], ny = arrays.field(1)[k], nz = arrays.field(2)[k];
+        float NdotDir = nx*ray.dir[0] + ny*ray.dir[1] + nz*ray.dir[2];
+        float t = (arrays.field(3)[k] - (nx*ray.origin[0] + ny*ray.origin[1] + nz*ray.origin[2])) / NdotDir;
+        return t >= tMin ? t : numeric_limits<float>::infinity(); // NaN (ray inside the plane) is a miss
+    }
+
+    static Vector3 normalAt(const Plane& plane, const Vector3& position, const Vector3& rayDir) {
+        Vector3 normal = Vector3::normalize(plane.normal);
+        return Vector3::dot(normal, rayDir) > 0 ? -normal : normal; // facing the ray
+    }
+};
+
+template <>
+struct PrimitiveKernel<BOX> {
+    typedef Box Shape;
+    static constexpr int FIELDS = 6; // min x, y, z and max x, y, z
+
+    static void store(const Box& box, float* fields, int count, int k) {
+        float corners[6] = {box.min.x, box.min.y, box.min.z, box.max.x, box.max.y, box.max.z};
+        for (int f = 0; f < FIELDS; f++) {
+            fields[f*count + k] = corners[f];
+        }
+    }
+
+    static float intersect(const PrimitiveArrays& arrays, int k, const PrimitiveRay& ray, float tMin) {
+        float tEntry = -numeric_limits<float>::infinity();
+        float tExit = numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3; axis++) { // slab test, see AABB::intersectRay
+            float t1 = (arrays.field(axis)[k] - ray.origin[axis]) * ray.invDir[axis];
+            float t2 = (arrays.field(axis + 3)[k] - ray.origin[axis]) * ray.invDir[axis];
+            tEntry = std::max(tEntry, std::min(t1, t2));
+            tExit = std::min(tExit, std::max(t1, t2));
+        }
+        if (tEntry > tExit) {
+            return numeric_limits<float>::infinity();
+        }
+        // rays starting inside the box (e.g. shadow rays) hit it where they leave it
+        return tEntry >= tMin ? tEntry : tExit >= tMin ? tExit : numeric_limits<float>::infinity();
+    }
+
+    static Vector3 normalAt(const Box& box, const Vector3& position, const Vector3& rayDir) {
+        // the face hit is the one the position is the closest to, relative to the size of the box
+        // (a flat box is a rectangle, whose normal faces the ray like the ones of planes)
+        float p[3] = {position.x, position.y, position.z};
+        float low[3] = {box.min.x, box.min.y, box.min.z};
+        float high[3] = {box.max.x, box.max.y, box.max.z};
+        float dir[3] = {rayDir.x, rayDir.y, rayDir.z};
+        int faceAxis = 0;
+        float faceSide = 0, faceDistance = numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3; axis++) {
+            float size = high[axis] - low[axis];
+            if (size <= 0) {
+                faceAxis = axis, faceSide = dir[axis] > 0 ? -1 : 1;
+                break;
+            }
+            float toLow = fabsf(p[axis] - low[axis]) / size;
+            float toHigh = fabsf(high[axis] - p[axis]) / size;
+            if (toLow < faceDistance) {
+                faceAxis = axis, faceSide = -1, faceDistance = toLow;
+            }
+            if (toHigh < faceDistance) {
+                faceAxis = axis, faceSide = 1, faceDistance = toHigh;
+            }
+        }
+        return Vector3(faceAxis == 0 ? faceSide : 0, faceAxis == 1 ? faceSide : 0, faceAxis == 2 ? faceSide : 0);
+    }
+
+    static AABB bounds(const Box& box) {
+        AABB bounds;
+        float low[3] = {box.min.x, box.min.y, box.min.z};
+        float high[3] = {box.max.x, box.max.y, box.max.z};
+        bounds.grow(low);
+        bounds.grow(high);
+        return bounds;
+    }
+};
+
+template <>
+struct PrimitiveKernel<TRIANGLE> {
+    typedef Triangle Shape;
+    static constexpr int FIELDS = 9; // vertex a, and edges b - a and c - a
+
+    static void store(const Triangle& triangle, float* fields, int count, int k) {
+        Vector3 edge1 = triangle.b - triangle.a;
+        Vector3 edge2 = triangle.c - triangle.a;
+        float values[9] = {triangle.a.x, triangle.a.y, triangle.a.z, edge1.x, edge1.y, edge1.z, edge2.x, edge2.y, edge2.z};
+        for (int f = 0; f < FIELDS; f++) {
+            fields[f*count + k] = values[f];
+        }
+    }
+
+    static float intersect(const PrimitiveArrays& arrays, int k, const PrimitiveRay& ray, float tMin) {
+        // Möller-Trumbore: solves origin + t*dir = a + u*edge1 + v*edge2 with Cramer's rule
+        const float* d = ray.dir;
+        float e1[3] = {arrays.field(3)[k], arrays.field(4)[k], arrays.field(5)[k]};
+        float e2[3] = {arrays.field(6)[k], arrays.field(7)[k], arrays.field(8)[k]};
+        float p[3] = {d[1]*e2[2] - d[2]*e2[1], d[2]*e2[0] - d[0]*e2[2], d[0]*e2[1] - d[1]*e2[0]}; // dir x edge2
+        float determinant = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+        if (determinant == 0) { // ray parallel to the triangle
+            return numeric_limits<float>::infinity();
+        }
+        float inverse = 1 / determinant;
+        float s[3] = {ray.origin[0] - arrays.field(0)[k], ray.origin[1] - arrays.field(1)[k], ray.origin[2] - arrays.field(2)[k]};
+        float u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2]) * inverse;
+        if (u < 0 || u > 1) {
+            return numeric_limits<float>::infinity();
+        }
+        float q[3] = {s[1]*e1[2] - s[2]*e1[1], s[2]*e1[0] - s[0]*e1[2], s[0]*e1[1] - s[1]*e1[0]}; // s x edge1
+        float v = (d[0]*q[0] + d[1]*q[1] + d[2]*q[2]) * inverse;
+        if (v < 0 || u + v > 1) {
+            return numeric_limits<float>::infinity();
+        }
+        float t = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) * inverse;
+        return t >= tMin ? t : numeric_limits<float>::infinity();
+    }
+
+    static Vector3 normalAt(const Triangle& triangle, const Vector3& position, const Vector3& rayDir) {
+        Vector3 normal = Vector3::normalize(Vector3::cross(triangle.b - triangle.a, triangle.c - triangle.a));
+        return Vector3::dot(normal, rayDir) > 0 ? -normal : normal; // facing the ray
+    }
+
+    static AABB bounds(const Triangle& triangle) {
+        return bounds(&triangle.a.x, &triangle.b.x, &triangle.c.x);
+    }
+
+    static AABB bounds(const float a[3], const float b[3], const float c[3]) { // also used by the mesh triangles
+        AABB bounds;
+        for (const float* vertex : {a, b, c}) {
+            bounds.grow(vertex);
+        }
+        float size = std::max(bounds.max[0] - bounds.min[0], std::max(bounds.max[1] - bounds.min[1], bounds.max[2] - bounds.min[2]));
+        for (int axis = 0; axis < 3; axis++) { // margin for the rounding errors of the intersection test
+            bounds.min[axis] -= size * .001f;
+            bounds.max[axis] += size * .001f;
+        }
+        return bounds;
+    }
+};
+
+template <PrimitiveType TYPE>
+int nearestPrimitive(const PrimitiveArrays& arrays, int begin, int end, const PrimitiveRay& ray, float tMin, float tMax,
+                     float& tNearest) {
+    /**
+     * Finds the closest intersection, between tMin and tMax, of a ray with the primitives
+     * [begin, end) of the arrays of a type, like nearestSphere() does for spheres
+     *
+     * @return The position of the closest primitive in the arrays (lowest position on ties), -1
+     *         if none is hit. tNearest is set to its distance.
+    */
+    int nearest = -1;
+    tNearest = numeric_limits<float>::infinity();
+    for (int k = begin; k < end; k++) {
+        float t = PrimitiveKernel<TYPE>::intersect(arrays, k, ray, tMin);
+        if (t <= tMax && t < tNearest) {
+            nearest = k;
+            tNearest = t;
+        }
+    }
+    return nearest;
+}
+
+struct MeshArrays {
+    /**
+     * The triangles of all the meshes of a compiled scene, stored mesh after mesh: one vertex
+     * buffer shared by the triangles, three vertex indices per triangle (in scene order), and
+     * the triangles in the order of the leaves of the BVH of their mesh
+    */
+    const float* vertices = nullptr; // x, y and z of every vertex
+    const int* triangles = nullptr; // indices in vertices (not multiplied by 3) of the vertices of triangle i: triangles[3*i..3*i+2]
+    const int* order = nullptr; // the triangle at each position, positions being in BVH order
+    int count = 0; // number of triangles
+
+    const float* vertex(int triangle, int corner) const {
+        return this->vertices + 3 * (size_t) this->triangles[3*triangle + corner];
+    }
+};
+
+int nearestMeshTriangle(const MeshArrays& arrays, int begin, int end, const PrimitiveRay& ray, float tMin, float tMax,
+                        float& tNearest) {
+    /**
+     * Finds the closest intersection, between tMin and tMax, of a ray with the mesh triangles at
+     * the positions [begin, end) of the arrays. Triangles are tested 4 at a time with the
+     * Möller-Trumbore test of PrimitiveKernel<TRIANGLE>, their vertices being gathered from the
+     * vertex buffer into SoA registers. Every operation is rounded like in the scalar test.
+     *
+     * @return The position of the closest triangle (lowest triangle index on ties), -1 if none is
+     *         hit. tNearest is set to its distance.
+    */
+    int nearest = -1;
+    tNearest = numeric_limits<float>::infinity();
+    Float4 ox(ray.origin[0]), oy(ray.origin[1]), oz(ray.origin[2]);
+    Float4 dx(ray.dir[0]), dy(ray.dir[1]), dz(ray.dir[2]);
+    Float4 zero(0.f), one(1.f), lowest(tMin), highest(tMax);
+    for (int k = begin; k < end; k += 4) {
+        alignas(16) float a[3][4], e1[3][4], e2[3][4]; // vertex a, and edges b - a and c - a
+        for (int lane = 0; lane < 4; lane++) {
+            int triangle = arrays.order[std::min(k + lane, end - 1)]; // missing lanes repeat the last triangle
+            const float* va = arrays.vertex(triangle, 0);
+            const float* vb = arrays.vertex(triangle, 1);
+            const float* vc = arrays.vertex(triangle, 2);
+            for (int axis = 0; axis < 3; axis++) {
+                a[axis][lane] = va[axis];
+                e1[axis][lane] = vb[axis] - va[axis];
+                e2[axis][lane] = vc[axis] - va[axis];
+            }
+        }
+        Float4 e1x = Float4::load(e1[0]), e1y = Float4::load(e1[1]), e1z = Float4::load(e1[2]);
+        Float4 e2x = Float4::load(e2[0]), e2y = Float4::load(e2[1]), e2z = Float4::load(e2[2]);
+        Float4 px = dy*e2z - dz*e2y, py = dz*e2x - dx*e2z, pz = dx*e2y - dy*e2x; // dir x edge2
+        // a determinant of 0 (ray parallel to the triangle) gives NaN or infinite u, a miss
+        Float4 inverse = one / (e1x*px + e1y*py + e1z*pz);
+        Float4 sx = ox - Float4::load(a[0]), sy = oy - Float4::load(a[1]), sz = oz - Float4::load(a[2]);
+        Float4 u = (sx*px + sy*py + sz*pz) * inverse;
+        Mask4 inside = (u >= zero) & (u <= one);
+        if (!inside.any()) { // most rays miss all the triangles of the leaf here
+            continue;
+        }
+        Float4 qx = sy*e1z - sz*e1y, qy = sz*e1x - sx*e1z, qz = sx*e1y - sy*e1x; // s x edge1
+        Float4 v = (dx*qx + dy*qy + dz*qz) * inverse;
+        Float4 t = (e2x*qx + e2y*qy + e2z*qz) * inverse;
+        int hits = (inside & (v >= zero) & (u + v <= one) & (t >= lowest) & (t <= highest)).bits();
+        if (hits == 0) {
+            continue;
+        }
+        alignas(16) float distances[4];
+        t.store(distances);
+        for (int lane = 0; lane < 4 && k + lane < end; lane++) {
+            bool closer = distances[lane] < tNearest
+                          || (distances[lane] == tNearest && nearest != -1 && arrays.order[k + lane] < arrays.order[nearest]);
+            if ((hits >> lane & 1) && closer) {
+                nearest = k + lane;
+                tNearest = distances[lane];
+            }
+        }
+    }
+    return nearest;
+}
+
+Vector3 meshNormalAt(const MeshArrays& arrays, int triangle, const Vector3& rayDir) {
+    /**
+     * Returns the normal of a mesh triangle, facing the ray like the normal of a Triangle
+    */
+    const float* va = arrays.vertex(triangle, 0);
+    const float* vb = arrays.vertex(triangle, 1);
+    const float* vc = arrays.vertex(triangle, 2);
+    Vector3 a(va[0], va[1], va[2]);
+    Triangle shape(a, Vector3(vb[0], vb[1], vb[2]), Vector3(vc[0], vc[1], vc[2]), 0);
+    return PrimitiveKernel<TRIANGLE>::normalAt(shape, a, rayDir);
+}
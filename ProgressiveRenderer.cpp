@@ -0,0 +1,312 @@
+#pragma once
+
+// Progressive (coarse to fine) rendering with adaptive refinement. This file is included by
+// main.cpp after the tracer functions (screenToProjPlane, closestHit, hitAttributes,
+// shadeHitpoint...) since it builds on them.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <vector>
+
+// custom files:
+#include <Color.cpp>
+#include <Framebuffer.cpp>
+#include <ThreadPool.cpp>
+
+using namespace std;
+
+COLORREF sampleColor(const CompiledScene& scene, float x, float y, int& primitive) {
+    /**
+     * Computes the color seen through any point of the canvas, like pixelColor() does for the
+     * pixel centers (both give the same color for integer coordinates)
+     *
+     * @param scene The scene to render
+     * @param x The x coordinate in the canvas, in pixels
+     * @param y The y coordinate in the canvas, in pixels
+     * @param primitive Set to the identifier of the primitive seen at this point, -1 for the background
+     * @return The color seen at x, y
+    */
+    Vector3 cameraPos = scene.cameraPos;
+    Vector3 rayDir = Vector3::normalize(screenToProjPlane(scene, x, y) - cameraPos);
+    HitRecord hit = closestHit(scene, cameraPos, rayDir, 1, numeric_limits<float>::infinity());
+    primitive = hit.index;
+    COLORREF color;
+    Vector3 hitPos, normal;
+    tie(color, hitPos, normal) = hitAttributes(scene, cameraPos, rayDir, hit);
+    return shadeHitpoint(scene, color, hitPos, normal);
+}
+
+struct ProgressivePass {
+    int step; // distance in pixels between the samples of the pass
+    long long primaryRays; // rays traced during the pass (refinement and anti-aliasing)
+    long long interpolated; // samples interpolated instead of traced
+    double milliseconds; // rendering time (previews excluded) when the pass was complete
+};
+
+class ProgressiveRenderer {
+    /**
+     * Renders an image in passes, from a grid of one sample every initialStep pixels down to
+     * one sample per pixel, the step being halved at each pass. A usable preview is available
+     * after every pass, the samples not computed yet taking the color of the closest sample
+     * above and to the left of them.
+     *
+     * After the first pass, a sample is only traced if the samples of the previous pass around
+     * it (its two neighbours on a grid line, or the four corners of its grid cell) see
+     * different primitives or have colors more than threshold apart, which happens on silhouettes
+     * and shadow edges. Elsewhere the sample is interpolated from them. Once every pixel has a
+     * sample, the pixels whose color or primitive differ from one of their neighbours (the edges
+     * of the image) are anti-aliased with aaGrid by aaGrid extra samples.
+     *
+     * The buffers are allocated once by the constructor, so rendering does not allocate.
+    */
+    public:
+        static constexpr int MAX_PASSES = 16;
+
+        int width, height; // resolution of the rendered images
+        int initialStep; // distance in pixels between the samples of the first pass, a power of 2
+        int threshold; // largest difference of a color channel (0 to 255) between samples that are interpolated
+        int aaGrid; // edge pixels get aaGrid by aaGrid samples, 1 or less disables anti-aliasing
+        vector<ProgressivePass> passes; // statistics of the passes of the last render
+
+        ProgressiveRenderer(int width, int height, int initialStep=8, int threshold=16, int aaGrid=2)
+            : samples(width, height) {
+            this->width = width;
+            this->height = height;
+            this->initialStep = initialStep;
+            this->threshold = threshold;
+            this->aaGrid = aaGrid;
+            this->samplePrimitives.assign((size_t) width * height, -1);
+            this->passes.reserve(MAX_PASSES);
+        }
+
+        static bool validStep(int step) {
+            /**
+             * Returns true if step can be used as the initial step of a progressive render
+            */
+            return step >= 1 && (step & (step - 1)) == 0 && step <= (1 << (MAX_PASSES - 2));
+        }
+
+        template <typename OnPass>
+        void render(const CompiledScene& scene, Framebuffer& framebuffer, ThreadPool& pool, OnPass onPass) {
+            /**
+             * Renders a scene progressively into a framebuffer
+             *
+             * @param scene The scene to render
+             * @param framebuffer The image to render into, its size must be width by height
+             * @param pool The threads to render with
+             * @param onPass Called with the index of the pass once the framebuffer holds its
+             *               preview, the last pass giving the final image
+            */
+            auto start = chrono::steady_clock::now();
+            double callbackTime = 0; // milliseconds spent in onPass, not counted in the pass times
+            this->passes.clear();
+            for (int step = this->initialStep; step >= 1; step /= 2) {
+                this->tracedRays = 0;
+                this->interpolatedSamples = 0;
+                bool first = step == this->initialStep;
+                forEachTile(pool, [&](int x0, int y0, int x1, int y1) {
+                    long long rays = 0, interpolated = 0;
+                    for (int y = (y0 + step - 1) / step * step; y < y1; y += step) {
+                        for (int x = (x0 + step - 1) / step * step; x < x1; x += step) {
+                            if (first) {
+                                traceSample(scene, x, y);
+                                rays++;
+                            }
+                            else if (((x | y) & step) != 0) { // the samples of the previous pass (multiples of 2*step) are kept
+                                bool traced = refineSample(scene, x, y, step);
+                                rays += traced;
+                                interpolated += !traced;
+                            }
+                        }
+                    }
+                    this->tracedRays += rays;
+                    this->interpolatedSamples += interpolated;
+                });
+                if (step > 1) {
+                    fillPreview(framebuffer, pool, step);
+                }
+                else {
+                    antialias(scene, framebuffer, pool);
+                }
+                auto passEnd = chrono::steady_clock::now();
+                double elapsed = chrono::duration<double, milli>(passEnd - start).count() - callbackTime;
+                this->passes.push_back({step, this->tracedRays, this->interpolatedSamples, elapsed});
+                onPass((int) this->passes.size() - 1);
+                callbackTime += chrono::duration<double, milli>(chrono::steady_clock::now() - passEnd).count();
+            }
+        }
+
+        long long totalRays() const {
+            /**
+             * Returns the number of primary rays traced by the last render
+            */
+            long long rays = 0;
+            for (const ProgressivePass& pass : this->passes) {
+                rays += pass.primaryRays;
+            }
+            return rays;
+        }
+
+    private:
+        Framebuffer samples; // color of the samples computed so far, one per pixel
+        vector<int> samplePrimitives; // primitive seen by every sample, -1 for the background
+        atomic<long long> tracedRays{0}; // counters of the pass being rendered
+        atomic<long long> interpolatedSamples{0};
+
+        template <typename TileTask>
+        void forEachTile(ThreadPool& pool, TileTask tileTask) {
+            /**
+             * Calls tileTask(x0, y0, x1, y1) for every tile of the image, on the threads of the pool
+            */
+            int tilesX = (this->width + tileSize - 1) / tileSize;
+            int tilesY = (this->height + tileSize - 1) / tileSize;
+            pool.run(tilesX * tilesY, [&](int tile) {
+                int x0 = (tile % tilesX) * tileSize;
+                int y0 = (tile / tilesX) * tileSize;
+                tileTask(x0, y0, min(x0 + tileSize, this->width), min(y0 + tileSize, this->height));
+            });
+        }
+
+        void traceSample(const CompiledScene& scene, int x, int y) {
+            size_t i = (size_t) y * this->width + x;
+            this->samples.pixels[i] = sampleColor(scene, x, y, this->samplePrimitives[i]);
+        }
+
+        bool similarSamples(const size_t* indices, int count) const {
+            /**
+             * Returns true if the samples samples.pixels[indices[k]] see the same primitive and
+             * their color channels are at most threshold apart
+            */
+            int primitive = this->samplePrimitives[indices[0]];
+            COLORREF first = this->samples.pixels[indices[0]];
+            bool equal = true;
+            for (int k = 1; k < count; k++) {
+                if (this->samplePrimitives[indices[k]] != primitive) {
+                    return false;
+                }
+                equal = equal && this->samples.pixels[indices[k]] == first;
+            }
+            if (equal) { // flat regions, the most common case
+                return true;
+            }
+            int low[3] = {255, 255, 255}, high[3] = {0, 0, 0};
+            for (int k = 0; k < count; k++) {
+                COLORREF color = this->samples.pixels[indices[k]];
+                int channels[3] = {GetRValue(color), GetGValue(color), GetBValue(color)};
+                for (int c = 0; c < 3; c++) {
+                    low[c] = min(low[c], channels[c]);
+                    high[c] = max(high[c], channels[c]);
+                }
+            }
+            for (int c = 0; c < 3; c++) {
+                if (high[c] - low[c] > this->threshold) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool refineSample(const CompiledScene& scene, int x, int y, int step) {
+            /**
+             * Computes a sample added by the pass of the given step, from the samples of the
+             * previous pass (2*step apart) around it: they are interpolated if they are similar,
+             * otherwise the sample is traced. Samples next to the right or bottom border of the
+             * image, which lack some of these neighbours, are always traced.
+             *
+             * @return true if the sample was traced
+            */
+            bool oddX = (x & step) != 0, oddY = (y & step) != 0; // not on the grid of the previous pass
+            int x0 = oddX ? x - step : x, x1 = oddX ? x + step : x;
+            int y0 = oddY ? y - step : y, y1 = oddY ? y + step : y;
+            if (x1 >= this->width || y1 >= this->height) {
+                traceSample(scene, x, y);
+                return true;
+            }
+            size_t indices[4] = {};
+            int count = 0;
+            for (int ny = y0; ny <= y1; ny += 2*step) {
+                for (int nx = x0; nx <= x1; nx += 2*step) {
+                    indices[count++] = (size_t) ny * this->width + nx;
+                }
+            }
+            if (!similarSamples(indices, count)) {
+                traceSample(scene, x, y);
+                return true;
+            }
+            int sum[3] = {0, 0, 0};
+            for (int k = 0; k < count; k++) {
+                COLORREF color = this->samples.pixels[indices[k]];
+                sum[0] += GetRValue(color);
+                sum[1] += GetGValue(color);
+                sum[2] += GetBValue(color);
+            }
+            size_t i = (size_t) y * this->width + x;
+            this->samples.pixels[i] = RGB((sum[0] + count/2) / count, (sum[1] + count/2) / count, (sum[2] + count/2) / count);
+            this->samplePrimitives[i] = this->samplePrimitives[indices[0]];
+            return false;
+        }
+
+        void fillPreview(Framebuffer& framebuffer, ThreadPool& pool, int step) {
+            /**
+             * Fills the framebuffer with the samples computed so far, every pixel taking the
+             * color of the sample of its grid cell
+            */
+            forEachTile(pool, [&](int x0, int y0, int x1, int y1) {
+                for (int y = y0; y < y1; y++) {
+                    for (int x = x0; x < x1; x++) {
+                        framebuffer.setPixel(x, y, this->samples.getPixel(x & -step, y & -step));
+                    }
+                }
+            });
+        }
+
+        bool isEdge(int x, int y) const {
+            /**
+             * Returns true if the sample of pixel (x, y) differs from the one of a pixel next to it
+            */
+            size_t i = (size_t) y * this->width + x;
+            size_t pairs[4][2] = {{i, i - 1}, {i, i + 1}, {i, i - this->width}, {i, i + this->width}};
+            bool inside[4] = {x > 0, x + 1 < this->width, y > 0, y + 1 < this->height};
+            for (int k = 0; k < 4; k++) {
+                if (inside[k] && !similarSamples(pairs[k], 2)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void antialias(const CompiledScene& scene, Framebuffer& framebuffer, ThreadPool& pool) {
+            /**
+             * Writes the final image: edge pixels get the average of aaGrid by aaGrid samples
+             * spread over the pixel, the others keep their single sample
+            */
+            int grid = this->aaGrid;
+            forEachTile(pool, [&](int x0, int y0, int x1, int y1) {
+                long long rays = 0;
+                for (int y = y0; y < y1; y++) {
+                    for (int x = x0; x < x1; x++) {
+                        if (grid <= 1 || !isEdge(x, y)) {
+                            framebuffer.setPixel(x, y, this->samples.getPixel(x, y));
+                            continue;
+                        }
+                        int sum[3] = {0, 0, 0};
+                        for (int j = 0; j < grid; j++) {
+                            for (int i = 0; i < grid; i++) {
+                                int primitive;
+                                COLORREF color = sampleColor(scene, x + (i + .5f) / grid - .5f, y + (j + .5f) / grid - .5f, primitive);
+                                sum[0] += GetRValue(color);
+                                sum[1] += GetGValue(color);
+                                sum[2] += GetBValue(color);
+                            }
+                        }
+                        int count = grid * grid;
+                        rays += count;
+                        framebuffer.setPixel(x, y, RGB((sum[0] + count/2) / count, (sum[1] + count/2) / count, (sum[2] + count/2) / count));
+                    }
+                }
+                this->tracedRays += rays;
+            });
+        }
+};
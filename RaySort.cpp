@@ -0,0 +1,136 @@
+#pragma once
+
+// Ray reordering for the wavefront renderer. This file is included by Wavefront.cpp.
+//
+// Secondary and shadow rays start from hitpoints all over the scene and go every which way, so
+// neighbouring rays of a queue touch unrelated BVH nodes and primitives. Sorting them by a key
+// made of their direction octant and of the Morton code of their origin puts rays going the same
+// way from the same region next to each other, which then walk the same nodes while they are
+// still in the cache.
+
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
+// custom files:
+#include <ThreadPool.cpp>
+#include <Vector3.cpp>
+
+using namespace std;
+
+static uint32_t spreadBits(uint32_t value) {
+    /**
+     * Moves the 9 low bits of value 3 bits apart (bit k goes to bit 3k), to interleave them
+     * with the bits of two other coordinates
+    */
+    value &= 0x1ff;
+    value = (value | (value << 16)) & 0x030000ff;
+    value = (value | (value << 8)) & 0x0300f00f;
+    value = (value | (value << 4)) & 0x030c30c3;
+    value = (value | (value << 2)) & 0x09249249;
+    return value;
+}
+
+uint32_t rayKey(const Vector3& origin, const Vector3& dir, const Vector3& low, const Vector3& scale) {
+    /**
+     * Returns the sort key of a ray: the octant of its direction in the 3 high bits, then the
+     * Morton code of its origin on a 512x512x512 grid
+     *
+     * @param low The corner of the grid (smallest coordinates of the origins)
+     * @param scale The number of cells per unit along each axis
+    */
+    auto cell = [](float coordinate) {
+        return (uint32_t) max(0.f, min(coordinate, 511.f));
+    };
+    uint32_t octant = (dir.x < 0 ? 4 : 0) | (dir.y < 0 ? 2 : 0) | (dir.z < 0 ? 1 : 0);
+    uint32_t morton = spreadBits(cell((origin.x - low.x) * scale.x)) << 2 | spreadBits(cell((origin.y - low.y) * scale.y)) << 1
+                      | spreadBits(cell((origin.z - low.z) * scale.z));
+    return octant << 27 | morton;
+}
+
+class RaySorter {
+    /**
+     * Parallel least significant digit radix sort of 30 bits keys, 8 bits per pass. The queue
+     * itself is not moved: the sorter gives the order to trace it in. The sort is stable, so
+     * the order only depends on the keys, not on the threads. The buffers are allocated by
+     * reserve(), so sorting does not allocate.
+    */
+    public:
+        static constexpr int KEY_BITS = 30;
+        static constexpr int DIGIT_BITS = 8;
+        static constexpr int BLOCK_SIZE = 4096; // keys per task
+
+        vector<uint32_t> keys; // set by the caller for the count elements to sort, then sorted
+        vector<int> order; // positions in the queue, in key order once sorted
+
+        void reserve(size_t capacity) {
+            if (this->keys.size() < capacity) {
+                this->keys.resize(capacity);
+                this->order.resize(capacity);
+                this->sortedKeys.resize(capacity);
+                this->sortedOrder.resize(capacity);
+                this->counts.resize(((capacity + BLOCK_SIZE - 1) / BLOCK_SIZE) << DIGIT_BITS);
+            }
+        }
+
+        void sort(ThreadPool& pool, int count) {
+            /**
+             * Sorts the first count keys, order ending up as the queue positions in key order.
+             * Digits shared by all the keys are skipped.
+            */
+            const int digits = 1 << DIGIT_BITS;
+            int blockCount = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            pool.run(blockCount, [&](int block) {
+                int* order = this->order.data();
+                for (int i = block * BLOCK_SIZE, end = min(count, (block + 1) * BLOCK_SIZE); i < end; i++) {
+                    order[i] = i;
+                }
+            });
+            for (int shift = 0; shift < KEY_BITS; shift += DIGIT_BITS) {
+                // histogram of the digit in every block
+                pool.run(blockCount, [&](int block) {
+                    const uint32_t* keys = this->keys.data();
+                    int* counts = this->counts.data() + ((size_t) block << DIGIT_BITS);
+                    fill(counts, counts + digits, 0);
+                    for (int i = block * BLOCK_SIZE, end = min(count, (block + 1) * BLOCK_SIZE); i < end; i++) {
+                        counts[(keys[i] >> shift) & (digits - 1)]++;
+                    }
+                });
+                // where every block writes every digit: digit by digit, then block by block
+                int position = 0;
+                bool shared = false;
+                for (int digit = 0; digit < digits; digit++) {
+                    int start = position;
+                    for (int block = 0; block < blockCount; block++) {
+                        int& counter = this->counts[((size_t) block << DIGIT_BITS) + digit];
+                        int keys = counter;
+                        counter = position;
+                        position += keys;
+                    }
+                    shared = shared || position - start == count;
+                }
+                if (shared) { // nothing to move
+                    continue;
+                }
+                pool.run(blockCount, [&](int block) {
+                    const uint32_t* keys = this->keys.data();
+                    const int* order = this->order.data();
+                    uint32_t* sortedKeys = this->sortedKeys.data();
+                    int* sortedOrder = this->sortedOrder.data();
+                    int* offsets = this->counts.data() + ((size_t) block << DIGIT_BITS);
+                    for (int i = block * BLOCK_SIZE, end = min(count, (block + 1) * BLOCK_SIZE); i < end; i++) {
+                        int position = offsets[(keys[i] >> shift) & (digits - 1)]++;
+                        sortedKeys[position] = keys[i];
+                        sortedOrder[position] = order[i];
+                    }
+                });
+                swap(this->keys, this->sortedKeys);
+                swap(this->order, this->sortedOrder);
+            }
+        }
+
+    private:
+        vector<uint32_t> sortedKeys; // the other buffers of every pass
+        vector<int> sortedOrder;
+        vector<int> counts; // 2^DIGIT_BITS counters per block
+};
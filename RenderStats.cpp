@@ -0,0 +1,188 @@
+#pragma once
+
+// Per-pixel render statistics, only collected when the program is compiled with RENDER_STATS
+// defined (otherwise every STATS() statement compiles to nothing). This file is included by
+// main.cpp after CompiledScene.cpp, before the tracer functions it instruments.
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// custom files:
+#include <Color.cpp>
+#include <Framebuffer.cpp>
+#include <ImageWriter.cpp>
+
+using namespace std;
+
+#ifdef RENDER_STATS
+#define STATS(statement) statement
+#else
+#define STATS(statement)
+#endif
+
+struct PixelStats {
+    /**
+     * What rendering a single pixel cost
+    */
+    long long primaryRays = 0;
+    long long shadowRays = 0;
+    long long intersectionTests = 0; // ray-primitive tests, of any kind of ray
+    long long hits = 0; // rays that hit a primitive (blocked shadow rays included)
+    long long misses = 0;
+    double traceTime = 0; // nanoseconds spent finding the primary hitpoint
+    double shadeTime = 0; // nanoseconds spent shading it, shadow rays included
+    double totalTime = 0; // nanoseconds spent on the whole pixel
+    int primitive = -1; // primitive hit by the primary ray, -1 for the background
+    chrono::steady_clock::time_point start; // when the pixel was started
+};
+
+double nanosecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+class RenderStats {
+    /**
+     * The statistics of every pixel of a render, filled by the render loops through
+     * beginPixelStats() and endPixelStats()
+    */
+    public:
+        int width, height;
+        vector<PixelStats> pixels; // pixel (x, y) is pixels[y*width + x]
+
+        RenderStats(int width, int height) {
+            this->width = width;
+            this->height = height;
+            this->pixels.resize((size_t) width * height);
+        }
+
+        PixelStats total() const {
+            /**
+             * Returns the sum of the statistics of every pixel
+            */
+            PixelStats sum;
+            for (const PixelStats& pixel : this->pixels) {
+                sum.primaryRays += pixel.primaryRays;
+                sum.shadowRays += pixel.shadowRays;
+                sum.intersectionTests += pixel.intersectionTests;
+                sum.hits += pixel.hits;
+                sum.misses += pixel.misses;
+                sum.traceTime += pixel.traceTime;
+                sum.shadeTime += pixel.shadeTime;
+                sum.totalTime += pixel.totalTime;
+            }
+            return sum;
+        }
+
+        double heatmapScale() const {
+            /**
+             * Returns the pixel time shown as the hottest color of the heatmap: the 99th
+             * percentile, so that a few outliers do not make the rest of the map black
+            */
+            vector<double> times;
+            for (const PixelStats& pixel : this->pixels) {
+                times.push_back(pixel.totalTime);
+            }
+            if (times.empty()) {
+                return 1;
+            }
+            size_t percentile = times.size() * 99 / 100;
+            nth_element(times.begin(), times.begin() + percentile, times.end());
+            return max(times[percentile], 1.);
+        }
+
+        bool writeHeatmap(const string& path) const {
+            /**
+             * Writes the time spent on every pixel as an image, going from black (cheap) to blue,
+             * red, yellow and white (heatmapScale() nanoseconds or more)
+            */
+            static const float ramp[5][3] = {{0, 0, 0}, {0, 0, 255}, {255, 0, 0}, {255, 255, 0}, {255, 255, 255}};
+            double scale = this->heatmapScale();
+            Framebuffer heatmap(this->width, this->height, RGB(0, 0, 0));
+            for (int y = 0; y < this->height; y++) {
+                for (int x = 0; x < this->width; x++) {
+                    float cost = (float) min(1., this->pixels[(size_t) y*this->width + x].totalTime / scale) * 4;
+                    int stop = min(3, (int) cost);
+                    float blend = cost - stop;
+                    float color[3];
+                    for (int c = 0; c < 3; c++) {
+                        color[c] = ramp[stop][c] + (ramp[stop+1][c] - ramp[stop][c]) * blend;
+                    }
+                    heatmap.setPixel(x, y, RGB(color[0], color[1], color[2]));
+                }
+            }
+            return writeImage(heatmap, path);
+        }
+
+        void printSummary(ostream& out, const CompiledScene& scene) const {
+            /**
+             * Prints the totals of the render, the time per pixel split by stage and the
+             * primitives whose pixels cost the most
+            */
+            PixelStats sum = this->total();
+            double pixelCount = max((double) this->pixels.size(), 1.);
+            long long rays = sum.primaryRays + sum.shadowRays;
+            out << "Render statistics (" << this->width << "x" << this->height << " pixels):" << endl;
+            out << "  rays: " << sum.primaryRays << " primary, " << sum.shadowRays << " shadow ("
+                << sum.shadowRays / pixelCount << " per pixel)" << endl;
+            out << "  intersection tests: " << sum.intersectionTests << " (" << (double) sum.intersectionTests / max(rays, 1LL)
+                << " per ray)" << endl;
+            out << "  hits: " << sum.hits << ", misses: " << sum.misses << " ("
+                << 100. * sum.hits / max(sum.hits + sum.misses, 1LL) << "% hits)" << endl;
+            out << "  time per pixel: " << sum.totalTime / pixelCount << " ns (trace " << sum.traceTime / pixelCount
+                << " ns, shading " << sum.shadeTime / pixelCount << " ns)" << endl;
+
+            // time of the pixels of every primitive, the background being the last entry
+            int primitiveCount = scene.primitiveCount();
+            vector<double> time(primitiveCount + 1, 0);
+            vector<long long> count(primitiveCount + 1, 0);
+            for (const PixelStats& pixel : this->pixels) {
+                int entry = pixel.primitive == -1 ? primitiveCount : pixel.primitive;
+                time[entry] += pixel.totalTime;
+                count[entry]++;
+            }
+            vector<int> order;
+            for (int i = 0; i <= primitiveCount; i++) {
+                if (count[i] > 0) {
+                    order.push_back(i);
+                }
+            }
+            sort(order.begin(), order.end(), [&](int a, int b) { return time[a] > time[b]; });
+            out << "  most expensive parts of the image:" << endl;
+            for (size_t k = 0; k < order.size() && k < 5; k++) {
+                int i = order[k];
+                if (i == primitiveCount) {
+                    out << "    background";
+                }
+                else {
+                    out << "    " << scene.describePrimitive(i);
+                }
+                out << ": " << 100. * time[i] / max(sum.totalTime, 1.) << "% of the time, " << count[i] << " pixels, "
+                    << time[i] / count[i] << " ns per pixel" << endl;
+            }
+            out << "  heatmap: white is " << this->heatmapScale() << " ns per pixel or more" << endl;
+        }
+};
+
+#ifdef RENDER_STATS
+static thread_local PixelStats pixelStats; // statistics of the pixel being rendered by this thread
+static RenderStats* renderStats = nullptr; // where the render loops store pixelStats, null if nobody wants them
+
+void beginPixelStats() {
+    pixelStats = PixelStats();
+    pixelStats.start = chrono::steady_clock::now();
+}
+
+void endPixelStats(int x, int y) {
+    /**
+     * Stores the statistics of pixel (x, y), the time since beginPixelStats() being added to
+     * its total time
+    */
+    pixelStats.totalTime += nanosecondsSince(pixelStats.start);
+    if (renderStats != nullptr) {
+        renderStats->pixels[(size_t) y*renderStats->width + x] = pixelStats;
+    }
+}
+#endif
@@ -0,0 +1,766 @@
+#pragma once
+
+// Scene files. This file is included by main.cpp after CompiledScene.cpp, since it reads and
+// writes both Scene and CompiledScene.
+//
+// Two formats are supported:
+// - Text scenes (any extension but .rtscene), one element per line, # starting a comment:
+//       camera <x> <y> <z>
+//       viewport <width> <height> <distance>
+//       material <reflective> <transparency> <refractive index>   (numbered from 0 in file order, see
+//                                                                  Material in Primitives.cpp)
+//       sphere <x> <y> <z> <radius> <r> <g> <b>
+//       plane <x> <y> <z> <nx> <ny> <nz> <r> <g> <b>   (a point of the plane and its normal)
+//       box <minx> <miny> <minz> <maxx> <maxy> <maxz> <r> <g> <b>
+//       triangle <ax> <ay> <az> <bx> <by> <bz> <cx> <cy> <cz> <r> <g> <b>
+//       mesh <file.obj> <r> <g> <b>   (a triangle mesh read from an OBJ file, see ObjFile.cpp,
+//                                      whose path is relative to the directory of the scene)
+//   (every sphere, plane, box, triangle and mesh line can end with "material <index>", a
+//    material defined above it, the primitive being matte otherwise)
+//       light ambient <intensity>
+//       light point <intensity> <x> <y> <z>
+//       light directional <intensity> <dx> <dy> <dz>   ("sun" can be used instead of "directional")
+//       prototype   (starts the geometry of a prototype, numbered from 0 in file order: sphere,
+//       ...          box, triangle and mesh lines up to the next "end" line, see Instances.cpp)
+//       end
+//       instance <prototype> [translate <x> <y> <z>] [rotate <ax> <ay> <az> <degrees>] [scale <s>]
+//                [matrix <12 numbers, row by row>] [color <r> <g> <b>]
+//           (a copy of a prototype defined above it, moved by the transforms in the given order,
+//            and painted with color if it is given)
+//   They are read line by line, then compiled like any other Scene.
+// - Binary scenes (.rtscene): a header followed by the memory block of a CompiledScene (primitives,
+//   lights, BVHs and primitive arrays), in the byte order of the machine that wrote it, then by a
+//   header and a block for each of its prototypes. The file is
+//   memory mapped and rendered from directly: nothing is parsed, copied or built when loading,
+//   pages being read from the disk the first time rays touch them. Binary files are trusted,
+//   only their header is checked.
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// custom files:
+#include <Color.cpp> // for COLORREF (and windows.h on Windows)
+#include <ObjFile.cpp> // meshes of text scenes
+
+using namespace std;
+
+bool isBinarySceneFile(const string& path) {
+    /**
+     * Returns true if path names a binary scene (.rtscene extension)
+    */
+    const string extension = ".rtscene";
+    return path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+static string readWord(const char*& cursor) {
+    /**
+     * Reads the next word of a line of a text scene, moving cursor after it
+    */
+    while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r') {
+        cursor++;
+    }
+    const char* start = cursor;
+    while (*cursor != '\0' && *cursor != ' ' && *cursor != '\t' && *cursor != '\r') {
+        cursor++;
+    }
+    return string(start, cursor);
+}
+
+static bool validColor(const float* values) {
+    /**
+     * Returns true if values holds the three channels of a color of a text scene, integers
+     * between 0 and 255
+    */
+    for (int c = 0; c < 3; c++) {
+        if (!(values[c] >= 0 && values[c] <= 255 && values[c] == (int) values[c])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static COLORREF readColor(const float* values) {
+    return RGB((int) values[0], (int) values[1], (int) values[2]);
+}
+
+static string directoryOf(const string& path) {
+    /**
+     * Returns the directory of a file, with its final separator ("" for a file of the working
+     * directory)
+    */
+    size_t separator = path.find_last_of("/\\");
+    return separator == string::npos ? "" : path.substr(0, separator + 1);
+}
+
+static bool readNumbers(const char*& cursor, float* values, int count) {
+    /**
+     * Reads the next count numbers of a line of a text scene, moving cursor after them
+     *
+     * @return false if there are less than count numbers
+    */
+    for (int k = 0; k < count; k++) {
+        char* end;
+        values[k] = strtof(cursor, &end);
+        if (end == cursor) {
+            return false;
+        }
+        cursor = end;
+    }
+    return true;
+}
+
+static bool readMaterial(const char*& cursor, int& material, size_t materialCount) {
+    /**
+     * Reads the optional "material <index>" ending a primitive line of a text scene, leaving
+     * material as it is (-1, matte) if there is none
+     *
+     * @return false if it is not a material defined above the line
+    */
+    const char* start = cursor;
+    string word = readWord(cursor);
+    if (word.empty()) {
+        cursor = start;
+        return true;
+    }
+    float index;
+    if (word != "material" || !readNumbers(cursor, &index, 1) || index != (int) index || index < 0 || index >= (float) materialCount) {
+        return false;
+    }
+    material = (int) index;
+    return true;
+}
+
+bool loadTextScene(const string& path, Scene& scene) {
+    /**
+     * Reads a text scene, line by line. The camera is at the origin and the viewport is 1 by 1
+     * at a distance of 1 unless the file says otherwise.
+     *
+     * @param path The file to read
+     * @param scene Set to the scene of the file
+     * @return false if the file could not be read or has an error (reported on cerr)
+    */
+    ifstream file(path);
+    if (!file) {
+        cerr << "Could not open " << path << endl;
+        return false;
+    }
+    scene = Scene(Vector3(0, 0, 0), 1, 1, 1, {}, {});
+    bool inPrototype = false; // reading the geometry of scene.prototypes.back()
+    int prototypeLine = 0;
+    string line;
+    for (int lineNumber = 1; getline(file, line); lineNumber++) {
+        size_t comment = line.find('#');
+        if (comment != string::npos) {
+            line.resize(comment);
+        }
+        const char* cursor = line.c_str();
+        string keyword = readWord(cursor);
+        if (keyword.empty()) {
+            continue; // empty line
+        }
+        Prototype* prototype = inPrototype ? &scene.prototypes.back() : nullptr; // where the geometry goes
+        vector<Sphere>& spheres = prototype != nullptr ? prototype->spheres : scene.spheres;
+        vector<Box>& boxes = prototype != nullptr ? prototype->boxes : scene.boxes;
+        vector<Triangle>& triangles = prototype != nullptr ? prototype->triangles : scene.triangles;
+        vector<Mesh>& meshes = prototype != nullptr ? prototype->meshes : scene.meshes;
+        if (inPrototype && keyword != "sphere" && keyword != "box" && keyword != "triangle" && keyword != "mesh" && keyword != "end") {
+            cerr << path << ":" << lineNumber << ": " << keyword << " in a prototype (only sphere, box, triangle and mesh can be)" << endl;
+            return false;
+        }
+        float values[12];
+        bool valid;
+        if (keyword == "camera") {
+            valid = readNumbers(cursor, values, 3);
+            scene.cameraPos = Vector3(values[0], values[1], values[2]);
+        }
+        else if (keyword == "viewport") {
+            valid = readNumbers(cursor, values, 3);
+            scene.projPlaneWidth = values[0];
+            scene.projPlaneHeight = values[1];
+            scene.projPlaneDistance = values[2];
+        }
+        else if (keyword == "sphere") {
+            valid = readNumbers(cursor, values, 7) && values[3] >= 0 && validColor(values + 4);
+            spheres.push_back(Sphere(Vector3(values[0], values[1], values[2]), values[3], readColor(values + 4)));
+            valid = valid && readMaterial(cursor, spheres.back().material, scene.materials.size());
+        }
+        else if (keyword == "plane") {
+            valid = readNumbers(cursor, values, 9) && validColor(values + 6)
+                    && (values[3] != 0 || values[4] != 0 || values[5] != 0);
+            scene.planes.push_back(Plane(Vector3(values[0], values[1], values[2]), Vector3(values[3], values[4], values[5]),
+                                         readColor(values + 6)));
+            valid = valid && readMaterial(cursor, scene.planes.back().material, scene.materials.size());
+        }
+        else if (keyword == "box") {
+            valid = readNumbers(cursor, values, 9) && validColor(values + 6)
+                    && values[0] <= values[3] && values[1] <= values[4] && values[2] <= values[5];
+            boxes.push_back(Box(Vector3(values[0], values[1], values[2]), Vector3(values[3], values[4], values[5]),
+                                readColor(values + 6)));
+            valid = valid && readMaterial(cursor, boxes.back().material, scene.materials.size());
+        }
+        else if (keyword == "triangle") {
+            valid = readNumbers(cursor, values, 12) && validColor(values + 9);
+            triangles.push_back(Triangle(Vector3(values[0], values[1], values[2]), Vector3(values[3], values[4], values[5]),
+                                         Vector3(values[6], values[7], values[8]), readColor(values + 9)));
+            valid = valid && readMaterial(cursor, triangles.back().material, scene.materials.size());
+        }
+        else if (keyword == "mesh") {
+            string meshPath = readWord(cursor);
+            valid = !meshPath.empty() && readNumbers(cursor, values, 3) && validColor(values);
+            if (valid) {
+                bool absolute = meshPath[0] == '/' || meshPath[0] == '\\' || (meshPath.size() > 1 && meshPath[1] == ':');
+                meshes.push_back(Mesh());
+                if (!loadObj(absolute ? meshPath : directoryOf(path) + meshPath, meshes.back())) {
+                    cerr << path << ":" << lineNumber << ": could not load mesh " << meshPath << endl;
+                    return false;
+                }
+                meshes.back().color = readColor(values);
+                valid = readMaterial(cursor, meshes.back().material, scene.materials.size());
+            }
+        }
+        else if (keyword == "material") {
+            valid = readNumbers(cursor, values, 3) && values[0] >= 0 && values[1] >= 0 && values[0] + values[1] <= 1 && values[2] > 0;
+            scene.materials.push_back(Material(values[0], values[1], values[2]));
+        }
+        else if (keyword == "light") {
+            Light light(readWord(cursor), 0, Vector3(0, 0, 0), Vector3(0, 0, 0));
+            LightType type;
+            valid = parseLightType(light.type, type) && readNumbers(cursor, values, type == AMBIENT_LIGHT ? 1 : 4);
+            if (valid) {
+                light.intensity = values[0];
+            }
+            if (valid && type == POINT_LIGHT) {
+                light.position = Vector3(values[1], values[2], values[3]);
+            }
+            else if (valid && type == DIRECTIONAL_LIGHT) {
+                light.direction = Vector3(values[1], values[2], values[3]);
+            }
+            scene.lights.push_back(light);
+        }
+        else if (keyword == "prototype" || keyword == "end") {
+            valid = (keyword == "end") == inPrototype;
+            inPrototype = keyword == "prototype";
+            if (inPrototype) {
+                scene.prototypes.push_back(Prototype());
+                prototypeLine = lineNumber;
+            }
+        }
+        else if (keyword == "instance") {
+            Instance instance;
+            valid = readNumbers(cursor, values, 1) && values[0] == (int) values[0] && values[0] >= 0
+                    && values[0] < (float) scene.prototypes.size();
+            instance.prototype = valid ? (int) values[0] : 0;
+            for (string word = readWord(cursor); valid && !word.empty(); word = readWord(cursor)) {
+                if (word == "translate" && readNumbers(cursor, values, 3)) {
+                    instance.transform = Transform::translation(Vector3(values[0], values[1], values[2])) * instance.transform;
+                }
+                else if (word == "rotate" && readNumbers(cursor, values, 4) && (values[0] != 0 || values[1] != 0 || values[2] != 0)) {
+                    instance.transform = Transform::rotation(Vector3(values[0], values[1], values[2]), values[3]) * instance.transform;
+                }
+                else if (word == "scale" && readNumbers(cursor, values, 1)) {
+                    instance.transform = Transform::scaling(values[0]) * instance.transform;
+                }
+                else if (word == "matrix" && readNumbers(cursor, values, 12)) {
+                    Transform matrix;
+                    memcpy(matrix.m, values, sizeof(matrix.m));
+                    instance.transform = matrix * instance.transform;
+                }
+                else if (word == "color" && readNumbers(cursor, values, 3) && validColor(values)) {
+                    instance.hasColor = true;
+                    instance.color = readColor(values);
+                }
+                else {
+                    valid = false;
+                }
+            }
+            Transform inverse;
+            valid = valid && instance.transform.inverse(inverse); // flat transforms are refused
+            scene.instances.push_back(instance);
+        }
+        else {
+            cerr << path << ":" << lineNumber << ": unknown element \"" << keyword << "\"" << endl;
+            return false;
+        }
+        if (!valid || !readWord(cursor).empty()) {
+            cerr << path << ":" << lineNumber << ": invalid " << keyword << ": " << line << endl;
+            return false;
+        }
+    }
+    if (inPrototype) {
+        cerr << path << ":" << prototypeLine << ": prototype without end" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool writeTextScene(const Scene& scene, const string& path) {
+    /**
+     * Writes a scene as a text scene, with enough digits for every float to be read back exactly.
+     * Meshes are written next to it as OBJ files (scene_mesh0.obj, scene_mesh1.obj... for
+     * scene.txt, and scene_prototype0_mesh0.obj... for the meshes of the prototypes).
+     *
+     * @return false if the file or one of its meshes could not be written
+    */
+    ofstream file(path);
+    file << setprecision(numeric_limits<float>::max_digits10);
+    file << "# scene written by the raytracer, see SceneFile.cpp for the format" << endl;
+    file << "camera " << scene.cameraPos.x << " " << scene.cameraPos.y << " " << scene.cameraPos.z << endl;
+    file << "viewport " << scene.projPlaneWidth << " " << scene.projPlaneHeight << " " << scene.projPlaneDistance << endl;
+    for (const Light& light : scene.lights) {
+        LightType type;
+        if (!parseLightType(light.type, type)) {
+            continue; // would be ignored when compiling the scene anyway
+        }
+        file << "light " << light.type << " " << light.intensity;
+        if (type == POINT_LIGHT) {
+            file << " " << light.position.x << " " << light.position.y << " " << light.position.z;
+        }
+        else if (type == DIRECTIONAL_LIGHT) {
+            file << " " << light.direction.x << " " << light.direction.y << " " << light.direction.z;
+        }
+        file << endl;
+    }
+    for (const Material& material : scene.materials) {
+        file << "material " << material.reflective << " " << material.transparency << " " << material.refractiveIndex << endl;
+    }
+    auto writeColor = [&file](COLORREF color) {
+        file << " " << (int) GetRValue(color) << " " << (int) GetGValue(color) << " " << (int) GetBValue(color);
+    };
+    auto writeMaterial = [&file](int material) { // ends the line of a primitive
+        if (material >= 0) {
+            file << " material " << material;
+        }
+        file << "\n";
+    };
+    auto writeVector = [&file](const Vector3& vector) {
+        file << " " << vector.x << " " << vector.y << " " << vector.z;
+    };
+    string directory = directoryOf(path);
+    string name = path.substr(directory.size());
+    name = name.substr(0, name.find_last_of('.')); // npos keeps the whole name
+    auto writeGeometry = [&](const vector<Sphere>& spheres, const vector<Box>& boxes, const vector<Triangle>& triangles,
+                             const vector<Mesh>& meshes, const string& meshPrefix) { // false if a mesh could not be written
+        for (const Sphere& sphere : spheres) {
+            file << "sphere";
+            writeVector(sphere.center);
+            file << " " << sphere.radius;
+            writeColor(sphere.color);
+            writeMaterial(sphere.material);
+        }
+        for (const Box& box : boxes) {
+            file << "box";
+            writeVector(box.min);
+            writeVector(box.max);
+            writeColor(box.color);
+            writeMaterial(box.material);
+        }
+        for (const Triangle& triangle : triangles) {
+            file << "triangle";
+            writeVector(triangle.a);
+            writeVector(triangle.b);
+            writeVector(triangle.c);
+            writeColor(triangle.color);
+            writeMaterial(triangle.material);
+        }
+        for (size_t m = 0; m < meshes.size(); m++) {
+            string meshName = meshPrefix + "_mesh" + to_string(m) + ".obj";
+            if (!writeObj(meshes[m], directory + meshName)) {
+                return false;
+            }
+            file << "mesh " << meshName;
+            writeColor(meshes[m].color);
+            writeMaterial(meshes[m].material);
+        }
+        return true;
+    };
+    for (const Plane& plane : scene.planes) {
+        file << "plane";
+        writeVector(plane.point);
+        writeVector(plane.normal);
+        writeColor(plane.color);
+        writeMaterial(plane.material);
+    }
+    if (!writeGeometry(scene.spheres, scene.boxes, scene.triangles, scene.meshes, name)) {
+        return false;
+    }
+    for (size_t p = 0; p < scene.prototypes.size(); p++) {
+        const Prototype& prototype = scene.prototypes[p];
+        file << "prototype" << endl;
+        if (!writeGeometry(prototype.spheres, prototype.boxes, prototype.triangles, prototype.meshes,
+                           name + "_prototype" + to_string(p))) {
+            return false;
+        }
+        file << "end" << endl;
+    }
+    for (const Instance& instance : scene.instances) {
+        file << "instance " << instance.prototype << " matrix";
+        for (int row = 0; row < 3; row++) {
+            for (int column = 0; column < 4; column++) {
+                file << " " << instance.transform.m[row][column];
+            }
+        }
+        if (instance.hasColor) {
+            file << " color";
+            writeColor(instance.color);
+        }
+        file << "\n";
+    }
+    file.close();
+    return !file.fail();
+}
+
+Scene decompileScene(const CompiledScene& compiled) {
+    /**
+     * Returns a Scene that compiles to the same scene as compiled (the ambient lights are merged
+     * into one)
+    */
+    Scene scene(compiled.cameraPos, compiled.projPlaneWidth, compiled.projPlaneHeight, compiled.projPlaneDistance, {}, {});
+    scene.spheres.assign(compiled.spheres, compiled.spheres + compiled.sphereCount);
+    scene.planes.assign(compiled.planes, compiled.planes + compiled.groups[PLANE].count);
+    scene.boxes.assign(compiled.boxes, compiled.boxes + compiled.groups[BOX].count);
+    scene.triangles.assign(compiled.triangles, compiled.triangles + compiled.groups[TRIANGLE].count);
+    for (int m = 0; m < compiled.meshCount; m++) {
+        const CompiledMesh& compiledMesh = compiled.meshes[m];
+        Mesh mesh;
+        const float* vertices = compiled.meshArrays.vertices + 3 * (size_t) compiledMesh.firstVertex;
+        for (int i = 0; i < compiledMesh.vertexCount; i++) {
+            mesh.vertices.push_back(Vector3(vertices[3*i], vertices[3*i + 1], vertices[3*i + 2]));
+        }
+        const int* triangles = compiled.meshArrays.triangles + 3 * (size_t) compiledMesh.firstTriangle;
+        for (int i = 0; i < 3 * compiledMesh.triangleCount; i++) {
+            mesh.indices.push_back(triangles[i] - compiledMesh.firstVertex);
+        }
+        mesh.color = compiledMesh.color;
+        mesh.material = compiledMesh.material;
+        scene.meshes.push_back(mesh);
+    }
+    for (const CompiledScene& compiledPrototype : compiled.prototypes) {
+        Scene geometry = decompileScene(compiledPrototype);
+        Prototype prototype;
+        prototype.spheres = move(geometry.spheres);
+        prototype.boxes = move(geometry.boxes);
+        prototype.triangles = move(geometry.triangles);
+        prototype.meshes = move(geometry.meshes);
+        scene.prototypes.push_back(move(prototype));
+    }
+    scene.materials.assign(compiled.materials, compiled.materials + compiled.materialCount);
+    for (int i = 0; i < compiled.groups[INSTANCE].count; i++) {
+        const CompiledInstance& instance = compiled.instances[i];
+        scene.instances.push_back(instance.hasColor ? Instance(instance.prototype, instance.toScene, instance.color)
+                                                    : Instance(instance.prototype, instance.toScene));
+    }
+    if (compiled.ambientIntensity > 0) {
+        scene.lights.push_back(Light("ambient", compiled.ambientIntensity, Vector3(0, 0, 0), Vector3(0, 0, 0)));
+    }
+    for (int i = 0; i < compiled.pointLightCount; i++) {
+        const CompiledLight& light = compiled.pointLights[i];
+        scene.lights.push_back(Light("point", light.intensity, light.position, Vector3(0, 0, 0)));
+    }
+    for (int i = 0; i < compiled.directionalLightCount; i++) {
+        const CompiledLight& light = compiled.directionalLights[i];
+        scene.lights.push_back(Light("directional", light.intensity, Vector3(0, 0, 0), light.direction));
+    }
+    return scene;
+}
+
+struct BinarySceneHeader {
+    /**
+     * Start of a binary scene file, followed by zeros up to SIZE bytes and then by the block
+     * of the compiled scene. The prototypes of the scene come next, each as a header and a block.
+    */
+    static constexpr size_t SIZE = 512; // multiple of CompiledScene::CACHE_LINE, so that the block stays aligned
+    static constexpr uint32_t VERSION = 8;
+    static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304; // read back differently on machines of the other byte order
+
+    char magic[8]; // "RTSCENE"
+    uint32_t version;
+    uint32_t byteOrder;
+    float cameraPos[3];
+    float projPlaneWidth, projPlaneHeight, projPlaneDistance;
+    float ambientIntensity;
+    float bvhSahCost;
+    int32_t sphereCount, pointLightCount, directionalLightCount, bvhNodeCount, sphereArrayCount;
+    int32_t primitiveCounts[PRIMITIVE_TYPE_COUNT], primitiveNodeCounts[PRIMITIVE_TYPE_COUNT]; // of every group but the spheres
+    int32_t meshCount, meshVertexCount;
+    int32_t lightNodeCount;
+    int32_t materialCount;
+    int32_t prototypeCount; // prototypes following the block (none in the headers of the prototypes)
+    int32_t vectorSize; // sizeof(Vector3), which depends on the storage of vectors (VECTOR3_SSE)
+    CompiledSceneLayout layout;
+    uint64_t geometryHash, cameraHash, lightsHash;
+};
+
+static_assert(sizeof(BinarySceneHeader) <= BinarySceneHeader::SIZE, "the binary scene header does not fit");
+static_assert(BinarySceneHeader::SIZE % CompiledScene::CACHE_LINE == 0, "the block of binary scenes would not be aligned");
+#ifndef VECTOR3_SSE
+static_assert(sizeof(Sphere) == 24 && sizeof(Plane) == 32 && sizeof(Box) == 32 && sizeof(Triangle) == 44
+              && sizeof(CompiledMesh) == 32 && sizeof(CompiledInstance) == 108 && sizeof(CompiledLight) == 28
+              && sizeof(Material) == 12 && sizeof(BVHNode) == 32 && sizeof(LightNode) == 48,
+              "the binary scene format depends on the size of the arrays elements");
+#endif
+
+static void writeBinaryBlock(ofstream& file, const CompiledScene& compiled) {
+    /**
+     * Writes the header and the block of a compiled scene, then the ones of its prototypes
+    */
+    BinarySceneHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "RTSCENE", 8);
+    header.version = BinarySceneHeader::VERSION;
+    header.byteOrder = BinarySceneHeader::BYTE_ORDER_MARK;
+    header.vectorSize = sizeof(Vector3);
+    header.cameraPos[0] = compiled.cameraPos.x;
+    header.cameraPos[1] = compiled.cameraPos.y;
+    header.cameraPos[2] = compiled.cameraPos.z;
+    header.projPlaneWidth = compiled.projPlaneWidth;
+    header.projPlaneHeight = compiled.projPlaneHeight;
+    header.projPlaneDistance = compiled.projPlaneDistance;
+    header.ambientIntensity = compiled.ambientIntensity;
+    header.bvhSahCost = compiled.bvhSahCost;
+    header.sphereCount = compiled.sphereCount;
+    header.pointLightCount = compiled.pointLightCount;
+    header.directionalLightCount = compiled.directionalLightCount;
+    header.bvhNodeCount = compiled.bvhNodeCount;
+    header.sphereArrayCount = compiled.sphereArrays.count;
+    header.meshCount = compiled.meshCount;
+    header.meshVertexCount = compiled.meshVertexCount;
+    header.lightNodeCount = compiled.lightNodeCount;
+    header.materialCount = compiled.materialCount;
+    header.prototypeCount = (int32_t) compiled.prototypes.size();
+    for (int type = PLANE; type < PRIMITIVE_TYPE_COUNT; type++) {
+        header.primitiveCounts[type] = compiled.groups[type].count;
+        header.primitiveNodeCounts[type] = compiled.groups[type].bvhNodeCount;
+    }
+    header.layout = compiled.layout;
+    header.geometryHash = compiled.geometryHash;
+    header.cameraHash = compiled.cameraHash;
+    header.lightsHash = compiled.lightsHash;
+
+    char padded[BinarySceneHeader::SIZE] = {};
+    memcpy(padded, &header, sizeof(header));
+    file.write(padded, sizeof(padded));
+    file.write((const char*) compiled.blockData(), compiled.memorySize());
+    for (const CompiledScene& prototype : compiled.prototypes) {
+        writeBinaryBlock(file, prototype);
+    }
+}
+
+bool writeBinaryScene(const CompiledScene& compiled, const string& path) {
+    /**
+     * Writes a compiled scene as a binary scene. The BVHs and the sphere arrays are only stored
+     * if the scene was compiled with them.
+     *
+     * @return false if the file could not be written
+    */
+    ofstream file(path, ios::binary);
+    writeBinaryBlock(file, compiled);
+    file.close();
+    return !file.fail();
+}
+
+bool mapFile(const string& path, shared_ptr<const void>& mapping, size_t& size) {
+    /**
+     * Maps a whole file in memory, read-only
+     *
+     * @param path The file to map
+     * @param mapping Set to the start of the mapping, which is unmapped once the last copy of
+     *                mapping is destroyed
+     * @param size Set to the size of the file
+     * @return false if the file could not be mapped
+    */
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    HANDLE fileMapping = GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0
+                         ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    void* start = fileMapping != NULL ? MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (fileMapping != NULL) {
+        CloseHandle(fileMapping); // the view keeps the mapping open
+    }
+    CloseHandle(file);
+    if (start == NULL) {
+        return false;
+    }
+    size = (size_t) fileSize.QuadPart;
+    mapping = shared_ptr<const void>(start, [](const void* start) { UnmapViewOfFile(start); });
+#else
+    int file = open(path.c_str(), O_RDONLY);
+    if (file == -1) {
+        return false;
+    }
+    struct stat status;
+    void* start = fstat(file, &status) == 0 && status.st_size > 0
+                  ? mmap(nullptr, (size_t) status.st_size, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+    close(file); // the mapping keeps the file open
+    if (start == MAP_FAILED) {
+        return false;
+    }
+    size = (size_t) status.st_size;
+    mapping = shared_ptr<const void>(start, [size](const void* start) { munmap((void*) start, size); });
+#endif
+    return true;
+}
+
+static bool attachBinaryBlock(const string& path, const shared_ptr<const void>& mapping, size_t size, size_t& offset,
+                              CompiledScene& compiled) {
+    /**
+     * Points a compiled scene into the header and the block found at offset in a mapped binary
+     * scene, then its prototypes into the ones following it, moving offset after them
+     *
+     * @return false if the header is invalid (reported on cerr)
+    */
+    BinarySceneHeader header;
+    if (size - offset < BinarySceneHeader::SIZE) {
+        cerr << path << " is truncated or corrupted" << endl;
+        return false;
+    }
+    memcpy(&header, (const uint8_t*) mapping.get() + offset, sizeof(header));
+    bool validCounts = header.sphereCount >= 0 && header.pointLightCount >= 0 && header.directionalLightCount >= 0
+                       && header.bvhNodeCount >= 0 && (header.sphereArrayCount == 0 || header.sphereArrayCount == header.sphereCount)
+                       && header.meshCount >= 0 && header.meshVertexCount >= 0 && header.lightNodeCount >= 0 && header.materialCount >= 0
+                       && header.prototypeCount >= 0 && (offset == 0 || header.prototypeCount == 0); // prototypes have no instances
+    compiled = CompiledScene();
+    for (int type = PLANE; type < PRIMITIVE_TYPE_COUNT; type++) {
+        validCounts = validCounts && header.primitiveCounts[type] >= 0 && header.primitiveNodeCounts[type] >= 0;
+        compiled.groups[type].count = header.primitiveCounts[type];
+        compiled.groups[type].bvhNodeCount = header.primitiveNodeCounts[type];
+    }
+    compiled.cameraPos = Vector3(header.cameraPos[0], header.cameraPos[1], header.cameraPos[2]);
+    compiled.projPlaneWidth = header.projPlaneWidth;
+    compiled.projPlaneHeight = header.projPlaneHeight;
+    compiled.projPlaneDistance = header.projPlaneDistance;
+    compiled.ambientIntensity = header.ambientIntensity;
+    compiled.bvhSahCost = header.bvhSahCost;
+    compiled.sphereCount = header.sphereCount;
+    compiled.pointLightCount = header.pointLightCount;
+    compiled.directionalLightCount = header.directionalLightCount;
+    compiled.bvhNodeCount = header.bvhNodeCount;
+    compiled.sphereArrays.count = header.sphereArrayCount;
+    compiled.meshCount = header.meshCount;
+    compiled.meshVertexCount = header.meshVertexCount;
+    compiled.lightNodeCount = header.lightNodeCount;
+    compiled.materialCount = header.materialCount;
+    CompiledSceneLayout layout = compiled.layoutOfCounts();
+    offset += BinarySceneHeader::SIZE;
+    if (!validCounts || memcmp(&layout, &header.layout, sizeof(layout)) != 0 || size - offset < layout.size) {
+        cerr << path << " is truncated or corrupted" << endl;
+        return false;
+    }
+    compiled.layout = layout;
+    compiled.geometryHash = header.geometryHash;
+    compiled.cameraHash = header.cameraHash;
+    compiled.lightsHash = header.lightsHash;
+    compiled.attach((const uint8_t*) mapping.get() + offset, mapping);
+    offset += layout.size;
+    compiled.prototypes.resize(header.prototypeCount);
+    for (CompiledScene& prototype : compiled.prototypes) {
+        if (!attachBinaryBlock(path, mapping, size, offset, prototype)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool loadBinaryScene(const string& path, CompiledScene& compiled) {
+    /**
+     * Maps a binary scene in memory and points a compiled scene (and its prototypes) into it,
+     * without copying the arrays. The file stays mapped as long as the compiled scene exists.
+     *
+     * @param path The file to load
+     * @param compiled Set to the scene of the file
+     * @return false if the file could not be mapped or is not a valid binary scene (reported on cerr)
+    */
+    shared_ptr<const void> mapping;
+    size_t size;
+    if (!mapFile(path, mapping, size)) {
+        cerr << "Could not map " << path << endl;
+        return false;
+    }
+    BinarySceneHeader header;
+    if (size < BinarySceneHeader::SIZE) {
+        cerr << path << " is not a binary scene" << endl;
+        return false;
+    }
+    memcpy(&header, mapping.get(), sizeof(header));
+    if (memcmp(header.magic, "RTSCENE", 8) != 0 || header.version != BinarySceneHeader::VERSION
+        || header.byteOrder != BinarySceneHeader::BYTE_ORDER_MARK) {
+        cerr << path << " is not a binary scene of this version and byte order" << endl;
+        return false;
+    }
+    if (header.vectorSize != (int32_t) sizeof(Vector3)) {
+        cerr << path << " was written with " << header.vectorSize << " bytes vectors, this build uses "
+             << sizeof(Vector3) << " bytes vectors (VECTOR3_SSE)" << endl;
+        return false;
+    }
+    size_t offset = 0;
+    return attachBinaryBlock(path, mapping, size, offset, compiled);
+}
+
+bool loadScene(const string& path, CompiledScene& compiled, bool useBVH=true, bool useSphereArrays=true) {
+    /**
+     * Loads a text or binary scene (picked from the extension of path), ready to be rendered
+     *
+     * @param path The file to load
+     * @param compiled Set to the scene of the file
+     * @param useBVH Builds the BVHs over the primitives, binary scenes using the ones of the file
+     * @param useSphereArrays Builds the SoA sphere arrays, binary scenes using the ones of the file
+     * @return false if the file could not be loaded (reported on cerr)
+    */
+    if (!isBinarySceneFile(path)) {
+        Scene scene;
+        if (!loadTextScene(path, scene)) {
+            return false;
+        }
+        compiled = CompiledScene::compile(scene, useBVH, useSphereArrays);
+        return true;
+    }
+    if (!loadBinaryScene(path, compiled)) {
+        return false;
+    }
+    auto matchesOptions = [&](const CompiledScene& scene) { // true if its BVHs and sphere arrays are the ones the options ask for
+        bool matching = (scene.sphereArrays.count == scene.sphereCount) == useSphereArrays;
+        for (PrimitiveType type : {SPHERE, BOX, TRIANGLE, MESH, INSTANCE}) {
+            matching = matching && (scene.groups[type].bvhNodeCount > 0) == (useBVH && scene.groups[type].count > 0);
+        }
+        return matching;
+    };
+    bool matching = matchesOptions(compiled);
+    for (const CompiledScene& prototype : compiled.prototypes) {
+        matching = matching && matchesOptions(prototype);
+    }
+    if (!matching) {
+        // the file was written with other options: compile its primitives and lights again
+        cerr << "The BVHs or the sphere arrays of " << path << " do not match the options, the scene is compiled again" << endl;
+        compiled = CompiledScene::compile(decompileScene(compiled), useBVH, useSphereArrays);
+    }
+    return true;
+}
+
+bool saveScene(const CompiledScene& compiled, const string& path) {
+    /**
+     * Writes a compiled scene as a binary scene, or as a text scene if path does not have the
+     * .rtscene extension
+     *
+     * @return false if the file could not be written
+    */
+    if (isBinarySceneFile(path)) {
+        return writeBinaryScene(compiled, path);
+    }
+    return writeTextScene(decompileScene(compiled), path);
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <limits>
+#include <math.h>
+#include <string>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SPHERE_KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2 // MSVC compiles any intrinsic without target flags
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace std;
+
+struct SphereArrays {
+    /**
+     * Structure-of-arrays view of the scene spheres geometry: one array per coordinate so that
+     * SIMD kernels test several spheres with a single load per attribute. The arrays are stored
+     * in the memory block of a CompiledScene, and are padded with PADDING spheres that can never
+     * be hit, so kernels may read a full vector past the last sphere.
+    */
+    static constexpr int PADDING = 8;
+
+    const float* centerX = nullptr; // sphere centers
+    const float* centerY = nullptr;
+    const float* centerZ = nullptr;
+    const float* radius2 = nullptr; // squared radii, negative for padding spheres
+    const int* index = nullptr; // index in the scene spheres of each sphere of the arrays
+    int count = 0; // number of real spheres (without padding), 0 if the arrays are not built
+};
+
+// Finds the closest intersection, between tMin and tMax, of the ray origin + t*dir with the
+// spheres [begin, end) of the arrays, using the same equation as Sphere::intersectDistances
+// (dir is the normalized ray direction given to it). Returns the position of the closest sphere in
+// the arrays (lowest position on ties), -1 if none is hit, and sets tNearest to its distance.
+typedef int (*NearestSphereKernel)(const SphereArrays& spheres, int begin, int end, const float origin[3],
+                                   const float dir[3], float tMin, float tMax, float& tNearest);
+
+int nearestSphereScalar(const SphereArrays& spheres, int begin, int end, const float origin[3],
+                        const float dir[3], float tMin, float tMax, float& tNearest) {
+    float a = dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2];
+    int nearest = -1;
+    tNearest = numeric_limits<float>::infinity();
+    for (int i = begin; i < end; i++) {
+        // vector from the center to the origin (see Sphere::intersectDistances)
+        float wx = origin[0] - spheres.centerX[i];
+        float wy = origin[1] - spheres.centerY[i];
+        float wz = origin[2] - spheres.centerZ[i];
+        float b = 2 * (wx*dir[0] + wy*dir[1] + wz*dir[2]);
+        float c = (wx*wx + wy*wy + wz*wz) - spheres.radius2[i];
+        float discriminant = b*b - 4*a*c;
+        if (discriminant < 0) {
+            continue;
+        }
+        float root = sqrtf(discriminant);
+        float t1 = (-b + root) / (2*a);
+        float t2 = (-b - root) / (2*a);
+        if (tMin <= t1 && t1 <= tMax && t1 < tNearest) {
+            nearest = i;
+            tNearest = t1;
+        }
+        if (tMin <= t2 && t2 <= tMax && t2 < tNearest) {
+            nearest = i;
+            tNearest = t2;
+        }
+    }
+    return nearest;
+}
+
+#ifdef SPHERE_KERNELS_X86
+int nearestSphereSSE(const SphereArrays& spheres, int begin, int end, const float origin[3],
+                     const float dir[3], float tMin, float tMax, float& tNearest) {
+    // 4 spheres per iteration, SSE2 only (always available on x86-64)
+    const __m128 ox = _mm_set1_ps(origin[0]), oy = _mm_set1_ps(origin[1]), oz = _mm_set1_ps(origin[2]);
+    const __m128 dx = _mm_set1_ps(dir[0]), dy = _mm_set1_ps(dir[1]), dz = _mm_set1_ps(dir[2]);
+    float aScalar = dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2];
+    const __m128 four_a = _mm_set1_ps(4 * aScalar), two_a = _mm_set1_ps(2 * aScalar);
+    const __m128 two = _mm_set1_ps(2), zero = _mm_setzero_ps();
+    const __m128 tMinV = _mm_set1_ps(tMin), tMaxV = _mm_set1_ps(tMax);
+    const __m128 infinity = _mm_set1_ps(numeric_limits<float>::infinity());
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3), four = _mm_set1_epi32(4);
+    const __m128i endV = _mm_set1_epi32(end);
+    __m128 bestT = infinity;
+    __m128i bestIndex = _mm_set1_epi32(-1);
+    __m128i indices = _mm_add_epi32(_mm_set1_epi32(begin), lane);
+    for (int i = begin; i < end; i += 4) {
+        __m128 wx = _mm_sub_ps(ox, _mm_loadu_ps(&spheres.centerX[i]));
+        __m128 wy = _mm_sub_ps(oy, _mm_loadu_ps(&spheres.centerY[i]));
+        __m128 wz = _mm_sub_ps(oz, _mm_loadu_ps(&spheres.centerZ[i]));
+        __m128 b = _mm_mul_ps(two, _mm_add_ps(_mm_add_ps(_mm_mul_ps(wx, dx), _mm_mul_ps(wy, dy)), _mm_mul_ps(wz, dz)));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(wx, wx), _mm_mul_ps(wy, wy)), _mm_mul_ps(wz, wz)),
+                              _mm_loadu_ps(&spheres.radius2[i]));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(four_a, c));
+        __m128 hit = _mm_cmpge_ps(discriminant, zero);
+        hit = _mm_and_ps(hit, _mm_castsi128_ps(_mm_cmplt_epi32(indices, endV))); // lanes past end
+        if (_mm_movemask_ps(hit) != 0) {
+            __m128 root = _mm_sqrt_ps(discriminant);
+            __m128 t1 = _mm_div_ps(_mm_add_ps(_mm_sub_ps(zero, b), root), two_a);
+            __m128 t2 = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(zero, b), root), two_a);
+            __m128 valid1 = _mm_and_ps(_mm_cmple_ps(tMinV, t1), _mm_cmple_ps(t1, tMaxV));
+            __m128 valid2 = _mm_and_ps(_mm_cmple_ps(tMinV, t2), _mm_cmple_ps(t2, tMaxV));
+            t1 = _mm_or_ps(_mm_and_ps(valid1, t1), _mm_andnot_ps(valid1, infinity));
+            t2 = _mm_or_ps(_mm_and_ps(valid2, t2), _mm_andnot_ps(valid2, infinity));
+            __m128 t = _mm_min_ps(t1, t2);
+            __m128 closer = _mm_and_ps(hit, _mm_cmplt_ps(t, bestT));
+            bestT = _mm_or_ps(_mm_and_ps(closer, t), _mm_andnot_ps(closer, bestT));
+            __m128i closerInt = _mm_castps_si128(closer);
+            bestIndex = _mm_or_si128(_mm_and_si128(closerInt, indices), _mm_andnot_si128(closerInt, bestIndex));
+        }
+        indices = _mm_add_epi32(indices, four);
+    }
+    alignas(16) float laneT[4];
+    alignas(16) int laneIndex[4];
+    _mm_store_ps(laneT, bestT);
+    _mm_store_si128((__m128i*) laneIndex, bestIndex);
+    int nearest = -1;
+    tNearest = numeric_limits<float>::infinity();
+    for (int k = 0; k < 4; k++) {
+        if (laneIndex[k] != -1 && (laneT[k] < tNearest || (laneT[k] == tNearest && laneIndex[k] < nearest))) {
+            nearest = laneIndex[k];
+            tNearest = laneT[k];
+        }
+    }
+    return nearest;
+}
+
+TARGET_AVX2
+int nearestSphereAVX2(const SphereArrays& spheres, int begin, int end, const float origin[3],
+                      const float dir[3], float tMin, float tMax, float& tNearest) {
+    // 8 spheres per iteration
+    const __m256 ox = _mm256_set1_ps(origin[0]), oy = _mm256_set1_ps(origin[1]), oz = _mm256_set1_ps(origin[2]);
+    const __m256 dx = _mm256_set1_ps(dir[0]), dy = _mm256_set1_ps(dir[1]), dz = _mm256_set1_ps(dir[2]);
+    float aScalar = dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2];
+    const __m256 four_a = _mm256_set1_ps(4 * aScalar), two_a = _mm256_set1_ps(2 * aScalar);
+    const __m256 two = _mm256_set1_ps(2), zero = _mm256_setzero_ps();
+    const __m256 tMinV = _mm256_set1_ps(tMin), tMaxV = _mm256_set1_ps(tMax);
+    const __m256 infinity = _mm256_set1_ps(numeric_limits<float>::infinity());
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), eight = _mm256_set1_epi32(8);
+    const __m256i endV = _mm256_set1_epi32(end);
+    __m256 bestT = infinity;
+    __m256i bestIndex = _mm256_set1_epi32(-1);
+    __m256i indices = _mm256_add_epi32(_mm256_set1_epi32(begin), lane);
+    for (int i = begin; i < end; i += 8) {
+        __m256 wx = _mm256_sub_ps(ox, _mm256_loadu_ps(&spheres.centerX[i]));
+        __m256 wy = _mm256_sub_ps(oy, _mm256_loadu_ps(&spheres.centerY[i]));
+        __m256 wz = _mm256_sub_ps(oz, _mm256_loadu_ps(&spheres.centerZ[i]));
+        __m256 b = _mm256_mul_ps(two, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(wx, dx), _mm256_mul_ps(wy, dy)), _mm256_mul_ps(wz, dz)));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(wx, wx), _mm256_mul_ps(wy, wy)), _mm256_mul_ps(wz, wz)),
+                                 _mm256_loadu_ps(&spheres.radius2[i]));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(four_a, c));
+        __m256 hit = _mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ);
+        hit = _mm256_and_ps(hit, _mm256_castsi256_ps(_mm256_cmpgt_epi32(endV, indices))); // lanes past end
+        if (_mm256_movemask_ps(hit) != 0) {
+            __m256 root = _mm256_sqrt_ps(discriminant);
+            __m256 t1 = _mm256_div_ps(_mm256_add_ps(_mm256_sub_ps(zero, b), root), two_a);
+            __m256 t2 = _mm256_div_ps(_mm256_sub_ps(_mm256_sub_ps(zero, b), root), two_a);
+            __m256 valid1 = _mm256_and_ps(_mm256_cmp_ps(tMinV, t1, _CMP_LE_OQ), _mm256_cmp_ps(t1, tMaxV, _CMP_LE_OQ));
+            __m256 valid2 = _mm256_and_ps(_mm256_cmp_ps(tMinV, t2, _CMP_LE_OQ), _mm256_cmp_ps(t2, tMaxV, _CMP_LE_OQ));
+            t1 = _mm256_blendv_ps(infinity, t1, valid1);
+            t2 = _mm256_blendv_ps(infinity, t2, valid2);
+            __m256 t = _mm256_min_ps(t1, t2);
+            __m256 closer = _mm256_and_ps(hit, _mm256_cmp_ps(t, bestT, _CMP_LT_OQ));
+            bestT = _mm256_blendv_ps(bestT, t, closer);
+            bestIndex = _mm256_blendv_epi8(bestIndex, indices, _mm256_castps_si256(closer));
+        }
+        indices = _mm256_add_epi32(indices, eight);
+    }
+    alignas(32) float laneT[8];
+    alignas(32) int laneIndex[8];
+    _mm256_store_ps(laneT, bestT);
+    _mm256_store_si256((__m256i*) laneIndex, bestIndex);
+    int nearest = -1;
+    tNearest = numeric_limits<float>::infinity();
+    for (int k = 0; k < 8; k++) {
+        if (laneIndex[k] != -1 && (laneT[k] < tNearest || (laneT[k] == tNearest && laneIndex[k] < nearest))) {
+            nearest = laneIndex[k];
+            tNearest = laneT[k];
+        }
+    }
+    return nearest;
+}
+
+bool cpuSupportsAVX2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    bool avx2 = (info[1] & (1 << 5)) != 0;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    return avx2 && osxsave && (_xgetbv(0) & 6) == 6; // the OS saves the YMM registers
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+// kernel used by the tracer, the fastest one the CPU supports unless changed by setSphereKernel()
+static NearestSphereKernel nearestSphere = nearestSphereScalar;
+static string nearestSphereName = "scalar";
+
+bool setSphereKernel(const string& name) {
+    /**
+     * Selects the kernel used to intersect rays with the sphere arrays
+     *
+     * @param name "scalar", "sse", "avx2", or "auto" for the fastest one supported by the CPU
+     * @return false if the kernel is unknown or not supported by this CPU
+    */
+#ifdef SPHERE_KERNELS_X86
+    if (name == "auto") {
+        return setSphereKernel(cpuSupportsAVX2() ? "avx2" : "sse");
+    }
+    if (name == "sse") {
+        nearestSphere = nearestSphereSSE;
+        nearestSphereName = name;
+        return true;
+    }
+    if (name == "avx2") {
+        if (!cpuSupportsAVX2()) {
+            return false;
+        }
+        nearestSphere = nearestSphereAVX2;
+        nearestSphereName = name;
+        return true;
+    }
+#else
+    if (name == "auto") {
+        return setSphereKernel("scalar");
+    }
+#endif
+    if (name == "scalar") {
+        nearestSphere = nearestSphereScalar;
+        nearestSphereName = name;
+        return true;
+    }
+    return false;
+}
+
+static bool sphereKernelSelected = setSphereKernel("auto"); // picked once, at startup
@@ -0,0 +1,164 @@
+#pragma once
+
+// Streaming renders of images too big to be held in memory (a 32k x 32k image takes 4 GB of
+// COLORREFs before it is even encoded). This file is included by main.cpp after renderParallel(),
+// which renders the image a band of rows (a stripe) at a time.
+//
+// Every stripe is encoded and appended to the image file as soon as it is rendered, by a writer
+// thread, while the threads of the pool render the next stripes. Only a window of stripes is held
+// in memory: rendering waits when every stripe of the window is rendered but not written yet. The
+// memory used is set by the width of the image, the height of the stripes and the window, not by
+// the height of the image.
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// custom files:
+#include <Framebuffer.cpp>
+#include <ImageWriter.cpp>
+#include <ThreadPool.cpp>
+
+using namespace std;
+
+long long peakMemoryUsage() {
+    /**
+     * Returns the largest amount of physical memory the process used so far (peak resident set
+     * size), in bytes, or -1 where it is not known
+    */
+#ifdef _WIN32
+    return -1;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss; // in bytes on macOS
+#else
+    return usage.ru_maxrss * 1024LL; // in kilobytes on Linux
+#endif
+#endif
+}
+
+class StreamingRenderer {
+    /**
+     * Renders xRes by yRes images straight into a PNG or PPM file, stripe by stripe. The
+     * stripes of the window are allocated by the constructor, so the memory used does not
+     * depend on the height of the image, and the pixels are the same as with renderParallel().
+    */
+    public:
+        static constexpr int MAX_WINDOW = 64; // stripes held in memory at most
+
+        int stripeRows; // height of the stripes, in pixels
+        int stripeCount = 0; // stripes of the last image
+        double renderTime = 0; // milliseconds spent rendering the stripes of the last image
+        double writeTime = 0; // milliseconds spent encoding and writing them, in parallel
+        double waitTime = 0; // milliseconds rendering waited for a stripe of the window to be written
+
+        static bool validWindow(int windowStripes) {
+            return windowStripes >= 1 && windowStripes <= MAX_WINDOW;
+        }
+
+        StreamingRenderer(int width, int _stripeRows, int windowStripes) {
+            /**
+             * @param width The width of the images, 0 for a renderer which is not used
+             * @param _stripeRows The height of the stripes in pixels
+             * @param windowStripes The number of stripes held in memory, at least 2 for the
+             *                      stripes to be written while the next ones are rendered
+            */
+            this->stripeRows = _stripeRows;
+            for (int i = 0; i < (width > 0 ? windowStripes : 0); i++) {
+                this->stripes.push_back(Framebuffer(width, _stripeRows, defaultColor));
+            }
+        }
+
+        size_t memorySize() const {
+            /**
+             * Returns the bytes of the stripes of the window
+            */
+            size_t size = 0;
+            for (const Framebuffer& stripe : this->stripes) {
+                size += stripe.pixels.size() * sizeof(COLORREF);
+            }
+            return size;
+        }
+
+        bool render(const CompiledScene& scene, ThreadPool& pool, const string& path) {
+            /**
+             * Renders a scene into an image file, the format being picked from its extension
+             *
+             * @param scene The scene to render
+             * @param pool The threads rendering the stripes (the stripes are written by
+             *             another thread)
+             * @param path The image file to write
+             * @return false if the file could not be written
+            */
+            ImageStreamWriter writer;
+            if (!writer.open(path, xRes, yRes)) {
+                return false;
+            }
+            int window = (int) this->stripes.size();
+            this->stripeCount = (yRes + this->stripeRows - 1) / this->stripeRows;
+            this->renderedStripes = 0;
+            this->writtenStripes = 0;
+            this->renderTime = 0;
+            this->writeTime = 0;
+            this->waitTime = 0;
+            thread writerThread(&StreamingRenderer::writerLoop, this, ref(writer));
+            for (int stripe = 0; stripe < this->stripeCount; stripe++) {
+                auto waitStart = chrono::steady_clock::now();
+                {
+                    unique_lock<mutex> lock(this->stateLock);
+                    this->changed.wait(lock, [&] { return stripe - this->writtenStripes < window; });
+                }
+                auto renderStart = chrono::steady_clock::now();
+                renderParallel(scene, this->stripes[stripe % window], pool, stripe * this->stripeRows);
+                auto renderEnd = chrono::steady_clock::now();
+                this->waitTime += chrono::duration<double, milli>(renderStart - waitStart).count();
+                this->renderTime += chrono::duration<double, milli>(renderEnd - renderStart).count();
+                {
+                    lock_guard<mutex> lock(this->stateLock);
+                    this->renderedStripes = stripe + 1;
+                }
+                this->changed.notify_all();
+            }
+            writerThread.join();
+            return writer.close();
+        }
+
+    private:
+        vector<Framebuffer> stripes; // the window, stripe k being rendered into stripes[k % window]
+        mutex stateLock;
+        condition_variable changed; // signaled when a stripe is rendered or written
+        int renderedStripes = 0, writtenStripes = 0; // of the image being rendered
+
+        void writerLoop(ImageStreamWriter& writer) {
+            /**
+             * Writes the stripes in order, each one as soon as it is rendered
+            */
+            int window = (int) this->stripes.size();
+            for (int stripe = 0; stripe < this->stripeCount; stripe++) {
+                {
+                    unique_lock<mutex> lock(this->stateLock);
+                    this->changed.wait(lock, [&] { return this->renderedStripes > stripe; });
+                }
+                auto start = chrono::steady_clock::now();
+                writer.writeRows(this->stripes[stripe % window].pixels.data(), min(this->stripeRows, yRes - stripe * this->stripeRows));
+                double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+                {
+                    lock_guard<mutex> lock(this->stateLock);
+                    this->writeTime += elapsed;
+                    this->writtenStripes = stripe + 1;
+                }
+                this->changed.notify_all();
+            }
+        }
+};
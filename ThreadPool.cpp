@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+class ThreadPool {
+    /**
+     * A fixed set of worker threads running batches of independent tasks with work-stealing.
+     * Each batch of tasks is split in contiguous ranges, one per worker queue. A worker takes
+     * its own tasks from the start of its range and, once it is empty, steals tasks from the
+     * end of the other ranges, so that threads which got cheap tasks help the others.
+     * Queues are plain index ranges: running a batch does not allocate any memory.
+     * The thread calling run() works as one of the workers, so a pool of size 1 runs
+     * everything on the calling thread.
+    */
+    public:
+        ThreadPool(int threadCount=0) {
+            /**
+             * @param threadCount The number of threads working on each batch, including the calling
+             *                    thread (0 uses one thread per hardware thread)
+            */
+            if (threadCount <= 0) {
+                threadCount = max(1, (int) thread::hardware_concurrency());
+            }
+            for (int i = 0; i < threadCount; i++) {
+                this->queues.push_back(make_unique<WorkQueue>());
+            }
+            for (int i = 1; i < threadCount; i++) {
+                this->workers.emplace_back(&ThreadPool::workerLoop, this, i);
+            }
+        }
+
+        ~ThreadPool() {
+            {
+                lock_guard<mutex> lock(this->stateLock);
+                this->stopping = true;
+            }
+            this->wake.notify_all();
+            for (thread& worker : this->workers) {
+                worker.join();
+            }
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator = (const ThreadPool&) = delete;
+
+        int size() const {
+            return (int) this->queues.size();
+        }
+
+        template <typename Task>
+        void run(int taskCount, const Task& task) {
+            /**
+             * Runs task(0) to task(taskCount-1) on the pool and returns once all of them are done.
+             * The task is called through a plain function pointer instead of being copied into
+             * a std::function, so that running a batch does not allocate.
+             *
+             * @param taskCount The number of tasks in the batch
+             * @param task The function (or lambda) executed for every task index
+            */
+            if (taskCount <= 0) {
+                return;
+            }
+            int queueCount = this->size();
+            {
+                lock_guard<mutex> lock(this->stateLock);
+                this->task = &task;
+                this->callTask = [](const void* task, int index) { (*(const Task*) task)(index); };
+                this->remaining = taskCount;
+                for (int q = 0; q < queueCount; q++) {
+                    lock_guard<mutex> queueLock(this->queues[q]->lock);
+                    this->queues[q]->next = (int) ((long long) taskCount * q / queueCount);
+                    this->queues[q]->end = (int) ((long long) taskCount * (q+1) / queueCount);
+                }
+                this->generation++;
+            }
+            this->wake.notify_all();
+
+            work(0);
+            unique_lock<mutex> lock(this->stateLock);
+            this->done.wait(lock, [this] { return this->remaining == 0; });
+        }
+
+    private:
+        struct WorkQueue {
+            mutex lock;
+            int next = 0; // the tasks left in the queue are [next, end)
+            int end = 0;
+        };
+
+        vector<unique_ptr<WorkQueue>> queues; // one queue per thread, queues[0] belongs to the caller of run()
+        vector<thread> workers;
+        mutex stateLock;
+        condition_variable wake; // signaled when a batch starts or when the pool is destroyed
+        condition_variable done; // signaled when the last task of a batch is finished
+        const void* task = nullptr; // task of the current batch...
+        void (*callTask)(const void*, int) = nullptr; // ...and how to call it
+        atomic<int> remaining{0}; // number of unfinished tasks in the current batch
+        long long generation = 0; // number of batches started so far
+        bool stopping = false;
+
+        bool takeTask(int id, int& index) {
+            /**
+             * Takes the first task of the queue of thread id or, if it is empty, steals the last
+             * one of another queue. Returns false if there is no task left.
+            */
+            {
+                WorkQueue& own = *this->queues[id];
+                lock_guard<mutex> lock(own.lock);
+                if (own.next < own.end) {
+                    index = own.next++;
+                    return true;
+                }
+            }
+            int queueCount = this->size();
+            for (int offset = 1; offset < queueCount; offset++) {
+                WorkQueue& victim = *this->queues[(id + offset) % queueCount];
+                lock_guard<mutex> lock(victim.lock);
+                if (victim.next < victim.end) {
+                    index = --victim.end;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void work(int id) {
+            int index;
+            while (takeTask(id, index)) {
+                this->callTask(this->task, index);
+                if (--this->remaining == 0) {
+                    lock_guard<mutex> lock(this->stateLock);
+                    this->done.notify_all();
+                }
+            }
+        }
+
+        void workerLoop(int id) {
+            long long seenGeneration = 0;
+            while (true) {
+                {
+                    unique_lock<mutex> lock(this->stateLock);
+                    this->wake.wait(lock, [&] { return this->stopping || this->generation != seenGeneration; });
+                    if (this->stopping) {
+                        return;
+                    }
+                    seenGeneration = this->generation;
+                }
+                work(id);
+            }
+        }
+};
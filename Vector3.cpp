@@ -1,118 +1,235 @@
+#pragma once
+
 #include <math.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
 
+// custom files:
+#include <Float4.cpp> // for FLOAT4_SSE and the SSE intrinsics
+
 using namespace std;
 
-class Vector3 {
+// Compile with VECTOR3_SSE defined (-DVECTOR3_SSE) to store vectors as 16 bytes aligned SSE
+// registers (x, y, z and a padding lane) computed with SSE instructions. Every operation is
+// rounded like the scalar version, so both give the exact same images. Scalar vectors (the
+// default) take 12 bytes and all their operations are constexpr.
+#if defined(VECTOR3_SSE) && !defined(FLOAT4_SSE)
+#error "VECTOR3_SSE needs SSE2"
+#endif
+#ifdef VECTOR3_SSE
+#define VECTOR3_CONSTEXPR inline
+#else
+#define VECTOR3_CONSTEXPR constexpr
+#endif
+
+class
+#ifdef VECTOR3_SSE
+alignas(16)
+#endif
+Vector3 {
     /**
      * A class used to store vectors in 3D space, such as positions or directions.
      * It contains usefull basic linear algebra functions for manipulating vectors.
     */
     public:
         float x, y, z;
+#ifdef VECTOR3_SSE
+        float w = 0; // padding lane, so that the vector fills an SSE register
+#endif
 
-        Vector3() {}; // default constructor
-        Vector3(float _x, float _y, float _z) {
-            this->x = _x;
-            this->y = _y;
-            this->z = _z;
+        static inline bool fastNormalize = false; // normalize() uses normalizeFast(), see checkNormalizePrecision()
+
+        Vector3() = default; // default constructor
+        constexpr Vector3(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {}
+
+#ifdef VECTOR3_SSE
+        Vector3(__m128 v) {
+            _mm_store_ps(&this->x, v);
+        }
+        __m128 load() const {
+            return _mm_load_ps(&this->x);
         }
 
-        Vector3 operator + (Vector3 B) {
+        Vector3 operator + (const Vector3& B) const {
+            return _mm_add_ps(this->load(), B.load());
+        }
+        Vector3 operator - (const Vector3& B) const {
+            return _mm_sub_ps(this->load(), B.load());
+        }
+        Vector3 operator - () const {
+            return _mm_sub_ps(_mm_setzero_ps(), this->load());
+        }
+        Vector3 operator * (float a) const {
+            return _mm_mul_ps(this->load(), _mm_set1_ps(a));
+        }
+        Vector3 operator / (float a) const {
+            return _mm_div_ps(this->load(), _mm_set1_ps(a));
+        }
+#else
+        constexpr Vector3 operator + (const Vector3& B) const {
             return Vector3(this->x + B.x,
                            this->y + B.y,
                            this->z + B.z);
         }
-        Vector3 operator - (Vector3 B) {
+        constexpr Vector3 operator - (const Vector3& B) const {
             return Vector3(this->x - B.x,
                            this->y - B.y,
                            this->z - B.z);
         }
-        Vector3 operator * (float a) {
+        constexpr Vector3 operator - () const {
+            return Vector3(-this->x, -this->y, -this->z);
+        }
+        constexpr Vector3 operator * (float a) const {
             return Vector3(this->x * a,
                            this->y * a,
                            this->z * a);
         }
-        Vector3 operator / (float a) {
+        constexpr Vector3 operator / (float a) const {
             return Vector3(this->x / a,
                            this->y / a,
                            this->z / a);
         }
-        bool operator == (Vector3 B) {
+#endif
+        constexpr bool operator == (const Vector3& B) const {
             return this->x == B.x &&
                    this->y == B.y &&
                    this->z == B.z;
         }
+        constexpr bool operator != (const Vector3& B) const {
+            return !(*this == B);
+        }
 
         // Some usefull functions to do math with Vector3s
-        static float distance(Vector3 A, Vector3 B) {
+        static VECTOR3_CONSTEXPR float dot(const Vector3& A, const Vector3& B) {
             /**
-             * Computes the distance between two 3 dimensional vectors
-             * 
+             * Computes the dot product between two 3 dimensional vectors, in single precision
+             * and summed from x to z with both storages
+             *
              * @param A
              * @param B
-             * @return the distance between A and B
+             * @return A dot B
             */
-            return sqrt(pow(A.x - B.x, 2) + pow(A.y - B.y, 2) + pow(A.z - B.z, 2));
+#ifdef VECTOR3_SSE
+            __m128 products = _mm_mul_ps(A.load(), B.load());
+            return _mm_cvtss_f32(products)
+                   + _mm_cvtss_f32(_mm_shuffle_ps(products, products, 1))
+                   + _mm_cvtss_f32(_mm_shuffle_ps(products, products, 2));
+#else
+            return A.x * B.x + A.y * B.y + A.z * B.z;
+#endif
         }
-        static float dot(Vector3 A, Vector3 B) {
+        static VECTOR3_CONSTEXPR Vector3 cross(const Vector3& A, const Vector3& B) {
             /**
-             * Computes the dot product between two 3 dimensional vectors
-             * 
+             * Computes the cross product between two 3 dimensional vectors
+             *
              * @param A
              * @param B
-             * @return A dot B
+             * @return A cross B, orthogonal to both
             */
-            return A.x * B.x + A.y * B.y + A.z * B.z;
+            return Vector3(A.y * B.z - A.z * B.y,
+                           A.z * B.x - A.x * B.z,
+                           A.x * B.y - A.y * B.x);
+        }
+        static VECTOR3_CONSTEXPR float lengthSquared(const Vector3& A) {
+            return Vector3::dot(A, A);
         }
-        float length() {
+        static float length(const Vector3& A) {
+            /**
+             * Computes the length of a 3 dimensional vector
+             *
+             * @param A
+             * @return the length of A (sqrt(x²+y²+z²))
+            */
+            return sqrtf(Vector3::dot(A, A));
+        }
+        static float norm(const Vector3& A) { // same as length()
+            return Vector3::length(A);
+        }
+        float length() const {
             /**
              * Computes the length of the 3 dimensional vector
             */
-           return sqrt(pow(this->x, 2) + pow(this->y, 2) + pow(this->z, 2));
+            return Vector3::length(*this);
         }
-        static float length(Vector3 A) {
+        static float distance(const Vector3& A, const Vector3& B) {
             /**
-             * Computes the length of a 3 dimensional vector
-             * 
+             * Computes the distance between two 3 dimensional vectors
+             *
              * @param A
-             * @return the length of A (sqrt(x²+y²+z²))
+             * @param B
+             * @return the distance between A and B
             */
-           return sqrt(pow(A.x, 2) + pow(A.y, 2) + pow(A.z, 2));
+            return Vector3::length(A - B);
         }
-        Vector3 normalize() {
+        static float reciprocalSqrtFast(float a) {
             /**
-             * Returns a Vector3 of same direction and of length 1
+             * Approximates 1/sqrt(a) with the reciprocal square root estimate of the CPU (or the
+             * integer trick without SSE) refined by one Newton-Raphson step, a few ulps away
+             * from the exact value for normal positive floats
             */
-           return *this / this->length();
+#ifdef FLOAT4_SSE
+            float estimate = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(a)));
+#else
+            uint32_t bits;
+            memcpy(&bits, &a, sizeof(bits));
+            bits = 0x5f375a86 - (bits >> 1);
+            float estimate;
+            memcpy(&estimate, &bits, sizeof(estimate));
+            estimate = estimate * (1.5f - .5f * a * estimate * estimate);
+#endif
+            return estimate * (1.5f - .5f * a * estimate * estimate);
         }
-        static Vector3 normalize(Vector3 A) {
+        static Vector3 normalizeExact(const Vector3& A) {
+            /**
+             * Returns a Vector3 of same direction as the parameter and of length 1, correctly
+             * rounded divisions by the correctly rounded length
+            */
+            return A / Vector3::length(A);
+        }
+        static Vector3 normalizeFast(const Vector3& A) {
+            /**
+             * Returns a Vector3 of same direction as the parameter and of length 1 to a few ulps,
+             * using a multiplication by reciprocalSqrtFast() instead of a square root and three
+             * divisions. Only accurate for vectors whose squared length is a normal float
+             * (lengths between about 1e-19 and 1e19).
+            */
+            return A * Vector3::reciprocalSqrtFast(Vector3::dot(A, A));
+        }
+        static Vector3 normalize(const Vector3& A) {
             /**
              * Returns a Vector 3 of same direction as the parameter
              * and of length 1
-             * 
+             *
              * @param A
-             * @return a unit vector with the same direction as A 
+             * @return a unit vector with the same direction as A, from normalizeFast() if
+             *         fastNormalize is set and from normalizeExact() otherwise
+            */
+            return Vector3::fastNormalize ? Vector3::normalizeFast(A) : Vector3::normalizeExact(A);
+        }
+        Vector3 normalize() const {
+            /**
+             * Returns a Vector3 of same direction and of length 1
             */
-           return A / A.length();
+            return Vector3::normalize(*this);
         }
 
         // Other utilitary functions
-        string toString() {
+        string toString() const {
             /**
              * Return a ready-to-display string describing the 3 dimensional vector,
              * formated as: "(x, y, z)"
             */
             return "(" + to_string(this->x) + ", " + to_string(this->y) + ", " + to_string(this->z) + ")";
         }
-        static string toString(Vector3 A) {
+        static string toString(const Vector3& A) {
             /**
              * Return a ready-to-display string describing a 3 dimensional vector,
              * formated as: "(x, y, z)"
-             * 
+             *
              * @param A the Vector3 to print
              * @return a string describing A
             */
-            return "(" + to_string(A.x) + ", " + to_string(A.y) + ", " + to_string(A.z) + ")";
+            return A.toString();
         }
-};
\ No newline at end of file
+};
@@ -0,0 +1,540 @@
+#pragma once
+
+// Wavefront rendering of reflections and refractions. This file is included by main.cpp after
+// the tracer functions (screenToProjPlane, closestHit, hitAttributes, isLightObstructed...)
+// since it builds on them.
+//
+// Instead of following every ray of a pixel recursively, rays are kept in queues and every
+// stage of the tracer runs as a batch over a whole queue: generate (the camera rays), intersect
+// (closest hits), shade (hitpoint attributes and materials), shadow (a queue of shadow rays,
+// one per light lighting each hitpoint) and spawn (the reflected and refracted rays, which make
+// the queue of the next bounce). Each stage only runs one kind of work over coherent data, the
+// depth of the rays is bounded without any recursion, and the cost of every bounce is measured
+// on its own. The secondary and shadow rays are traced in the order of their sort keys (see
+// RaySort.cpp), so that rays walking the same nodes are traced together.
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <math.h>
+#include <vector>
+
+// custom files:
+#include <Color.cpp>
+#include <Framebuffer.cpp>
+#include <RaySort.cpp> // order the rays are traced in
+#include <ThreadPool.cpp>
+
+using namespace std;
+
+struct WavefrontRay {
+    Vector3 origin;
+    Vector3 dir; // normalized
+    float t_min; // 1 for the camera rays, shadowEpsilon for the secondary rays
+    float weight; // share of the color of its pixel the ray brings back
+    int pixel; // index of the pixel in the chunk being rendered
+};
+
+struct WavefrontHit {
+    /**
+     * What the shade stage found for a ray of the queue
+    */
+    HitRecord hit;
+    COLORREF color; // surface color at the hitpoint, backgroundColor for a miss
+    Vector3 position, normal;
+    Material material; // matte for a miss
+    bool solid; // hit a sphere or a box, which refract light (the other primitives are thin)
+    int firstShadowRay, shadowRayCount; // its shadow rays in the shadow queue
+    int firstChild, childCount; // its reflected and refracted rays in the queue of the next bounce
+};
+
+struct WavefrontShadowRay {
+    Vector3 origin; // hitpoint the ray starts from
+    Vector3 dir; // normalized direction towards the light
+    float contribution; // intensity the light brings to the hitpoint if nothing blocks it
+    int light; // index of the light, point lights first, then directional lights and merged point lights (see visitPointLights)
+    bool obstructed;
+    bool cachedOccluder; // obstructed by the primitive that blocked the previous ray of the thread towards the light
+};
+
+struct WavefrontBounce {
+    int depth; // 0 for the camera rays
+    long long rays; // rays traced at this depth
+    long long hits;
+    long long shadowRays;
+    long long repeatedHits; // rays hitting the primitive the ray traced before them hit
+    long long obstructedRays; // shadow rays not reaching their light
+    long long cachedOccluders; // shadow rays blocked by the occluder of the previous ray (see OcclusionCache)
+    double sortTime, intersectTime, shadeTime, shadowTime, spawnTime; // milliseconds spent in each stage
+};
+
+static void surfaceOf(const CompiledScene& scene, const HitRecord& hit, int& material, bool& solid) {
+    /**
+     * Finds the material index and the kind of surface of the primitive a ray hit, looking into
+     * the prototype of an instance
+    */
+    PrimitiveType type = scene.primitiveType(hit.index);
+    int i = hit.index - scene.groups[type].first;
+    solid = type == SPHERE || type == BOX;
+    switch (type) {
+        case SPHERE: material = scene.spheres[i].material; break;
+        case PLANE: material = scene.planes[i].material; break;
+        case BOX: material = scene.boxes[i].material; break;
+        case TRIANGLE: material = scene.triangles[i].material; break;
+        case MESH: material = scene.meshes[scene.meshAt(i)].material; break;
+        case INSTANCE: {
+            const CompiledInstance& instance = scene.instances[i];
+            surfaceOf(scene.prototypes[instance.prototype], HitRecord{hit.t, hit.instancePrimitive}, material, solid);
+            break;
+        }
+        default: material = -1, solid = false; break; // not a primitive type
+    }
+}
+
+template <LightType TYPE>
+bool emitShadowRay(const CompiledLight& light, int lightIndex, const WavefrontHit& hit, WavefrontShadowRay* shadowRay) {
+    /**
+     * Writes the shadow ray of a light towards a hitpoint if the light shines on its front, like
+     * diffuseLight() traces it
+     *
+     * @param shadowRay Where the shadow ray is written, nullptr to only check the light
+     * @return false if the light is behind the surface (no shadow ray)
+    */
+    Vector3 lightDir = Vector3::normalize(LightKernel<TYPE>::toLight(light, hit.position));
+    float NdotDir = Vector3::dot(hit.normal, lightDir);
+    if (!(NdotDir > 0)) { // also skips the lights of degenerate normals (NaN)
+        return false;
+    }
+    if (shadowRay != nullptr) {
+        shadowRay->origin = hit.position;
+        shadowRay->dir = lightDir;
+        shadowRay->contribution = light.intensity * NdotDir/(Vector3::norm(hit.normal) * Vector3::norm(lightDir));
+        shadowRay->light = lightIndex;
+        shadowRay->obstructed = false;
+        shadowRay->cachedOccluder = false;
+    }
+    return true;
+}
+
+int emitShadowRays(const CompiledScene& scene, const WavefrontHit& hit, WavefrontShadowRay* shadowRays) {
+    /**
+     * Finds the lights shining on the front of a hitpoint, the ones lightIntensity() traces a
+     * shadow ray for (the point lights given by visitPointLights(), then the directional lights),
+     * and writes their shadow rays in that order
+     *
+     * @param shadowRays Where the shadow rays are written, nullptr to only count them
+     * @return The number of shadow rays
+    */
+    int count = 0;
+    visitPointLights(scene, hit.position, hit.normal, [&](const CompiledLight& light, int lightIndex) {
+        count += emitShadowRay<POINT_LIGHT>(light, lightIndex, hit, shadowRays != nullptr ? shadowRays + count : nullptr);
+    });
+    for (int i = 0; i < scene.directionalLightCount; i++) {
+        count += emitShadowRay<DIRECTIONAL_LIGHT>(scene.directionalLights[i], scene.pointLightCount + i, hit,
+                                                  shadowRays != nullptr ? shadowRays + count : nullptr);
+    }
+    return count;
+}
+
+class WavefrontRenderer {
+    /**
+     * Renders reflective and transparent surfaces (see Material) with queues of rays, up to
+     * maxDepth bounces after the camera rays. The image is rendered by chunks of pixels small
+     * enough for the queues of a chunk to hold every ray it can spawn: a ray spawns at most two
+     * rays (reflected and refracted), so a chunk has rayBudget >> maxDepth pixels. The shadow rays
+     * of a bounce are traced by batches of rays whose shadow rays fit in SHADOW_BUDGET, so their
+     * queue does not grow with the number of lights. The queues are allocated once by the
+     * constructor, so rendering does not allocate (unless a single hitpoint is lit by more than
+     * SHADOW_BUDGET lights).
+     *
+     * The color of a pixel is the sum over its rays of weight * (1 - reflective - transparency)
+     * * the lit color of the hitpoint, a miss bringing the background lit by the ambient light
+     * like in the other renderers. Matte surfaces are shaded exactly like shadeHitpoint() does,
+     * so a scene without materials gives the same image as renderParallel().
+     * Refraction follows Snell's law through spheres and boxes, a ray going out of one when it
+     * leaves through the side its normal points to, and total internal reflection adding to the
+     * reflection. Planes, triangles and meshes are thin: light goes through them unbent.
+     * Rays bringing less than 1/256 of the color of their pixel are not spawned, and shadow rays
+     * are blocked by any surface, transparent or not.
+     *
+     * With sortRays, the rays of the bounces after the camera rays and their shadow rays are traced
+     * in the order of their sort keys, their results staying in queue order: sorting makes the
+     * secondary rays coherent without changing any pixel. The camera rays and their shadow rays
+     * are coherent already, in pixel order.
+    */
+    public:
+        static constexpr int RAY_BUDGET = 1 << 17; // default size of the ray queues
+        static constexpr int MAX_DEPTH = 8; // chunks of RAY_BUDGET >> MAX_DEPTH pixels at least
+        static constexpr int BLOCK_SIZE = 256; // rays per task of the stages
+        static constexpr int SHADOW_BUDGET = 1 << 20; // size of the shadow queue at most
+
+        int maxDepth; // bounces after the camera rays
+        int rayBudget; // size of the ray queues
+        bool sortRays = true; // trace the secondary and shadow rays in key order
+        vector<WavefrontBounce> bounces; // statistics of every depth for the last render
+
+        WavefrontRenderer(int maxDepth, int lightCount, int rayBudget=RAY_BUDGET) {
+            /**
+             * @param maxDepth The number of bounces after the camera rays, up to MAX_DEPTH
+             * @param lightCount The number of point and directional lights of the scenes rendered,
+             *                   the shadow queue being smaller when they are few
+             * @param rayBudget The size of the ray queues, 0 for a renderer that is not used
+            */
+            this->maxDepth = max(0, min(maxDepth, MAX_DEPTH));
+            this->chunkPixels = max(1, rayBudget >> this->maxDepth);
+            this->rayBudget = this->chunkPixels << this->maxDepth; // a queue holds every ray of a chunk
+            this->rays.resize(this->rayBudget);
+            this->nextRays.resize(this->rayBudget);
+            this->hits.resize(this->rayBudget);
+            this->shadowRays.resize(min((size_t) this->rayBudget * max(lightCount, 1), (size_t) SHADOW_BUDGET));
+            this->sorter.reserve(max(this->shadowRays.size(), (size_t) this->rayBudget));
+            this->colors.resize((size_t) 3 * this->chunkPixels);
+            this->bounces.resize(this->maxDepth + 1);
+        }
+
+        static bool validDepth(int depth) {
+            return depth >= 0 && depth <= MAX_DEPTH;
+        }
+
+        void render(const CompiledScene& scene, Framebuffer& framebuffer, ThreadPool& pool) {
+            /**
+             * Renders a scene into a framebuffer, chunk by chunk of pixels in row order
+             *
+             * @param scene The scene to render
+             * @param framebuffer The image to render into, its size must be xRes by yRes
+             * @param pool The threads to render with
+            */
+            for (int depth = 0; depth <= this->maxDepth; depth++) {
+                this->bounces[depth] = WavefrontBounce{depth, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+            }
+            long long pixelCount = (long long) xRes * yRes;
+            for (long long first = 0; first < pixelCount; first += this->chunkPixels) {
+                int chunkSize = (int) min((long long) this->chunkPixels, pixelCount - first);
+                this->renderChunk(scene, framebuffer, pool, first, chunkSize);
+            }
+        }
+
+        long long totalRays() const {
+            long long total = 0;
+            for (const WavefrontBounce& bounce : this->bounces) {
+                total += bounce.rays;
+            }
+            return total;
+        }
+
+    private:
+        int chunkPixels; // pixels rendered at once
+        vector<WavefrontRay> rays; // queue of the current bounce
+        vector<WavefrontRay> nextRays; // queue of the next bounce, filled by the spawn stage
+        vector<WavefrontHit> hits; // what every ray of the queue hit
+        vector<WavefrontShadowRay> shadowRays; // queue of the shadow rays of the current bounce
+        vector<float> colors; // red, green and blue of every pixel of the chunk, summed over its rays
+        RaySorter sorter; // order of the rays, then of the shadow rays, of the current bounce
+
+        template <typename Stage>
+        static void forEachBlock(ThreadPool& pool, int count, const Stage& stage) {
+            /**
+             * Runs stage(begin, end) over blocks of BLOCK_SIZE elements of a queue of count elements
+            */
+            int blockCount = (count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            pool.run(blockCount, [&](int block) {
+                stage(block * BLOCK_SIZE, min(count, (block + 1) * BLOCK_SIZE));
+            });
+        }
+
+        template <typename Ray>
+        const int* sortQueue(ThreadPool& pool, const Ray* queue, int count) {
+            /**
+             * Sorts a queue of rays by their keys, on a grid over the bounds of their origins
+             *
+             * @return The positions of the rays in the order to trace them in
+            */
+            if (count == 0) {
+                return this->sorter.order.data();
+            }
+            Vector3 low = queue[0].origin, high = queue[0].origin;
+            for (int i = 1; i < count; i++) {
+                const Vector3& origin = queue[i].origin;
+                low = Vector3(min(low.x, origin.x), min(low.y, origin.y), min(low.z, origin.z));
+                high = Vector3(max(high.x, origin.x), max(high.y, origin.y), max(high.z, origin.z));
+            }
+            auto cellsPerUnit = [](float extent) {
+                return extent > 0 ? 512 / extent : 0.f;
+            };
+            Vector3 scale(cellsPerUnit(high.x - low.x), cellsPerUnit(high.y - low.y), cellsPerUnit(high.z - low.z));
+            uint32_t* keys = this->sorter.keys.data();
+            forEachBlock(pool, count, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    keys[i] = rayKey(queue[i].origin, queue[i].dir, low, scale);
+                }
+            });
+            this->sorter.sort(pool, count);
+            return this->sorter.order.data();
+        }
+
+        static double millisecondsSince(chrono::steady_clock::time_point start) {
+            return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        }
+
+        void renderChunk(const CompiledScene& scene, Framebuffer& framebuffer, ThreadPool& pool, long long first, int chunkSize) {
+            /**
+             * Renders the chunkSize pixels following pixel first (in row order), bounce after bounce
+            */
+            // generate
+            WavefrontRay* rays = this->rays.data();
+            forEachBlock(pool, chunkSize, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    long long pixel = first + i;
+                    WavefrontRay& ray = rays[i];
+                    ray.origin = scene.cameraPos;
+                    ray.dir = Vector3::normalize(screenToProjPlane(scene, (int) (pixel % xRes), (int) (pixel / xRes)) - scene.cameraPos);
+                    ray.t_min = 1;
+                    ray.weight = 1;
+                    ray.pixel = i;
+                }
+            });
+            fill(this->colors.begin(), this->colors.begin() + 3 * chunkSize, 0.f);
+            int rayCount = chunkSize;
+            for (int depth = 0; depth <= this->maxDepth && rayCount > 0; depth++) {
+                rayCount = this->traceBounce(scene, pool, depth, rayCount);
+                swap(this->rays, this->nextRays);
+            }
+            for (int i = 0; i < chunkSize; i++) {
+                long long pixel = first + i;
+                const float* color = this->colors.data() + 3 * i;
+                framebuffer.setPixel((int) (pixel % xRes), (int) (pixel / xRes),
+                                     RGB(min(color[0], 255.f), min(color[1], 255.f), min(color[2], 255.f)));
+            }
+        }
+
+        int traceBounce(const CompiledScene& scene, ThreadPool& pool, int depth, int rayCount) {
+            /**
+             * Runs the stages of one bounce over the rayCount rays of the queue, adding their
+             * colors to their pixels
+             *
+             * @return The number of rays spawned into the queue of the next bounce
+            */
+            WavefrontBounce& bounce = this->bounces[depth];
+            const WavefrontRay* rays = this->rays.data();
+            WavefrontHit* hits = this->hits.data();
+            bool spawning = depth < this->maxDepth;
+            bool sorting = this->sortRays && depth > 0;
+
+            // sort
+            auto start = chrono::steady_clock::now();
+            const int* order = sorting ? this->sortQueue(pool, rays, rayCount) : nullptr; // trace order, queue order if null
+            bounce.sortTime += millisecondsSince(start);
+
+            // intersect
+            start = chrono::steady_clock::now();
+            forEachBlock(pool, rayCount, [&](int begin, int end) {
+                for (int k = begin; k < end; k++) {
+                    int i = order != nullptr ? order[k] : k;
+                    hits[i].hit = closestHit(scene, rays[i].origin, rays[i].dir, rays[i].t_min, numeric_limits<float>::infinity());
+                }
+            });
+            bounce.intersectTime += millisecondsSince(start);
+            for (int k = 1; k < rayCount; k++) {
+                const HitRecord& hit = hits[order != nullptr ? order[k] : k].hit;
+                const HitRecord& previous = hits[order != nullptr ? order[k - 1] : k - 1].hit;
+                bounce.repeatedHits += hit.hit() && hit.index == previous.index && hit.instancePrimitive == previous.instancePrimitive;
+            }
+
+            // shade: attributes and materials of the hitpoints, and how many rays each one needs
+            start = chrono::steady_clock::now();
+            forEachBlock(pool, rayCount, [&](int begin, int end) {
+                for (int k = begin; k < end; k++) {
+                    int i = order != nullptr ? order[k] : k;
+                    this->shadeRay(scene, rays[i], hits[i], spawning);
+                }
+            });
+            int childCount = 0;
+            for (int i = 0; i < rayCount; i++) { // queue positions of the rays they spawn
+                hits[i].firstChild = childCount;
+                childCount += hits[i].childCount;
+            }
+            bounce.shadeTime += millisecondsSince(start);
+
+            // shadow, by batches of rays whose shadow rays fit in the shadow queue
+            for (int batchStart = 0; batchStart < rayCount;) {
+                int batchEnd = batchStart, shadowRayCount = 0;
+                while (batchEnd < rayCount && (batchEnd == batchStart
+                                               || shadowRayCount + hits[batchEnd].shadowRayCount <= (int) this->shadowRays.size())) {
+                    hits[batchEnd].firstShadowRay = shadowRayCount;
+                    shadowRayCount += hits[batchEnd].shadowRayCount;
+                    batchEnd++;
+                }
+                if (shadowRayCount > (int) this->shadowRays.size()) { // a hitpoint lit by more lights than the queue holds
+                    this->shadowRays.resize(shadowRayCount);
+                    this->sorter.reserve(shadowRayCount);
+                }
+                this->traceShadowRays(scene, pool, bounce, sorting, batchStart, batchEnd, shadowRayCount);
+                batchStart = batchEnd;
+            }
+
+            // spawn
+            start = chrono::steady_clock::now();
+            WavefrontRay* nextRays = this->nextRays.data();
+            forEachBlock(pool, rayCount, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    if (hits[i].childCount > 0) {
+                        spawnRays(rays[i], hits[i], nextRays + hits[i].firstChild);
+                    }
+                }
+            });
+            bounce.spawnTime += millisecondsSince(start);
+
+            bounce.rays += rayCount;
+            for (int i = 0; i < rayCount; i++) {
+                bounce.hits += hits[i].hit.hit();
+            }
+            return childCount;
+        }
+
+        void traceShadowRays(const CompiledScene& scene, ThreadPool& pool, WavefrontBounce& bounce, bool sorting,
+                             int begin, int end, int shadowRayCount) {
+            /**
+             * Runs the shadow stage over the rays begin to end-1 of the queue, whose shadow rays
+             * fill the first shadowRayCount rays of the shadow queue, and adds their colors to
+             * their pixels
+            */
+            auto start = chrono::steady_clock::now();
+            const WavefrontRay* rays = this->rays.data();
+            const WavefrontHit* hits = this->hits.data();
+            WavefrontShadowRay* shadowRays = this->shadowRays.data();
+            forEachBlock(pool, end - begin, [&](int blockBegin, int blockEnd) {
+                for (int i = begin + blockBegin; i < begin + blockEnd; i++) {
+                    const WavefrontHit& hit = hits[i];
+                    if (hit.shadowRayCount > 0) {
+                        emitShadowRays(scene, hit, shadowRays + hit.firstShadowRay);
+                    }
+                }
+            });
+            bounce.shadowTime += millisecondsSince(start);
+            start = chrono::steady_clock::now();
+            const int* shadowOrder = sorting ? this->sortQueue(pool, shadowRays, shadowRayCount) : nullptr;
+            bounce.sortTime += millisecondsSince(start);
+            start = chrono::steady_clock::now();
+            forEachBlock(pool, shadowRayCount, [&](int blockBegin, int blockEnd) {
+                for (int k = blockBegin; k < blockEnd; k++) {
+                    WavefrontShadowRay& shadowRay = shadowRays[shadowOrder != nullptr ? shadowOrder[k] : k];
+                    int light = shadowRay.light, lightCount = scene.pointLightCount + scene.directionalLightCount;
+                    if (light < scene.pointLightCount) {
+                        shadowRay.obstructed = isLightObstructed<POINT_LIGHT>(scene, scene.pointLights[light], light, shadowRay.origin,
+                                                                              shadowRay.dir, &shadowRay.cachedOccluder);
+                    }
+                    else if (light < lightCount) {
+                        shadowRay.obstructed = isLightObstructed<DIRECTIONAL_LIGHT>(scene, scene.directionalLights[light - scene.pointLightCount],
+                                                                                    light, shadowRay.origin, shadowRay.dir,
+                                                                                    &shadowRay.cachedOccluder);
+                    }
+                    else { // merged point lights
+                        shadowRay.obstructed = isLightObstructed<POINT_LIGHT>(scene, scene.lightNodes[light - lightCount].mergedLight(), light,
+                                                                              shadowRay.origin, shadowRay.dir, &shadowRay.cachedOccluder);
+                    }
+                }
+            });
+            // the lit colors are added in queue order, so that renders do not depend on the threads
+            for (int i = begin; i < end; i++) {
+                this->accumulate(scene, rays[i], hits[i]);
+            }
+            bounce.shadowTime += millisecondsSince(start);
+            bounce.shadowRays += shadowRayCount;
+            for (int k = 0; k < shadowRayCount; k++) {
+                bounce.obstructedRays += shadowRays[k].obstructed;
+                bounce.cachedOccluders += shadowRays[k].cachedOccluder;
+            }
+        }
+
+        static void shadeRay(const CompiledScene& scene, const WavefrontRay& ray, WavefrontHit& hit, bool spawning) {
+            /**
+             * Computes the attributes and the material of the hitpoint of a ray, and the number of
+             * shadow rays and secondary rays it needs
+            */
+            tie(hit.color, hit.position, hit.normal) = hitAttributes(scene, ray.origin, ray.dir, hit.hit);
+            hit.material = Material();
+            hit.solid = false;
+            hit.shadowRayCount = 0;
+            hit.childCount = 0;
+            if (!hit.hit.hit()) {
+                return;
+            }
+            int material = -1;
+            surfaceOf(scene, hit.hit, material, hit.solid);
+            if (material >= 0 && material < scene.materialCount) {
+                hit.material = scene.materials[material];
+            }
+            hit.shadowRayCount = emitShadowRays(scene, hit, nullptr);
+            if (spawning) {
+                hit.childCount = spawnRays(ray, hit, nullptr);
+            }
+        }
+
+        void accumulate(const CompiledScene& scene, const WavefrontRay& ray, const WavefrontHit& hit) {
+            /**
+             * Adds the lit color of the hitpoint of a ray to its pixel, summing the lights like
+             * lightIntensity() does (ambient light, then the point lights, then the directional lights)
+            */
+            float pointIntensity = 0, directionalIntensity = 0;
+            for (int k = hit.firstShadowRay; k < hit.firstShadowRay + hit.shadowRayCount; k++) {
+                const WavefrontShadowRay& shadowRay = this->shadowRays[k];
+                if (!shadowRay.obstructed) {
+                    bool directional = shadowRay.light >= scene.pointLightCount
+                                       && shadowRay.light < scene.pointLightCount + scene.directionalLightCount;
+                    (directional ? directionalIntensity : pointIntensity) += shadowRay.contribution;
+                }
+            }
+            float intensity = scene.ambientIntensity;
+            intensity += pointIntensity;
+            intensity += directionalIntensity;
+            intensity = max((float) 0, min(intensity, (float) 1));
+            float share = ray.weight * (1 - hit.material.reflective - hit.material.transparency);
+            float* color = this->colors.data() + 3 * ray.pixel;
+            color[0] += share * (GetRValue(hit.color) * intensity);
+            color[1] += share * (GetGValue(hit.color) * intensity);
+            color[2] += share * (GetBValue(hit.color) * intensity);
+        }
+
+        static int spawnRays(const WavefrontRay& ray, const WavefrontHit& hit, WavefrontRay* children) {
+            /**
+             * Computes the reflected and refracted rays of a hitpoint, the ones bringing less than
+             * 1/256 of the color of the pixel being dropped
+             *
+             * @param children Where the rays are written, nullptr to only count them
+             * @return The number of rays
+            */
+            const Material& material = hit.material;
+            Vector3 normal = Vector3::normalize(hit.normal);
+            float DdotN = Vector3::dot(ray.dir, normal);
+            float reflected = material.reflective, refracted = material.transparency;
+            Vector3 refractedDir = ray.dir; // thin surfaces let light through unbent
+            if (refracted > 0 && hit.solid) {
+                bool entering = DdotN < 0;
+                float eta = entering ? 1 / material.refractiveIndex : material.refractiveIndex;
+                Vector3 facing = entering ? normal : -normal; // normal on the side the ray comes from
+                float cosIncident = entering ? -DdotN : DdotN;
+                float k = 1 - eta * eta * (1 - cosIncident * cosIncident);
+                if (k < 0) { // total internal reflection
+                    reflected += refracted;
+                    refracted = 0;
+                }
+                else {
+                    refractedDir = Vector3::normalize(ray.dir * eta + facing * (eta * cosIncident - sqrtf(k)));
+                }
+            }
+            int count = 0;
+            auto spawn = [&](const Vector3& dir, float share) {
+                float weight = ray.weight * share;
+                if (weight < 1.f / 256) {
+                    return;
+                }
+                if (children != nullptr) {
+                    children[count] = WavefrontRay{hit.position, dir, shadowEpsilon, weight, ray.pixel};
+                }
+                count++;
+            };
+            spawn(ray.dir - normal * (2 * DdotN), reflected);
+            spawn(refractedDir, refracted);
+            return count;
+        }
+};
@@ -1,75 +1,42 @@
 #define UNICODE
 
-#include <windows.h>
+// Without HEADLESS, the Windows build renders into a window. Everywhere else (or with
+// HEADLESS defined), the renderer runs without any display and writes an image file.
+#if defined(_WIN32) && !defined(HEADLESS)
+#define WINDOWED
+#endif
+
 #include <iostream>
 #include <string>
 #include <tuple>
 #include <vector>
 #include <limits>
 #include <math.h>
+#include <stdlib.h>
+#include <chrono>
+
+// custom files:
+#include <Color.cpp> // for COLORREF and RGB() (includes windows.h on Windows)
+#include <Framebuffer.cpp> // in-memory image the renderer writes into
+#include <ImageWriter.cpp> // for PPM and PNG output
+#include <ThreadPool.cpp> // for multithreaded rendering
+#include <AllocationCounter.cpp> // counts the heap allocations, to check the render loop does not allocate
+#include <Vector3.cpp> // for 3D vectors
 
 using namespace std;
 
+#ifdef WINDOWED
 static HWND sHwnd;
+#endif
 static COLORREF defaultColor = RGB(255, 0, 0); // will be used the default color for a pixel if not specified
 static COLORREF backgroundColor = RGB(0, 0, 0);
 static int xRes = 500; // image resolution in pixels
 static int yRes = 500;
+static int threadCount = 0; // number of render threads (0: one per hardware thread)
+static int tileSize = 16; // width and height in pixels of the tiles rendered by each thread task
+static float lightErrorBound = 0; // largest error on the lighting of a hitpoint by a group of merged point lights, 0 shades every light
 
 
-class Vector3{ // stores the coordinates of a Vector3 in 3D space
-    public:
-        float x, y, z; // Vector3 coordinates
-
-        Vector3() {} // default constructor
-
-        Vector3(float x, float y, float z){
-            this->x = x;
-            this->y = y;
-            this->z = z;
-        }
-
-        Vector3 operator + (Vector3 B) {
-            return Vector3(this->x + B.x, this->y + B.y, this->z + B.z);
-        }
-
-        Vector3 operator - (Vector3 B) {
-            return Vector3(B.x - this->x, B.y - this->y, B.z - this->z);
-        }
-        
-        Vector3 operator * (float scalar) {
-            return Vector3(this->x * scalar, this->y * scalar, this->z * scalar);
-        }
-
-        Vector3 operator / (float scalar) {
-            return Vector3(this->x / scalar, this->y / scalar, this->z / scalar);
-        }
-
-        bool operator == (Vector3 B) {
-            return this->x == B.x && this->y == B.y && this->z == B.z;
-        }
-
-        static float distance(Vector3 A, Vector3 B) { // computes the distance between A and B
-            return sqrt(pow(B.x - A.x, 2) + pow(B.y - A.y, 2) + pow(B.z - A.z, 2));
-        }
-
-        static float dot(Vector3 A, Vector3 B) { // computes the dot product between A and B
-            return A.x * B.x + A.y * B.y + A.z * B.z;
-        }
-
-        static float norm(Vector3 A) {
-            return sqrt(pow(A.x, 2) + pow(A.y, 2) + pow(A.z, 2));
-        }
-
-        static Vector3 normalize(Vector3 A) {
-            return A/Vector3::norm(A);
-        }
-
-        string toString() {
-            return "(" + to_string(this->x) + ", " + to_string(this->y) + ", " + to_string(this->z) + ")";
-        }
-};
-
 class Light {
     public:
         string type;
@@ -91,6 +58,7 @@ class Sphere{ // a sphere that has a geometry (center, radius) and a color
         Vector3 center;
         float radius;
         COLORREF color;
+        int material = -1; // index in the materials of the scene, -1 for a matte surface (see Material)
 
         Sphere() {} // default Sphere constructor
     
@@ -100,41 +68,62 @@ class Sphere{ // a sphere that has a geometry (center, radius) and a color
             this->color = color;
         }
 
-        tuple<float, float, Vector3, Vector3, Vector3, Vector3> intersectRay(Vector3 origin, Vector3 target) {
+        tuple<float, float> intersectDistances(const Vector3& origin, const Vector3& rayDir) const {
             /**
-             * Compute the intersection Vector3(s) between this and the ray that goes
-             * from origin and pass by target
+             * Compute only the distances of the intersections between this and the ray that
+             * goes from origin in the (normalized) direction rayDir
              * 
              * @param origin The origin of the ray
-             * @param target The target of the ray
-             * @return a tupple (t1, t2, H1, H2; N1, N2) of a couple of floats containing the intersection
-             *         (returns (infinity, infinity) if there is no intersection), a couple of Vector3
-             *         that are the hipoints respectivly at t1 and t2 and finally a couple of Vector3
-             *         that are the normals of the hitpoints (0 if no intersection)
+             * @param rayDir The normalized direction of the ray, Vector3::normalize(target - origin)
+             * @return a couple (t1, t2) of distances, (infinity, infinity) if there is no intersection
             */
             Vector3 CO = origin - this->center; // vector from the sphere to the origin
-            Vector3 rayDir = Vector3::normalize(origin - target); // direction of the ray
             float a = Vector3::dot(rayDir, rayDir);
             float b = 2 * Vector3::dot(CO, rayDir);
             float c = Vector3::dot(CO, CO) - pow(this->radius, 2);
             float discriminant = pow(b, 2) - 4*a*c;
             if (discriminant < 0) { // case where there is no intersection
-                return make_tuple(numeric_limits<float>::infinity(), numeric_limits<float>::infinity(), Vector3(0, 0, 0), Vector3(0, 0, 0), Vector3(0, 0, 0), Vector3(0, 0, 0));
+                return make_tuple(numeric_limits<float>::infinity(), numeric_limits<float>::infinity());
             }
             float t1 = (-b + sqrt(discriminant)) / (2*a);
             float t2 = (-b - sqrt(discriminant)) / (2*a);
-            Vector3 H1 = rayDir * t1; // hitpoint 1
-            Vector3 H2 = rayDir * t2; // hitpoint 2
-            Vector3 N1 = Vector3::normalize(H1 - this->center); // normal at H1
-            Vector3 N2 = Vector3::normalize(H2 - this->center); // normal at H2
-            return make_tuple(t1, t2, H1, H2, N1, N2);
+            return make_tuple(t1, t2);
+        }
+
+        Vector3 normalAt(const Vector3& position) const {
+            /**
+             * Computes the normal of the sphere at a point of its surface
+             *
+             * @param position A point of the surface, usually a hitpoint
+             * @return The normalized normal at position, pointing out of the sphere
+            */
+            return Vector3::normalize(position - this->center);
         }
 
-        string toString() {
+        string toString() const {
             return "Center: " + this->center.toString() + ",   radius: " + to_string(this->radius);
         }
 };
 
+// custom files (build on the Sphere class above):
+#include <Primitives.cpp> // planes, boxes, triangles and meshes
+#include <Instances.cpp> // prototypes and their instances
+
+struct HitRecord {
+    /**
+     * Closest hit of a ray, as found by closestHit(): the distance of the hitpoint and the
+     * primitive hit, nothing more. The position, normal and color of the hitpoint are computed
+     * by hitAttributes(), once for the final hit of the ray.
+    */
+    float t = numeric_limits<float>::infinity(); // distance of the hitpoint along the ray
+    int index = -1; // identifier of the primitive hit (see PrimitiveGroup), -1 if the ray hit nothing
+    int instancePrimitive = -1; // for an instance, identifier of the primitive hit in its prototype
+
+    bool hit() const {
+        return this->index != -1;
+    }
+};
+
 class Scene { // a scene that contains objects and a projection plane (viewport)
     public:
         Vector3 cameraPos;
@@ -142,6 +131,13 @@ class Scene { // a scene that contains objects and a projection plane (viewport)
         float projPlaneHeight; 
         float projPlaneDistance; // controls the inverse camera fov
         vector<Sphere> spheres; // contains all spheres in the scene
+        vector<Plane> planes; // contains all planes in the scene
+        vector<Box> boxes; // contains all boxes in the scene
+        vector<Triangle> triangles; // contains all triangles in the scene
+        vector<Mesh> meshes; // contains all triangle meshes in the scene
+        vector<Prototype> prototypes; // contains the geometry shared by the instances
+        vector<Instance> instances; // contains all instances of prototypes in the scene
+        vector<Material> materials; // contains the materials the primitives refer to (prototypes included)
         vector<Light> lights; // contains all lights in the scene
 
         Scene() {} // default Scene constructor
@@ -150,74 +146,557 @@ class Scene { // a scene that contains objects and a projection plane (viewport)
             this->cameraPos = cameraPos;
             this->projPlaneWidth = projPlaneWidth;
             this->projPlaneHeight = projPlaneHeight;
-            this->projPlaneDistance = -projPlaneDistance; // needs to be negative for some reason ¯\_(ツ)_/¯
+            this->projPlaneDistance = projPlaneDistance;
             this->spheres = spheres;
             this->lights = lights;
         }
 
         static Scene getDefaultScene() { // returns default scene with three spheres and a ground
             // the whole scene is hardcoded
-            return Scene(Vector3(0, 0, 0), // camera position
-                         1, 1, 1, // projection plane properties
-                         { // vector of spheres in the scene
-                            Sphere(Vector3(3, 0, 9), 1, RGB(255, 0, 0)),
-                            Sphere(Vector3(0, 0, 9), 1, RGB(0, 255, 0)),
-                            Sphere(Vector3(-3, 0, 9), 1, RGB(0, 0, 255)),
-                            Sphere(Vector3(0, -10001, 0), 10000, RGB(150, 150, 150)) // ground
-                         }, { // vector of lights in the scene
-                            Light("ambient", .1, Vector3(0, 0, 0), Vector3(0, 0, 0)),
-                            Light("point", 1, Vector3(0, 2, 7), Vector3(0, 0, 0)),
-                            // Light("directional", 1, Vector3(0, 0, 0), Vector3(-1, -1, 2))
-                         });
+            Scene scene(Vector3(0, 0, 0), // camera position
+                        1, 1, 1, // projection plane properties
+                        { // vector of spheres in the scene
+                           Sphere(Vector3(3, 0, 9), 1, RGB(255, 0, 0)),
+                           Sphere(Vector3(0, 0, 9), 1, RGB(0, 255, 0)),
+                           Sphere(Vector3(-3, 0, 9), 1, RGB(0, 0, 255))
+                        }, { // vector of lights in the scene
+                           Light("ambient", .1, Vector3(0, 0, 0), Vector3(0, 0, 0)),
+                           Light("point", 1, Vector3(0, 2, 7), Vector3(0, 0, 0)),
+                           // Light("directional", 1, Vector3(0, 0, 0), Vector3(-1, -1, 2))
+                        });
+            scene.planes = {Plane(Vector3(0, -1, 0), Vector3(0, 1, 0), RGB(150, 150, 150))}; // ground
+            return scene;
+        }
+
+        static Scene getReflectiveScene(int sphereCount=-1, int pointLightCount=1) {
+            /**
+             * Returns the default scene (or the random scene of sphereCount spheres and
+             * pointLightCount point lights) with
+             * materials: every second sphere of three is a mirror, every third one is glass and
+             * the ground is slightly reflective (only the wavefront renderer shows them), so the
+             * default scene gets a mirror in the middle and a glass sphere on the left
+            */
+            Scene scene = sphereCount >= 0 ? getRandomScene(sphereCount, 1, pointLightCount) : getDefaultScene();
+            scene.materials = {Material(.8f, 0, 1), Material(.1f, .8f, 1.5f), Material(.3f, 0, 1)};
+            for (size_t i = 0; i < scene.spheres.size(); i++) {
+                scene.spheres[i].material = i % 3 == 1 ? 0 : i % 3 == 2 ? 1 : -1;
+            }
+            scene.planes[0].material = 2;
+            return scene;
+        }
+
+        static Scene getRandomScene(int sphereCount, unsigned int seed=1, int pointLightCount=1) {
+            /**
+             * Returns the default scene's camera, ground and lights with sphereCount randomly placed
+             * spheres in front of the camera. The same seed always gives the same scene, on any
+             * platform (no standard library distribution is involved).
+             * With pointLightCount other than 1, the point light of the default scene is replaced by
+             * pointLightCount randomly placed point lights sharing the same total intensity.
+            */
+            Scene scene = getDefaultScene();
+            scene.spheres.clear(); // the ground plane is kept
+            unsigned int state = seed * 2654435761u + 1;
+            auto random = [&state]() { // uniform float in [0, 1)
+                state = state * 1664525u + 1013904223u;
+                return (state >> 8) * (1.f / 16777216.f);
+            };
+            float radiusScale = min(1.f, (float) cbrt(2000. / max(sphereCount, 1))); // keeps the spheres from filling the view
+            for (int i = 0; i < sphereCount; i++) {
+                float z = 4 + random() * 36;
+                float radius = (.1f + random() * .4f) * radiusScale;
+                float x = (random() - .5f) * z;
+                float y = -1 + radius + random() * z * .5f;
+                COLORREF color = RGB(55 + random() * 200, 55 + random() * 200, 55 + random() * 200);
+                scene.spheres.push_back(Sphere(Vector3(x, y, z), radius, color));
+            }
+            if (pointLightCount != 1) {
+                scene.lights = {scene.lights[0]}; // ambient light
+                for (int i = 0; i < pointLightCount; i++) {
+                    Vector3 position((random() - .5f) * 20, 1 + random() * 10, random() * 20);
+                    scene.lights.push_back(Light("point", 1.f / pointLightCount, position, Vector3(0, 0, 0)));
+                }
+            }
+            return scene;
+        }
+
+        static Scene getInstancedScene(int instanceCount, unsigned int seed=1) {
+            /**
+             * Returns the default scene's camera, ground and lights with instanceCount randomly
+             * placed, turned and scaled instances of two prototypes: three spheres around a box,
+             * and a sphere mesh of 20000 triangles. Every third instance has its own color. The
+             * geometry of the prototypes is stored once, whatever the number of instances.
+            */
+            Scene scene = getDefaultScene();
+            scene.spheres.clear(); // the ground plane is kept
+            Prototype cluster;
+            cluster.spheres = {Sphere(Vector3(-.6f, 0, 0), .4f, RGB(255, 0, 0)), Sphere(Vector3(.6f, 0, 0), .4f, RGB(0, 255, 0)),
+                               Sphere(Vector3(0, .6f, 0), .4f, RGB(0, 0, 255))};
+            cluster.boxes = {Box(Vector3(-.3f, -.3f, -.3f), Vector3(.3f, .3f, .3f), RGB(200, 200, 200))};
+            Prototype ball;
+            ball.meshes = {Mesh::getSphereMesh(20000, Vector3(0, 0, 0), .8f, RGB(255, 200, 0))};
+            scene.prototypes = {cluster, ball};
+            unsigned int state = seed * 2654435761u + 1;
+            auto random = [&state]() { // uniform float in [0, 1), like in getRandomScene
+                state = state * 1664525u + 1013904223u;
+                return (state >> 8) * (1.f / 16777216.f);
+            };
+            float sizeScale = min(1.f, (float) cbrt(2000. / max(instanceCount, 1))); // keeps the instances from filling the view
+            for (int i = 0; i < instanceCount; i++) {
+                float z = 4 + random() * 36;
+                float size = (.2f + random() * .4f) * sizeScale;
+                Vector3 position((random() - .5f) * z, -1 + size + random() * z * .5f, z);
+                Vector3 axis(random() - .5f, random() - .5f, random() - .5f);
+                Transform transform = Transform::translation(position) * Transform::rotation(axis, random() * 360)
+                                      * Transform::scaling(size);
+                int prototype = i % 2;
+                if (i % 3 == 2) {
+                    COLORREF color = RGB(55 + random() * 200, 55 + random() * 200, 55 + random() * 200);
+                    scene.instances.push_back(Instance(prototype, transform, color));
+                }
+                else {
+                    scene.instances.push_back(Instance(prototype, transform));
+                }
+            }
+            return scene;
         }
 };
 
-void SetWindowHandle(HWND hwnd) {
-    sHwnd=hwnd;
-}
+// custom file (builds on the Scene class above):
+#include <CompiledScene.cpp> // flat read-only scene used by the render loop
+#include <RenderStats.cpp> // optional per-pixel statistics (compile with RENDER_STATS)
+#include <SceneFile.cpp> // text and binary scene files
 
-Vector3 screenToProjPlane(Scene scene, int screenX, int screenY) {
+Vector3 screenToProjPlane(const CompiledScene& scene, float screenX, float screenY) {
     /**
      * Convert a pixel position in the canvas into a 3D viewport position in the projection
      * plane
      * 
      * @param scene The scene that needs to be rendered
-     * @param screenX The x coordinate in the canvas
+     * @param screenX The x coordinate in the canvas (pixel centers are at integer coordinates)
      * @param screenY The y coordinate in the canvas
      * @return a 3-upple of coordinates in the viewport (projection plane in 3D space)
     */
-    float vpX = screenX * scene.projPlaneWidth/xRes - scene.projPlaneWidth/2;
-    float vpY = screenY * scene.projPlaneHeight/yRes - scene.projPlaneHeight/2;
+    // the canvas y axis goes down while the scene one goes up, and the canvas x axis goes
+    // right while the scene one goes left (as seen from the camera)
+    float vpX = scene.projPlaneWidth/2 - screenX * scene.projPlaneWidth/xRes;
+    float vpY = scene.projPlaneHeight/2 - screenY * scene.projPlaneHeight/yRes;
     float vpZ = scene.projPlaneDistance;
-    return Vector3(vpX, vpY, vpZ);
+    Vector3 cameraPos = scene.cameraPos;
+    return cameraPos + Vector3(vpX, vpY, vpZ);
+}
+
+template <PrimitiveType TYPE>
+int nearestInRange(const CompiledScene& scene, const PrimitiveRay& ray, int begin, int end, float t_min, float t_max, float& t) {
+    /**
+     * Finds the closest intersection, between t_min and t_max, of a ray with the primitives of a
+     * type at the positions [begin, end) of its arrays (in BVH order if it has a BVH)
+     *
+     * @return The position of the closest primitive, -1 if none is hit. t is set to its distance.
+    */
+    return nearestPrimitive<TYPE>(scene.groups[TYPE].arrays, begin, end, ray, t_min, t_max, t);
+}
+
+template <>
+int nearestInRange<SPHERE>(const CompiledScene& scene, const PrimitiveRay& ray, int begin, int end, float t_min, float t_max, float& t) {
+    // spheres are tested with the selected SIMD kernel when the sphere arrays are built, and one
+    // by one with Sphere::intersectDistances otherwise (ties going to the lowest sphere index)
+    const SphereArrays& arrays = scene.sphereArrays;
+    if (arrays.count == scene.sphereCount) {
+        return nearestSphere(arrays, begin, end, ray.origin, ray.dir, t_min, t_max, t);
+    }
+    Vector3 origin(ray.origin[0], ray.origin[1], ray.origin[2]);
+    Vector3 rayDir(ray.dir[0], ray.dir[1], ray.dir[2]);
+    int nearest = -1, nearestIndex = -1;
+    t = numeric_limits<float>::infinity();
+    for (int k = begin; k < end; k++) {
+        int i = scene.bvhNodeCount == 0 ? k : scene.bvhPrimitives[k];
+        float t1, t2; // distance of the hitpoints (infinity if no intersection)
+        tie(t1, t2) = scene.spheres[i].intersectDistances(origin, rayDir);
+        for (float tk : {t1, t2}) {
+            if (t_min <= tk && tk <= t_max && (tk < t || (tk == t && i < nearestIndex))) {
+                nearest = k, nearestIndex = i, t = tk;
+            }
+        }
+    }
+    return nearest;
 }
 
-tuple<float, Sphere> closestIntersection(Scene scene, Vector3 origin, Vector3 target, float t_min, float t_max) {
+template <PrimitiveType TYPE>
+int primitiveAt(const CompiledScene& scene, int position) {
+    /**
+     * Returns the identifier of the primitive of a type at a position of its arrays
+    */
+    const PrimitiveGroup& group = scene.groups[TYPE];
+    return group.first + group.arrays.index[position];
+}
+
+template <>
+int nearestInRange<MESH>(const CompiledScene& scene, const PrimitiveRay& ray, int begin, int end, float t_min, float t_max, float& t) {
+    return nearestMeshTriangle(scene.meshArrays, begin, end, ray, t_min, t_max, t);
+}
+
+template <>
+int primitiveAt<MESH>(const CompiledScene& scene, int position) {
+    return scene.groups[MESH].first + scene.meshArrays.order[position];
+}
+
+template <>
+int primitiveAt<SPHERE>(const CompiledScene& scene, int position) {
+    if (scene.sphereArrays.count == scene.sphereCount) {
+        return scene.sphereArrays.index[position];
+    }
+    return scene.bvhNodeCount == 0 ? position : scene.bvhPrimitives[position];
+}
+
+template <PrimitiveType TYPE>
+void closestInBVH(const CompiledScene& scene, const PrimitiveRay& ray, const BVHNode* nodes, int nodeCount, int offset, int count,
+                  float t_min, float t_max, HitRecord& closest, int& visitedNodes) {
+    /**
+     * Finds the closest hit of a ray with the primitives of a type at the positions [offset,
+     * offset+count) of its arrays, through a BVH over them if nodeCount is not 0 (whose leaves
+     * number them from 0), and keeps it if it is closer than closest
+     *
+     * @param visitedNodes Increased by the number of BVH nodes visited by the ray
+    */
+    auto testRange = [&](int begin, int end, float tMax) { // keeps the closest of the hits found so far
+        STATS(pixelStats.intersectionTests += end - begin;)
+        float t;
+        int k = nearestInRange<TYPE>(scene, ray, begin, end, t_min, tMax, t);
+        if (k == -1) {
+            return;
+        }
+        int primitive = primitiveAt<TYPE>(scene, k);
+        if (t < closest.t || (t == closest.t && primitive < closest.index)) {
+            closest.index = primitive;
+            closest.t = t;
+        }
+    };
+    float tMax = min(t_max, closest.t); // farther primitives cannot give a closer hit
+    if (nodeCount == 0) {
+        if (count > 0) {
+            testRange(offset, offset + count, tMax);
+        }
+        return;
+    }
+    visitedNodes += BVH::traverse(nodes, nodeCount, ray.origin, ray.dir, t_min, tMax, [&](int first, int count, float& tMax) {
+        testRange(offset + first, offset + first + count, tMax);
+        tMax = min(tMax, closest.t); // farther nodes cannot contain a closer hit
+        return false;
+    });
+}
+
+template <PrimitiveType TYPE>
+void closestOfType(const CompiledScene& scene, const PrimitiveRay& ray, float t_min, float t_max, HitRecord& closest, int& visitedNodes) {
+    /**
+     * Finds the closest hit of a ray with the primitives of one type, through the BVH of the
+     * type if it has one, and keeps it if it is closer than closest
+     *
+     * @param visitedNodes Increased by the number of BVH nodes visited by the ray
+    */
+    const PrimitiveGroup& group = scene.groups[TYPE];
+    closestInBVH<TYPE>(scene, ray, group.bvhNodes, group.bvhNodeCount, 0, group.count, t_min, t_max, closest, visitedNodes);
+}
+
+template <>
+void closestOfType<MESH>(const CompiledScene& scene, const PrimitiveRay& ray, float t_min, float t_max, HitRecord& closest, int& visitedNodes) {
+    // every mesh has its own BVH, the root box of which skips the meshes the ray misses
+    for (int m = 0; m < scene.meshCount; m++) {
+        const CompiledMesh& mesh = scene.meshes[m];
+        closestInBVH<MESH>(scene, ray, scene.groups[MESH].bvhNodes + mesh.firstNode, mesh.nodeCount, mesh.firstTriangle, mesh.triangleCount,
+                           t_min, t_max, closest, visitedNodes);
+    }
+}
+
+PrimitiveRay toPrototype(const CompiledInstance& instance, const PrimitiveRay& ray) {
+    /**
+     * Moves a ray into the space of the prototype of an instance. Its direction is not normalized
+     * again, so that distances along the ray stay the ones of the scene.
+    */
+    Vector3 origin(ray.origin[0], ray.origin[1], ray.origin[2]);
+    Vector3 rayDir(ray.dir[0], ray.dir[1], ray.dir[2]);
+    return PrimitiveRay(instance.toPrototype.apply(origin), instance.toPrototype.applyLinear(rayDir));
+}
+
+template <>
+void closestOfType<INSTANCE>(const CompiledScene& scene, const PrimitiveRay& ray, float t_min, float t_max, HitRecord& closest, int& visitedNodes) {
+    // the top level BVH finds the instances the ray reaches, and the ray is traced again through
+    // the BVHs of the prototype of each of them (prototypes have no planes nor instances)
+    const PrimitiveGroup& group = scene.groups[INSTANCE];
+    auto testRange = [&](int begin, int end) {
+        STATS(pixelStats.intersectionTests += end - begin;)
+        for (int k = begin; k < end; k++) {
+            int i = group.arrays.index[k];
+            const CompiledInstance& instance = scene.instances[i];
+            const CompiledScene& prototype = scene.prototypes[instance.prototype];
+            PrimitiveRay local = toPrototype(instance, ray);
+            HitRecord hit;
+            float tMax = min(t_max, closest.t);
+            closestOfType<SPHERE>(prototype, local, t_min, tMax, hit, visitedNodes);
+            closestOfType<BOX>(prototype, local, t_min, tMax, hit, visitedNodes);
+            closestOfType<TRIANGLE>(prototype, local, t_min, tMax, hit, visitedNodes);
+            closestOfType<MESH>(prototype, local, t_min, tMax, hit, visitedNodes);
+            if (hit.hit() && (hit.t < closest.t || (hit.t == closest.t && group.first + i < closest.index))) {
+                closest.t = hit.t;
+                closest.index = group.first + i;
+                closest.instancePrimitive = hit.index;
+            }
+        }
+    };
+    float tMax = min(t_max, closest.t);
+    if (group.bvhNodeCount == 0) {
+        testRange(0, group.count);
+        return;
+    }
+    visitedNodes += BVH::traverse(group.bvhNodes, group.bvhNodeCount, ray.origin, ray.dir, t_min, tMax, [&](int first, int count, float& tMax) {
+        testRange(first, first + count);
+        tMax = min(tMax, closest.t);
+        return false;
+    });
+}
+
+HitRecord closestHit(const CompiledScene& scene, const Vector3& origin, const Vector3& rayDir, float t_min, float t_max, int* visitedNodes=nullptr) {
+    /**
+     * Find the primitive with the closest intersection with the ray comming from origin in the
+     * direction rayDir, restricted between t_min and t_max. Distances are measured like in
+     * Sphere::intersectDistances. Every type of primitive is searched on its own, through its own
+     * BVH if it is built (planes are always all tested, they have no bounds), the code testing
+     * each type being picked at compile time.
+     * On ties, the primitive with the lowest identifier wins, like when testing them in order.
+     * 
+     * @param scene The scene to trace the ray in
+     * @param origin The ray origin
+     * @param rayDir The normalized ray direction, Vector3::normalize(target - origin)
+     * @param t_min The minimum distance of a hitpoint
+     * @param t_max The maximum distance of a hitpoint
+     * @param visitedNodes If not null, set to the number of BVH nodes visited by the ray
+     * @return The distance of the closest hitpoint and the identifier of its primitive (index -1
+     *         and infinite distance if the ray hits nothing), and for an instance the primitive
+     *         of its prototype
+    */
+    PrimitiveRay ray(origin, rayDir);
+    HitRecord closest;
+    int visited = 0;
+    // planes come first: they are few, and the ground cuts most of the other searches short
+    closestOfType<PLANE>(scene, ray, t_min, t_max, closest, visited);
+    closestOfType<SPHERE>(scene, ray, t_min, t_max, closest, visited);
+    closestOfType<BOX>(scene, ray, t_min, t_max, closest, visited);
+    closestOfType<TRIANGLE>(scene, ray, t_min, t_max, closest, visited);
+    closestOfType<MESH>(scene, ray, t_min, t_max, closest, visited);
+    closestOfType<INSTANCE>(scene, ray, t_min, t_max, closest, visited);
+    if (visitedNodes != nullptr) {
+        *visitedNodes = visited;
+    }
+    return closest;
+}
+
+template <PrimitiveType TYPE>
+bool anyInBVH(const CompiledScene& scene, const PrimitiveRay& ray, const BVHNode* nodes, int nodeCount, int offset, int count,
+              float t_min, float t_max, int& occluder) {
+    /**
+     * Checks if a ray hits any primitive of a type at the positions [offset, offset+count) of its
+     * arrays between t_min and t_max, stopping at the first leaf of the BVH over them (if
+     * nodeCount is not 0) that holds one
+     *
+     * @param occluder Set to the position of the primitive found (see anyHit()) when the ray is blocked
+    */
+    const PrimitiveGroup& group = scene.groups[TYPE];
+    auto hitInRange = [&](int begin, int end) { // a primitive of the positions [begin, end) hit by the ray, -1 if none
+        STATS(pixelStats.intersectionTests += end - begin;)
+        float t;
+        return nearestInRange<TYPE>(scene, ray, begin, end, t_min, t_max, t);
+    };
+    if (nodeCount == 0) {
+        int k = count > 0 ? hitInRange(offset, offset + count) : -1;
+        if (k != -1) {
+            occluder = group.first + k;
+        }
+        return k != -1;
+    }
+    float tMax = t_max;
+    bool hit = false;
+    BVH::traverse(nodes, nodeCount, ray.origin, ray.dir, t_min, tMax, [&](int first, int count, float& tMax) {
+        int k = hitInRange(offset + first, offset + first + count);
+        if (k != -1) {
+            occluder = group.first + k;
+            hit = true;
+        }
+        return hit; // stops at the first blocking primitive
+    });
+    return hit;
+}
+
+template <PrimitiveType TYPE>
+bool anyOfType(const CompiledScene& scene, const PrimitiveRay& ray, float t_min, float t_max, int& occluder) {
+    /**
+     * Checks if a ray hits any primitive of one type between t_min and t_max, through the BVH of
+     * the type if it has one
+    */
+    const PrimitiveGroup& group = scene.groups[TYPE];
+    return anyInBVH<TYPE>(scene, ray, group.bvhNodes, group.bvhNodeCount, 0, group.count, t_min, t_max, occluder);
+}
+
+template <>
+bool anyOfType<MESH>(const CompiledScene& scene, const PrimitiveRay& ray, float t_min, float t_max, int& occluder) {
+    for (int m = 0; m < scene.meshCount; m++) {
+        const CompiledMesh& mesh = scene.meshes[m];
+        if (anyInBVH<MESH>(scene, ray, scene.groups[MESH].bvhNodes + mesh.firstNode, mesh.nodeCount, mesh.firstTriangle,
+                           mesh.triangleCount, t_min, t_max, occluder)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <PrimitiveType TYPE>
+bool occludes(const CompiledScene& scene, const PrimitiveRay& ray, int position, float t_min, float t_max) {
+    STATS(pixelStats.intersectionTests++;)
+    float t;
+    return nearestInRange<TYPE>(scene, ray, position, position + 1, t_min, t_max, t) != -1;
+}
+
+template <>
+bool occludes<INSTANCE>(const CompiledScene& scene, const PrimitiveRay& ray, int position, float t_min, float t_max) {
+    STATS(pixelStats.intersectionTests++;)
+    const CompiledInstance& instance = scene.instances[scene.groups[INSTANCE].arrays.index[position]];
+    const CompiledScene& prototype = scene.prototypes[instance.prototype];
+    PrimitiveRay local = toPrototype(instance, ray);
+    int occluder; // the primitive of the prototype is not kept: the instance is tested first next time
+    return anyOfType<SPHERE>(prototype, local, t_min, t_max, occluder) || anyOfType<BOX>(prototype, local, t_min, t_max, occluder)
+           || anyOfType<TRIANGLE>(prototype, local, t_min, t_max, occluder) || anyOfType<MESH>(prototype, local, t_min, t_max, occluder);
+}
+
+template <>
+bool anyOfType<INSTANCE>(const CompiledScene& scene, const PrimitiveRay& ray, float t_min, float t_max, int& occluder) {
+    const PrimitiveGroup& group = scene.groups[INSTANCE];
+    auto hitInRange = [&](int begin, int end) { // an instance of the positions [begin, end) hit by the ray, -1 if none
+        for (int k = begin; k < end; k++) {
+            if (occludes<INSTANCE>(scene, ray, k, t_min, t_max)) {
+                return k;
+            }
+        }
+        return -1;
+    };
+    if (group.bvhNodeCount == 0) {
+        int k = hitInRange(0, group.count);
+        if (k != -1) {
+            occluder = group.first + k;
+        }
+        return k != -1;
+    }
+    float tMax = t_max;
+    bool hit = false;
+    BVH::traverse(group.bvhNodes, group.bvhNodeCount, ray.origin, ray.dir, t_min, tMax, [&](int first, int count, float& tMax) {
+        int k = hitInRange(first, first + count);
+        if (k != -1) {
+            occluder = group.first + k;
+            hit = true;
+        }
+        return hit;
+    });
+    return hit;
+}
+
+bool anyHit(const CompiledScene& scene, const Vector3& origin, const Vector3& rayDir, float t_min, float t_max, int& lastOccluder) {
+    /**
+     * Checks if the ray comming from origin in the direction rayDir hits any primitive between
+     * t_min and t_max. Unlike closestHit(), the search stops at the first hit found, which is all
+     * a shadow ray needs. Distances are measured like in closestHit().
+     * 
+     * @param scene The scene to trace the ray in
+     * @param origin The ray origin
+     * @param rayDir The normalized ray direction, Vector3::normalize(target - origin)
+     * @param t_min The minimum distance of a hitpoint
+     * @param t_max The maximum distance of a hitpoint
+     * @param lastOccluder A primitive likely to block the ray (usually the one that blocked the
+     *                     previous ray towards the same light), tested first, -1 if there is
+     *                     none. Set to the primitive found when the ray is blocked. Primitives
+     *                     are given as the first identifier of their type plus their position
+     *                     in the arrays of the type (in BVH order), not as identifiers.
+     * @return true if a primitive is in the way
+    */
+    PrimitiveRay ray(origin, rayDir);
+    if (lastOccluder >= 0 && lastOccluder < scene.primitiveCount()) {
+        PrimitiveType type = scene.primitiveType(lastOccluder);
+        int position = lastOccluder - scene.groups[type].first;
+        bool blocked = type == SPHERE ? occludes<SPHERE>(scene, ray, position, t_min, t_max)
+                       : type == PLANE ? occludes<PLANE>(scene, ray, position, t_min, t_max)
+                       : type == BOX ? occludes<BOX>(scene, ray, position, t_min, t_max)
+                       : type == TRIANGLE ? occludes<TRIANGLE>(scene, ray, position, t_min, t_max)
+                       : type == MESH ? occludes<MESH>(scene, ray, position, t_min, t_max)
+                       : occludes<INSTANCE>(scene, ray, position, t_min, t_max);
+        if (blocked) {
+            STATS(pixelStats.hits++;)
+            return true;
+        }
+    }
+    bool hit = anyOfType<PLANE>(scene, ray, t_min, t_max, lastOccluder) || anyOfType<SPHERE>(scene, ray, t_min, t_max, lastOccluder)
+               || anyOfType<BOX>(scene, ray, t_min, t_max, lastOccluder) || anyOfType<TRIANGLE>(scene, ray, t_min, t_max, lastOccluder)
+               || anyOfType<MESH>(scene, ray, t_min, t_max, lastOccluder) || anyOfType<INSTANCE>(scene, ray, t_min, t_max, lastOccluder);
+    STATS(hit ? pixelStats.hits++ : pixelStats.misses++;)
+    return hit;
+}
+
+HitRecord closestIntersection(const CompiledScene& scene, const Vector3& origin, const Vector3& target, float t_min, float t_max) {
        /**
     * Find the closest intersection between the ray comming from origin to target and restricted
     * between t_min and t_max with the objects in the scene
    */
-    float tRes = numeric_limits<float>::infinity();
-    Sphere sphereRes;
-    for (Sphere sphere : scene.spheres) {
-        float t1, t2;
-        Vector3 _1, _2, _3, _4; // dummy variables
-        tie(t1, t2, _1, _2, _3, _4) = sphere.intersectRay(origin, target);
-        if (t_min<=t1 && t1<=t_max && t1<tRes) { // a closer intersection is found
-            // update the results
-            tRes = t1;
-            sphereRes = sphere;
-        }
-        if (t_min<=t2 && t2<=t_max && t2<=tRes) { // a closer intersection is found
-            // update the results
-            tRes = t2;
-            sphereRes = sphere;
-        }
+    return closestHit(scene, origin, Vector3::normalize(target - origin), t_min, t_max);
+}
+
+template <PrimitiveType TYPE>
+tuple<COLORREF, Vector3, Vector3> shapeAttributes(const CompiledScene& scene, int i, const Vector3& hitPos, const Vector3& rayDir) {
+    const typename PrimitiveKernel<TYPE>::Shape& shape = scene.shape<TYPE>(i);
+    return make_tuple(shape.color, hitPos, PrimitiveKernel<TYPE>::normalAt(shape, hitPos, rayDir));
+}
+
+tuple<COLORREF, Vector3, Vector3> hitAttributes(const CompiledScene& scene, const Vector3& origin, const Vector3& rayDir, const HitRecord& hit) {
+    /**
+     * Computes the color, the position and the normal of the hitpoint found by closestHit() for
+     * a ray. A sphere hit is intersected again, to measure its distance like
+     * Sphere::intersectDistances does: the SIMD kernels may round it slightly differently, and
+     * every kernel must shade the same hitpoint. The other types have a single kernel, whose
+     * distance is used as it is.
+     * 
+     * @param scene The scene the ray was traced in
+     * @param origin The ray origin
+     * @param rayDir The normalized ray direction, the one given to closestHit()
+     * @param hit The closest hit of the ray
+     * @return A tuple containing the color, the position and the normal of the hitpoint
+    */
+    if (!hit.hit()) { // case where the ray did not intersect any primitive
+        return make_tuple(backgroundColor, Vector3(0, 0, 0), Vector3(0, 0, 0));
+    }
+    PrimitiveType type = scene.primitiveType(hit.index);
+    int i = hit.index - scene.groups[type].first;
+    if (type == SPHERE) {
+        const Sphere& sphere = scene.spheres[i];
+        float t1, t2; // distance of the hitpoints
+        tie(t1, t2) = sphere.intersectDistances(origin, rayDir);
+        Vector3 hitPos = origin + rayDir * (fabs(t1 - hit.t) <= fabs(t2 - hit.t) ? t1 : t2);
+        return make_tuple(sphere.color, hitPos, sphere.normalAt(hitPos));
+    }
+    if (type == INSTANCE) { // the hitpoint is found in the prototype, then moved back into the scene
+        const CompiledInstance& instance = scene.instances[i];
+        Vector3 localOrigin = instance.toPrototype.apply(origin);
+        Vector3 localDir = instance.toPrototype.applyLinear(rayDir);
+        COLORREF color;
+        Vector3 localPos, localNormal;
+        tie(color, localPos, localNormal) = hitAttributes(scene.prototypes[instance.prototype], localOrigin, localDir,
+                                                          HitRecord{hit.t, hit.instancePrimitive});
+        return make_tuple(instance.hasColor ? instance.color : color, instance.toScene.apply(localPos),
+                          Vector3::normalize(instance.toPrototype.applyTransposed(localNormal)));
     }
-    return make_tuple(tRes, sphereRes);
+    Vector3 hitPos = origin + rayDir * hit.t;
+    if (type == MESH) {
+        return make_tuple(scene.meshes[scene.meshAt(i)].color, hitPos, meshNormalAt(scene.meshArrays, i, rayDir));
+    }
+    return type == PLANE ? shapeAttributes<PLANE>(scene, i, hitPos, rayDir)
+           : type == BOX ? shapeAttributes<BOX>(scene, i, hitPos, rayDir)
+           : shapeAttributes<TRIANGLE>(scene, i, hitPos, rayDir);
 }
 
-tuple<COLORREF, Vector3, Vector3> traceRay(Scene scene, Vector3 origin, Vector3 target, float t_min, float t_max) {
+tuple<COLORREF, Vector3, Vector3> traceRay(const CompiledScene& scene, const Vector3& origin, const Vector3& target, float t_min, float t_max) {
     /**
      * Compute the ray that goes from origin to target and returns informations about the closest hitpoint with its
      * distance betwen t_min and t_max
@@ -229,31 +708,11 @@ tuple<COLORREF, Vector3, Vector3> traceRay(Scene scene, Vector3 origin, Vector3
      * @param t_max The maximum distance of a hit Vector3
      * @return A tuple containing the color, the position and the normal of the closest hitpoint of the ray 
     */
-    float closestDist = numeric_limits<float>::infinity();
-    Vector3 hitPos, hitNormal;
-    int closestSphereIndex = -1;
-    for (int i = 0; i < scene.spheres.size(); i++) {
-        float t1, t2; // distance of the hitpoints (infinity if no intersection)
-        Vector3 H1, H2; // hitpoints positions (0 if no intersection)
-        Vector3 N1, N2; // normal at the hitpoints (0 if no intersection)
-        tie(t1, t2, H1, H2, N1, N2) = scene.spheres[i].intersectRay(origin, target);
-        if (t_min <= t1 && t1 <= t_max && t1 < closestDist) { // found a better valid hitpoint
-            closestSphereIndex = i;
-            closestDist = t1;
-            hitPos = H1;
-            hitNormal = N1;
-        }
-        if (t_min <= t2 && t2 <= t_max && t2 < closestDist) { // found a better valid hitpoint
-            closestSphereIndex = i;
-            closestDist = t2;
-            hitPos = H2;
-            hitNormal = N2;
-        }
-    }
-    if (closestSphereIndex == -1) { // case where the ray did not intersect any sphere
-        return make_tuple(backgroundColor, Vector3(0, 0, 0), Vector3(0, 0, 0));
-    }
-    return make_tuple(scene.spheres[closestSphereIndex].color, hitPos, hitNormal);;
+    Vector3 rayDir = Vector3::normalize(target - origin);
+    HitRecord hit = closestHit(scene, origin, rayDir, t_min, t_max);
+    STATS(if (pixelStats.hits + pixelStats.misses == 0) { pixelStats.primitive = hit.index; }) // first ray of the pixel
+    STATS(hit.hit() ? pixelStats.hits++ : pixelStats.misses++;)
+    return hitAttributes(scene, origin, rayDir, hit);
 }
 
 // bool isLightObstructed(Scene scene, Light light, Vector3 position) {
@@ -288,94 +747,218 @@ tuple<COLORREF, Vector3, Vector3> traceRay(Scene scene, Vector3 origin, Vector3
 //     }
 // }
 
-bool isLightObstructed(Scene scene, Light light, Vector3 position) {
+struct OcclusionCache {
+    /**
+     * The last primitive that blocked a shadow ray of each light, kept by every thread: neighbouring
+     * hitpoints are usually in the shadow of the same primitive
+    */
+    static constexpr int MAX_LIGHTS = 64; // lights past this one are not cached
+    const CompiledScene* scene = nullptr; // the scene the cached primitives belong to
+    int lastOccluder[MAX_LIGHTS];
+};
+
+static thread_local OcclusionCache occlusionCache;
+static const float shadowEpsilon = .01f; // margin keeping shadow rays from hitting the surface they start from
+
+template <LightType TYPE>
+bool isLightObstructed(const CompiledScene& scene, const CompiledLight& light, int lightIndex, const Vector3& position, const Vector3& lightDir,
+                       bool* cachedOccluder=nullptr) {
     /**
      * Checks if the light is obstructed from position and in the scene (if there is an object
-     * between the light and position)
+     * between the light and position). Ambient lights cannot be obstructed and have no kernel.
+     * 
+     * @param scene The scene containing the light
+     * @param light The light
+     * @param lightIndex A number identifying the light in its scene, for the occlusion cache
+     * @param position The position of the hitpoint
+     * @param lightDir The normalized direction from position towards the light
+     * @param cachedOccluder If not null, set to true if the light is blocked by the cached
+     *                       occluder, the one that blocked the previous ray towards the light
+     * @return true if the light does not reach position
     */
-    if (light.type == "ambient") {
-        return false; // ambient light cannot be obstructed 
-    }
-    Vector3 lightPos;
-    if (light.type == "point") {
-        lightPos = light.position;
-    }
-    if (light.type == "directional") {
-        lightPos = Vector3(0, 0, 0) - Vector3::normalize(light.direction) * 100000000; // virtual position of the light
+    OcclusionCache& cache = occlusionCache;
+    if (cache.scene != &scene) { // the cache of another scene is useless
+        cache.scene = &scene;
+        fill(cache.lastOccluder, cache.lastOccluder + OcclusionCache::MAX_LIGHTS, -1);
     }
+    int uncached = -1;
+    int& lastOccluder = lightIndex < OcclusionCache::MAX_LIGHTS ? cache.lastOccluder[lightIndex] : uncached;
     // trace the ray from the position to the light and check if an object obstructing the (light) ray
-    float tShadow;
-    Sphere sphereShadow;
-    tie(tShadow, sphereShadow) = closestIntersection(scene, position, lightPos, 0.1, 10000000);
-    // tie(tShadow, sphereShadow) = closestIntersection(scene, position, light.position, .00000001, numeric_limits<float>::infinity());
-    if (tShadow < 1000000000000) { // this condition means the ray has found an object
-        std::cout << "Light obstructed by: " << sphereShadow.toString() << std::endl;
-        return true; // light is obstructed
-    }
-    else {
-        return false;
+    STATS(pixelStats.shadowRays++;)
+    int cached = lastOccluder;
+    bool obstructed = anyHit(scene, position, lightDir, shadowEpsilon, LightKernel<TYPE>::distance(light, position) - shadowEpsilon,
+                             lastOccluder);
+    if (cachedOccluder != nullptr) { // the cached occluder is tested first, and a primitive missed once cannot be found again
+        *cachedOccluder = obstructed && cached >= 0 && lastOccluder == cached;
     }
+    return obstructed;
 }
 
+template <LightType TYPE>
+float diffuseLight(const CompiledScene& scene, const CompiledLight& light, int lightIndex, const Vector3& position, const Vector3& normal) {
+    /**
+     * Returns the diffuse lighting of a single light at a hitpoint, 0 if the light is behind
+     * the surface or blocked by a primitive casting a shadow
+     *
+     * @param lightIndex The number identifying the light, for the occlusion cache
+    */
+    Vector3 lightDir = Vector3::normalize(LightKernel<TYPE>::toLight(light, position));
+    float NdotDir = Vector3::dot(normal, lightDir);
+    // only the lit side of the surface needs a shadow ray
+    if (NdotDir > 0 && !isLightObstructed<TYPE>(scene, light, lightIndex, position, lightDir)) {
+        return light.intensity * NdotDir/(Vector3::norm(normal) * Vector3::norm(lightDir));
+    }
+    return 0;
+}
 
-float lightIntensity (Scene scene, Vector3 position, Vector3 normal) { 
+template <LightType TYPE>
+float diffuseIntensity(const CompiledScene& scene, const CompiledLight* lights, int lightCount, int firstLightIndex,
+                       const Vector3& position, const Vector3& normal) {
     /**
-     * TODO: write the documentation for this function
+     * Sums the diffuse lighting of a group of lights of the same type at a hitpoint, lights
+     * blocked by a primitive casting a shadow
+     *
+     * @param scene The scene containing the lights
+     * @param lights The lights of the group, all of type TYPE
+     * @param lightCount The number of lights in the group
+     * @param firstLightIndex The number identifying the first light of the group in the scene
+     * @param position The position of the hitpoint
+     * @param normal The surface normal at the hitpoint
+     * @return The intensity received from the group, not clamped
     */
     float intensity = 0;
-    for (int i = 0; i < scene.lights.size(); i++) {
-        Light light = scene.lights[i];
-        // if (!isLightObstructed(scene, light, position)) { // this condition is responsible for the shadows
-        if (true) { // debug
-            // if the light is not obstructed, handle the three types of light differently
-            if (light.type == "ambient") {
-                intensity += light.intensity;
-            }
-            else {
-                Vector3 lightDir;
-                if (light.type == "point") {
-                    lightDir = light.position - position;
-                }
-                if (light.type == "directional") {
-                    lightDir = light.direction;
-                }
-                lightDir = Vector3::normalize(lightDir);
-                float NdotDir = Vector3::dot(normal, lightDir);
-                if (NdotDir > 0) { // compute diffuse lighting
-                    intensity += light.intensity * NdotDir/(Vector3::norm(normal) * Vector3::norm(lightDir));
-                }
+    for (int i = 0; i < lightCount; i++) {
+        intensity += diffuseLight<TYPE>(scene, lights[i], firstLightIndex + i, position, normal);
+    }
+    return intensity;
+}
+
+static int sideOfSurface(const AABB& bounds, const Vector3& position, const Vector3& normal) {
+    /**
+     * Returns 1 if a whole box is in front of the surface at a hitpoint, -1 if it is behind it
+     * (or on its tangent plane), where no light can shine from, and 0 if it crosses the plane
+    */
+    bool front = false, back = false;
+    for (int corner = 0; corner < 8; corner++) {
+        Vector3 point(corner & 1 ? bounds.max[0] : bounds.min[0], corner & 2 ? bounds.max[1] : bounds.min[1],
+                      corner & 4 ? bounds.max[2] : bounds.min[2]);
+        (Vector3::dot(normal, point - position) > 0 ? front : back) = true;
+    }
+    return front && back ? 0 : front ? 1 : -1;
+}
+
+template <typename Visit>
+void visitPointLights(const CompiledScene& scene, const Vector3& position, const Vector3& normal, const Visit& visit) {
+    /**
+     * Calls visit(light, lightIndex) for the point lights shading a hitpoint, which are all the
+     * point lights of the scene unless lightErrorBound is positive. The light hierarchy is then
+     * walked instead: nodes whose lights are all behind the surface are skipped, and nodes far
+     * enough from the hitpoint are visited as their merged light (see LightNode), numbered after
+     * the lights of the scene (lightIndex = light count + node index), with a single shadow ray.
+     * Only nodes in front of the surface are merged. The cosine term N.(p - x)/|p - x| of a
+     * light at p has a gradient the intensity-weighted center cancels out once summed over the
+     * lights of the node, and second derivatives of at most 3/rho^2 at a distance rho: with its
+     * lights within a radius r of the center of its bounds, at a distance d > r, merging a node
+     * changes its lighting by at most its intensity * 6 r^2/(d - r)^2, which must not be more
+     * than lightErrorBound. The bound holds for every merged node (shadows aside, the merged
+     * light casting the shadows of its center), so the far away lights are merged the most.
+    */
+    if (lightErrorBound <= 0 || scene.lightNodeCount == 0) {
+        for (int i = 0; i < scene.pointLightCount; i++) {
+            visit(scene.pointLights[i], i);
+        }
+        return;
+    }
+    int lightCount = scene.pointLightCount + scene.directionalLightCount;
+    int stack[BVH::STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+        int index = stack[--stackSize];
+        const LightNode& node = scene.lightNodes[index];
+        int side = sideOfSurface(node.bounds, position, normal);
+        if (side < 0) {
+            continue;
+        }
+        if (node.count == 1) { // a single light is never merged
+            int light = scene.lightOrder[node.first];
+            visit(scene.pointLights[light], light);
+            continue;
+        }
+        float radius = .5f * Vector3::norm(Vector3(node.bounds.max[0] - node.bounds.min[0], node.bounds.max[1] - node.bounds.min[1],
+                                                   node.bounds.max[2] - node.bounds.min[2]));
+        float distance = Vector3::norm(Vector3(node.bounds.center(0), node.bounds.center(1), node.bounds.center(2)) - position);
+        float clearance = distance - radius; // to the closest light of the node
+        if (side > 0 && clearance > 0 && 6 * fabsf(node.intensity) * radius * radius <= lightErrorBound * clearance * clearance) {
+            visit(node.mergedLight(), lightCount + index);
+        }
+        else if (node.count > 0) {
+            for (int k = node.first; k < node.first + node.count; k++) {
+                int light = scene.lightOrder[k];
+                visit(scene.pointLights[light], light);
             }
         }
+        else { // left child first
+            stack[stackSize++] = node.first + 1;
+            stack[stackSize++] = node.first;
+        }
     }
+}
+
+float lightIntensity (const CompiledScene& scene, const Vector3& position, const Vector3& normal) { 
+    /**
+     * Computes how much light reaches a hitpoint: the ambient light of the scene plus the
+     * diffuse lighting of every point and directional light (point lights being merged by the
+     * light hierarchy when lightErrorBound is positive, see visitPointLights())
+     *
+     * @param scene The scene containing the lights
+     * @param position The position of the hitpoint
+     * @param normal The surface normal at the hitpoint
+     * @return The light intensity, clamped between 0 and 1
+    */
+    float intensity = scene.ambientIntensity;
+    float pointIntensity = 0;
+    visitPointLights(scene, position, normal, [&](const CompiledLight& light, int lightIndex) {
+        pointIntensity += diffuseLight<POINT_LIGHT>(scene, light, lightIndex, position, normal);
+    });
+    intensity += pointIntensity;
+    intensity += diffuseIntensity<DIRECTIONAL_LIGHT>(scene, scene.directionalLights, scene.directionalLightCount,
+                                                     scene.pointLightCount, position, normal);
     return max((float) 0, min(intensity, (float) 1)); // clamp intensity between 0 and 1
 }
 
-COLORREF viewportColor(Scene scene, Vector3 vpPos) {
+COLORREF shadeHitpoint(const CompiledScene& scene, COLORREF color, const Vector3& hitPos, const Vector3& normal) {
+    /**
+     * Computes the final color of a hitpoint, lit by the lights of the scene
+     * 
+     * @param scene The scene containing the lights
+     * @param color The surface color at the hitpoint
+     * @param hitPos The position of the hitpoint
+     * @param normal The surface normal at the hitpoint
+     * @return The lit color
+    */
+    float intensity = lightIntensity(scene, hitPos, normal);
+    return RGB(GetRValue(color) * intensity, GetGValue(color) * intensity, GetBValue(color) * intensity);
+}
+
+COLORREF viewportColor(const CompiledScene& scene, const Vector3& vpPos) {
     /**
      * TODO: write the docstring for this function
     */
     Vector3 cameraPos = scene.cameraPos;
     COLORREF color; // color of the closest solid point
     Vector3 hitPos, normal; // position and the normal of the geometry at the hitpoint
+    STATS(pixelStats.primaryRays++; auto traceStart = chrono::steady_clock::now();)
     tie(color, hitPos, normal) = traceRay(scene,
                               cameraPos, vpPos,
                               1, numeric_limits<float>::infinity());
-    float intensity = lightIntensity(scene, hitPos, normal);
-    return RGB(GetRValue(color) * intensity, GetGValue(color) * intensity, GetBValue(color) * intensity);
+    STATS(pixelStats.traceTime += nanosecondsSince(traceStart); auto shadeStart = chrono::steady_clock::now();)
+    color = shadeHitpoint(scene, color, hitPos, normal);
+    STATS(pixelStats.shadeTime += nanosecondsSince(shadeStart);)
+    return color;
 }
 
-void setPixel(int x,int y, const COLORREF& color=defaultColor) {
-    if(sHwnd==NULL) {
-        MessageBox(NULL, L"sHwnd was not initialized !", L"Error",MB_OK|MB_ICONERROR);
-        exit(0);
-    }
-    HDC hdc=GetDC(sHwnd);
-    SetPixel(hdc,x,y,color);
-    ReleaseDC(sHwnd,hdc);
-    return;
-}
-
-const COLORREF pixelColor(Scene scene, int x, int y) {
+const COLORREF pixelColor(const CompiledScene& scene, int x, int y) {
     /**
      * Computes the color of a single pixel in the final image
      * 
@@ -390,29 +973,141 @@ const COLORREF pixelColor(Scene scene, int x, int y) {
 }
 
 
-void render(Scene scene) {
+// custom file (builds on the tracer functions above):
+#include <PacketTracer.cpp> // coherent primary ray packets
+#include <ProgressiveRenderer.cpp> // coarse to fine rendering with adaptive refinement
+#include <GBuffer.cpp> // primary hits kept for relight-only re-renders
+#include <Animation.cpp> // keyframed animations
+#include <Distributed.cpp> // tiles rendered by worker processes (POSIX only, started by the coordinator on Linux)
+#include <Wavefront.cpp> // reflections and refractions traced by queues of rays
+
+void render(const CompiledScene& scene, Framebuffer& framebuffer) {
     /**
-     * Renders a scene (draws every single pixel)
+     * Renders a scene (computes every single pixel) into a framebuffer. Nothing is
+     * presented while rendering.
      * 
      * @param scene The scene to render
+     * @param framebuffer The image to render into, its size must be xRes by yRes
     */
     for(int x = 0; x < xRes; x++) {
         for(int y = 0; y < yRes; y++) {
-            setPixel(x, y, defaultColor); // indicates that the pixel is currently being rendered
+            STATS(beginPixelStats();)
             COLORREF color = pixelColor(scene, x, y);
-            setPixel(x, y, color);
+            STATS(endPixelStats(x, y);)
+            framebuffer.setPixel(x, y, color);
+        }
+    }
+}
+
+void renderParallel(const CompiledScene& scene, Framebuffer& framebuffer, ThreadPool& pool, int firstRow=0) {
+    /**
+     * Renders a scene into a framebuffer using every thread of a pool. The image is split
+     * into tiles of tileSize by tileSize pixels, each tile being a task of the pool: tiles
+     * covering expensive parts of the scene are balanced between threads by work-stealing.
+     * Every pixel is computed by pixelColor() exactly like in render(), so both produce the
+     * exact same image.
+     * 
+     * @param scene The scene to render
+     * @param framebuffer The image to render into, xRes pixels wide and yRes pixels high, or
+     *                    fewer to only render a band of the image
+     * @param pool The threads to render with
+     * @param firstRow The row of the image rendered into the first row of framebuffer, the
+     *                 band stopping at the bottom of framebuffer or of the image
+    */
+    int rows = min(framebuffer.height, yRes - firstRow);
+    int tilesX = (xRes + tileSize - 1) / tileSize;
+    int tilesY = (rows + tileSize - 1) / tileSize;
+    pool.run(tilesX * tilesY, [&](int tile) {
+        int x0 = (tile % tilesX) * tileSize;
+        int y0 = (tile / tilesX) * tileSize;
+        int x1 = min(x0 + tileSize, xRes);
+        int y1 = min(y0 + tileSize, rows);
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                STATS(beginPixelStats();)
+                COLORREF color = pixelColor(scene, x, firstRow + y);
+                STATS(endPixelStats(x, firstRow + y);)
+                framebuffer.setPixel(x, y, color);
+            }
+        }
+    });
+}
+
+void reportRayCost(const CompiledScene& scene) {
+    /**
+     * Traces the primary ray of every pixel (closest hit only, no shading) and prints the
+     * average cost of a ray: time and, when the BVH is built, number of visited nodes
+     * 
+     * @param scene The scene to trace the rays in
+    */
+    long long visitedNodes = 0;
+    int hits = 0;
+    auto start = chrono::steady_clock::now();
+    for (int y = 0; y < yRes; y++) {
+        for (int x = 0; x < xRes; x++) {
+            Vector3 cameraPos = scene.cameraPos;
+            Vector3 rayDir = Vector3::normalize(screenToProjPlane(scene, x, y) - cameraPos);
+            int visited = 0;
+            hits += closestHit(scene, cameraPos, rayDir, 1, numeric_limits<float>::infinity(), &visited).hit();
+            visitedNodes += visited;
         }
     }
+    double elapsed = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    double rays = (double) xRes * yRes;
+    cout << "Primary rays: " << elapsed / rays << " ns/ray, " << visitedNodes / rays << " nodes/ray, "
+         << 100. * hits / rays << "% hits (" << scene.primitiveCount() << " primitives)" << endl;
+}
+
+// custom files (build on the functions above):
+#include <StreamingRenderer.cpp> // images bigger than the memory, written a band of rows at a time
+#include <Benchmark.cpp> // benchmark suite
+
+#ifdef WINDOWED
+static Framebuffer frame; // last rendered image, presented on every WM_PAINT
+
+void SetWindowHandle(HWND hwnd) {
+    sHwnd=hwnd;
+}
+
+void presentFramebuffer(HDC hdc, const Framebuffer& framebuffer) {
+    /**
+     * Draws a whole framebuffer in the window with a single blit
+    */
+    // a 32 bits DIB expects BGRX pixels while COLORREF stores them as RGBX
+    vector<DWORD> bgr(framebuffer.pixels.size());
+    for (size_t i = 0; i < bgr.size(); i++) {
+        COLORREF color = framebuffer.pixels[i];
+        bgr[i] = (GetRValue(color) << 16) | (GetGValue(color) << 8) | GetBValue(color);
+    }
+    BITMAPINFO info = {};
+    info.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    info.bmiHeader.biWidth = framebuffer.width;
+    info.bmiHeader.biHeight = -framebuffer.height; // negative height: rows are stored top-down
+    info.bmiHeader.biPlanes = 1;
+    info.bmiHeader.biBitCount = 32;
+    info.bmiHeader.biCompression = BI_RGB;
+    SetDIBitsToDevice(hdc, 0, 0, framebuffer.width, framebuffer.height,
+                      0, 0, 0, framebuffer.height, bgr.data(), &info, DIB_RGB_COLORS);
 }
 
 LRESULT CALLBACK WndProc(HWND hwnd,UINT message,WPARAM wParam,LPARAM lParam) {
     switch(message) {
-    case WM_PAINT:
+    case WM_PAINT: {
         SetWindowHandle(hwnd);
-        std::cout << "Starting rendering process..." << std::endl;
-        render(Scene::getDefaultScene());
-        cout << "Rendering complete." << endl;
-        break;
+        if (frame.pixels.empty()) { // the scene is rendered once, then only presented
+            frame = Framebuffer(xRes, yRes, defaultColor);
+            ThreadPool pool(threadCount);
+            CompiledScene scene = CompiledScene::compile(Scene::getDefaultScene());
+            std::cout << "Starting rendering process..." << std::endl;
+            renderParallel(scene, frame, pool);
+            cout << "Rendering complete." << endl;
+        }
+        PAINTSTRUCT paint;
+        HDC hdc = BeginPaint(hwnd, &paint);
+        presentFramebuffer(hdc, frame);
+        EndPaint(hwnd, &paint);
+        return 0;
+    }
     case WM_CLOSE: // Failure to call DefWindowProc
         break;
     case WM_DESTROY:
@@ -472,4 +1167,526 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     }
 
     return 0;
-}
\ No newline at end of file
+}
+#else
+int main(int argc, char* argv[]) {
+    /**
+     * Headless entry point: renders the default scene into memory and writes it to an
+     * image file (PNG or PPM, picked from the file extension).
+     * Usage: raytracer [-o output.png] [--width 500] [--height 500] [--threads 0] [--tile-size 16] [--serial]
+     *                   [--spheres 0] [--instances 0] [--no-bvh] [--ray-cost] [--kernel auto] [--packets 0] [--check-allocations]
+     *                   [--benchmark [--benchmark-output results.csv]] [--stats]
+     *                   [--progressive [--initial-step 8] [--refine-threshold 16] [--aa-grid 2] [--previews]]
+     *                   [--scene file.scene|file.rtscene] [--save-scene file.scene|file.rtscene] [--relight-frames 0]
+     *                   [--animation file.anim] [--workers 0 [--socket path]] [--worker path [--worker-exit-after -1]]
+     *                   [--fast-normalize] [--check-precision] [--reflective] [--wavefront [--max-depth 4] [--no-ray-sort]]
+     *                   [--stream-rows 0 [--stream-window 4]] [--point-lights 1] [--light-error 0]
+     *                   [--refit-threshold 1.5]
+    */
+    string outputPath = "render.png";
+    bool serial = false; // use the single-threaded reference renderer
+    int randomSpheres = -1; // if positive, render a random scene with that many spheres
+    int randomInstances = -1; // if positive, render a random scene with that many instances
+    bool useBVH = true; // test every sphere for every ray if false
+    bool rayCost = false; // print the average cost of a primary ray
+    string kernel = "auto"; // sphere intersection kernel, "none" tests the Sphere objects one by one
+    int packetSize = 0; // width of the pixel blocks traced as ray packets, 0 traces every pixel on its own
+    bool checkAllocations = false; // fail if rendering makes any heap allocation
+    bool benchmark = false; // run the benchmark suite instead of rendering
+    string benchmarkOutput; // CSV file the benchmark results are also written to
+    bool stats = false; // print render statistics and write a cost heatmap (needs RENDER_STATS)
+    bool progressive = false; // render coarse to fine with adaptive refinement
+    int initialStep = 8; // distance in pixels between the samples of the first progressive pass
+    int refineThreshold = 16; // largest color channel difference of samples interpolated by the progressive passes
+    int aaGrid = 2; // edge pixels of progressive renders get aaGrid by aaGrid samples
+    bool previews = false; // write the preview of every progressive pass
+    string scenePath; // scene file to render instead of the default scene
+    string saveScenePath; // if set, the scene is written to this file instead of being rendered
+    int relightFrames = 0; // frames rendered after the image with the lights turned around the camera
+    string animationPath; // if set, the keyframes of an animation to render instead of a single image
+    float refitThreshold = 1.5f; // animation frames refit the BVH until its SAH cost grows past this factor, 0 builds it every frame
+    int workers = 0; // worker processes started to render the tiles, 0 renders in this process
+    string socketPath; // socket the workers connect to, a file of /tmp by default
+    string workerSocket; // if set, this process is a worker of the coordinator listening on this socket
+    int workerExitAfter = -1; // if not negative, the worker dies after this many tiles (to test re-issuing)
+    bool checkPrecision = false; // compare the fast normalization to the exact one instead of rendering
+    bool reflective = false; // render the default or random scene with reflective and transparent materials
+    bool wavefront = false; // trace reflections and refractions with queues of rays
+    int maxDepth = 4; // bounces of the wavefront renderer after the camera rays
+    bool sortRays = true; // trace the secondary rays of the wavefront renderer in key order
+    int streamRows = 0; // if positive, the image is written while it is rendered, in stripes of that many rows
+    int streamWindow = 4; // stripes of streaming renders held in memory
+    int pointLights = 1; // point lights of the random scenes
+    vector<string> workerCommand = {argv[0], "--threads", "1"}; // spawned workers render on one thread unless told otherwise
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        int first = i;
+        if ((arg == "-o" || arg == "--output") && i+1 < argc) {
+            outputPath = argv[++i];
+        }
+        else if (arg == "--width" && i+1 < argc) {
+            xRes = atoi(argv[++i]);
+        }
+        else if (arg == "--height" && i+1 < argc) {
+            yRes = atoi(argv[++i]);
+        }
+        else if (arg == "--threads" && i+1 < argc) {
+            threadCount = atoi(argv[++i]);
+        }
+        else if (arg == "--tile-size" && i+1 < argc) {
+            tileSize = atoi(argv[++i]);
+        }
+        else if (arg == "--serial") {
+            serial = true;
+        }
+        else if (arg == "--spheres" && i+1 < argc) {
+            randomSpheres = atoi(argv[++i]);
+        }
+        else if (arg == "--instances" && i+1 < argc) {
+            randomInstances = atoi(argv[++i]);
+        }
+        else if (arg == "--no-bvh") {
+            useBVH = false;
+        }
+        else if (arg == "--ray-cost") {
+            rayCost = true;
+        }
+        else if (arg == "--kernel" && i+1 < argc) {
+            kernel = argv[++i];
+        }
+        else if (arg == "--packets" && i+1 < argc) {
+            packetSize = atoi(argv[++i]);
+        }
+        else if (arg == "--check-allocations") {
+            checkAllocations = true;
+        }
+        else if (arg == "--benchmark") {
+            benchmark = true;
+        }
+        else if (arg == "--benchmark-output" && i+1 < argc) {
+            benchmarkOutput = argv[++i];
+        }
+        else if (arg == "--stats") {
+            stats = true;
+        }
+        else if (arg == "--progressive") {
+            progressive = true;
+        }
+        else if (arg == "--initial-step" && i+1 < argc) {
+            initialStep = atoi(argv[++i]);
+        }
+        else if (arg == "--refine-threshold" && i+1 < argc) {
+            refineThreshold = atoi(argv[++i]);
+        }
+        else if (arg == "--aa-grid" && i+1 < argc) {
+            aaGrid = atoi(argv[++i]);
+        }
+        else if (arg == "--previews") {
+            previews = true;
+        }
+        else if (arg == "--scene" && i+1 < argc) {
+            scenePath = argv[++i];
+        }
+        else if (arg == "--save-scene" && i+1 < argc) {
+            saveScenePath = argv[++i];
+        }
+        else if (arg == "--relight-frames" && i+1 < argc) {
+            relightFrames = atoi(argv[++i]);
+        }
+        else if (arg == "--animation" && i+1 < argc) {
+            animationPath = argv[++i];
+        }
+        else if (arg == "--workers" && i+1 < argc) {
+            workers = atoi(argv[++i]);
+            continue; // not passed on to the workers
+        }
+        else if (arg == "--socket" && i+1 < argc) {
+            socketPath = argv[++i];
+            continue;
+        }
+        else if (arg == "--worker" && i+1 < argc) {
+            workerSocket = argv[++i];
+        }
+        else if (arg == "--worker-exit-after" && i+1 < argc) {
+            workerExitAfter = atoi(argv[++i]);
+        }
+        else if (arg == "--fast-normalize") {
+            Vector3::fastNormalize = true;
+        }
+        else if (arg == "--check-precision") {
+            checkPrecision = true;
+        }
+        else if (arg == "--reflective") {
+            reflective = true;
+        }
+        else if (arg == "--wavefront") {
+            wavefront = true;
+        }
+        else if (arg == "--max-depth" && i+1 < argc) {
+            maxDepth = atoi(argv[++i]);
+        }
+        else if (arg == "--no-ray-sort") {
+            sortRays = false;
+        }
+        else if (arg == "--stream-rows" && i+1 < argc) {
+            streamRows = atoi(argv[++i]);
+        }
+        else if (arg == "--stream-window" && i+1 < argc) {
+            streamWindow = atoi(argv[++i]);
+        }
+        else if (arg == "--point-lights" && i+1 < argc) {
+            pointLights = atoi(argv[++i]);
+        }
+        else if (arg == "--light-error" && i+1 < argc) {
+            lightErrorBound = (float) atof(argv[++i]);
+        }
+        else if (arg == "--refit-threshold" && i+1 < argc) {
+            refitThreshold = (float) atof(argv[++i]);
+        }
+        else {
+            cerr << "Usage: " << argv[0] << " [-o output.png|output.ppm] [--width pixels] [--height pixels]"
+                 << " [--threads count] [--tile-size pixels] [--serial] [--spheres count] [--instances count] [--no-bvh] [--ray-cost]"
+                 << " [--kernel none|scalar|sse|avx2|auto] [--packets 0|4|8] [--check-allocations]"
+                 << " [--benchmark] [--benchmark-output results.csv] [--stats] [--progressive] [--initial-step pixels]"
+                 << " [--refine-threshold 0-255] [--aa-grid samples] [--previews] [--scene file.scene|file.rtscene]"
+                 << " [--save-scene file.scene|file.rtscene] [--relight-frames count]"
+                 << " [--animation file.anim] [--workers count] [--socket path] [--worker path]"
+                 << " [--worker-exit-after tiles] [--fast-normalize] [--check-precision] [--reflective] [--wavefront]"
+                 << " [--max-depth bounces] [--no-ray-sort] [--stream-rows rows] [--stream-window stripes]"
+                 << " [--point-lights count] [--light-error bound]"
+                 << " [--refit-threshold factor]" << endl;
+            return 1;
+        }
+        workerCommand.insert(workerCommand.end(), argv + first, argv + i + 1); // workers load the same scene
+    }
+    if (xRes <= 0 || yRes <= 0 || tileSize <= 0) {
+        cerr << "Invalid resolution: " << xRes << "x" << yRes << " (tiles of " << tileSize << " pixels)" << endl;
+        return 1;
+    }
+    if (packetSize != 0 && packetSize != 4 && packetSize != 8) {
+        cerr << "Packets must be 4x4 or 8x8 pixels" << endl;
+        return 1;
+    }
+    if (packetSize != 0 && kernel == "none") {
+        cerr << "Packet tracing needs the sphere arrays (--kernel none is not supported)" << endl;
+        return 1;
+    }
+    if (kernel != "none" && !setSphereKernel(kernel)) {
+        cerr << "Sphere kernel " << kernel << " is unknown or not supported by this CPU" << endl;
+        return 1;
+    }
+    if (progressive && !ProgressiveRenderer::validStep(initialStep)) {
+        cerr << "The initial step of progressive renders must be a power of 2" << endl;
+        return 1;
+    }
+    if (progressive && (stats || packetSize != 0 || serial)) {
+        cerr << "Progressive renders cannot be combined with --stats, --packets or --serial" << endl;
+        return 1;
+    }
+    if (relightFrames > 0 && (progressive || stats || packetSize != 0 || serial)) {
+        cerr << "Relight frames cannot be combined with --progressive, --stats, --packets or --serial" << endl;
+        return 1;
+    }
+    if (!animationPath.empty() && (progressive || stats || packetSize != 0 || relightFrames > 0)) {
+        cerr << "Animations cannot be combined with --progressive, --stats, --packets or --relight-frames" << endl;
+        return 1;
+    }
+    bool distributed = workers > 0 || !socketPath.empty();
+    if ((distributed || !workerSocket.empty())
+        && (progressive || stats || packetSize != 0 || serial || relightFrames > 0 || !animationPath.empty() || checkAllocations)) {
+        cerr << "Distributed renders cannot be combined with --progressive, --stats, --packets, --serial, --relight-frames,"
+             << " --animation or --check-allocations" << endl;
+        return 1;
+    }
+    if (wavefront && (progressive || stats || packetSize != 0 || serial || relightFrames > 0 || !animationPath.empty()
+                      || distributed || !workerSocket.empty())) {
+        cerr << "Wavefront renders cannot be combined with --progressive, --stats, --packets, --serial, --relight-frames,"
+             << " --animation or distributed renders" << endl;
+        return 1;
+    }
+    if (!WavefrontRenderer::validDepth(maxDepth)) {
+        cerr << "The maximum depth must be between 0 and " << WavefrontRenderer::MAX_DEPTH << endl;
+        return 1;
+    }
+    if (pointLights < 0 || (pointLights != 1 && randomSpheres < 0)) {
+        cerr << "--point-lights needs a random scene (--spheres) and a count of at least 0" << endl;
+        return 1;
+    }
+    if (!(lightErrorBound >= 0 && lightErrorBound < numeric_limits<float>::infinity())) {
+        cerr << "The light error bound must be 0 or more" << endl;
+        return 1;
+    }
+    if (!(refitThreshold == 0 || (refitThreshold >= 1 && refitThreshold < numeric_limits<float>::infinity()))) {
+        cerr << "The refit threshold must be 0 (no refit) or at least 1" << endl;
+        return 1;
+    }
+    if (streamRows < 0 || !StreamingRenderer::validWindow(streamWindow)) {
+        cerr << "Streaming renders need stripes of at least 1 row and a window of 1 to "
+             << StreamingRenderer::MAX_WINDOW << " stripes" << endl;
+        return 1;
+    }
+    if (streamRows > 0 && (progressive || stats || packetSize != 0 || serial || relightFrames > 0 || !animationPath.empty()
+                           || distributed || !workerSocket.empty() || wavefront || checkAllocations)) {
+        cerr << "Streaming renders cannot be combined with --progressive, --stats, --packets, --serial, --relight-frames,"
+             << " --animation, distributed renders, --wavefront or --check-allocations" << endl;
+        return 1;
+    }
+#ifdef _WIN32
+    if (distributed || !workerSocket.empty()) {
+        cerr << "Distributed renders are only supported on POSIX systems" << endl;
+        return 1;
+    }
+#else
+#ifndef __linux__
+    if (workers > 0) {
+        cerr << "Workers are only started by the coordinator on Linux, start them by hand with --socket and --worker" << endl;
+        return 1;
+    }
+#endif
+    if (distributed && socketPath.empty()) {
+        socketPath = "/tmp/raytracer-" + to_string(getpid()) + ".sock";
+    }
+#endif
+#ifndef RENDER_STATS
+    if (stats) {
+        cerr << "Render statistics are compiled out, rebuild with RENDER_STATS defined (-DRENDER_STATS)" << endl;
+        return 1;
+    }
+#endif
+    if (benchmark) {
+        ThreadPool pool(threadCount);
+        vector<BenchmarkResult> results = runBenchmarks(pool);
+        writeBenchmarkResults(cout, results, pool.size());
+        if (!benchmarkOutput.empty()) {
+            ofstream file(benchmarkOutput);
+            writeBenchmarkResults(file, results, pool.size());
+            if (!file) {
+                cerr << "Could not write " << benchmarkOutput << endl;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    bool streaming = streamRows > 0;
+    Framebuffer framebuffer(streaming ? 0 : xRes, streaming ? 0 : yRes, defaultColor); // streaming renders only hold stripes
+    CompiledScene compiled;
+    if (!scenePath.empty()) {
+        auto loadStart = chrono::steady_clock::now();
+        if (!loadScene(scenePath, compiled, useBVH, kernel != "none")) {
+            return 1;
+        }
+        cout << "Scene " << scenePath << " loaded in "
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - loadStart).count() << " ms" << endl;
+    }
+    else {
+        Scene scene = randomInstances >= 0 ? Scene::getInstancedScene(randomInstances)
+                      : reflective ? Scene::getReflectiveScene(randomSpheres, pointLights)
+                      : randomSpheres >= 0 ? Scene::getRandomScene(randomSpheres, 1, pointLights) : Scene::getDefaultScene();
+        compiled = CompiledScene::compile(scene, useBVH, kernel != "none");
+    }
+#ifndef _WIN32
+    if (!workerSocket.empty()) {
+        return runWorker(compiled, workerSocket, workerExitAfter);
+    }
+#endif
+    if (!saveScenePath.empty()) {
+        if (!saveScene(compiled, saveScenePath)) {
+            cerr << "Could not write " << saveScenePath << endl;
+            return 1;
+        }
+        cout << "Scene written to " << saveScenePath << endl;
+        return 0;
+    }
+    if (useBVH) {
+        cout << "BVH: " << compiled.sphereCount << " spheres, " << compiled.bvhNodeCount << " nodes";
+        if (compiled.groups[BOX].count > 0) {
+            cout << ", " << compiled.groups[BOX].count << " boxes, " << compiled.groups[BOX].bvhNodeCount << " nodes";
+        }
+        if (compiled.groups[TRIANGLE].count > 0) {
+            cout << ", " << compiled.groups[TRIANGLE].count << " triangles, " << compiled.groups[TRIANGLE].bvhNodeCount << " nodes";
+        }
+        if (compiled.meshCount > 0) {
+            cout << ", " << compiled.meshCount << " meshes of " << compiled.groups[MESH].count << " triangles, "
+                 << compiled.groups[MESH].bvhNodeCount << " nodes";
+        }
+        if (compiled.groups[INSTANCE].count > 0) {
+            cout << ", " << compiled.groups[INSTANCE].count << " instances of " << compiled.prototypes.size() << " prototypes, "
+                 << compiled.groups[INSTANCE].bvhNodeCount << " nodes";
+        }
+        cout << ", SAH cost " << compiled.bvhSahCost << ", built in " << compiled.bvhBuildTime << " ms" << endl;
+    }
+    if (lightErrorBound > 0) {
+        cout << "Light hierarchy: " << compiled.pointLightCount << " point lights, " << compiled.lightNodeCount
+             << " nodes, groups of lights merged within an error of " << lightErrorBound << endl;
+    }
+    cout << "Compiled scene: " << compiled.memorySize() << " bytes";
+    if (compiled.groups[MESH].count > 0) {
+        cout << " (meshes: " << (double) compiled.meshMemorySize() / compiled.groups[MESH].count << " bytes per triangle)";
+    }
+    if (compiled.groups[INSTANCE].count > 0) {
+        cout << " (instances: " << (double) compiled.instanceMemorySize() / compiled.groups[INSTANCE].count << " bytes per instance)"
+             << " + prototypes: " << compiled.prototypeMemorySize() << " bytes";
+    }
+    cout << endl;
+    if (kernel != "none") {
+        cout << "Sphere kernel: " << nearestSphereName << endl;
+    }
+    if (rayCost) {
+        reportRayCost(compiled);
+    }
+    ThreadPool pool(serial ? 1 : threadCount);
+    if (checkPrecision) {
+        return checkNormalizePrecision(cout, compiled, pool) ? 0 : 1;
+    }
+    if (!animationPath.empty()) {
+        Animation animation;
+        if (!loadAnimation(animationPath, compiled.sphereCount, animation)) {
+            return 1;
+        }
+        return renderAnimation(decompileScene(compiled), animation, pool, outputPath, useBVH, kernel != "none", &compiled, refitThreshold) ? 0 : 1;
+    }
+    ProgressiveRenderer progressiveRenderer(progressive ? xRes : 0, progressive ? yRes : 0, initialStep, refineThreshold, aaGrid);
+    double previewTime = 0; // milliseconds spent writing previews, not counted as rendering time
+    GBuffer gbuffer; // primary hits of the last frame, when relight frames are rendered
+    WavefrontRenderer wavefrontRenderer(maxDepth, compiled.pointLightCount + compiled.directionalLightCount,
+                                        wavefront ? WavefrontRenderer::RAY_BUDGET : 0);
+    wavefrontRenderer.sortRays = sortRays;
+    StreamingRenderer streamingRenderer(streaming ? xRes : 0, streamRows, streamWindow);
+    RenderStats statistics(stats ? xRes : 0, stats ? yRes : 0);
+#ifdef RENDER_STATS
+    renderStats = stats ? &statistics : nullptr;
+#endif
+    cout << "Starting rendering process..." << endl;
+    long long allocationsBefore = heapAllocations();
+    auto start = chrono::steady_clock::now();
+    if (progressive) {
+        progressiveRenderer.render(compiled, framebuffer, pool, [&](int pass) {
+            if (previews && progressiveRenderer.passes[pass].step > 1) { // the last pass is the final image
+                auto previewStart = chrono::steady_clock::now();
+                string previewPath = suffixedPath(outputPath, "_pass" + to_string(pass));
+                if (!writeImage(framebuffer, previewPath)) {
+                    cerr << "Could not write " << previewPath << endl;
+                }
+                previewTime += chrono::duration<double, milli>(chrono::steady_clock::now() - previewStart).count();
+            }
+        });
+    }
+    else if (wavefront) {
+        wavefrontRenderer.render(compiled, framebuffer, pool);
+    }
+    else if (streaming) {
+        if (!streamingRenderer.render(compiled, pool, outputPath)) {
+            cerr << "Could not write " << outputPath << endl;
+            return 1;
+        }
+    }
+    else if (relightFrames > 0) {
+        renderWithGBuffer(compiled, framebuffer, pool, gbuffer);
+    }
+    else if (serial) {
+        render(compiled, framebuffer);
+    }
+    else if (packetSize != 0) {
+        renderPackets(compiled, framebuffer, pool, packetSize);
+    }
+#ifndef _WIN32
+    else if (distributed) {
+        workerCommand.push_back("--worker");
+        if (!renderDistributed(compiled, framebuffer, pool, socketPath, workerCommand, workers)) {
+            return 1;
+        }
+    }
+#endif
+    else {
+        renderParallel(compiled, framebuffer, pool);
+    }
+    double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() - previewTime;
+    long long allocations = heapAllocations() - allocationsBefore;
+    cout << "Rendering complete (" << elapsed << " ms, " << pool.size() << " threads)." << endl;
+    if (progressive) {
+        for (const ProgressivePass& pass : progressiveRenderer.passes) {
+            cout << "  pass with step " << pass.step << ": " << pass.primaryRays << " rays traced, " << pass.interpolated
+                 << " samples interpolated, complete after " << pass.milliseconds << " ms" << endl;
+        }
+        cout << "  " << progressiveRenderer.totalRays() << " primary rays in total ("
+             << (double) progressiveRenderer.totalRays() / ((double) xRes * yRes) << " per pixel)" << endl;
+    }
+    if (wavefront) {
+        for (const WavefrontBounce& bounce : wavefrontRenderer.bounces) {
+            cout << "  depth " << bounce.depth << ": " << bounce.rays << " rays (" << bounce.hits << " hits), "
+                 << bounce.shadowRays << " shadow rays, sort " << bounce.sortTime << " ms, intersect " << bounce.intersectTime
+                 << " ms, shade " << bounce.shadeTime << " ms, shadow " << bounce.shadowTime << " ms, spawn " << bounce.spawnTime << " ms";
+            if (bounce.rays > 0) {
+                double milliseconds = bounce.sortTime + bounce.intersectTime + bounce.shadeTime + bounce.shadowTime + bounce.spawnTime;
+                cout << " (" << 1e6 * milliseconds / bounce.rays << " ns/ray)" << endl;
+                cout << "    " << 100. * bounce.repeatedHits / max(bounce.hits, 1LL) << "% of the hits on the primitive of the previous ray, "
+                     << 100. * bounce.cachedOccluders / max(bounce.obstructedRays, 1LL)
+                     << "% of the blocked shadow rays blocked by the cached occluder";
+            }
+            cout << endl;
+        }
+        cout << "  " << wavefrontRenderer.totalRays() << " rays in total ("
+             << (double) wavefrontRenderer.totalRays() / ((double) xRes * yRes) << " per pixel)" << endl;
+    }
+    if (checkAllocations) {
+        cout << "Heap allocations while rendering: " << allocations << " ("
+             << (double) allocations / ((double) xRes * yRes) << " per pixel)" << endl;
+        if (allocations != 0) {
+            cerr << "The render loop allocated memory" << endl;
+            return 1;
+        }
+    }
+    if (streaming) {
+        cout << "Image streamed to " << outputPath << ": " << streamingRenderer.stripeCount << " stripes of " << streamRows
+             << " rows, " << streamingRenderer.memorySize() / 1048576. << " MB of stripes in memory, "
+             << streamingRenderer.renderTime << " ms rendering, " << streamingRenderer.writeTime << " ms writing in parallel, "
+             << streamingRenderer.waitTime << " ms waiting for the writer" << endl;
+        long long peakMemory = peakMemoryUsage();
+        if (peakMemory >= 0) {
+            cout << "Peak memory: " << peakMemory / 1048576. << " MB" << endl;
+        }
+        return 0;
+    }
+    if (!writeImage(framebuffer, outputPath)) {
+        cerr << "Could not write " << outputPath << endl;
+        return 1;
+    }
+    cout << "Image written to " << outputPath << endl;
+    if (stats) {
+        statistics.printSummary(cout, compiled);
+        string heatmapPath = suffixedPath(outputPath, "_heatmap");
+        if (!statistics.writeHeatmap(heatmapPath)) {
+            cerr << "Could not write " << heatmapPath << endl;
+            return 1;
+        }
+        cout << "Cost heatmap written to " << heatmapPath << endl;
+    }
+    if (relightFrames > 0) {
+        // the lights turn around the vertical axis of the camera, everything else stays still
+        Scene source = decompileScene(compiled);
+        Vector3 cameraPos = source.cameraPos;
+        for (int frame = 1; frame <= relightFrames; frame++) {
+            float angle = 2 * (float) M_PI * frame / (relightFrames + 1);
+            auto turn = [angle](Vector3 v) { return Vector3(v.x * cos(angle) + v.z * sin(angle), v.y, v.z * cos(angle) - v.x * sin(angle)); };
+            Scene lit = source;
+            for (Light& light : lit.lights) {
+                light.position = cameraPos + turn(light.position - cameraPos);
+                light.direction = turn(light.direction);
+            }
+            auto frameStart = chrono::steady_clock::now();
+            CompiledScene relit = CompiledScene::compile(lit, useBVH, kernel != "none", &compiled);
+            bool shaded = renderWithGBuffer(relit, framebuffer, pool, gbuffer);
+            double frameTime = chrono::duration<double, milli>(chrono::steady_clock::now() - frameStart).count();
+            string framePath = suffixedPath(outputPath, "_relight" + to_string(frame));
+            if (!writeImage(framebuffer, framePath)) {
+                cerr << "Could not write " << framePath << endl;
+                return 1;
+            }
+            cout << "Relight frame " << frame << " (" << frameTime << " ms, " << (shaded ? "shaded from the G-buffer" : "primary rays traced")
+                 << ") written to " << framePath << endl;
+        }
+    }
+    return 0;
+}
+#endif